@@ -30,6 +30,9 @@
 #include <hio/hio-server.h>
 #include <hjs/hjs-runtime-spidermonkey.h>
 #include <hjs/hjs-script-spidermonkey.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
 
 typedef struct {
     HioServer *server;
@@ -93,6 +96,9 @@ struct HwfContainer {
     HjsRuntime *runtime;
 
     GSList *servers;
+
+    /* connections rejected because the runner was overloaded */
+    guint shed_count;
 };
 
 struct HwfContainerClass {
@@ -133,6 +139,153 @@ on_server_closed(HioServer *server,
     /* FIXME */
 }
 
+/* Sent as-is to connections we don't have capacity for; it's
+ * better to fail fast than to queue the request and blow the
+ * latency for everyone.
+ */
+static const char service_unavailable_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Service Unavailable\n";
+
+/* After the 503 and our FIN, wait this long for the client's EOF
+ * before closing anyway.
+ */
+#define LINGER_TIMEOUT_MSEC 2000
+/* Past this many shed sockets lingering at once, close right away */
+#define MAX_LINGERING 1024
+
+/* a shed socket waiting for the client to finish sending */
+typedef struct {
+    int fd;
+    GSource *io_source;
+    GSource *timeout_source;
+} LingeringClose;
+
+static volatile int n_lingering = 0;
+
+static void
+lingering_close_finish(LingeringClose *linger)
+{
+    g_source_destroy(linger->io_source);
+    g_source_unref(linger->io_source);
+    g_source_destroy(linger->timeout_source);
+    g_source_unref(linger->timeout_source);
+
+    close(linger->fd);
+    g_slice_free(LingeringClose, linger);
+
+    g_atomic_int_add(&n_lingering, -1);
+}
+
+static gboolean
+on_lingering_readable(GIOChannel  *channel,
+                      GIOCondition condition,
+                      void        *data)
+{
+    LingeringClose *linger = data;
+    char buf[1024];
+    gssize bytes_read;
+
+    /* throw away whatever the client sent, until EOF */
+    for (;;) {
+        bytes_read = read(linger->fd, buf, sizeof(buf));
+        if (bytes_read > 0)
+            continue;
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TRUE;
+        break;
+    }
+
+    lingering_close_finish(linger);
+
+    return FALSE;
+}
+
+static gboolean
+on_lingering_timeout(void *data)
+{
+    LingeringClose *linger = data;
+
+    lingering_close_finish(linger);
+
+    return FALSE;
+}
+
+/* Closing a socket with unread data in its receive buffer sends an
+ * RST instead of a FIN, and the RST can make the client throw away
+ * a response it hasn't read yet. So once we've said all we're going
+ * to say, read and discard until the client closes too, then close.
+ */
+static void
+lingering_close(HioServer *server,
+                int        fd)
+{
+    LingeringClose *linger;
+    GMainContext *context;
+    GIOChannel *channel;
+
+    shutdown(fd, SHUT_WR);
+
+    if (g_atomic_int_exchange_and_add(&n_lingering, 1) >= MAX_LINGERING) {
+        g_atomic_int_add(&n_lingering, -1);
+        close(fd);
+        return;
+    }
+
+    linger = g_slice_new(LingeringClose);
+    linger->fd = fd;
+
+    /* same context we were accepted in, so the callbacks are
+     * serialized with each other
+     */
+    g_object_get(G_OBJECT(server), "main-context", &context, NULL);
+
+    channel = g_io_channel_unix_new(fd);
+    linger->io_source = g_io_create_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_io_channel_unref(channel);
+    g_source_set_callback(linger->io_source,
+                          (GSourceFunc) on_lingering_readable,
+                          linger, NULL);
+
+    linger->timeout_source = g_timeout_source_new(LINGER_TIMEOUT_MSEC);
+    g_source_set_callback(linger->timeout_source,
+                          on_lingering_timeout,
+                          linger, NULL);
+
+    g_source_attach(linger->io_source, context);
+    g_source_attach(linger->timeout_source, context);
+}
+
+static void
+shed_connection(HwfContainer *container,
+                HioServer    *server,
+                int           fd)
+{
+    HrtTaskRunnerLoad load;
+
+    container->shed_count += 1;
+
+    hrt_task_runner_get_load(container->runner, &load);
+    hrt_debug("Overloaded (%d active tasks of %d in flight, limit %d, queue delay %ldus), rejecting socket %d; %u rejected so far",
+              load.active_tasks, load.in_flight_tasks, load.concurrency_limit,
+              (long) load.queue_delay_usec, fd, container->shed_count);
+
+    /* socket is nonblocking and the response is tiny, so this should
+     * always fit in the socket buffer; if not, too bad.
+     */
+    send(fd, service_unavailable_response,
+         sizeof(service_unavailable_response) - 1,
+         MSG_NOSIGNAL | MSG_DONTWAIT);
+    lingering_close(server, fd);
+}
+
 static gboolean
 on_server_socket_accepted(HioServer *server,
                           int        fd,
@@ -142,6 +295,11 @@ on_server_socket_accepted(HioServer *server,
     HrtTask *task;
     GValue value = { 0, };
 
+    if (hrt_task_runner_is_overloaded(container->runner)) {
+        shed_connection(container, server, fd);
+        return TRUE;
+    }
+
     hrt_debug("Creating connection for accepted socket %d", fd);
 
     task = hrt_task_runner_create_task(container->runner);
@@ -237,8 +395,14 @@ hwf_container_finalize(GObject *object)
 static void
 hwf_container_init(HwfContainer *container)
 {
+    /* Complete tasks in the invoke threads so finishing a request
+     * doesn't have to go through the main loop to notify the
+     * connection.
+     */
     container->runner = g_object_new(HRT_TYPE_TASK_RUNNER,
                                      "event-loop-type", HRT_EVENT_LOOP_EV,
+                                     "complete-in-invoke-thread", TRUE,
+                                     "emit-tasks-completed", FALSE,
                                      NULL);
 
     g_signal_connect_data(G_OBJECT(container->runner),
@@ -66,6 +66,19 @@ hwf_request_container_create_buffer(HioMessage *message)
     return hjs_runtime_create_buffer(request->runtime);
 }
 
+/* the JS runtime's buffers are UTF-16, like its strings */
+static HrtBuffer*
+hwf_request_container_intern_buffer(HioMessage *message,
+                                    HioInternId id)
+{
+    HrtBuffer *buffer;
+
+    buffer = hio_intern_get_buffer(id, HRT_BUFFER_ENCODING_UTF16);
+    hrt_buffer_ref(buffer);
+
+    return buffer;
+}
+
 static void
 hwf_request_container_get_property (GObject                *object,
                                     guint                   prop_id,
@@ -161,6 +174,7 @@ hwf_request_container_class_init(HwfRequestContainerClass *klass)
     http_class = HIO_REQUEST_HTTP_CLASS(klass);
 
     message_class->create_buffer = hwf_request_container_create_buffer;
+    message_class->intern_buffer = hwf_request_container_intern_buffer;
 
     http_class->add_header = hwf_request_container_add_header;
 
@@ -24,6 +24,7 @@
 #include <hio/hio-connection-http.h>
 #include <hio/hio-connection.h>
 #include <hrt/hrt-log.h>
+#include <hrt/hrt-task.h>
 #include <hio/hio-output-chain.h>
 #include <deps/http-parser/http_parser.h>
 
@@ -34,6 +35,17 @@
  * request with crazy http versions (huge numbers, missing numbers)
  */
 
+/* Text of a header name or value. While all of it came in one
+ * parser callback it's only a pointer into the read buffer; it gets
+ * copied if it continues in another callback, or is still incomplete
+ * when the read buffer goes away.
+ */
+typedef struct {
+    const char *at;
+    gsize len;
+    GString *copy;
+} HeaderText;
+
 struct HioConnectionHttpPrivate {
     http_parser parser;
 
@@ -48,8 +60,17 @@ struct HioConnectionHttpPrivate {
 
     HioRequestHttp *current_request;
 
-    HrtBuffer *current_header_name;
-    HrtBuffer *current_header_value;
+    /* the header being parsed, which only becomes a buffer once
+     * complete, so well-known names and values can be interned
+     * buffers instead of fresh copies
+     */
+    HeaderText header_name;
+    HeaderText header_value;
+
+    /* bytes of request line and headers charged to the connection
+     * task while parsing, so a huge header can hit its memory limit
+     */
+    gsize parse_state_charged;
 
     HioOutputChain *response_chain;
 
@@ -97,25 +118,107 @@ complete_request_line(HioConnectionHttp *http)
     }
 }
 
+static void
+header_text_save(HeaderText *text)
+{
+    if (text->at != NULL) {
+        g_string_append_len(text->copy, text->at, text->len);
+        text->at = NULL;
+    }
+}
+
+static void
+header_text_append(HeaderText *text,
+                   const char *at,
+                   gsize       len)
+{
+    if (text->at == NULL && text->copy->len == 0) {
+        text->at = at;
+        text->len = len;
+    } else {
+        header_text_save(text);
+        g_string_append_len(text->copy, at, len);
+    }
+}
+
+static const char*
+header_text_get(HeaderText *text,
+                gsize      *len_p)
+{
+    if (text->at != NULL) {
+        *len_p = text->len;
+        return text->at;
+    } else {
+        *len_p = text->copy->len;
+        return text->copy->str;
+    }
+}
+
+static void
+header_text_clear(HeaderText *text)
+{
+    text->at = NULL;
+    g_string_set_size(text->copy, 0);
+}
+
+/* Returns a locked buffer with text for the current request, which
+ * is the shared interned buffer if id has one the request can use.
+ */
+static HrtBuffer*
+header_buffer_new(HioConnectionHttp *http,
+                  const char        *text,
+                  gsize              len,
+                  HioInternId        id)
+{
+    HioMessage *message;
+    HrtBuffer *buffer;
+
+    message = HIO_MESSAGE(http->priv->current_request);
+
+    buffer = NULL;
+    if (id != HIO_INTERN_NONE)
+        buffer = hio_message_intern_buffer(message, id);
+
+    if (buffer == NULL) {
+        buffer = hio_message_create_buffer(message);
+        hrt_buffer_append_ascii(buffer, text, len);
+        hrt_buffer_lock(buffer);
+    }
+
+    return buffer;
+}
+
 /* called when we see a new header name, or headers complete */
 static void
 complete_header(HioConnectionHttp *http)
 {
-    if (http->priv->current_header_name &&
+    const char *name_text;
+    const char *value_text;
+    gsize name_len;
+    gsize value_len;
+
+    name_text = header_text_get(&http->priv->header_name, &name_len);
+
+    if (name_len > 0 &&
         http->priv->header_value_seen) {
-        g_assert(http->priv->current_header_value != NULL);
+        HrtBuffer *name;
+        HrtBuffer *value;
+
+        value_text = header_text_get(&http->priv->header_value, &value_len);
 
-        hrt_buffer_lock(http->priv->current_header_name);
-        hrt_buffer_lock(http->priv->current_header_value);
+        name = header_buffer_new(http, name_text, name_len,
+                                 hio_intern_lookup_name(name_text, name_len));
+        value = header_buffer_new(http, value_text, value_len,
+                                  hio_intern_lookup_value(value_text, value_len));
 
         hio_request_http_add_header(http->priv->current_request,
-                                    http->priv->current_header_name,
-                                    http->priv->current_header_value);
+                                    name, value);
+
+        hrt_buffer_unref(name);
+        hrt_buffer_unref(value);
 
-        hrt_buffer_unref(http->priv->current_header_name);
-        http->priv->current_header_name = NULL;
-        hrt_buffer_unref(http->priv->current_header_value);
-        http->priv->current_header_value = NULL;
+        header_text_clear(&http->priv->header_name);
+        header_text_clear(&http->priv->header_value);
         http->priv->header_value_seen = FALSE;
     }
 }
@@ -123,6 +226,29 @@ complete_header(HioConnectionHttp *http)
 #define PARSER_GET_CONNECTION(parser) HIO_CONNECTION_HTTP((parser)->data)
 #define PARSER_GET_PRIVATE(parser)    (PARSER_GET_CONNECTION(parser)->priv)
 
+/* FALSE if the connection task is over its memory limit, in which
+ * case we stop parsing.
+ */
+static gboolean
+charge_parse_state(HioConnectionHttp *http,
+                   gsize              length)
+{
+    if (!hrt_task_charge_memory(HIO_CONNECTION(http)->task, length))
+        return FALSE;
+
+    http->priv->parse_state_charged += length;
+
+    return TRUE;
+}
+
+static void
+uncharge_parse_state(HioConnectionHttp *http)
+{
+    hrt_task_uncharge_memory(HIO_CONNECTION(http)->task,
+                             http->priv->parse_state_charged);
+    http->priv->parse_state_charged = 0;
+}
+
 static int
 on_message_begin(http_parser *parser)
 {
@@ -148,6 +274,9 @@ on_path(http_parser *parser,
     HioConnectionHttpPrivate *priv = PARSER_GET_PRIVATE(parser);
     hrt_debug("http_parser %s", G_STRFUNC);
 
+    if (!charge_parse_state(PARSER_GET_CONNECTION(parser), length))
+        return 1;
+
     g_string_append_len(priv->path, at, length);
 
     return 0;
@@ -161,6 +290,9 @@ on_query_string(http_parser *parser,
     HioConnectionHttpPrivate *priv = PARSER_GET_PRIVATE(parser);
     hrt_debug("http_parser %s", G_STRFUNC);
 
+    if (!charge_parse_state(PARSER_GET_CONNECTION(parser), length))
+        return 1;
+
     g_string_append_len(priv->query_string, at, length);
 
     return 0;
@@ -212,16 +344,10 @@ on_header_field(http_parser *parser,
     /* complete any previous header */
     complete_header(http);
 
-    if (http->priv->current_header_name == NULL) {
-        g_assert(http->priv->current_header_value == NULL);
-        http->priv->current_header_name =
-            hio_message_create_buffer(HIO_MESSAGE(http->priv->current_request));
-        http->priv->current_header_value =
-            hio_message_create_buffer(HIO_MESSAGE(http->priv->current_request));
-    }
+    if (!charge_parse_state(http, length))
+        return 1;
 
-    hrt_buffer_append_ascii(http->priv->current_header_name,
-                            at, length);
+    header_text_append(&http->priv->header_name, at, length);
 
     return 0;
 }
@@ -237,12 +363,15 @@ on_header_value(http_parser *parser,
 
     http = PARSER_GET_CONNECTION(parser);
 
-    g_assert(http->priv->current_header_value != NULL);
+    g_assert(http->priv->header_name.at != NULL ||
+             http->priv->header_name.copy->len > 0);
+
+    if (!charge_parse_state(http, length))
+        return 1;
 
     http->priv->header_value_seen = TRUE;
 
-    hrt_buffer_append_ascii(http->priv->current_header_value,
-                            at, length);
+    header_text_append(&http->priv->header_value, at, length);
 
     return 0;
 }
@@ -288,6 +417,9 @@ on_headers_complete(http_parser *parser)
 
     complete_header(http);
 
+    /* the headers now belong to the request */
+    uncharge_parse_state(http);
+
     g_assert(http->priv->response_chain == NULL);
 
     /* ensure we have a response chain (reused for multiple requests) */
@@ -298,6 +430,8 @@ on_headers_complete(http_parser *parser)
          * or data-store-bound request handler.
          */
         http->priv->response_chain = hio_output_chain_new(connection->task);
+        hio_output_chain_set_zerocopy(http->priv->response_chain,
+                                      connection->zerocopy);
         hio_output_chain_set_fd(http->priv->response_chain,
                                 connection->fd);
 
@@ -414,6 +548,12 @@ hio_connection_http_on_incoming_data(HioConnection *connection)
             /* FIXME - error, maybe bad http. have to handle. */
             g_warning("HTTP Parser didn't consume all the data");
         }
+
+        /* a header that continues in the next read can't point
+         * into buf anymore
+         */
+        header_text_save(&http->priv->header_name);
+        header_text_save(&http->priv->header_value);
     }
 }
 
@@ -464,6 +604,10 @@ hio_connection_http_dispose(GObject *object)
         http->priv->response_chain = NULL;
     }
 
+    /* before the parent class drops the task */
+    if (http->priv->parse_state_charged > 0)
+        uncharge_parse_state(http);
+
     G_OBJECT_CLASS(hio_connection_http_parent_class)->dispose(object);
 }
 
@@ -477,15 +621,8 @@ hio_connection_http_finalize(GObject *object)
     g_string_free(http->priv->path, TRUE);
     g_string_free(http->priv->query_string, TRUE);
 
-    if (http->priv->current_header_name != NULL) {
-        hrt_buffer_unref(http->priv->current_header_name);
-        http->priv->current_header_name = NULL;
-    }
-
-    if (http->priv->current_header_value != NULL) {
-        hrt_buffer_unref(http->priv->current_header_value);
-        http->priv->current_header_value = NULL;
-    }
+    g_string_free(http->priv->header_name.copy, TRUE);
+    g_string_free(http->priv->header_value.copy, TRUE);
 
     G_OBJECT_CLASS(hio_connection_http_parent_class)->finalize(object);
 }
@@ -503,6 +640,8 @@ hio_connection_http_init(HioConnectionHttp *http)
 
     http->priv->path = g_string_new(NULL);
     http->priv->query_string = g_string_new(NULL);
+    http->priv->header_name.copy = g_string_new(NULL);
+    http->priv->header_value.copy = g_string_new(NULL);
 
     g_assert(http->priv->response_chain == NULL);
 }
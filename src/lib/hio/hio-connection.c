@@ -87,6 +87,18 @@ quit_reading(HioConnection *connection)
     }
 }
 
+/* The other end has gone away (or the socket is broken), so nobody
+ * will read the responses to any requests in progress. Cancel the
+ * request tasks, which are children of the connection task.
+ */
+static void
+cancel_requests(HioConnection *connection)
+{
+    if (connection->task != NULL) {
+        hrt_task_cancel_children(connection->task);
+    }
+}
+
 static void
 close_fd(HioConnection *connection)
 {
@@ -96,7 +108,16 @@ close_fd(HioConnection *connection)
          * Not sure if there are other considerations.
          */
         /* shutdown(hio_connection->fd, SHUT_RDWR); */
-        close(connection->fd);
+        if (connection->zerocopy != NULL) {
+            /* the kernel may still be sending from our buffers,
+             * so this waits for it to finish before closing.
+             */
+            hrt_zerocopy_close_fd(connection->zerocopy);
+            hrt_zerocopy_unref(connection->zerocopy);
+            connection->zerocopy = NULL;
+        } else {
+            close(connection->fd);
+        }
         connection->fd = -1;
     }
 }
@@ -163,6 +184,8 @@ hio_connection_new_from_socket(GType          subtype,
 
     g_object_ref(connection->task);
 
+    if (hrt_zerocopy_get_enabled())
+        connection->zerocopy = hrt_zerocopy_new(task, fd);
 
     return connection;
 }
@@ -175,6 +198,17 @@ on_incoming_data(HrtTask        *task,
     HioConnection *connection = HIO_CONNECTION(data);
     HioConnectionClass *klass = HIO_CONNECTION_GET_CLASS(connection);
 
+    /* zero-copy completions wake us through POLLERR with nothing
+     * to read; leave them to the zerocopy watcher.
+     */
+    if (connection->zerocopy != NULL) {
+        char c;
+
+        if (recv(connection->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TRUE;
+    }
+
     if (klass->on_incoming_data != NULL) {
         (* klass->on_incoming_data)(connection);
     }
@@ -218,10 +252,12 @@ _hio_connection_read(HioConnection *connection,
             goto again;
         } else {
             quit_reading(connection);
+            cancel_requests(connection);
             return -1;
         }
     } else if (bytes_read == 0) {
         quit_reading(connection);
+        cancel_requests(connection);
         return 0;
     } else {
         return bytes_read;
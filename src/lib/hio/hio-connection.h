@@ -29,6 +29,7 @@
 
 #include <glib-object.h>
 #include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-zerocopy.h>
 #include <hio/hio-incoming.h>
 #include <hio/hio-outgoing.h>
 
@@ -48,6 +49,8 @@ struct HioConnection {
     GObject      parent_instance;
     HrtTask     *task;
     int fd;
+    /* non-NULL if zero-copy sends are enabled and work on fd */
+    HrtZerocopy *zerocopy;
 
     HrtWatcher *read_watcher;
 };
@@ -73,7 +76,8 @@ void            hio_connection_process_socket(GType          subtype,
                                               int            fd);
 
 /* This is invoked by subclasses in the read watcher thread from
- * on_incoming_data()
+ * on_incoming_data(). On EOF or error, it stops reading and cancels
+ * any request tasks (children of the connection's task).
  */
 gssize _hio_connection_read     (HioConnection *connection,
                                  void          *buf,
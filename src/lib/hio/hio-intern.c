@@ -0,0 +1,250 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <hio/hio-intern.h>
+#include <hrt/hrt-buffer-pool.h>
+#include <string.h>
+
+#define FIRST_VALUE HIO_INTERN_VALUE_ANY_TYPE
+
+static const char * const strings[HIO_INTERN_LAST] = {
+    [HIO_INTERN_ACCEPT]                    = "Accept",
+    [HIO_INTERN_ACCEPT_CHARSET]            = "Accept-Charset",
+    [HIO_INTERN_ACCEPT_ENCODING]           = "Accept-Encoding",
+    [HIO_INTERN_ACCEPT_LANGUAGE]           = "Accept-Language",
+    [HIO_INTERN_AUTHORIZATION]             = "Authorization",
+    [HIO_INTERN_CACHE_CONTROL]             = "Cache-Control",
+    [HIO_INTERN_CONNECTION]                = "Connection",
+    [HIO_INTERN_CONTENT_ENCODING]          = "Content-Encoding",
+    [HIO_INTERN_CONTENT_LENGTH]            = "Content-Length",
+    [HIO_INTERN_CONTENT_TYPE]              = "Content-Type",
+    [HIO_INTERN_COOKIE]                    = "Cookie",
+    [HIO_INTERN_DATE]                      = "Date",
+    [HIO_INTERN_HOST]                      = "Host",
+    [HIO_INTERN_IF_MODIFIED_SINCE]         = "If-Modified-Since",
+    [HIO_INTERN_IF_NONE_MATCH]             = "If-None-Match",
+    [HIO_INTERN_KEEP_ALIVE]                = "Keep-Alive",
+    [HIO_INTERN_LAST_MODIFIED]             = "Last-Modified",
+    [HIO_INTERN_ORIGIN]                    = "Origin",
+    [HIO_INTERN_PRAGMA]                    = "Pragma",
+    [HIO_INTERN_REFERER]                   = "Referer",
+    [HIO_INTERN_SERVER]                    = "Server",
+    [HIO_INTERN_SET_COOKIE]                = "Set-Cookie",
+    [HIO_INTERN_TRANSFER_ENCODING]         = "Transfer-Encoding",
+    [HIO_INTERN_UPGRADE]                   = "Upgrade",
+    [HIO_INTERN_UPGRADE_INSECURE_REQUESTS] = "Upgrade-Insecure-Requests",
+    [HIO_INTERN_USER_AGENT]                = "User-Agent",
+    [HIO_INTERN_VARY]                      = "Vary",
+    [HIO_INTERN_X_FORWARDED_FOR]           = "X-Forwarded-For",
+    [HIO_INTERN_X_REQUESTED_WITH]          = "X-Requested-With",
+
+    [HIO_INTERN_VALUE_ANY_TYPE]            = "*/*",
+    [HIO_INTERN_VALUE_APPLICATION_JSON]    = "application/json",
+    [HIO_INTERN_VALUE_CHUNKED]             = "chunked",
+    [HIO_INTERN_VALUE_CLOSE]               = "close",
+    [HIO_INTERN_VALUE_DEFLATE]             = "deflate",
+    [HIO_INTERN_VALUE_GZIP]                = "gzip",
+    [HIO_INTERN_VALUE_GZIP_DEFLATE]        = "gzip, deflate",
+    [HIO_INTERN_VALUE_GZIP_DEFLATE_BR]     = "gzip, deflate, br",
+    [HIO_INTERN_VALUE_IDENTITY]            = "identity",
+    [HIO_INTERN_VALUE_KEEP_ALIVE]          = "keep-alive",
+    [HIO_INTERN_VALUE_MAX_AGE_0]           = "max-age=0",
+    [HIO_INTERN_VALUE_NO_CACHE]            = "no-cache",
+    [HIO_INTERN_VALUE_ONE]                 = "1",
+    [HIO_INTERN_VALUE_TEXT_HTML]           = "text/html",
+    [HIO_INTERN_VALUE_TEXT_PLAIN]          = "text/plain"
+};
+
+typedef struct {
+    gsize len;
+    guint hash;
+    HrtBuffer *utf8;
+    HrtBuffer *utf16;
+} Entry;
+
+/* open addressing, with room to keep probe sequences short; a slot
+ * holds an id, or HIO_INTERN_NONE if empty
+ */
+#define N_SLOTS 128
+
+static volatile gsize table_initialized = 0;
+static Entry entries[HIO_INTERN_LAST];
+static guint8 name_slots[N_SLOTS];
+static guint8 value_slots[N_SLOTS];
+static gsize longest;
+
+/* FNV-1a; header names are case-insensitive so those hash folded */
+static guint
+hash_bytes(const char *s,
+           gsize       len,
+           gboolean    fold_case)
+{
+    guint hash;
+    gsize i;
+
+    hash = 2166136261u;
+    for (i = 0; i < len; ++i) {
+        guchar c = s[i];
+
+        if (fold_case)
+            c = g_ascii_tolower(c);
+
+        hash = (hash ^ c) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void
+build_table(void)
+{
+    int id;
+
+    for (id = HIO_INTERN_NONE + 1; id < HIO_INTERN_LAST; ++id) {
+        Entry *entry = &entries[id];
+        gboolean is_name = id < FIRST_VALUE;
+        guint8 *slots = is_name ? name_slots : value_slots;
+        guint i;
+
+        entry->len = strlen(strings[id]);
+        entry->hash = hash_bytes(strings[id], entry->len, is_name);
+
+        entry->utf8 = hrt_buffer_new_static_utf8_locked(strings[id]);
+
+        entry->utf16 = hrt_buffer_new(HRT_BUFFER_ENCODING_UTF16,
+                                      hrt_buffer_pool_get_allocator(),
+                                      NULL, NULL);
+        hrt_buffer_append_ascii(entry->utf16, strings[id], entry->len);
+        hrt_buffer_lock(entry->utf16);
+
+        for (i = entry->hash % N_SLOTS; slots[i] != HIO_INTERN_NONE; i = (i + 1) % N_SLOTS)
+            ;
+        slots[i] = id;
+
+        longest = MAX(longest, entry->len);
+    }
+}
+
+static inline void
+ensure_table(void)
+{
+    if (g_once_init_enter(&table_initialized)) {
+        build_table();
+        g_once_init_leave(&table_initialized, 1);
+    }
+}
+
+static HioInternId
+lookup(const guint8 *slots,
+       const char   *s,
+       gsize         len,
+       gboolean      fold_case)
+{
+    guint hash;
+    guint i;
+
+    ensure_table();
+
+    if (len == 0 || len > longest)
+        return HIO_INTERN_NONE;
+
+    hash = hash_bytes(s, len, fold_case);
+
+    for (i = hash % N_SLOTS; slots[i] != HIO_INTERN_NONE; i = (i + 1) % N_SLOTS) {
+        const Entry *entry = &entries[slots[i]];
+
+        if (entry->hash != hash || entry->len != len)
+            continue;
+
+        if (fold_case ?
+            g_ascii_strncasecmp(strings[slots[i]], s, len) == 0 :
+            memcmp(strings[slots[i]], s, len) == 0)
+            return slots[i];
+    }
+
+    return HIO_INTERN_NONE;
+}
+
+/* CALLED FROM ANY THREAD */
+/* Header names are case-insensitive, so this ignores ASCII case;
+ * the interned string has the usual capitalization.
+ */
+HioInternId
+hio_intern_lookup_name(const char *name,
+                       gsize       len)
+{
+    return lookup(name_slots, name, len, TRUE);
+}
+
+/* CALLED FROM ANY THREAD */
+HioInternId
+hio_intern_lookup_value(const char *value,
+                        gsize       len)
+{
+    return lookup(value_slots, value, len, FALSE);
+}
+
+const char*
+hio_intern_get_string(HioInternId id)
+{
+    g_return_val_if_fail(id > HIO_INTERN_NONE && id < HIO_INTERN_LAST, NULL);
+
+    return strings[id];
+}
+
+/* The hash lookups use, case-folded for header names, so callers
+ * with their own tables of headers needn't hash again.
+ */
+guint
+hio_intern_get_hash(HioInternId id)
+{
+    g_return_val_if_fail(id > HIO_INTERN_NONE && id < HIO_INTERN_LAST, 0);
+
+    ensure_table();
+
+    return entries[id].hash;
+}
+
+/* Returns the shared locked buffer for id, which is never freed so
+ * doesn't have to be reffed. UTF-8 and UTF-16 are available.
+ */
+HrtBuffer*
+hio_intern_get_buffer(HioInternId       id,
+                      HrtBufferEncoding encoding)
+{
+    g_return_val_if_fail(id > HIO_INTERN_NONE && id < HIO_INTERN_LAST, NULL);
+
+    ensure_table();
+
+    switch (encoding) {
+    case HRT_BUFFER_ENCODING_UTF8:
+        return entries[id].utf8;
+    case HRT_BUFFER_ENCODING_UTF16:
+        return entries[id].utf16;
+    default:
+        break;
+    }
+
+    g_return_val_if_reached(NULL);
+}
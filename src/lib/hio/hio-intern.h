@@ -0,0 +1,107 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HIO_INTERN_H__
+#define __HIO_INTERN_H__
+
+/*
+ * A fixed table of the header names and values almost every request
+ * or response has, each with a shared locked HrtBuffer that is never
+ * freed. Using the interned buffer instead of a copy saves the
+ * allocation, and lets code compare headers by pointer.
+ *
+ * The table is built on first use and never changes after that, so
+ * lookups take no locks and are safe from any thread.
+ */
+
+#include <glib.h>
+#include <hrt/hrt-buffer.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    HIO_INTERN_NONE,
+
+    /* header names */
+    HIO_INTERN_ACCEPT,
+    HIO_INTERN_ACCEPT_CHARSET,
+    HIO_INTERN_ACCEPT_ENCODING,
+    HIO_INTERN_ACCEPT_LANGUAGE,
+    HIO_INTERN_AUTHORIZATION,
+    HIO_INTERN_CACHE_CONTROL,
+    HIO_INTERN_CONNECTION,
+    HIO_INTERN_CONTENT_ENCODING,
+    HIO_INTERN_CONTENT_LENGTH,
+    HIO_INTERN_CONTENT_TYPE,
+    HIO_INTERN_COOKIE,
+    HIO_INTERN_DATE,
+    HIO_INTERN_HOST,
+    HIO_INTERN_IF_MODIFIED_SINCE,
+    HIO_INTERN_IF_NONE_MATCH,
+    HIO_INTERN_KEEP_ALIVE,
+    HIO_INTERN_LAST_MODIFIED,
+    HIO_INTERN_ORIGIN,
+    HIO_INTERN_PRAGMA,
+    HIO_INTERN_REFERER,
+    HIO_INTERN_SERVER,
+    HIO_INTERN_SET_COOKIE,
+    HIO_INTERN_TRANSFER_ENCODING,
+    HIO_INTERN_UPGRADE,
+    HIO_INTERN_UPGRADE_INSECURE_REQUESTS,
+    HIO_INTERN_USER_AGENT,
+    HIO_INTERN_VARY,
+    HIO_INTERN_X_FORWARDED_FOR,
+    HIO_INTERN_X_REQUESTED_WITH,
+
+    /* header values */
+    HIO_INTERN_VALUE_ANY_TYPE,
+    HIO_INTERN_VALUE_APPLICATION_JSON,
+    HIO_INTERN_VALUE_CHUNKED,
+    HIO_INTERN_VALUE_CLOSE,
+    HIO_INTERN_VALUE_DEFLATE,
+    HIO_INTERN_VALUE_GZIP,
+    HIO_INTERN_VALUE_GZIP_DEFLATE,
+    HIO_INTERN_VALUE_GZIP_DEFLATE_BR,
+    HIO_INTERN_VALUE_IDENTITY,
+    HIO_INTERN_VALUE_KEEP_ALIVE,
+    HIO_INTERN_VALUE_MAX_AGE_0,
+    HIO_INTERN_VALUE_NO_CACHE,
+    HIO_INTERN_VALUE_ONE,
+    HIO_INTERN_VALUE_TEXT_HTML,
+    HIO_INTERN_VALUE_TEXT_PLAIN,
+
+    HIO_INTERN_LAST
+} HioInternId;
+
+HioInternId hio_intern_lookup_name   (const char        *name,
+                                      gsize              len);
+HioInternId hio_intern_lookup_value  (const char        *value,
+                                      gsize              len);
+const char* hio_intern_get_string    (HioInternId        id);
+guint       hio_intern_get_hash      (HioInternId        id);
+HrtBuffer*  hio_intern_get_buffer    (HioInternId        id,
+                                      HrtBufferEncoding  encoding);
+
+G_END_DECLS
+
+#endif  /* __HIO_INTERN_H__ */
@@ -22,6 +22,7 @@
  */
 #include <config.h>
 #include <hio/hio-message.h>
+#include <hrt/hrt-buffer-pool.h>
 #include <hrt/hrt-log.h>
 #include <string.h>
 
@@ -101,6 +102,37 @@ hio_message_init(HioMessage *hio_message)
 
 }
 
+/* By default header names and values are UTF-8 from the buffer pool;
+ * subclasses can keep them in a format they can use directly, for
+ * example a JS runtime's strings.
+ */
+static HrtBuffer*
+hio_message_real_create_buffer(HioMessage *message)
+{
+    return hrt_buffer_new(HRT_BUFFER_ENCODING_UTF8,
+                          hrt_buffer_pool_get_allocator(),
+                          NULL, NULL);
+}
+
+/* An interned buffer is only usable in place of one from
+ * create_buffer() if it has the same encoding, so subclasses that
+ * change create_buffer() get none unless they override this too.
+ */
+static HrtBuffer*
+hio_message_real_intern_buffer(HioMessage *message,
+                               HioInternId id)
+{
+    HrtBuffer *buffer;
+
+    if (HIO_MESSAGE_GET_CLASS(message)->create_buffer != hio_message_real_create_buffer)
+        return NULL;
+
+    buffer = hio_intern_get_buffer(id, HRT_BUFFER_ENCODING_UTF8);
+    hrt_buffer_ref(buffer);
+
+    return buffer;
+}
+
 static void
 hio_message_class_init(HioMessageClass *klass)
 {
@@ -113,6 +145,9 @@ hio_message_class_init(HioMessageClass *klass)
 
     object_class->dispose = hio_message_dispose;
     object_class->finalize = hio_message_finalize;
+
+    klass->create_buffer = hio_message_real_create_buffer;
+    klass->intern_buffer = hio_message_real_intern_buffer;
 }
 
 HrtBuffer*
@@ -124,3 +159,19 @@ hio_message_create_buffer(HioMessage *message)
 
     return (* klass->create_buffer)(message);
 }
+
+/* Returns a new ref to the shared locked buffer for id, in the same
+ * encoding as hio_message_create_buffer(), or NULL if the message
+ * can't use interned buffers.
+ */
+HrtBuffer*
+hio_message_intern_buffer(HioMessage *message,
+                          HioInternId id)
+{
+    HioMessageClass *klass = HIO_MESSAGE_GET_CLASS(message);
+
+    if (klass->intern_buffer == NULL)
+        return NULL;
+
+    return (* klass->intern_buffer)(message, id);
+}
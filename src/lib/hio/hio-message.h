@@ -29,6 +29,7 @@
 
 #include <glib-object.h>
 #include <hrt/hrt-buffer.h>
+#include <hio/hio-intern.h>
 
 G_BEGIN_DECLS
 
@@ -51,12 +52,16 @@ struct HioMessageClass {
     GObjectClass parent_class;
 
     HrtBuffer* (* create_buffer) (HioMessage *message);
+    HrtBuffer* (* intern_buffer) (HioMessage *message,
+                                  HioInternId id);
 };
 
 
 GType           hio_message_get_type                  (void) G_GNUC_CONST;
 
 HrtBuffer* hio_message_create_buffer(HioMessage *message);
+HrtBuffer* hio_message_intern_buffer(HioMessage *message,
+                                     HioInternId id);
 
 G_END_DECLS
 
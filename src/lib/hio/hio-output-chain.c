@@ -22,6 +22,7 @@
  */
 #include <config.h>
 #include <hio/hio-output-chain.h>
+#include <hrt/hrt-buffer.h>
 #include <hrt/hrt-log.h>
 #include <hrt/hrt-task.h>
 #include <unistd.h>
@@ -50,6 +51,8 @@ struct HioOutputChain {
     HrtTask     *task;
 
     int          fd;
+    /* passed to each stream along with the fd, may be NULL */
+    HrtZerocopy *zerocopy;
     GQueue       streams;
     HioOutputStream *current_stream;
 
@@ -61,6 +64,15 @@ struct HioOutputChain {
     guint blocking_completion : 1;
     guint have_had_a_stream : 1;
     guint have_empty_notified : 1;
+    /* current stream was given the fd, and may have written to it */
+    guint current_has_fd : 1;
+    /* the kernel may be holding back output on the fd because the
+     * last stream to write told it more was coming (MSG_MORE).
+     */
+    guint corked : 1;
+
+    /* holds a ref on the chain while queued */
+    HrtTaskPost update_post;
 };
 
 struct HioOutputChainClass {
@@ -134,6 +146,11 @@ hio_output_chain_dispose(GObject *object)
         chain->empty_notify_data = NULL;
     }
 
+    if (chain->zerocopy) {
+        hrt_zerocopy_unref(chain->zerocopy);
+        chain->zerocopy = NULL;
+    }
+
     if (chain->task) {
         g_object_unref(chain->task);
         chain->task = NULL;
@@ -174,20 +191,32 @@ hio_output_chain_class_init(HioOutputChainClass *klass)
 }
 
 /* IN OUR OWN TASK THREAD */
-static gboolean
-on_update_current_stream(HrtTask        *task,
-                         HrtWatcherFlags flags,
-                         void           *data)
+static void
+on_update_current_stream(HrtTask     *task,
+                         HrtTaskPost *post)
 {
     HioOutputChain *chain;
 
-    chain = HIO_OUTPUT_CHAIN(data);
+    chain = HRT_TASK_POST_CONTAINER(post, HioOutputChain, update_post);
 
     HRT_ASSERT_IN_TASK_THREAD(chain->task);
 
     update_current_stream(chain);
 
-    return FALSE;
+    g_object_unref(chain);
+}
+
+/* RUN FROM ANY THREAD. Several requests before the update runs
+ * collapse into one update.
+ */
+static void
+queue_update_current_stream(HioOutputChain *chain)
+{
+    g_object_ref(chain);
+    if (!hrt_task_post(chain->task,
+                       &chain->update_post,
+                       on_update_current_stream))
+        g_object_unref(chain);
 }
 
 /* INVOKED IN STREAM'S TASK THREAD NOT OUR OWN */
@@ -202,10 +231,7 @@ on_stream_done(HioOutputStream *stream,
     /* Get back to our own task thread, then
      * update current stream.
      */
-    hrt_task_add_immediate(chain->task,
-                           on_update_current_stream,
-                           g_object_ref(chain),
-                           g_object_unref);
+    queue_update_current_stream(chain);
 }
 
 static void
@@ -236,6 +262,13 @@ update_current_stream(HioOutputChain *chain)
                     g_object_unref(head);
                 }
             } else {
+                /* A stream that knew another came after it may have
+                 * left its last packet corked for the next one to
+                 * fill out. One that didn't uncorked at its end.
+                 */
+                if (chain->current_has_fd)
+                    chain->corked = g_queue_get_length(&chain->streams) > 0;
+
                 /* just unref the current stream */
                 g_object_unref(chain->current_stream);
             }
@@ -255,6 +288,17 @@ update_current_stream(HioOutputChain *chain)
 
         if (head != NULL) {
             chain->current_stream = head;
+            chain->current_has_fd = FALSE;
+
+            /* let the stream batch its last packet with the next
+             * stream's output, and flush what the previous stream
+             * left corked if it doesn't write anything itself.
+             */
+            hio_output_stream_set_followed(head,
+                                           g_queue_get_length(&chain->streams) > 1);
+            hio_output_stream_set_fd_corked(head, chain->corked);
+            if (chain->zerocopy != NULL)
+                hio_output_stream_set_zerocopy(head, chain->zerocopy);
 
             hio_output_stream_set_done_notify(head,
                                               on_stream_done,
@@ -270,15 +314,13 @@ update_current_stream(HioOutputChain *chain)
                           chain->current_stream);
 
                 /* we won't ever get the notify if the stream was done
-                 * before we got to it. In this case, queue a new
-                 * watcher to update the current stream again.
+                 * before we got to it. In this case, queue another
+                 * update of the current stream.
                  */
-                hrt_task_add_immediate(chain->task,
-                                       on_update_current_stream,
-                                       g_object_ref(chain),
-                                       g_object_unref);
+                queue_update_current_stream(chain);
             } else {
                 /* Give this stream something to start writing to. */
+                chain->current_has_fd = TRUE;
                 hio_output_stream_set_fd(head, chain->fd);
             }
         }
@@ -290,6 +332,13 @@ update_current_stream(HioOutputChain *chain)
         hrt_debug("output chain fd %d is now empty",
                   chain->fd);
 
+        /* only if every stream after the last one to write was empty */
+        if (chain->corked) {
+            chain->corked = FALSE;
+            if (chain->fd >= 0 && !chain->errored)
+                hrt_buffer_uncork(chain->fd);
+        }
+
         if (chain->empty_notify && !chain->have_empty_notified) {
             chain->have_empty_notified = TRUE;
             (* chain->empty_notify) (chain, chain->empty_notify_data);
@@ -350,6 +399,24 @@ hio_output_chain_set_fd(HioOutputChain  *chain,
     update_current_stream(chain);
 }
 
+/* Streams send large buffers without copying through zerocopy,
+ * which must be for the chain's fd. Set it before the fd.
+ */
+void
+hio_output_chain_set_zerocopy(HioOutputChain *chain,
+                              HrtZerocopy    *zerocopy)
+{
+    HRT_ASSERT_IN_TASK_THREAD(chain->task);
+
+    g_return_if_fail(chain->current_stream == NULL);
+
+    if (zerocopy != NULL)
+        hrt_zerocopy_ref(zerocopy);
+    if (chain->zerocopy != NULL)
+        hrt_zerocopy_unref(chain->zerocopy);
+    chain->zerocopy = zerocopy;
+}
+
 void
 hio_output_chain_set_empty_notify(HioOutputChain            *chain,
                                   HioOutputChainEmptyNotify  func,
@@ -428,5 +495,9 @@ hio_output_chain_add_stream(HioOutputChain  *chain,
 
     g_queue_push_tail(&chain->streams, stream);
 
+    /* the current stream can now leave its last packet for this one */
+    if (chain->current_stream != NULL)
+        hio_output_stream_set_followed(chain->current_stream, TRUE);
+
     update_current_stream(chain);
 }
@@ -48,6 +48,8 @@ GType           hio_output_chain_get_type (void) G_GNUC_CONST;
 HioOutputChain* hio_output_chain_new              (HrtTask                   *task);
 void            hio_output_chain_set_fd           (HioOutputChain            *chain,
                                                    int                        fd);
+void            hio_output_chain_set_zerocopy     (HioOutputChain            *chain,
+                                                   HrtZerocopy               *zerocopy);
 gboolean        hio_output_chain_got_error        (HioOutputChain            *chain);
 gboolean        hio_output_chain_is_empty         (HioOutputChain            *chain);
 void            hio_output_chain_add_stream       (HioOutputChain            *chain,
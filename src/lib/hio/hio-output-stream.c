@@ -22,6 +22,7 @@
  */
 #include <config.h>
 #include <hio/hio-output-stream.h>
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-log.h>
 #include <hrt/hrt-task-runner.h>
 #include <hrt/hrt-task.h>
@@ -41,7 +42,7 @@ struct HioOutputStream {
     volatile int          fd;
 
     /* touched both from writing thread(s) and our task thread */
-    GMutex      *buffers_lock;
+    HrtLock     *buffers_lock;
     GQueue       buffers;
 
     /* generally set by writing thread(s) and read by our task thread */
@@ -52,9 +53,14 @@ struct HioOutputStream {
      */
     volatile int errored;
 
-    /* touched both from writing thread(s) and our task thread */
-    GMutex     *write_watcher_lock;
+    /* touched both from writing thread(s) and our task thread.
+     * source_watcher is set instead of write_watcher while the
+     * current buffer is waiting for its pipe to have data; the fd
+     * is probably writable, so watching it would just spin.
+     */
+    HrtLock    *write_watcher_lock;
     HrtWatcher *write_watcher;
+    HrtWatcher *source_watcher;
 
     /* touched only from our task thread (important because we don't
      * want to hold a lock that other threads want, while in a
@@ -64,12 +70,34 @@ struct HioOutputStream {
     HrtBuffer *current_buffer;
     gsize current_buffer_remaining;
 
-    GMutex *done_notify_lock;
+    /* Set from the output chain's task thread and read by ours.
+     * more_follows means another stream will write to the fd after
+     * us, so we can leave our last packet for it to fill out.
+     * corked means the kernel may be holding back output on the fd
+     * because the last write to it (ours or an earlier stream's)
+     * asked it to wait for more with MSG_MORE.
+     */
+    volatile int more_follows;
+    volatile int corked;
+
+    /* HrtZerocopy for the fd, if large buffers should be sent
+     * without copying; set from the output chain's task thread
+     * before the fd, and owns a ref.
+     */
+    volatile gpointer zerocopy;
+
+    HrtLock *done_notify_lock;
     HioOutputStreamDoneNotify done_notify_func;
     void *done_notify_data;
     GDestroyNotify done_notify_dnotify;
 
     volatile int done_notified;
+
+    /* posted to our task from other threads; each holds a ref on
+     * the stream while queued.
+     */
+    HrtTaskPost notify_done_post;
+    HrtTaskPost drop_buffers_post;
 };
 
 struct HioOutputStreamClass {
@@ -124,6 +152,18 @@ hio_output_stream_set_property (GObject                *object,
     }
 }
 
+/* What a queued buffer counts against the task's memory limit; file
+ * buffers are sent straight from the file so cost nothing.
+ */
+static gsize
+queued_memory_size(HrtBuffer *locked_buffer)
+{
+    if (hrt_buffer_is_file(locked_buffer))
+        return 0;
+
+    return hrt_buffer_get_write_size(locked_buffer);
+}
+
 /* IN OUR TASK THREAD */
 static void
 ensure_current_buffer(HioOutputStream *stream,
@@ -132,7 +172,7 @@ ensure_current_buffer(HioOutputStream *stream,
     HRT_ASSERT_IN_TASK_THREAD(stream->task);
 
     if (stream->current_buffer == NULL || completed) {
-        g_mutex_lock(stream->buffers_lock);
+        hrt_lock_lock(stream->buffers_lock);
 
         if (completed != NULL) {
             HrtBuffer *old;
@@ -141,6 +181,8 @@ ensure_current_buffer(HioOutputStream *stream,
 
             old = g_queue_pop_head(&stream->buffers);
             g_assert(old == completed);
+            hrt_task_uncharge_memory(stream->task,
+                                     queued_memory_size(completed));
             hrt_buffer_unref(completed);
             stream->current_buffer = NULL;
         }
@@ -158,7 +200,7 @@ ensure_current_buffer(HioOutputStream *stream,
                 hrt_buffer_get_write_size(stream->current_buffer);
         }
 
-        g_mutex_unlock(stream->buffers_lock);
+        hrt_lock_unlock(stream->buffers_lock);
     }
 
     /* Be sure to NULL current_buffer if an error has occurred so we
@@ -189,7 +231,18 @@ notify_if_done(HioOutputStream *stream)
          */
         hrt_task_unblock_completion(stream->task);
 
-        g_mutex_lock(stream->done_notify_lock);
+        /* end of the output on this fd for now, don't leave the tail
+         * of it sitting in the kernel waiting for more.
+         */
+        if (g_atomic_int_get(&stream->corked) &&
+            !g_atomic_int_get(&stream->more_follows) &&
+            g_atomic_int_get(&stream->errored) == 0 &&
+            g_atomic_int_get(&stream->fd) >= 0) {
+            hrt_buffer_uncork(g_atomic_int_get(&stream->fd));
+            g_atomic_int_set(&stream->corked, FALSE);
+        }
+
+        hrt_lock_lock(stream->done_notify_lock);
         if (stream->done_notify_func != NULL) {
             HioOutputStreamDoneNotify func = stream->done_notify_func;
             void *data = stream->done_notify_data;
@@ -199,7 +252,7 @@ notify_if_done(HioOutputStream *stream)
             stream->done_notify_data = NULL;
             stream->done_notify_dnotify = NULL;
 
-            g_mutex_unlock(stream->done_notify_lock);
+            hrt_lock_unlock(stream->done_notify_lock);
 
             g_object_ref(stream);
             (* func) (stream, data);
@@ -208,9 +261,153 @@ notify_if_done(HioOutputStream *stream)
             }
             g_object_unref(stream);
         } else {
-            g_mutex_unlock(stream->done_notify_lock);
+            hrt_lock_unlock(stream->done_notify_lock);
+        }
+    }
+}
+
+/* Gathers as many queued buffers as we can into one write, then
+ * completes however many of them got written. Returns FALSE on a
+ * fatal error on the fd.
+ */
+/* IN OUR TASK THREAD */
+static gboolean
+write_queued_buffers(HioOutputStream *stream)
+{
+    HrtBuffer *batch[HRT_BUFFER_WRITEV_MAX];
+    HrtZerocopy *zerocopy;
+    GList *l;
+    int n_batch;
+    gboolean more;
+    gsize written;
+
+    HRT_ASSERT_IN_TASK_THREAD(stream->task);
+
+    zerocopy = g_atomic_pointer_get(&stream->zerocopy);
+
+    /* Only our task thread removes buffers from the head of the
+     * queue, so the ones we collect here stay valid after we drop
+     * the lock even if writers keep appending to the tail.
+     */
+    hrt_lock_lock(stream->buffers_lock);
+
+    n_batch = 0;
+    for (l = stream->buffers.head;
+         l != NULL && n_batch < HRT_BUFFER_WRITEV_MAX;
+         l = l->next) {
+        /* a buffer big enough to send without copying goes alone */
+        if (zerocopy != NULL &&
+            hrt_zerocopy_wants(zerocopy, l->data,
+                               n_batch == 0 ?
+                               stream->current_buffer_remaining :
+                               hrt_buffer_get_length(l->data))) {
+            if (n_batch == 0) {
+                batch[n_batch] = l->data;
+                n_batch += 1;
+                l = l->next;
+            }
+            break;
+        }
+
+        batch[n_batch] = l->data;
+        n_batch += 1;
+    }
+
+    /* Only say there's more to come if there really is: more queued
+     * than fits in this write, or we're finished and another stream
+     * writes next. An open stream with nothing else queued may not
+     * write again for a while (a streamed response waiting on its
+     * source), and its last packet would sit in the kernel until
+     * then.
+     */
+    more = l != NULL ||
+        (hio_output_stream_is_closed(stream) &&
+         g_atomic_int_get(&stream->more_follows));
+
+    hrt_lock_unlock(stream->buffers_lock);
+
+    g_assert(n_batch > 0);
+    g_assert(batch[0] == stream->current_buffer);
+
+    if (zerocopy != NULL && n_batch == 1 &&
+        hrt_zerocopy_wants(zerocopy, batch[0],
+                           stream->current_buffer_remaining)) {
+        gsize remaining;
+
+        remaining = stream->current_buffer_remaining;
+        if (!hrt_zerocopy_write(zerocopy, batch[0], &remaining, more))
+            return FALSE;
+
+        written = stream->current_buffer_remaining - remaining;
+    } else if (!hrt_buffer_writev(batch, n_batch,
+                                  g_atomic_int_get(&stream->fd),
+                                  stream->current_buffer_remaining,
+                                  more,
+                                  &written)) {
+        return FALSE;
+    }
+
+    if (written > 0)
+        g_atomic_int_set(&stream->corked, more);
+
+    while (stream->current_buffer != NULL) {
+        if (written < stream->current_buffer_remaining) {
+            stream->current_buffer_remaining -= written;
+            break;
         }
+
+        written -= stream->current_buffer_remaining;
+
+        /* get a new current buffer, deleting this one */
+        ensure_current_buffer(stream, stream->current_buffer);
+    }
+
+    return TRUE;
+}
+
+/* IN OUR TASK THREAD */
+static gboolean
+on_source_readable(HrtTask        *task,
+                   HrtWatcherFlags flags,
+                   void           *data)
+{
+    HioOutputStream *stream;
+
+    stream = HIO_OUTPUT_STREAM(data);
+
+    HRT_ASSERT_IN_TASK_THREAD(stream->task);
+
+    hrt_lock_lock(stream->write_watcher_lock);
+    stream->source_watcher = NULL;
+    hrt_lock_unlock(stream->write_watcher_lock);
+
+    /* back to waiting for the fd */
+    check_write_watcher(stream);
+
+    return FALSE;
+}
+
+/* IN OUR TASK THREAD, when the current buffer's pipe is empty */
+static void
+wait_for_source(HioOutputStream *stream,
+                int              source_fd)
+{
+    HRT_ASSERT_IN_TASK_THREAD(stream->task);
+
+    hrt_lock_lock(stream->write_watcher_lock);
+    if (stream->source_watcher == NULL) {
+        stream->source_watcher =
+            hrt_task_add_io(stream->task,
+                            source_fd,
+                            HRT_WATCHER_FLAG_READ,
+                            on_source_readable,
+                            g_object_ref(stream),
+                            (GDestroyNotify) g_object_unref);
     }
+    hrt_lock_unlock(stream->write_watcher_lock);
+
+    /* removes the write watcher */
+    check_write_watcher(stream);
 }
 
 /* IN OUR TASK THREAD */
@@ -232,14 +429,7 @@ on_ready_to_write(HrtTask        *task,
     ensure_current_buffer(stream, NULL);
 
     if (stream->current_buffer != NULL) {
-        if (hrt_buffer_write(stream->current_buffer,
-                             g_atomic_int_get(&stream->fd),
-                             &stream->current_buffer_remaining)) {
-            if (stream->current_buffer_remaining == 0) {
-                /* get a new current buffer, deleting this one */
-                ensure_current_buffer(stream, stream->current_buffer);
-            }
-        } else {
+        if (!write_queued_buffers(stream)) {
             /* ERROR */
             g_atomic_int_inc(&stream->errored);
             hio_output_stream_close(stream);
@@ -247,6 +437,14 @@ on_ready_to_write(HrtTask        *task,
         }
     }
 
+    if (stream->current_buffer != NULL) {
+        int source_fd;
+
+        source_fd = hrt_buffer_get_blocked_source_fd(stream->current_buffer);
+        if (source_fd >= 0)
+            wait_for_source(stream, source_fd);
+    }
+
     if (stream->current_buffer == NULL) {
         /* if no new buffer, we probably need removing. */
         check_write_watcher(stream);
@@ -272,11 +470,12 @@ check_write_watcher(HioOutputStream *stream)
      * simultaneously appear/disappear.  So keep both locks at once
      * until we're completely sorted out.
      */
-    g_mutex_lock(stream->write_watcher_lock);
-    g_mutex_lock(stream->buffers_lock);
+    hrt_lock_lock(stream->write_watcher_lock);
+    hrt_lock_lock(stream->buffers_lock);
 
     need_write_watcher =
         g_queue_get_length(&stream->buffers) > 0 &&
+        stream->source_watcher == NULL &&
         g_atomic_int_get(&stream->fd) >= 0 &&
         g_atomic_int_get(&stream->errored) == 0;
 
@@ -293,8 +492,8 @@ check_write_watcher(HioOutputStream *stream)
         stream->write_watcher = NULL;
     }
 
-    g_mutex_unlock(stream->write_watcher_lock);
-    g_mutex_unlock(stream->buffers_lock);
+    hrt_lock_unlock(stream->write_watcher_lock);
+    hrt_lock_unlock(stream->buffers_lock);
 }
 
 /* this should always be done before dispose, because we'll always
@@ -314,11 +513,21 @@ drop_all_buffers(HioOutputStream *stream)
      */
     stream->current_buffer = NULL;
 
-    g_mutex_lock(stream->buffers_lock);
+    /* the pipe it's watching is about to be closed */
+    hrt_lock_lock(stream->write_watcher_lock);
+    if (stream->source_watcher != NULL) {
+        hrt_watcher_remove(stream->source_watcher);
+        stream->source_watcher = NULL;
+    }
+    hrt_lock_unlock(stream->write_watcher_lock);
+
+    hrt_lock_lock(stream->buffers_lock);
     while ((buffer = g_queue_pop_head(&stream->buffers)) != NULL) {
+        hrt_task_uncharge_memory(stream->task,
+                                 queued_memory_size(buffer));
         hrt_buffer_unref(buffer);
     }
-    g_mutex_unlock(stream->buffers_lock);
+    hrt_lock_unlock(stream->buffers_lock);
 
     check_write_watcher(stream);
 
@@ -334,9 +543,15 @@ hio_output_stream_dispose(GObject *object)
 
     g_assert(g_queue_get_length(&stream->buffers) == 0);
     g_assert(stream->write_watcher == NULL);
+    g_assert(stream->source_watcher == NULL);
     g_assert(stream->done_notify_func == NULL);
     g_assert(g_atomic_int_get(&stream->done_notified) > 0);
 
+    if (stream->zerocopy) {
+        hrt_zerocopy_unref(stream->zerocopy);
+        stream->zerocopy = NULL;
+    }
+
     if (stream->task) {
         g_object_unref(stream->task);
         stream->task = NULL;
@@ -352,9 +567,9 @@ hio_output_stream_finalize(GObject *object)
 
     stream = HIO_OUTPUT_STREAM(object);
 
-    g_mutex_free(stream->buffers_lock);
-    g_mutex_free(stream->write_watcher_lock);
-    g_mutex_free(stream->done_notify_lock);
+    hrt_lock_free(stream->buffers_lock);
+    hrt_lock_free(stream->write_watcher_lock);
+    hrt_lock_free(stream->done_notify_lock);
 
     G_OBJECT_CLASS(hio_output_stream_parent_class)->finalize(object);
 }
@@ -364,12 +579,12 @@ hio_output_stream_init(HioOutputStream *stream)
 {
     stream->fd = -1;
 
-    stream->buffers_lock = g_mutex_new();
+    stream->buffers_lock = hrt_lock_new("hio-output-stream.buffers_lock");
     g_queue_init(&stream->buffers);
 
-    stream->write_watcher_lock = g_mutex_new();
+    stream->write_watcher_lock = hrt_lock_new("hio-output-stream.write_watcher_lock");
 
-    stream->done_notify_lock = g_mutex_new();
+    stream->done_notify_lock = hrt_lock_new("hio-output-stream.done_notify_lock");
 }
 
 static void
@@ -416,7 +631,17 @@ hio_output_stream_write(HioOutputStream *stream,
     if (hio_output_stream_is_closed(stream))
         return;
 
-    g_mutex_lock(stream->buffers_lock);
+    /* queued buffers count against the task's memory limit; if it's
+     * over, the task gets cancelled and we treat it like a write
+     * error, discarding this and anything else queued.
+     */
+    if (!hrt_task_charge_memory(stream->task,
+                                queued_memory_size(locked_buffer))) {
+        hio_output_stream_error(stream);
+        return;
+    }
+
+    hrt_lock_lock(stream->buffers_lock);
     /* note, we still want to buffer stuff if fd == -1 since that just
      * means we aren't being asked to write yet. But on error, discard
      * anything that gets written.
@@ -431,22 +656,24 @@ hio_output_stream_write(HioOutputStream *stream,
         hrt_buffer_ref(locked_buffer);
         g_queue_push_tail(&stream->buffers,
                           locked_buffer);
+    } else {
+        hrt_task_uncharge_memory(stream->task,
+                                 queued_memory_size(locked_buffer));
     }
-    g_mutex_unlock(stream->buffers_lock);
+    hrt_lock_unlock(stream->buffers_lock);
 
     /* add write watcher if necessary. */
     check_write_watcher(stream);
 }
 
 /* IN OUR TASK THREAD */
-static gboolean
-on_notify_done_after_close(HrtTask        *task,
-                           HrtWatcherFlags flags,
-                           void           *data)
+static void
+on_notify_done_after_close(HrtTask     *task,
+                           HrtTaskPost *post)
 {
     HioOutputStream *stream;
 
-    stream = HIO_OUTPUT_STREAM(data);
+    stream = HRT_TASK_POST_CONTAINER(post, HioOutputStream, notify_done_post);
     g_assert(stream->task == task);
 
     HRT_ASSERT_IN_TASK_THREAD(stream->task);
@@ -454,7 +681,7 @@ on_notify_done_after_close(HrtTask        *task,
     /* notify */
     notify_if_done(stream);
 
-    return FALSE;
+    g_object_unref(stream);
 }
 
 /* This does NOT close the fd. The stream never owns its fd.  It just
@@ -478,10 +705,11 @@ hio_output_stream_close(HioOutputStream *stream)
          * and you can't add watchers to completed tasks.
          */
         if (hio_output_stream_is_done(stream)) {
-            hrt_task_add_immediate(stream->task,
-                                   on_notify_done_after_close,
-                                   g_object_ref(stream),
-                                   g_object_unref);
+            g_object_ref(stream);
+            if (!hrt_task_post(stream->task,
+                               &stream->notify_done_post,
+                               on_notify_done_after_close))
+                g_object_unref(stream);
         }
     }
 }
@@ -511,31 +739,30 @@ hio_output_stream_is_done(HioOutputStream *stream)
 {
     gboolean done;
 
-    g_mutex_lock(stream->buffers_lock);
+    hrt_lock_lock(stream->buffers_lock);
     done = hio_output_stream_is_closed(stream) &&
         (g_queue_get_length(&stream->buffers) == 0 ||
          hio_output_stream_got_error(stream));
-    g_mutex_unlock(stream->buffers_lock);
+    hrt_lock_unlock(stream->buffers_lock);
 
     return done;
 }
 
 /* IN OUR TASK THREAD */
-static gboolean
-on_error_drop_all_buffers(HrtTask        *task,
-                          HrtWatcherFlags flags,
-                          void           *data)
+static void
+on_error_drop_all_buffers(HrtTask     *task,
+                          HrtTaskPost *post)
 {
     HioOutputStream *stream;
 
-    stream = HIO_OUTPUT_STREAM(data);
+    stream = HRT_TASK_POST_CONTAINER(post, HioOutputStream, drop_buffers_post);
     g_assert(stream->task == task);
 
     HRT_ASSERT_IN_TASK_THREAD(stream->task);
 
     drop_all_buffers(stream);
 
-    return FALSE;
+    g_object_unref(stream);
 }
 
 /* Invoked if we know the fd has an error, before we even
@@ -564,10 +791,11 @@ hio_output_stream_error(HioOutputStream *stream)
      * task. There's no buffers if we're already done, anyhow.
      */
     if (g_atomic_int_get(&stream->done_notified) == 0) {
-        hrt_task_add_immediate(stream->task,
-                               on_error_drop_all_buffers,
-                               g_object_ref(stream),
-                               g_object_unref);
+        g_object_ref(stream);
+        if (!hrt_task_post(stream->task,
+                           &stream->drop_buffers_post,
+                           on_error_drop_all_buffers))
+            g_object_unref(stream);
     }
 }
 
@@ -595,6 +823,45 @@ hio_output_stream_set_fd(HioOutputStream *stream,
     check_write_watcher(stream);
 }
 
+/* Hints from whoever is handing the fd around (the output chain),
+ * used to batch output into as few packets as possible. more_follows
+ * says another stream writes to the fd after this one; corked says
+ * earlier output on the fd may still be held back by MSG_MORE, so if
+ * this stream ends up writing nothing it still has to flush it.
+ * Set them before setting the fd.
+ */
+/* CALLED FROM ANY THREAD */
+void
+hio_output_stream_set_followed(HioOutputStream *stream,
+                              gboolean         more_follows)
+{
+    g_atomic_int_set(&stream->more_follows, more_follows != FALSE);
+}
+
+/* CALLED FROM ANY THREAD */
+void
+hio_output_stream_set_fd_corked(HioOutputStream *stream,
+                                gboolean         corked)
+{
+    g_atomic_int_set(&stream->corked, corked != FALSE);
+}
+
+/* Large buffers are sent through zerocopy, which must be for the
+ * fd the stream will be given. Set it before setting the fd; it
+ * can only be set once.
+ */
+/* CALLED FROM ANY THREAD */
+void
+hio_output_stream_set_zerocopy(HioOutputStream *stream,
+                               HrtZerocopy     *zerocopy)
+{
+    g_return_if_fail(stream->zerocopy == NULL);
+
+    if (zerocopy != NULL)
+        hrt_zerocopy_ref(zerocopy);
+    g_atomic_pointer_set(&stream->zerocopy, zerocopy);
+}
+
 /* notify when the stream has written everything it's going to
  * write to the fd. This is intended to be set only once,
  * and the caller needs to check after setting it that
@@ -607,7 +874,7 @@ hio_output_stream_set_done_notify(HioOutputStream           *stream,
                                   void                      *data,
                                   GDestroyNotify             dnotify)
 {
-    g_mutex_lock(stream->done_notify_lock);
+    hrt_lock_lock(stream->done_notify_lock);
 
     if (stream->done_notify_dnotify != NULL) {
         /* not really expecting this case (expecting that done_notify
@@ -625,7 +892,7 @@ hio_output_stream_set_done_notify(HioOutputStream           *stream,
          * it. Callers will have to check is_done() after calling
          * set_done_notify().
          */
-        g_mutex_unlock(stream->done_notify_lock);
+        hrt_lock_unlock(stream->done_notify_lock);
 
         if (dnotify != NULL) {
             (* dnotify) (data);
@@ -635,6 +902,6 @@ hio_output_stream_set_done_notify(HioOutputStream           *stream,
         stream->done_notify_data = data;
         stream->done_notify_dnotify = dnotify;
 
-        g_mutex_unlock(stream->done_notify_lock);
+        hrt_lock_unlock(stream->done_notify_lock);
     }
 }
@@ -27,6 +27,7 @@
 #include <glib-object.h>
 #include <hrt/hrt-buffer.h>
 #include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-zerocopy.h>
 
 G_BEGIN_DECLS
 
@@ -55,6 +56,12 @@ gboolean         hio_output_stream_is_done         (HioOutputStream           *s
 void             hio_output_stream_error           (HioOutputStream           *stream);
 void             hio_output_stream_set_fd          (HioOutputStream           *stream,
                                                     int                        fd);
+void             hio_output_stream_set_followed    (HioOutputStream           *stream,
+                                                    gboolean                   more_follows);
+void             hio_output_stream_set_fd_corked   (HioOutputStream           *stream,
+                                                    gboolean                   corked);
+void             hio_output_stream_set_zerocopy    (HioOutputStream           *stream,
+                                                    HrtZerocopy               *zerocopy);
 void             hio_output_stream_set_done_notify (HioOutputStream           *stream,
                                                     HioOutputStreamDoneNotify  func,
                                                     void                      *data,
@@ -22,7 +22,9 @@
  */
 #include <config.h>
 #include <hio/hio-response-http.h>
+#include <hio/hio-intern.h>
 #include <hio/hio-outgoing.h>
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-log.h>
 
 typedef struct {
@@ -36,7 +38,7 @@ struct HioResponseHttp {
     HioOutputStream *header_stream;
     HioOutputStream *body_stream;
 
-    GMutex *headers_lock;
+    HrtLock *headers_lock;
     GSList *headers;
     gboolean headers_sent;
 };
@@ -58,6 +60,16 @@ enum  {
 
 /* static guint signals[LAST_SIGNAL]; */
 
+/* pieces every response sends, made once in class_init and never
+ * freed, so sending headers allocates no buffers
+ */
+static HrtBuffer *status_line_ok;
+static HrtBuffer *header_separator;
+static HrtBuffer *line_end;
+static HrtBuffer *date_value;
+static HrtBuffer *server_value;
+static HrtBuffer *last_modified_value;
+
 static Header*
 header_new(HrtBuffer       *name,
            HrtBuffer       *value)
@@ -82,6 +94,79 @@ header_free(Header *header)
     g_slice_free(Header, header);
 }
 
+/* Code unit i of a locked UTF-8, binary or UTF-16 buffer whose
+ * data came from peek_units()
+ */
+#define UNIT_AT(data, wide, i) \
+    ((wide) ? ((const guint16*) (data))[i] : ((const guint8*) (data))[i])
+
+static const void*
+peek_units(HrtBuffer *buffer,
+           gboolean  *wide_p)
+{
+    const void *data;
+    gsize len;
+
+    switch (hrt_buffer_get_encoding(buffer)) {
+    case HRT_BUFFER_ENCODING_UTF16:
+        *wide_p = TRUE;
+        hrt_buffer_peek_utf16(buffer, (const guint16**) &data, &len);
+        return data;
+    case HRT_BUFFER_ENCODING_UTF8:
+        *wide_p = FALSE;
+        hrt_buffer_peek_utf8(buffer, (const char**) &data, &len);
+        return data;
+    case HRT_BUFFER_ENCODING_BINARY:
+        *wide_p = FALSE;
+        hrt_buffer_peek_binary(buffer, (const guint8**) &data, &len);
+        return data;
+    default:
+        return NULL;
+    }
+}
+
+/* Header names ignore ASCII case. Interned names are shared, so most
+ * matches are the same buffer; otherwise compare the text, in
+ * whichever encodings the two names have.
+ */
+static gboolean
+header_names_equal(HrtBuffer *a,
+                   HrtBuffer *b)
+{
+    const void *a_data;
+    const void *b_data;
+    gboolean a_wide;
+    gboolean b_wide;
+    gsize len;
+    gsize i;
+
+    if (a == b)
+        return TRUE;
+
+    len = hrt_buffer_get_length(a);
+    if (len != hrt_buffer_get_length(b))
+        return FALSE;
+
+    a_data = peek_units(a, &a_wide);
+    b_data = peek_units(b, &b_wide);
+    if (a_data == NULL || b_data == NULL)
+        return FALSE;
+
+    for (i = 0; i < len; ++i) {
+        guint a_unit = UNIT_AT(a_data, a_wide, i);
+        guint b_unit = UNIT_AT(b_data, b_wide, i);
+
+        if (a_unit < 0x80)
+            a_unit = g_ascii_tolower(a_unit);
+        if (b_unit < 0x80)
+            b_unit = g_ascii_tolower(b_unit);
+
+        if (a_unit != b_unit)
+            return FALSE;
+    }
+
+    return TRUE;
+}
 
 HioResponseHttp*
 hio_response_http_new(HioOutputStream *header_stream,
@@ -103,33 +188,48 @@ hio_response_http_set_header(HioResponseHttp *http,
                              HrtBuffer       *name,
                              HrtBuffer       *value)
 {
+    GSList *l;
+
     g_return_if_fail(hrt_buffer_is_locked(name));
     g_return_if_fail(hrt_buffer_is_locked(value));
 
-    g_mutex_lock(http->headers_lock);
+    hrt_lock_lock(http->headers_lock);
 
     if (http->headers_sent) {
-        g_mutex_unlock(http->headers_lock);
+        hrt_lock_unlock(http->headers_lock);
         hrt_message("Attempt to set http header after we already sent the headers, ignoring");
         return;
     }
 
-    /* FIXME overwrite a previous duplicate header if any */
+    /* Overwrite a previous duplicate header if any */
+    for (l = http->headers; l != NULL; l = l->next) {
+        Header *header = l->data;
+
+        if (header_names_equal(header->name, name)) {
+            hrt_buffer_ref(value);
+            hrt_buffer_unref(header->value);
+            header->value = value;
+
+            hrt_lock_unlock(http->headers_lock);
+            return;
+        }
+    }
+
     http->headers = g_slist_prepend(http->headers,
                                     header_new(name, value));
-    g_mutex_unlock(http->headers_lock);
+    hrt_lock_unlock(http->headers_lock);
 }
 
 static void
-write_to_header(HioResponseHttp *http,
-                const char      *s)
+write_header(HioResponseHttp *http,
+             HioInternId      name,
+             HrtBuffer       *value)
 {
-    HrtBuffer *buffer;
-
-    buffer = hrt_buffer_new_static_utf8_locked(s);
     hio_output_stream_write(http->header_stream,
-                            buffer);
-    hrt_buffer_unref(buffer);
+                            hio_intern_get_buffer(name, HRT_BUFFER_ENCODING_UTF8));
+    hio_output_stream_write(http->header_stream, header_separator);
+    hio_output_stream_write(http->header_stream, value);
+    hio_output_stream_write(http->header_stream, line_end);
 }
 
 void
@@ -137,7 +237,7 @@ hio_response_http_send_headers(HioResponseHttp *http)
 {
     /* FIXME send actual headers */
 
-    g_mutex_lock(http->headers_lock);
+    hrt_lock_lock(http->headers_lock);
 
     /* Sending headers twice is allowed, for example request handlers
      * can do it early, but a container might do it automatically
@@ -146,22 +246,26 @@ hio_response_http_send_headers(HioResponseHttp *http)
      * already sent them.
      */
     if (http->headers_sent) {
-        g_mutex_unlock(http->headers_lock);
+        hrt_lock_unlock(http->headers_lock);
         return;
     }
     http->headers_sent = TRUE;
 
-    write_to_header(http, "HTTP/1.1 200 OK\r\n");
-    write_to_header(http, "Date: Wed, 21 Jul 2010 02:24:36 GMT\r\n");
-    write_to_header(http, "Server: hrt/" VERSION "\r\n");
-    write_to_header(http, "Last-Modified: Tue, 01 Dec 2009 23:10:05 GMT\r\n");
-    write_to_header(http, "Content-Type: text/html\r\n");
-    write_to_header(http, "Connection: close\r\n");
-    write_to_header(http, "\r\n");
+    hio_output_stream_write(http->header_stream, status_line_ok);
+    write_header(http, HIO_INTERN_DATE, date_value);
+    write_header(http, HIO_INTERN_SERVER, server_value);
+    write_header(http, HIO_INTERN_LAST_MODIFIED, last_modified_value);
+    write_header(http, HIO_INTERN_CONTENT_TYPE,
+                 hio_intern_get_buffer(HIO_INTERN_VALUE_TEXT_HTML,
+                                       HRT_BUFFER_ENCODING_UTF8));
+    write_header(http, HIO_INTERN_CONNECTION,
+                 hio_intern_get_buffer(HIO_INTERN_VALUE_CLOSE,
+                                       HRT_BUFFER_ENCODING_UTF8));
+    hio_output_stream_write(http->header_stream, line_end);
 
     hio_output_stream_close(http->header_stream);
 
-    g_mutex_unlock(http->headers_lock);
+    hrt_lock_unlock(http->headers_lock);
 }
 
 void
@@ -248,7 +352,7 @@ hio_response_http_finalize(GObject *object)
 
     http = HIO_RESPONSE_HTTP(object);
 
-    g_mutex_free(http->headers_lock);
+    hrt_lock_free(http->headers_lock);
 
     G_OBJECT_CLASS(hio_response_http_parent_class)->finalize(object);
 }
@@ -256,7 +360,7 @@ hio_response_http_finalize(GObject *object)
 static void
 hio_response_http_init(HioResponseHttp *http)
 {
-    http->headers_lock = g_mutex_new();
+    http->headers_lock = hrt_lock_new("hio-response-http.headers_lock");
 }
 
 static GObject*
@@ -290,4 +394,11 @@ hio_response_http_class_init(HioResponseHttpClass *klass)
 
     object_class->dispose = hio_response_http_dispose;
     object_class->finalize = hio_response_http_finalize;
+
+    status_line_ok = hrt_buffer_new_static_utf8_locked("HTTP/1.1 200 OK\r\n");
+    header_separator = hrt_buffer_new_static_utf8_locked(": ");
+    line_end = hrt_buffer_new_static_utf8_locked("\r\n");
+    date_value = hrt_buffer_new_static_utf8_locked("Wed, 21 Jul 2010 02:24:36 GMT");
+    server_value = hrt_buffer_new_static_utf8_locked("hrt/" VERSION);
+    last_modified_value = hrt_buffer_new_static_utf8_locked("Tue, 01 Dec 2009 23:10:05 GMT");
 }
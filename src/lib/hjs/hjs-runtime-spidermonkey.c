@@ -24,7 +24,9 @@
 #include <config.h>
 #include <hjs/hjs-runtime-spidermonkey.h>
 #include <hjs/hjs-spidermonkey-private.h>
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-log.h>
+#include <hrt/hrt-utf.h>
 
 struct HjsRuntimeSpidermonkey {
     HjsRuntime parent_instance;
@@ -41,7 +43,7 @@ struct HjsRuntimeSpidermonkey {
      */
     GSList *free_thread_contexts;
     guint   active_thread_context_count; /* also protected by same lock */
-    GMutex *free_thread_contexts_lock;
+    HrtLock *free_thread_contexts_lock;
 };
 
 struct HjsRuntimeSpidermonkeyClass {
@@ -224,7 +226,7 @@ hjs_runtime_spidermonkey_dispose(GObject *object)
      * along with the main context we just moved to free list.
      */
 
-    g_mutex_lock(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_lock(runtime_spidermonkey->free_thread_contexts_lock);
 
     g_assert(runtime_spidermonkey->active_thread_context_count == 0);
 
@@ -238,7 +240,7 @@ hjs_runtime_spidermonkey_dispose(GObject *object)
 
         thread_context_destroy(thread_context);
     }
-    g_mutex_unlock(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_unlock(runtime_spidermonkey->free_thread_contexts_lock);
 
     g_assert(runtime_spidermonkey->free_thread_contexts == NULL);
     g_assert(runtime_spidermonkey->active_thread_context_count == 0);
@@ -260,7 +262,7 @@ hjs_runtime_spidermonkey_finalize(GObject *object)
 
     JS_DestroyRuntime(runtime_spidermonkey->runtime);
 
-    g_mutex_free(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_free(runtime_spidermonkey->free_thread_contexts_lock);
 
     G_OBJECT_CLASS(hjs_runtime_spidermonkey_parent_class)->finalize(object);
 }
@@ -286,9 +288,7 @@ try_string_to_utf8(JSContext  *context,
     jschar *s;
     size_t s_length;
     char *utf8_string;
-    long read_items;
-    long utf8_length;
-    GError *convert_error = NULL;
+    gssize utf8_length;
 
     JS_BeginRequest(context);
 
@@ -302,43 +302,27 @@ try_string_to_utf8(JSContext  *context,
     s = JS_GetStringChars(JSVAL_TO_STRING(string_val));
     s_length = JS_GetStringLength(JSVAL_TO_STRING(string_val));
 
-    utf8_string = g_utf16_to_utf8(s,
-                                  (glong)s_length,
-                                  &read_items, &utf8_length,
-                                  &convert_error);
+    /* Our assumption is that the string is being converted to UTF-8
+     * in order to use with GLib-style APIs; Javascript has a looser
+     * sense of validate-Unicode than GLib, so the conversion also
+     * validates by GLib's rules (rejecting unpaired surrogates,
+     * non-characters like a byte-reversed BOM, and nul), and takes
+     * the all-ASCII stretches a vector at a time.
+     */
+    utf8_string = g_malloc(s_length * 3 + 1);
+    utf8_length = hrt_utf16_to_utf8(s, s_length, utf8_string);
 
     /* ENDING REQUEST - no JSAPI after this point */
     JS_EndRequest(context);
 
-    if (!utf8_string) {
-        /* FIXME throw */
-        g_warning("utf16-to-utf8 failed");
-        g_error_free(convert_error);
-        return FALSE;
-    }
-
-    if ((size_t)read_items != s_length) {
+    if (utf8_length < 0) {
         /* FIXME throw */
-        g_warning("wrong length");
+        g_warning("invalid utf16");
         g_free(utf8_string);
         return FALSE;
     }
 
-    /* Our assumption is that the string is being converted to UTF-8
-     * in order to use with GLib-style APIs; Javascript has a looser
-     * sense of validate-Unicode than GLib, so validate here to
-     * prevent problems later on. Given the success of the above,
-     * the only thing that could really be wrong here is including
-     * non-characters like a byte-reversed BOM. If the validation
-     * ever becomes a bottleneck, we could do an inline-special
-     * case of all-ASCII.
-     */
-    if (!g_utf8_validate (utf8_string, utf8_length, NULL)) {
-        /* FIXME throw */
-        g_warning("invalid utf8");
-        g_free(utf8_string);
-        return FALSE;
-    }
+    utf8_string[utf8_length] = '\0';
 
     *utf8_string_p = utf8_string;
     return TRUE;
@@ -513,7 +497,7 @@ _hjs_runtime_spidermonkey_context_new(HjsRuntimeSpidermonkey *runtime_spidermonk
     thread_context = NULL;
 
     /* Try getting an existing context from free list */
-    g_mutex_lock(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_lock(runtime_spidermonkey->free_thread_contexts_lock);
     if (runtime_spidermonkey->free_thread_contexts != NULL) {
         thread_context = runtime_spidermonkey->free_thread_contexts->data;
         runtime_spidermonkey->free_thread_contexts =
@@ -526,7 +510,7 @@ _hjs_runtime_spidermonkey_context_new(HjsRuntimeSpidermonkey *runtime_spidermonk
      */
     runtime_spidermonkey->active_thread_context_count += 1;
 
-    g_mutex_unlock(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_unlock(runtime_spidermonkey->free_thread_contexts_lock);
 
     if (thread_context != NULL) {
         /* Move the context to the current thread */
@@ -567,14 +551,14 @@ _hjs_runtime_spidermonkey_context_detach(void *data)
 
     /* Recycle contexts; we free the free list in runtime dispose().
      */
-    g_mutex_lock(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_lock(runtime_spidermonkey->free_thread_contexts_lock);
 
     runtime_spidermonkey->free_thread_contexts =
         g_slist_prepend(runtime_spidermonkey->free_thread_contexts,
                         thread_context);
 
     runtime_spidermonkey->active_thread_context_count -= 1;
-    g_mutex_unlock(runtime_spidermonkey->free_thread_contexts_lock);
+    hrt_lock_unlock(runtime_spidermonkey->free_thread_contexts_lock);
 
     /* ThreadContext had a strong ref to the runtime while it was
      * associated with a thread. We drop that now.
@@ -593,7 +577,7 @@ _hjs_runtime_spidermonkey_get_main_context(HjsRuntimeSpidermonkey  *runtime_spid
 static void
 hjs_runtime_spidermonkey_init(HjsRuntimeSpidermonkey *runtime_spidermonkey)
 {
-    runtime_spidermonkey->free_thread_contexts_lock = g_mutex_new();
+    runtime_spidermonkey->free_thread_contexts_lock = hrt_lock_new("hjs-runtime-spidermonkey.free_thread_contexts_lock");
 
     runtime_spidermonkey->runtime = JS_NewRuntime(G_MAXUINT /* max bytes */);
     if (runtime_spidermonkey->runtime == NULL)
@@ -0,0 +1,586 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <hrt/hrt-buffer-builder.h>
+#include <hrt/hrt-buffer-pool.h>
+#include <hrt/hrt-utf.h>
+#include <string.h>
+
+/* The first chunk is this big, and chunks double until they reach
+ * MAX_CHUNK_SIZE; then the builder starts a new one rather than
+ * copying that much again.
+ */
+#define MIN_CHUNK_SIZE 256
+#define MAX_CHUNK_SIZE (64 * 1024)
+
+/* Appended buffers at least this long are shared, not copied */
+#define SHARE_THRESHOLD 1024
+
+struct HrtBufferBuilder {
+    HrtBufferEncoding encoding;
+    const HrtBufferAllocator *allocator;
+
+    /* the chunk we're appending to; allocated doesn't count the
+     * byte kept for the nul
+     */
+    char *data;
+    gsize length;
+    gsize allocated;
+
+    /* earlier output as locked buffers, oldest first */
+    GQueue pieces;
+    gsize pieces_length;
+};
+
+/* "00" "01" ... "99", so integers format two digits at a time */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+/* Each byte's replacement when escaping, indexing the replacement
+ * strings; 0 means the byte is copied as is, which includes every
+ * byte of a multibyte UTF-8 character.
+ */
+enum {
+    HTML_AMP = 1,
+    HTML_LT,
+    HTML_GT,
+    HTML_QUOT,
+    HTML_APOS
+};
+
+static const char * const html_replacements[] = {
+    NULL, "&amp;", "&lt;", "&gt;", "&quot;", "&#39;"
+};
+
+static const guint8 html_escapes[256] = {
+    ['&'] = HTML_AMP,
+    ['<'] = HTML_LT,
+    ['>'] = HTML_GT,
+    ['"'] = HTML_QUOT,
+    ['\''] = HTML_APOS
+};
+
+enum {
+    JSON_U = 1, /* \u00XX */
+    JSON_QUOT,
+    JSON_BACKSLASH,
+    JSON_B,
+    JSON_T,
+    JSON_N,
+    JSON_F,
+    JSON_R
+};
+
+static const char * const json_replacements[] = {
+    NULL, NULL, "\\\"", "\\\\", "\\b", "\\t", "\\n", "\\f", "\\r"
+};
+
+static const guint8 json_escapes[256] = {
+    JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U,
+    JSON_B, JSON_T, JSON_N, JSON_U, JSON_F, JSON_R, JSON_U, JSON_U,
+    JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U,
+    JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U, JSON_U,
+    ['"'] = JSON_QUOT,
+    ['\\'] = JSON_BACKSLASH
+};
+
+/* Output is UTF-8 or binary bytes. For UTF-8, appending ASCII,
+ * numbers, or another buffer doesn't check the result is valid, as
+ * with hrt_buffer_append_ascii().
+ */
+HrtBufferBuilder*
+hrt_buffer_builder_new(HrtBufferEncoding encoding)
+{
+    HrtBufferBuilder *builder;
+
+    g_return_val_if_fail(encoding == HRT_BUFFER_ENCODING_UTF8 ||
+                         encoding == HRT_BUFFER_ENCODING_BINARY, NULL);
+
+    builder = g_slice_new0(HrtBufferBuilder);
+    builder->encoding = encoding;
+    builder->allocator = hrt_buffer_pool_get_allocator();
+    g_queue_init(&builder->pieces);
+
+    return builder;
+}
+
+void
+hrt_buffer_builder_free(HrtBufferBuilder *builder)
+{
+    HrtBuffer *piece;
+
+    while ((piece = g_queue_pop_head(&builder->pieces)) != NULL)
+        hrt_buffer_unref(piece);
+
+    if (builder->data != NULL)
+        builder->allocator->free(builder->data, NULL);
+
+    g_slice_free(HrtBufferBuilder, builder);
+}
+
+gsize
+hrt_buffer_builder_get_length(HrtBufferBuilder *builder)
+{
+    return builder->pieces_length + builder->length;
+}
+
+static void
+push_piece(HrtBufferBuilder *builder,
+           HrtBuffer        *locked_buffer)
+{
+    g_queue_push_tail(&builder->pieces, locked_buffer);
+    builder->pieces_length += hrt_buffer_get_write_size(locked_buffer);
+}
+
+/* Turns the current chunk into a piece, adopting its memory */
+static void
+seal_chunk(HrtBufferBuilder *builder)
+{
+    if (builder->length == 0) {
+        if (builder->data != NULL)
+            builder->allocator->free(builder->data, NULL);
+    } else {
+        builder->data[builder->length] = '\0';
+        push_piece(builder,
+                   hrt_buffer_new_take(builder->encoding,
+                                       builder->data, builder->length,
+                                       builder->allocator, NULL, NULL));
+    }
+
+    builder->data = NULL;
+    builder->length = 0;
+    builder->allocated = 0;
+}
+
+/* Returns where to put at least needed more bytes, which the caller
+ * then counts in builder->length.
+ */
+static char*
+builder_reserve(HrtBufferBuilder *builder,
+                gsize             needed)
+{
+    gsize new_allocated;
+    char *data;
+
+    if (builder->data != NULL &&
+        builder->length + needed <= builder->allocated)
+        return builder->data + builder->length;
+
+    if (builder->allocated >= MAX_CHUNK_SIZE)
+        seal_chunk(builder);
+
+    new_allocated = MAX(builder->allocated * 2, MIN_CHUNK_SIZE);
+    while (new_allocated < builder->length + needed)
+        new_allocated *= 2;
+
+    /* 1 for nul */
+    if (builder->data == NULL)
+        data = builder->allocator->malloc(new_allocated + 1, NULL);
+    else
+        data = builder->allocator->realloc(builder->data, new_allocated + 1, NULL);
+
+    if (data == NULL)
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes",
+                new_allocated + 1);
+
+    builder->data = data;
+    builder->allocated = new_allocated;
+
+    return builder->data + builder->length;
+}
+
+static inline void
+builder_append(HrtBufferBuilder *builder,
+               const void       *bytes,
+               gsize             len)
+{
+    memcpy(builder_reserve(builder, len), bytes, len);
+    builder->length += len;
+}
+
+void
+hrt_buffer_builder_append_ascii(HrtBufferBuilder *builder,
+                                const char       *bytes,
+                                gsize             len)
+{
+    builder_append(builder, bytes, len);
+}
+
+/* Returns FALSE, appending nothing, if utf8 isn't valid */
+gboolean
+hrt_buffer_builder_append_utf8(HrtBufferBuilder *builder,
+                               const char       *utf8,
+                               gsize             len)
+{
+    if (!hrt_utf8_validate(utf8, len))
+        return FALSE;
+
+    builder_append(builder, utf8, len);
+
+    return TRUE;
+}
+
+/* Formats value in decimal ending just before end, returning where
+ * it starts
+ */
+static char*
+format_uint(char    *end,
+            guint64  value)
+{
+    char *p;
+
+    p = end;
+    while (value >= 100) {
+        guint i = (value % 100) * 2;
+
+        value /= 100;
+        p -= 2;
+        p[0] = digit_pairs[i];
+        p[1] = digit_pairs[i + 1];
+    }
+
+    if (value >= 10) {
+        guint i = value * 2;
+
+        p -= 2;
+        p[0] = digit_pairs[i];
+        p[1] = digit_pairs[i + 1];
+    } else {
+        p -= 1;
+        p[0] = '0' + value;
+    }
+
+    return p;
+}
+
+void
+hrt_buffer_builder_append_uint(HrtBufferBuilder *builder,
+                               guint64           value)
+{
+    char buf[20];
+    char *start;
+
+    start = format_uint(buf + sizeof(buf), value);
+
+    builder_append(builder, start, buf + sizeof(buf) - start);
+}
+
+void
+hrt_buffer_builder_append_int(HrtBufferBuilder *builder,
+                              gint64            value)
+{
+    char buf[21];
+    char *start;
+
+    if (value < 0) {
+        /* negating in unsigned works for the most negative value too */
+        start = format_uint(buf + sizeof(buf), - (guint64) value);
+        start -= 1;
+        start[0] = '-';
+    } else {
+        start = format_uint(buf + sizeof(buf), value);
+    }
+
+    builder_append(builder, start, buf + sizeof(buf) - start);
+}
+
+/* Lowercase, with no prefix or leading zeros, as for a chunk size */
+void
+hrt_buffer_builder_append_hex(HrtBufferBuilder *builder,
+                              guint64           value)
+{
+    char buf[16];
+    char *p;
+
+    p = buf + sizeof(buf);
+    do {
+        p -= 1;
+        p[0] = hex_digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+
+    builder_append(builder, p, buf + sizeof(buf) - p);
+}
+
+void
+hrt_buffer_builder_append_printf(HrtBufferBuilder *builder,
+                                 const char       *format,
+                                 ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    hrt_buffer_builder_append_vprintf(builder, format, args);
+    va_end(args);
+}
+
+/* Formats straight into the chunk, if it has room, and formats
+ * again after making room if it didn't.
+ */
+void
+hrt_buffer_builder_append_vprintf(HrtBufferBuilder *builder,
+                                  const char       *format,
+                                  va_list           args)
+{
+    va_list args_copy;
+    char *dest;
+    gsize room;
+    int needed;
+
+    dest = builder_reserve(builder, 0);
+    /* the byte kept for the nul can take vsnprintf's nul */
+    room = builder->allocated - builder->length + 1;
+
+    G_VA_COPY(args_copy, args);
+    needed = g_vsnprintf(dest, room, format, args_copy);
+    va_end(args_copy);
+
+    if (needed < 0)
+        return;
+
+    if ((gsize) needed >= room) {
+        dest = builder_reserve(builder, needed);
+        g_vsnprintf(dest, needed + 1, format, args);
+    }
+
+    builder->length += needed;
+}
+
+/* Copies runs of bytes that safe_prefix (one of the hrt-utf vector
+ * scans) passes through, and replaces the rest using the table.
+ * JSON_U entries in the JSON table have no string and get a \u
+ * escape.
+ */
+static void
+append_escaped(HrtBufferBuilder   *builder,
+               const char         *utf8,
+               gsize               len,
+               gsize             (* safe_prefix) (const char *s,
+                                                  gsize       len),
+               const guint8       *table,
+               const char * const *replacements)
+{
+    const guint8 *s;
+    gsize i;
+
+    s = (const guint8*) utf8;
+    i = 0;
+
+    while (TRUE) {
+        guint8 escape;
+        gsize safe;
+
+        safe = (* safe_prefix) (utf8 + i, len - i);
+        if (safe > 0)
+            builder_append(builder, s + i, safe);
+        i += safe;
+
+        if (i == len)
+            break;
+
+        escape = table[s[i]];
+        if (replacements[escape] != NULL) {
+            builder_append(builder, replacements[escape],
+                           strlen(replacements[escape]));
+        } else {
+            char u[6] = { '\\', 'u', '0', '0', 0, 0 };
+
+            u[4] = hex_digits[s[i] >> 4];
+            u[5] = hex_digits[s[i] & 0xF];
+            builder_append(builder, u, sizeof(u));
+        }
+
+        ++i;
+    }
+}
+
+/* Escapes & < > " and ' so the text can go in an element or a
+ * quoted attribute value. Returns FALSE, appending nothing, if utf8
+ * isn't valid.
+ */
+gboolean
+hrt_buffer_builder_append_html_escaped(HrtBufferBuilder *builder,
+                                       const char       *utf8,
+                                       gsize             len)
+{
+    if (!hrt_utf8_validate(utf8, len))
+        return FALSE;
+
+    append_escaped(builder, utf8, len, hrt_utf_html_safe_prefix,
+                   html_escapes, html_replacements);
+
+    return TRUE;
+}
+
+/* Escapes the inside of a JSON string: quote, backslash and control
+ * characters. Other characters stay UTF-8. Returns FALSE, appending
+ * nothing, if utf8 isn't valid.
+ */
+gboolean
+hrt_buffer_builder_append_json_escaped(HrtBufferBuilder *builder,
+                                       const char       *utf8,
+                                       gsize             len)
+{
+    if (!hrt_utf8_validate(utf8, len))
+        return FALSE;
+
+    append_escaped(builder, utf8, len, hrt_utf_json_safe_prefix,
+                   json_escapes, json_replacements);
+
+    return TRUE;
+}
+
+/* Appends what writing locked_buffer would send. Small buffers are
+ * copied; large ones, and file buffers, become pieces of their own.
+ * The buffer has to have the builder's encoding, since its bytes are
+ * used as they are; file buffers are taken as already being in it.
+ */
+void
+hrt_buffer_builder_append_buffer(HrtBufferBuilder *builder,
+                                 HrtBuffer        *locked_buffer)
+{
+    const void *data;
+    gsize len;
+
+    g_return_if_fail(hrt_buffer_is_locked(locked_buffer));
+    g_return_if_fail(hrt_buffer_is_file(locked_buffer) ||
+                     hrt_buffer_get_encoding(locked_buffer) == builder->encoding);
+
+    if (hrt_buffer_peek_write_data(locked_buffer, &data, &len) &&
+        len < SHARE_THRESHOLD) {
+        builder_append(builder, data, len);
+        return;
+    }
+
+    if (hrt_buffer_get_write_size(locked_buffer) == 0)
+        return;
+
+    seal_chunk(builder);
+
+    hrt_buffer_ref(locked_buffer);
+    push_piece(builder, locked_buffer);
+}
+
+/* Returns everything appended as locked buffers, in order, for
+ * writing one after another; nothing is copied. Free the array with
+ * g_free() after unreffing the buffers. The builder is left empty.
+ */
+int
+hrt_buffer_builder_finish_chain(HrtBufferBuilder  *builder,
+                                HrtBuffer       ***locked_buffers_p)
+{
+    HrtBuffer **buffers;
+    int n_buffers;
+    int i;
+
+    seal_chunk(builder);
+
+    n_buffers = g_queue_get_length(&builder->pieces);
+    buffers = n_buffers > 0 ? g_new(HrtBuffer*, n_buffers) : NULL;
+    for (i = 0; i < n_buffers; ++i)
+        buffers[i] = g_queue_pop_head(&builder->pieces);
+
+    builder->pieces_length = 0;
+
+    *locked_buffers_p = buffers;
+
+    return n_buffers;
+}
+
+static gboolean
+has_file_piece(HrtBufferBuilder *builder)
+{
+    GList *l;
+
+    for (l = builder->pieces.head; l != NULL; l = l->next) {
+        if (hrt_buffer_is_file(l->data))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Returns everything appended as one locked buffer. That's the
+ * chunk itself when everything fit in one; otherwise the pieces are
+ * copied together, so there can't be a file buffer among them (use
+ * hrt_buffer_builder_finish_chain() for those). The builder is left
+ * empty.
+ */
+HrtBuffer*
+hrt_buffer_builder_finish(HrtBufferBuilder *builder)
+{
+    HrtBuffer *buffer;
+    HrtBuffer *piece;
+    char *data;
+    gsize total;
+    gsize offset;
+
+    g_return_val_if_fail(!has_file_piece(builder), NULL);
+
+    seal_chunk(builder);
+
+    if (g_queue_get_length(&builder->pieces) == 1) {
+        builder->pieces_length = 0;
+        return g_queue_pop_head(&builder->pieces);
+    }
+
+    total = builder->pieces_length;
+
+    /* 1 for nul */
+    data = builder->allocator->malloc(total + 1, NULL);
+    if (data == NULL)
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes",
+                total + 1);
+
+    offset = 0;
+    while ((piece = g_queue_pop_head(&builder->pieces)) != NULL) {
+        const void *piece_data;
+        gsize piece_len;
+
+        hrt_buffer_peek_write_data(piece, &piece_data, &piece_len);
+        memcpy(data + offset, piece_data, piece_len);
+        offset += piece_len;
+
+        hrt_buffer_unref(piece);
+    }
+    data[offset] = '\0';
+
+    builder->pieces_length = 0;
+
+    buffer = hrt_buffer_new_take(builder->encoding, data, offset,
+                                 builder->allocator, NULL, NULL);
+
+    return buffer;
+}
@@ -0,0 +1,89 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_BUFFER_BUILDER_H__
+#define __HRT_BUFFER_BUILDER_H__
+
+/*
+ * HrtBufferBuilder puts together dynamic output (a response body, a
+ * header value) by formatting straight into memory from the buffer
+ * pool, then hands that memory over as locked buffers without
+ * copying it again. Numbers are formatted with digit tables and
+ * escaping scans with byte class tables, so neither needs a
+ * temporary string.
+ *
+ * Output goes into one chunk that grows by doubling, so a builder
+ * that stays under 64KB finishes into a single buffer. Past that,
+ * the full chunk is set aside and a new one started. Large buffers
+ * appended with hrt_buffer_builder_append_buffer() are referenced
+ * rather than copied. hrt_buffer_builder_finish_chain() gives all
+ * the pieces back in order for writing one after another, while
+ * hrt_buffer_builder_finish() has to copy them into one buffer if
+ * there's more than one.
+ *
+ * A builder is used from one thread at a time.
+ */
+
+#include <glib.h>
+#include <hrt/hrt-buffer.h>
+
+G_BEGIN_DECLS
+
+typedef struct HrtBufferBuilder HrtBufferBuilder;
+
+HrtBufferBuilder* hrt_buffer_builder_new                 (HrtBufferEncoding  encoding);
+void              hrt_buffer_builder_free                (HrtBufferBuilder  *builder);
+gsize             hrt_buffer_builder_get_length          (HrtBufferBuilder  *builder);
+void              hrt_buffer_builder_append_ascii        (HrtBufferBuilder  *builder,
+                                                          const char        *bytes,
+                                                          gsize              len);
+gboolean          hrt_buffer_builder_append_utf8         (HrtBufferBuilder  *builder,
+                                                          const char        *utf8,
+                                                          gsize              len);
+void              hrt_buffer_builder_append_int          (HrtBufferBuilder  *builder,
+                                                          gint64             value);
+void              hrt_buffer_builder_append_uint         (HrtBufferBuilder  *builder,
+                                                          guint64            value);
+void              hrt_buffer_builder_append_hex          (HrtBufferBuilder  *builder,
+                                                          guint64            value);
+void              hrt_buffer_builder_append_printf       (HrtBufferBuilder  *builder,
+                                                          const char        *format,
+                                                          ...) G_GNUC_PRINTF(2, 3);
+void              hrt_buffer_builder_append_vprintf      (HrtBufferBuilder  *builder,
+                                                          const char        *format,
+                                                          va_list            args);
+gboolean          hrt_buffer_builder_append_html_escaped (HrtBufferBuilder  *builder,
+                                                          const char        *utf8,
+                                                          gsize              len);
+gboolean          hrt_buffer_builder_append_json_escaped (HrtBufferBuilder  *builder,
+                                                          const char        *utf8,
+                                                          gsize              len);
+void              hrt_buffer_builder_append_buffer       (HrtBufferBuilder  *builder,
+                                                          HrtBuffer         *locked_buffer);
+HrtBuffer*        hrt_buffer_builder_finish              (HrtBufferBuilder  *builder);
+int               hrt_buffer_builder_finish_chain        (HrtBufferBuilder  *builder,
+                                                          HrtBuffer       ***locked_buffers_p);
+
+G_END_DECLS
+
+#endif  /* __HRT_BUFFER_BUILDER_H__ */
@@ -0,0 +1,526 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <hrt/hrt-buffer-pool.h>
+#include <hrt/hrt-lock.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Chunks are 2^MIN_CLASS_SHIFT through 2^MAX_CLASS_SHIFT bytes,
+ * including our header. Anything bigger is a large chunk.
+ */
+#define MIN_CLASS_SHIFT 5
+#define MAX_CLASS_SHIFT 20
+#define N_CLASSES       (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define LARGE_CLASS     N_CLASSES
+
+#define CLASS_SIZE(size_class) (((gsize) 1) << ((size_class) + MIN_CLASS_SHIFT))
+
+/* How many free chunks of a class a thread cache holds before it
+ * hands half of them to the depot, and how many the depot holds
+ * before it lets them go back to the system.
+ */
+#define THREAD_CACHE_BYTES (256 * 1024)
+#define DEPOT_BYTES        (8 * 1024 * 1024)
+#define MIN_CACHED         2
+#define MAX_CACHED         4096
+
+#define HUGE_PAGE_SIZE     (2 * 1024 * 1024)
+
+typedef union {
+    struct {
+        /* whole chunk including this header */
+        gsize size;
+        guint size_class;
+        guint huge : 1;
+    } h;
+    /* keep the data after the header aligned like malloc's */
+    double align[2];
+} ChunkHeader;
+
+typedef struct {
+    /* free chunks, linked through their headers */
+    GTrashStack *free[N_CLASSES];
+    guint n_free[N_CLASSES];
+
+    /* only touched by the owning thread; read racily for stats */
+    guint64 thread_hits;
+    guint64 depot_hits;
+    guint64 misses;
+} ThreadCache;
+
+static GStaticPrivate thread_cache = G_STATIC_PRIVATE_INIT;
+
+static volatile int use_huge_pages = -1;
+
+/* depot_lock() protects everything below */
+static GTrashStack *depot_free[N_CLASSES];
+static guint depot_n_free[N_CLASSES];
+/* live thread caches, for stats */
+static GSList *thread_caches = NULL;
+/* stats of threads that have exited */
+static guint64 exited_thread_hits = 0;
+static guint64 exited_depot_hits = 0;
+static guint64 exited_misses = 0;
+static gsize resident_bytes = 0;
+static gsize huge_page_bytes = 0;
+
+static HrtLock*
+depot_lock(void)
+{
+    static volatile gsize lock = 0;
+
+    if (g_once_init_enter(&lock)) {
+        g_once_init_leave(&lock, (gsize) hrt_lock_new("hrt-buffer-pool.depot"));
+    }
+
+    return (HrtLock*) lock;
+}
+
+static guint
+thread_cache_limit(guint size_class)
+{
+    return CLAMP(THREAD_CACHE_BYTES / CLASS_SIZE(size_class),
+                 MIN_CACHED, MAX_CACHED);
+}
+
+static guint
+depot_limit(guint size_class)
+{
+    return CLAMP(DEPOT_BYTES / CLASS_SIZE(size_class),
+                 MIN_CACHED, MAX_CACHED);
+}
+
+static guint
+class_for_size(gsize total)
+{
+    guint shift;
+
+    if (total <= CLASS_SIZE(0))
+        return 0;
+
+    shift = g_bit_storage(total - 1);
+    if (shift > MAX_CLASS_SHIFT)
+        return LARGE_CLASS;
+
+    return shift - MIN_CLASS_SHIFT;
+}
+
+/* CALLED WITH depot LOCK HELD */
+static void
+system_free_unlocked(ChunkHeader *header)
+{
+    resident_bytes -= header->h.size;
+
+    if (header->h.huge) {
+        huge_page_bytes -= header->h.size;
+        munmap(header, header->h.size);
+    } else {
+        g_free(header);
+    }
+}
+
+/* CALLED WITH depot LOCK HELD. Keeps the chunk in the depot, or gives
+ * it back to the system if the depot has enough of its class.
+ */
+static void
+depot_push_unlocked(guint        size_class,
+                    ChunkHeader *header)
+{
+    if (depot_n_free[size_class] < depot_limit(size_class)) {
+        g_trash_stack_push(&depot_free[size_class], header);
+        depot_n_free[size_class] += 1;
+    } else {
+        /* popped chunks had their header overwritten by the link */
+        header->h.size = CLASS_SIZE(size_class);
+        header->h.huge = FALSE;
+        system_free_unlocked(header);
+    }
+}
+
+static void
+thread_cache_free(void *data)
+{
+    ThreadCache *cache = data;
+    guint i;
+
+    hrt_lock_lock(depot_lock());
+
+    for (i = 0; i < N_CLASSES; ++i) {
+        ChunkHeader *header;
+
+        while ((header = g_trash_stack_pop(&cache->free[i])) != NULL)
+            depot_push_unlocked(i, header);
+    }
+
+    exited_thread_hits += cache->thread_hits;
+    exited_depot_hits += cache->depot_hits;
+    exited_misses += cache->misses;
+
+    thread_caches = g_slist_remove(thread_caches, cache);
+
+    hrt_lock_unlock(depot_lock());
+
+    g_free(cache);
+}
+
+static ThreadCache*
+get_thread_cache(void)
+{
+    ThreadCache *cache;
+
+    cache = g_static_private_get(&thread_cache);
+    if (G_UNLIKELY(cache == NULL)) {
+        cache = g_new0(ThreadCache, 1);
+
+        hrt_lock_lock(depot_lock());
+        thread_caches = g_slist_prepend(thread_caches, cache);
+        hrt_lock_unlock(depot_lock());
+
+        /* gives the chunks to the depot when the thread exits */
+        g_static_private_set(&thread_cache, cache, thread_cache_free);
+    }
+
+    return cache;
+}
+
+static ChunkHeader*
+class_alloc(ThreadCache *cache,
+            guint        size_class)
+{
+    ChunkHeader *header;
+    gsize size;
+
+    size = CLASS_SIZE(size_class);
+
+    if (cache->n_free[size_class] > 0) {
+        header = g_trash_stack_pop(&cache->free[size_class]);
+        cache->n_free[size_class] -= 1;
+        cache->thread_hits += 1;
+    } else {
+        guint batch;
+
+        /* refill half the thread cache at once, so we come back to
+         * the depot as rarely as we go to it when freeing
+         */
+        batch = thread_cache_limit(size_class) / 2;
+
+        hrt_lock_lock(depot_lock());
+        while (depot_n_free[size_class] > 0 &&
+               cache->n_free[size_class] < batch) {
+            g_trash_stack_push(&cache->free[size_class],
+                               g_trash_stack_pop(&depot_free[size_class]));
+            depot_n_free[size_class] -= 1;
+            cache->n_free[size_class] += 1;
+        }
+        if (cache->n_free[size_class] == 0)
+            resident_bytes += size;
+        hrt_lock_unlock(depot_lock());
+
+        if (cache->n_free[size_class] > 0) {
+            header = g_trash_stack_pop(&cache->free[size_class]);
+            cache->n_free[size_class] -= 1;
+            cache->depot_hits += 1;
+        } else {
+            header = g_try_malloc(size);
+            cache->misses += 1;
+
+            if (header == NULL) {
+                hrt_lock_lock(depot_lock());
+                resident_bytes -= size;
+                hrt_lock_unlock(depot_lock());
+                return NULL;
+            }
+        }
+    }
+
+    header->h.size = size;
+    header->h.size_class = size_class;
+    header->h.huge = FALSE;
+
+    return header;
+}
+
+static void
+class_free(ThreadCache *cache,
+           ChunkHeader *header)
+{
+    guint size_class;
+    guint limit;
+
+    size_class = header->h.size_class;
+    limit = thread_cache_limit(size_class);
+
+    if (cache->n_free[size_class] >= limit) {
+        /* hand half the cache to the depot, where other threads can
+         * get at it (a thread that mostly frees what another thread
+         * allocated would otherwise just pile chunks up).
+         */
+        hrt_lock_lock(depot_lock());
+        while (cache->n_free[size_class] > limit / 2) {
+            depot_push_unlocked(size_class,
+                                g_trash_stack_pop(&cache->free[size_class]));
+            cache->n_free[size_class] -= 1;
+        }
+        hrt_lock_unlock(depot_lock());
+    }
+
+    g_trash_stack_push(&cache->free[size_class], header);
+    cache->n_free[size_class] += 1;
+}
+
+static gboolean
+huge_pages_enabled(void)
+{
+    int enabled;
+
+    enabled = g_atomic_int_get(&use_huge_pages);
+    if (G_UNLIKELY(enabled < 0)) {
+        const char *env;
+
+        env = g_getenv("HRT_BUFFER_POOL_HUGE_PAGES");
+        enabled = env != NULL && strcmp(env, "0") != 0;
+        g_atomic_int_set(&use_huge_pages, enabled);
+    }
+
+    return enabled;
+}
+
+/* An mmap() aligned to a huge page, so the kernel can back all of it
+ * with huge pages. NULL if we can't get one.
+ */
+static ChunkHeader*
+huge_alloc(gsize total)
+{
+    gsize size;
+    char *map;
+    char *aligned;
+    gsize head;
+
+    size = (total + HUGE_PAGE_SIZE - 1) & ~((gsize) HUGE_PAGE_SIZE - 1);
+
+    /* map an extra huge page of slop, then trim it off both ends
+     * to leave an aligned range
+     */
+    map = mmap(NULL, size + HUGE_PAGE_SIZE,
+               PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    aligned = (char*) ((((gsize) map) + HUGE_PAGE_SIZE - 1) &
+                       ~((gsize) HUGE_PAGE_SIZE - 1));
+    head = aligned - map;
+    if (head > 0)
+        munmap(map, head);
+    munmap(aligned + size, HUGE_PAGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+    /* only advice; without THP we still have a working mapping */
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+    return (ChunkHeader*) aligned;
+}
+
+static ChunkHeader*
+large_alloc(ThreadCache *cache,
+            gsize        total)
+{
+    ChunkHeader *header;
+    gboolean huge;
+
+    header = NULL;
+    huge = FALSE;
+
+    if (total >= HUGE_PAGE_SIZE && huge_pages_enabled()) {
+        header = huge_alloc(total);
+        if (header != NULL) {
+            huge = TRUE;
+            total = (total + HUGE_PAGE_SIZE - 1) & ~((gsize) HUGE_PAGE_SIZE - 1);
+        }
+    }
+
+    if (header == NULL) {
+        header = g_try_malloc(total);
+        if (header == NULL)
+            return NULL;
+    }
+
+    cache->misses += 1;
+
+    header->h.size = total;
+    header->h.size_class = LARGE_CLASS;
+    header->h.huge = huge;
+
+    hrt_lock_lock(depot_lock());
+    resident_bytes += total;
+    if (huge)
+        huge_page_bytes += total;
+    hrt_lock_unlock(depot_lock());
+
+    return header;
+}
+
+/* CALLED FROM ANY THREAD */
+static void*
+pool_malloc(gsize bytes,
+            void *allocator_data)
+{
+    ThreadCache *cache;
+    ChunkHeader *header;
+    gsize total;
+    guint size_class;
+
+    if (bytes > G_MAXSIZE - sizeof(ChunkHeader))
+        return NULL;
+
+    total = bytes + sizeof(ChunkHeader);
+    size_class = class_for_size(total);
+
+    cache = get_thread_cache();
+
+    if (size_class == LARGE_CLASS)
+        header = large_alloc(cache, total);
+    else
+        header = class_alloc(cache, size_class);
+
+    if (header == NULL)
+        return NULL;
+
+    return header + 1;
+}
+
+/* CALLED FROM ANY THREAD, not necessarily the allocating one */
+static void
+pool_free(void *mem,
+          void *allocator_data)
+{
+    ChunkHeader *header;
+
+    if (mem == NULL)
+        return;
+
+    header = ((ChunkHeader*) mem) - 1;
+
+    if (header->h.size_class == LARGE_CLASS) {
+        hrt_lock_lock(depot_lock());
+        system_free_unlocked(header);
+        hrt_lock_unlock(depot_lock());
+    } else {
+        class_free(get_thread_cache(), header);
+    }
+}
+
+/* CALLED FROM ANY THREAD */
+static void*
+pool_realloc(void *mem,
+             gsize bytes,
+             void *allocator_data)
+{
+    ChunkHeader *header;
+    gsize capacity;
+    void *new_mem;
+
+    if (mem == NULL)
+        return pool_malloc(bytes, allocator_data);
+
+    header = ((ChunkHeader*) mem) - 1;
+    capacity = header->h.size - sizeof(ChunkHeader);
+
+    /* still fits in the chunk we have; buffers never shrink so
+     * there's no point giving back the rest
+     */
+    if (bytes <= capacity)
+        return mem;
+
+    new_mem = pool_malloc(bytes, allocator_data);
+    if (new_mem == NULL)
+        return NULL;
+
+    memcpy(new_mem, mem, capacity);
+    pool_free(mem, allocator_data);
+
+    return new_mem;
+}
+
+static const HrtBufferAllocator pool_allocator = {
+    pool_malloc,
+    pool_free,
+    pool_realloc
+};
+
+/* Pass to hrt_buffer_new() with NULL allocator_data. Memory from it
+ * can be freed from any thread.
+ */
+const HrtBufferAllocator*
+hrt_buffer_pool_get_allocator(void)
+{
+    return &pool_allocator;
+}
+
+/* Affects large chunks allocated from now on */
+void
+hrt_buffer_pool_set_huge_pages(gboolean enabled)
+{
+    g_atomic_int_set(&use_huge_pages, enabled != FALSE);
+}
+
+/* Totals are for all threads. Per-thread numbers are read without
+ * stopping the threads, so they're approximate while allocating.
+ */
+void
+hrt_buffer_pool_get_stats(HrtBufferPoolStats *stats)
+{
+    GSList *l;
+    guint i;
+
+    memset(stats, '\0', sizeof(*stats));
+
+    hrt_lock_lock(depot_lock());
+
+    stats->thread_hits = exited_thread_hits;
+    stats->depot_hits = exited_depot_hits;
+    stats->misses = exited_misses;
+
+    for (l = thread_caches; l != NULL; l = l->next) {
+        ThreadCache *cache = l->data;
+
+        stats->thread_hits += cache->thread_hits;
+        stats->depot_hits += cache->depot_hits;
+        stats->misses += cache->misses;
+
+        for (i = 0; i < N_CLASSES; ++i)
+            stats->cached_bytes += cache->n_free[i] * CLASS_SIZE(i);
+    }
+
+    for (i = 0; i < N_CLASSES; ++i)
+        stats->cached_bytes += depot_n_free[i] * CLASS_SIZE(i);
+
+    stats->resident_bytes = resident_bytes;
+    stats->huge_page_bytes = huge_page_bytes;
+
+    hrt_lock_unlock(depot_lock());
+}
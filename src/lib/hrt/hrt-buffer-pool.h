@@ -0,0 +1,69 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_BUFFER_POOL_H__
+#define __HRT_BUFFER_POOL_H__
+
+/*
+ * A HrtBufferAllocator that recycles memory in power-of-two size
+ * classes. Each thread keeps a small cache of free chunks per class,
+ * and trades batches of them with a global depot when its cache runs
+ * empty or full, so the common malloc/free doesn't take a lock.
+ * Buffers grow by roughly doubling, so a buffer that's reallocated
+ * often stays in its class and the realloc is free.
+ *
+ * Chunks too big for the largest class come straight from the system.
+ * If huge pages are enabled (hrt_buffer_pool_set_huge_pages() or
+ * HRT_BUFFER_POOL_HUGE_PAGES=1 in the environment), the ones of
+ * at least one huge page are mmap()ed and advised as transparent
+ * huge pages, which saves TLB misses on big bodies and file reads.
+ */
+
+#include <glib.h>
+#include <hrt/hrt-buffer.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+    /* allocations served from the calling thread's cache, from the
+     * global depot, and from the system
+     */
+    guint64 thread_hits;
+    guint64 depot_hits;
+    guint64 misses;
+    /* bytes the pool got from the system and hasn't given back,
+     * in use or not; of those, free ones waiting in a cache or
+     * the depot; and ones backed by huge pages
+     */
+    gsize   resident_bytes;
+    gsize   cached_bytes;
+    gsize   huge_page_bytes;
+} HrtBufferPoolStats;
+
+const HrtBufferAllocator* hrt_buffer_pool_get_allocator  (void);
+void                      hrt_buffer_pool_set_huge_pages (gboolean            enabled);
+void                      hrt_buffer_pool_get_stats      (HrtBufferPoolStats *stats);
+
+G_END_DECLS
+
+#endif  /* __HRT_BUFFER_POOL_H__ */
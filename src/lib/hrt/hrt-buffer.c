@@ -22,10 +22,19 @@
  */
 #include <config.h>
 #include <hrt/hrt-buffer.h>
+#include <hrt/hrt-buffer-pool.h>
+#include <hrt/hrt-utf.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 
 static void*
@@ -86,6 +95,16 @@ static const HrtBufferAllocator static_allocator = {
     buffer_static_realloc
 };
 
+/* A slice's data points into its parent, which is the
+ * allocator_data and is unreffed as the allocator_data_dnotify.
+ * This is a separate allocator only so we can recognize slices.
+ */
+static const HrtBufferAllocator slice_allocator = {
+    buffer_static_malloc,
+    buffer_static_free,
+    buffer_static_realloc
+};
+
 
 typedef struct {
     HrtBufferEncoding encoding;
@@ -95,17 +114,34 @@ typedef struct {
     void        (* append_ascii)   (HrtBuffer  *buffer,
                                     const char *bytes,
                                     gsize       len);
+    gboolean    (* append_utf8)    (HrtBuffer  *buffer,
+                                    const char *utf8,
+                                    gsize       len);
 } HrtEncodingClass;
 
+/* Contents up to this many bytes (including the nul) are stored in
+ * the HrtBuffer itself, saving a second allocation; most header
+ * names and values fit.
+ */
+#define INLINE_SIZE 32
+
+/* Writing a compact UTF-16 buffer widens at most this many bytes of
+ * it per write into a scratch buffer, freed when the write returns
+ */
+#define WIDEN_SCRATCH_SIZE (64 * 1024)
+
+/* The fields needed to read a buffer come first, followed by the
+ * inline contents, so reading a small buffer touches 64 bytes.
+ */
 struct HrtBuffer {
     volatile int refcount;
-    const HrtBufferAllocator  *allocator;
-    void *allocator_data;
-    GDestroyNotify allocator_data_dnotify;
-    const HrtEncodingClass *encoding;
     unsigned int locked : 1;
     /* number of array elements, not bytes or encoded chars  */
     unsigned int length : 31;
+    const HrtEncodingClass *encoding;
+    /* data may point at small.buf_8 or small.buf_16, and buf_8 and
+     * buf_16 have the same layout so either can be used for both.
+     */
     union {
         struct {
             guint16 *data;
@@ -117,12 +153,133 @@ struct HrtBuffer {
             gsize allocated;
         } buf_8;
     } d;
+    union {
+        char buf_8[INLINE_SIZE];
+        guint16 buf_16[INLINE_SIZE / 2];
+        /* a byte range of an fd, which the root buffer owns; file
+         * buffers have no contents to store inline.
+         */
+        struct {
+            int fd;
+            gboolean is_pipe;
+            goffset offset;
+            gsize len;
+        } file;
+    } small;
+    const HrtBufferAllocator  *allocator;
+    void *allocator_data;
+    GDestroyNotify allocator_data_dnotify;
+    /* a compact UTF-16 buffer's contents as UTF-16, made the first
+     * time someone peeks at them that way; writes don't need it
+     */
+    volatile gpointer widened;
 };
 
+static gboolean
+storage_is_inline(HrtBuffer *buffer)
+{
+    return buffer->d.buf_8.data == buffer->small.buf_8;
+}
+
+/* The buffer whose allocator owns the storage; for a slice that's
+ * the buffer it's a slice of.
+ */
+static HrtBuffer*
+storage_owner(HrtBuffer *buffer)
+{
+    if (buffer->allocator == &slice_allocator)
+        return buffer->allocator_data;
+    else
+        return buffer;
+}
+
+/* Makes room for new_needed array elements of elem_size bytes
+ * each. Contents start out inline if they fit, and move to memory
+ * from the allocator once they outgrow that. Unless exact, growing
+ * approximately doubles the allocation.
+ */
+static void
+storage_reserve(HrtBuffer *buffer,
+                gsize      elem_size,
+                gsize      new_needed,
+                gboolean   exact)
+{
+    gsize allocated;
+    gsize new_allocated;
+    char *data;
+
+    allocated = buffer->d.buf_8.allocated;
+    if (new_needed <= allocated)
+        return;
+
+    if (allocated == 0 && new_needed * elem_size <= INLINE_SIZE) {
+        buffer->d.buf_8.data = buffer->small.buf_8;
+        buffer->d.buf_8.allocated = INLINE_SIZE / elem_size;
+        return;
+    }
+
+    /* The common case is we never realloc, so alloc exact length
+     * the first time; after that, overly cute way to approximately
+     * double each time.
+     */
+    if (allocated == 0 || exact)
+        new_allocated = new_needed;
+    else
+        new_allocated = new_needed + allocated;
+
+    if (allocated == 0) {
+        data = buffer->allocator->malloc(new_allocated * elem_size,
+                                         buffer->allocator_data);
+    } else if (storage_is_inline(buffer)) {
+        data = buffer->allocator->malloc(new_allocated * elem_size,
+                                         buffer->allocator_data);
+        if (data != NULL)
+            memcpy(data, buffer->small.buf_8, buffer->length * elem_size);
+    } else {
+        data = buffer->allocator->realloc(buffer->d.buf_8.data,
+                                          new_allocated * elem_size,
+                                          buffer->allocator_data);
+    }
+
+    if (data == NULL)
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes",
+                new_allocated * elem_size);
+
+    buffer->d.buf_8.data = data;
+    buffer->d.buf_8.allocated = new_allocated;
+}
+
+/* Hands the contents, with their nul, over to the caller as memory
+ * from the allocator; inline contents are copied out for that.
+ */
+static void*
+storage_steal(HrtBuffer *buffer,
+              gsize      elem_size)
+{
+    void *data;
+
+    data = buffer->d.buf_8.data;
+    if (data != NULL && storage_is_inline(buffer)) {
+        data = buffer->allocator->malloc((buffer->length + 1) * elem_size,
+                                         buffer->allocator_data);
+        if (data == NULL)
+            g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes",
+                    (buffer->length + 1) * elem_size);
+        memcpy(data, buffer->small.buf_8, (buffer->length + 1) * elem_size);
+    }
+
+    buffer->d.buf_8.data = NULL;
+    buffer->d.buf_8.allocated = 0;
+    buffer->length = 0;
+
+    return data;
+}
+
 static void
 buf8_finalize(HrtBuffer *buffer)
 {
-    if (buffer->d.buf_8.data != NULL) {
+    if (buffer->d.buf_8.data != NULL &&
+        !storage_is_inline(buffer)) {
         buffer->allocator->free(buffer->d.buf_8.data,
                                 buffer->allocator_data);
     }
@@ -143,7 +300,8 @@ buf8_get_write_data(HrtBuffer *buffer)
 static void
 buf16_finalize(HrtBuffer *buffer)
 {
-    if (buffer->d.buf_16.data != NULL) {
+    if (buffer->d.buf_16.data != NULL &&
+        !storage_is_inline(buffer)) {
         buffer->allocator->free(buffer->d.buf_16.data,
                                 buffer->allocator_data);
     }
@@ -166,31 +324,11 @@ utf8_append_ascii(HrtBuffer  *buffer,
                   const char *bytes,
                   gsize       len)
 {
-    gsize new_needed;
     char *dest;
 
-    new_needed = buffer->length + len + 1; /* 1 for nul, always auto-nul */
-    if (new_needed > buffer->d.buf_8.allocated) {
-        if (buffer->d.buf_8.allocated == 0) {
-            /* The common case is we never realloc, so alloc exact length
-             * the first time.
-             */
-            buffer->d.buf_8.data = buffer->allocator->malloc(new_needed,
-                                                             buffer->allocator_data);
-            if (buffer->d.buf_8.data == NULL)
-                g_error("Failed to allocate %u bytes", new_needed);
-            buffer->d.buf_8.allocated = new_needed;
-        } else {
-            /* overly cute way to approximately double each time */
-            gsize new_allocated = new_needed + buffer->d.buf_8.allocated;
-            buffer->d.buf_8.data =
-                buffer->allocator->realloc(buffer->d.buf_8.data, new_allocated,
-                                           buffer->allocator_data);
-            if (buffer->d.buf_8.data == NULL)
-                g_error("Failed to reallocate %u bytes", new_needed);
-            buffer->d.buf_8.allocated = new_allocated;
-        }
-    }
+    /* 1 for nul, always auto-nul */
+    storage_reserve(buffer, 1, buffer->length + len + 1, FALSE);
+
     dest = buffer->d.buf_8.data + buffer->length;
     memcpy(dest, bytes, len);
     dest[len] = '\0';
@@ -198,62 +336,293 @@ utf8_append_ascii(HrtBuffer  *buffer,
     buffer->length = buffer->length + len;
 }
 
+static gboolean
+utf8_append_utf8(HrtBuffer  *buffer,
+                 const char *utf8,
+                 gsize       len)
+{
+    if (!hrt_utf8_validate(utf8, len))
+        return FALSE;
+
+    utf8_append_ascii(buffer, utf8, len);
+
+    return TRUE;
+}
+
 static const HrtEncodingClass utf8_encoding = {
     HRT_BUFFER_ENCODING_UTF8,
     buf8_finalize,
     buf8_get_write_size,
     buf8_get_write_data,
-    utf8_append_ascii
+    utf8_append_ascii,
+    utf8_append_utf8
 };
 
+/* Binary buffers store bytes just like UTF-8 ones (including the
+ * extra nul, which is handy for parsers), they just aren't text.
+ */
+static const HrtEncodingClass binary_encoding = {
+    HRT_BUFFER_ENCODING_BINARY,
+    buf8_finalize,
+    buf8_get_write_size,
+    buf8_get_write_data,
+    utf8_append_ascii,
+    utf8_append_utf8
+};
+
+/* Makes room for len more array elements plus the nul */
+static guint16*
+utf16_ensure_space(HrtBuffer *buffer,
+                   gsize      len)
+{
+    /* 1 for nul, always auto-nul */
+    storage_reserve(buffer, sizeof(guint16), buffer->length + len + 1, FALSE);
+
+    return buffer->d.buf_16.data + buffer->length;
+}
+
 static void
 utf16_append_ascii(HrtBuffer  *buffer,
                    const char *bytes,
                    gsize       len)
 {
-    gsize new_needed;
     guint16 *dest;
-    const char *src;
-    gsize i;
 
-    new_needed = buffer->length + len + 1; /* 1 for nul, always auto-nul */
-    if (new_needed > buffer->d.buf_16.allocated) {
-        if (buffer->d.buf_16.allocated == 0) {
-            /* The common case is we never realloc, so alloc exact length
-             * the first time.
-             */
-            buffer->d.buf_16.data = buffer->allocator->malloc(new_needed * sizeof(guint16),
-                                                              buffer->allocator_data);
-            if (buffer->d.buf_16.data == NULL)
-                g_error("Failed to allocate %u*2 bytes", new_needed);
-            buffer->d.buf_16.allocated = new_needed;
-        } else {
-            /* overly cute way to approximately double each time */
-            gsize new_allocated = new_needed + buffer->d.buf_16.allocated;
-            buffer->d.buf_16.data =
-                buffer->allocator->realloc(buffer->d.buf_16.data, new_allocated * sizeof(guint16),
-                                           buffer->allocator_data);
-            if (buffer->d.buf_16.data == NULL)
-                g_error("Failed to allocate %u*2 bytes", new_allocated);
-            buffer->d.buf_16.allocated = new_allocated;
-        }
-    }
-    dest = buffer->d.buf_16.data + buffer->length;
-    src = bytes;
-    for (i = 0; i < len; ++i) {
-        dest[i] = src[i];
-    }
-    dest[i] = 0;
+    dest = utf16_ensure_space(buffer, len);
+
+    /* bytes outside ASCII are taken as Latin-1 */
+    hrt_utf_widen_ascii(dest, bytes, len);
+    dest[len] = 0;
 
     buffer->length = buffer->length + len;
 }
 
+static gboolean
+utf16_append_utf8(HrtBuffer  *buffer,
+                  const char *utf8,
+                  gsize       len)
+{
+    guint16 *dest;
+    gssize converted;
+
+    /* UTF-16 never takes more elements than UTF-8 takes bytes */
+    dest = utf16_ensure_space(buffer, len);
+
+    converted = hrt_utf8_to_utf16(utf8, len, dest);
+    if (converted < 0) {
+        dest[0] = 0;
+        return FALSE;
+    }
+    dest[converted] = 0;
+
+    buffer->length = buffer->length + converted;
+
+    return TRUE;
+}
+
 static const HrtEncodingClass utf16_encoding = {
     HRT_BUFFER_ENCODING_UTF16,
     buf16_finalize,
     buf16_get_write_size,
     buf16_get_write_data,
-    utf16_append_ascii
+    utf16_append_ascii,
+    utf16_append_utf8
+};
+
+/* A UTF-16 buffer starts out compact: as long as every character
+ * is in Latin-1 (as HTTP headers are) it stores one byte per
+ * character, in buf_8, instead of two. It's still UTF-16 as far as
+ * anyone outside can tell. Appending a character past U+00FF widens
+ * it for good into an ordinary UTF-16 buffer, and once locked the
+ * UTF-16 form is made and cached when first asked for, by peeking
+ * or by writing (which always sends the UTF-16).
+ */
+static void
+latin1_finalize(HrtBuffer *buffer)
+{
+    HrtBuffer *owner;
+
+    if (buffer->widened != NULL) {
+        owner = storage_owner(buffer);
+        owner->allocator->free(buffer->widened,
+                               owner->allocator_data);
+    }
+
+    buf8_finalize(buffer);
+}
+
+/* CALLED FROM ANY THREAD, on a locked buffer */
+static const guint16*
+latin1_get_widened(HrtBuffer *buffer)
+{
+    HrtBuffer *owner;
+    guint16 *widened;
+
+    widened = g_atomic_pointer_get(&buffer->widened);
+    if (widened != NULL)
+        return widened;
+
+    owner = storage_owner(buffer);
+    widened = owner->allocator->malloc((buffer->length + 1) * sizeof(guint16),
+                                       owner->allocator_data);
+    if (widened == NULL)
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes",
+                (buffer->length + 1) * sizeof(guint16));
+
+    hrt_utf_widen_ascii(widened, buffer->d.buf_8.data, buffer->length);
+    widened[buffer->length] = 0;
+
+    /* another thread may have got there first */
+    if (!g_atomic_pointer_compare_and_exchange(&buffer->widened, NULL, widened)) {
+        owner->allocator->free(widened, owner->allocator_data);
+        widened = g_atomic_pointer_get(&buffer->widened);
+    }
+
+    return widened;
+}
+
+static const void*
+latin1_get_write_data(HrtBuffer *buffer)
+{
+    return latin1_get_widened(buffer);
+}
+
+/* Number of UTF-16 units to widen for the write data bytes
+ * [offset, offset + len) of a compact buffer, which can start or end
+ * halfway through a unit
+ */
+static gsize
+latin1_range_units(gsize offset,
+                   gsize len)
+{
+    return (offset + len + 1) / 2 - offset / 2;
+}
+
+/* Widens the write data bytes [offset, offset + len) of a compact
+ * buffer into scratch, which has room for latin1_range_units() units,
+ * returning where those bytes start in it.
+ */
+static const char*
+latin1_widen_range(HrtBuffer *buffer,
+                   gsize      offset,
+                   gsize      len,
+                   guint16   *scratch)
+{
+    hrt_utf_widen_ascii(scratch, buffer->d.buf_8.data + offset / 2,
+                        latin1_range_units(offset, len));
+
+    return ((const char*) scratch) + (offset & 1);
+}
+
+/* Turns an unlocked compact buffer into an ordinary UTF-16 one */
+static void
+latin1_widen_storage(HrtBuffer *buffer)
+{
+    guint16 *data;
+    gsize i;
+
+    buffer->encoding = &utf16_encoding;
+
+    /* nothing stored yet */
+    if (buffer->d.buf_8.data == NULL)
+        return;
+
+    if (storage_is_inline(buffer) &&
+        buffer->length + 1 <= INLINE_SIZE / 2) {
+        /* back to front since each unit lands on or after its byte */
+        for (i = buffer->length + 1; i > 0; --i)
+            buffer->small.buf_16[i - 1] = (guint8) buffer->small.buf_8[i - 1];
+        buffer->d.buf_16.allocated = INLINE_SIZE / 2;
+        return;
+    }
+
+    data = buffer->allocator->malloc((buffer->length + 1) * sizeof(guint16),
+                                     buffer->allocator_data);
+    if (data == NULL)
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes",
+                (buffer->length + 1) * sizeof(guint16));
+
+    /* the nul comes along too */
+    hrt_utf_widen_ascii(data, buffer->d.buf_8.data, buffer->length + 1);
+
+    buf8_finalize(buffer);
+
+    buffer->d.buf_16.data = data;
+    buffer->d.buf_16.allocated = buffer->length + 1;
+}
+
+static gboolean
+latin1_append_utf8(HrtBuffer  *buffer,
+                   const char *utf8,
+                   gsize       len)
+{
+    char *dest;
+    gssize converted;
+
+    /* Latin-1 never takes more bytes than UTF-8; 1 for nul */
+    storage_reserve(buffer, 1, buffer->length + len + 1, FALSE);
+
+    dest = buffer->d.buf_8.data + buffer->length;
+
+    converted = hrt_utf8_to_latin1(utf8, len, dest);
+    if (converted < 0) {
+        dest[0] = '\0';
+
+        /* Either it's invalid, which the UTF-16 conversion will
+         * notice, or it needs real UTF-16.
+         */
+        latin1_widen_storage(buffer);
+
+        return utf16_append_utf8(buffer, utf8, len);
+    }
+    dest[converted] = '\0';
+
+    buffer->length = buffer->length + converted;
+
+    return TRUE;
+}
+
+/* Appending ASCII stores the bytes as they are, since bytes outside
+ * ASCII are taken as Latin-1 anyway.
+ */
+static const HrtEncodingClass latin1_encoding = {
+    HRT_BUFFER_ENCODING_UTF16,
+    latin1_finalize,
+    buf16_get_write_size,
+    latin1_get_write_data,
+    utf8_append_ascii,
+    latin1_append_utf8
+};
+
+static void
+file_finalize(HrtBuffer *buffer)
+{
+    /* slices share the root's fd */
+    if (buffer->allocator != &slice_allocator)
+        close(buffer->small.file.fd);
+}
+
+static gsize
+file_get_write_size(HrtBuffer *buffer)
+{
+    return buffer->small.file.len;
+}
+
+static const void*
+file_get_write_data(HrtBuffer *buffer)
+{
+    /* the bytes never enter our address space */
+    return NULL;
+}
+
+/* File buffers are always locked, so they never get appended to */
+static const HrtEncodingClass file_encoding = {
+    HRT_BUFFER_ENCODING_FILE,
+    file_finalize,
+    file_get_write_size,
+    file_get_write_data,
+    NULL,
+    NULL
 };
 
 HrtBuffer*
@@ -265,6 +634,7 @@ hrt_buffer_new(HrtBufferEncoding         encoding,
     HrtBuffer *buffer;
 
     g_return_val_if_fail(encoding != HRT_BUFFER_ENCODING_INVALID, NULL);
+    g_return_val_if_fail(encoding != HRT_BUFFER_ENCODING_FILE, NULL);
     g_return_val_if_fail(allocator != NULL,
                          NULL);
 
@@ -273,16 +643,17 @@ hrt_buffer_new(HrtBufferEncoding         encoding,
     buffer->refcount = 1;
     switch (encoding) {
     case HRT_BUFFER_ENCODING_INVALID:
+    case HRT_BUFFER_ENCODING_FILE:
         g_assert_not_reached();
         break;
     case HRT_BUFFER_ENCODING_UTF8:
         buffer->encoding = &utf8_encoding;
         break;
     case HRT_BUFFER_ENCODING_UTF16:
-        buffer->encoding = &utf16_encoding;
+        buffer->encoding = &latin1_encoding;
         break;
     case HRT_BUFFER_ENCODING_BINARY:
-        g_error("binary buffers not implemented yet");
+        buffer->encoding = &binary_encoding;
         break;
     }
 
@@ -312,17 +683,178 @@ hrt_buffer_new_static_utf8_locked(const char *str)
     return buffer;
 }
 
+/* Returns a locked buffer that adopts len array elements at data,
+ * which were allocated with allocator and will be freed with it.
+ * The data need not be nul-terminated. A NULL allocator means data
+ * came from g_malloc(). For UTF-8 the caller has to know that the
+ * data is valid UTF-8.
+ */
+HrtBuffer*
+hrt_buffer_new_take(HrtBufferEncoding         encoding,
+                    void                     *data,
+                    gsize                     len,
+                    const HrtBufferAllocator *allocator,
+                    void                     *allocator_data,
+                    GDestroyNotify            dnotify)
+{
+    HrtBuffer *buffer;
+
+    g_return_val_if_fail(data != NULL || len == 0, NULL);
+    /* length is 31 bits */
+    g_return_val_if_fail(len <= G_MAXINT, NULL);
+
+    buffer = hrt_buffer_new(encoding,
+                            allocator != NULL ? allocator : &g_allocator,
+                            allocator_data, dnotify);
+
+    buffer->length = len;
+    if (encoding == HRT_BUFFER_ENCODING_UTF16) {
+        buffer->encoding = &utf16_encoding;
+        buffer->d.buf_16.data = data;
+        buffer->d.buf_16.allocated = len;
+    } else {
+        buffer->d.buf_8.data = data;
+        buffer->d.buf_8.allocated = len;
+    }
+
+    hrt_buffer_lock(buffer);
+
+    return buffer;
+}
+
+static HrtBuffer*
+file_buffer_new(int                       fd,
+                gboolean                  is_pipe,
+                goffset                   offset,
+                gsize                     len,
+                const HrtBufferAllocator *allocator,
+                void                     *allocator_data,
+                GDestroyNotify            dnotify)
+{
+    HrtBuffer *buffer;
+
+    buffer = g_slice_new0(HrtBuffer);
+
+    buffer->refcount = 1;
+    buffer->encoding = &file_encoding;
+    buffer->allocator = allocator;
+    buffer->allocator_data = allocator_data;
+    buffer->allocator_data_dnotify = dnotify;
+
+    buffer->small.file.fd = fd;
+    buffer->small.file.is_pipe = is_pipe;
+    buffer->small.file.offset = offset;
+    buffer->small.file.len = len;
+
+    hrt_buffer_lock(buffer);
+
+    return buffer;
+}
+
+/* Returns a locked buffer for len bytes of fd starting at offset,
+ * which hrt_buffer_write() sends with sendfile() without copying
+ * them through userspace. The buffer takes ownership of fd and
+ * closes it when the buffer and all its slices are unreffed, so
+ * several responses can share one open file by reffing or slicing
+ * the same buffer; writing never moves the file position.
+ *
+ * If fd is a pipe, offset is ignored and the bytes are moved with
+ * splice() instead. They can then only be written once, so don't
+ * share or slice the buffer. When the pipe is momentarily empty a
+ * write makes no progress even though the destination is writable;
+ * see hrt_buffer_get_blocked_source_fd() for what to wait on.
+ */
+HrtBuffer*
+hrt_buffer_new_file(int      fd,
+                    goffset  offset,
+                    gsize    len)
+{
+    struct stat statbuf;
+    gboolean is_pipe;
+
+    g_return_val_if_fail(fd >= 0, NULL);
+    g_return_val_if_fail(offset >= 0, NULL);
+
+    is_pipe = fstat(fd, &statbuf) == 0 && S_ISFIFO(statbuf.st_mode);
+
+    return file_buffer_new(fd, is_pipe, is_pipe ? 0 : offset, len,
+                           &static_allocator, NULL, NULL);
+}
+
+/* Returns a locked buffer holding len array elements (bytes, or
+ * 16-bit units for UTF-16) of locked_parent starting at offset,
+ * without copying. The slice keeps the parent's storage alive. A
+ * slice isn't nul-terminated, and can't be stolen from. A slice of a
+ * file buffer is a byte range of the same file.
+ */
+HrtBuffer*
+hrt_buffer_new_slice(HrtBuffer *locked_parent,
+                     gsize      offset,
+                     gsize      len)
+{
+    HrtBuffer *root;
+    HrtBuffer *slice;
+    gsize parent_length;
+
+    g_return_val_if_fail(locked_parent->locked, NULL);
+
+    parent_length = hrt_buffer_get_length(locked_parent);
+    g_return_val_if_fail(offset <= parent_length, NULL);
+    g_return_val_if_fail(len <= parent_length - offset, NULL);
+
+    if (locked_parent->encoding == &file_encoding)
+        g_return_val_if_fail(!locked_parent->small.file.is_pipe, NULL);
+    else
+        g_return_val_if_fail(len <= G_MAXINT, NULL); /* length is 31 bits */
+
+    /* a slice of a slice shares the original's storage directly,
+     * so we never build chains of parents.
+     */
+    root = locked_parent;
+    if (locked_parent->allocator == &slice_allocator)
+        root = locked_parent->allocator_data;
+
+    hrt_buffer_ref(root);
+
+    if (locked_parent->encoding == &file_encoding) {
+        return file_buffer_new(locked_parent->small.file.fd, FALSE,
+                               locked_parent->small.file.offset + offset, len,
+                               &slice_allocator, root,
+                               (GDestroyNotify) hrt_buffer_unref);
+    }
+
+    slice = hrt_buffer_new(locked_parent->encoding->encoding,
+                           &slice_allocator, root,
+                           (GDestroyNotify) hrt_buffer_unref);
+
+    /* a slice of a compact buffer is compact */
+    slice->encoding = locked_parent->encoding;
+
+    slice->length = len;
+    if (slice->encoding == &utf16_encoding) {
+        slice->d.buf_16.data = locked_parent->d.buf_16.data + offset;
+        slice->d.buf_16.allocated = len;
+    } else {
+        slice->d.buf_8.data = locked_parent->d.buf_8.data + offset;
+        slice->d.buf_8.allocated = len;
+    }
+
+    hrt_buffer_lock(slice);
+
+    return slice;
+}
+
 HrtBuffer*
 hrt_buffer_new_copy_utf8(const char *str)
 {
     HrtBuffer *buffer;
 
     buffer = hrt_buffer_new(HRT_BUFFER_ENCODING_UTF8,
-                            &g_allocator,
+                            hrt_buffer_pool_get_allocator(),
                             NULL, NULL);
 
-    /* FIXME append utf8 not ascii */
-    hrt_buffer_append_ascii(buffer, str, strlen(str));
+    if (!hrt_buffer_append_utf8(buffer, str, strlen(str)))
+        g_warning("Invalid UTF-8 passed to %s", G_STRFUNC);
 
     return buffer;
 }
@@ -372,28 +904,130 @@ hrt_buffer_append_ascii(HrtBuffer     *unlocked_buffer,
     (* unlocked_buffer->encoding->append_ascii) (unlocked_buffer, bytes, len);
 }
 
+void
+hrt_buffer_append_bytes(HrtBuffer     *unlocked_buffer,
+                        const void    *bytes,
+                        gsize          len)
+{
+    g_return_if_fail(!unlocked_buffer->locked);
+    g_return_if_fail(unlocked_buffer->encoding == &binary_encoding);
+
+    utf8_append_ascii(unlocked_buffer, bytes, len);
+}
+
+/* Returns FALSE, appending nothing, if utf8 isn't valid. For a
+ * binary buffer the bytes are still validated, since the caller
+ * said they're UTF-8.
+ */
+gboolean
+hrt_buffer_append_utf8(HrtBuffer     *unlocked_buffer,
+                       const char    *utf8,
+                       gsize          len)
+{
+    g_return_val_if_fail(!unlocked_buffer->locked, FALSE);
+
+    return (* unlocked_buffer->encoding->append_utf8) (unlocked_buffer, utf8, len);
+}
+
+/* For a file buffer this is the length in bytes */
 gsize
 hrt_buffer_get_length(HrtBuffer *buffer)
 {
+    if (buffer->encoding == &file_encoding)
+        return buffer->small.file.len;
+
     return buffer->length;
 }
 
+/* A UTF-16 buffer still reports UTF-16 while it's stored as Latin-1 */
+HrtBufferEncoding
+hrt_buffer_get_encoding(HrtBuffer *buffer)
+{
+    return buffer->encoding->encoding;
+}
+
+/* File buffers' contents aren't in memory, see hrt_buffer_new_file() */
+gboolean
+hrt_buffer_is_file(HrtBuffer *buffer)
+{
+    return buffer->encoding == &file_encoding;
+}
+
+/* TRUE if writing the buffer sends memory the buffer owns, which
+ * could be left with the kernel until it's sent. FALSE for file
+ * buffers, and for UTF-16 buffers stored as Latin-1, which are
+ * widened into scratch memory as they're written.
+ */
+gboolean
+hrt_buffer_is_sent_in_place(HrtBuffer *buffer)
+{
+    return buffer->encoding != &file_encoding &&
+        buffer->encoding != &latin1_encoding;
+}
+
+/* If the buffer reads from a pipe that has nothing to read right
+ * now, returns the pipe's fd; the next write can't make progress
+ * until it's readable, so wait for that rather than for the
+ * destination to be writable, which it may well already be.
+ * Otherwise returns -1.
+ */
+int
+hrt_buffer_get_blocked_source_fd(HrtBuffer *locked_buffer)
+{
+    struct pollfd pfd;
+
+    g_return_val_if_fail(locked_buffer->locked, -1);
+
+    if (locked_buffer->encoding != &file_encoding ||
+        !locked_buffer->small.file.is_pipe)
+        return -1;
+
+    pfd.fd = locked_buffer->small.file.fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    /* POLLHUP with no data is readable too: the next splice sees
+     * the writer went away and fails the write.
+     */
+    if (poll(&pfd, 1, 0) == 0)
+        return pfd.fd;
+    else
+        return -1;
+}
+
 /* This mutates a locked buffer, so is only allowed when you know the
  * buffer is confined to a single thread.
+ *
+ * Slices hold a ref on the buffer they point into, and would be left
+ * pointing at memory the caller now owns (or that the compact case
+ * frees outright), so stealing needs the only ref.
  */
 void
 hrt_buffer_steal_utf16(HrtBuffer     *locked_buffer,
                        guint16      **utf16_data_p,
                        gsize         *len_p)
 {
-    g_return_if_fail(locked_buffer->encoding == &utf16_encoding);
+    g_return_if_fail(locked_buffer->encoding->encoding == HRT_BUFFER_ENCODING_UTF16);
     g_return_if_fail(locked_buffer->locked);
+    g_return_if_fail(locked_buffer->allocator != &slice_allocator);
+    g_return_if_fail(g_atomic_int_get(&locked_buffer->refcount) == 1);
 
-    *utf16_data_p = locked_buffer->d.buf_16.data;
     *len_p = locked_buffer->length;
 
-    locked_buffer->d.buf_16.data = NULL;
-    locked_buffer->length = 0;
+    if (locked_buffer->encoding == &latin1_encoding) {
+        /* hand over the UTF-16 form and drop the bytes */
+        *utf16_data_p = (guint16*) latin1_get_widened(locked_buffer);
+        locked_buffer->widened = NULL;
+
+        buf8_finalize(locked_buffer);
+        locked_buffer->d.buf_8.data = NULL;
+        locked_buffer->d.buf_8.allocated = 0;
+        locked_buffer->length = 0;
+        locked_buffer->encoding = &utf16_encoding;
+        return;
+    }
+
+    *utf16_data_p = storage_steal(locked_buffer, sizeof(guint16));
 }
 
 void
@@ -401,10 +1035,13 @@ hrt_buffer_peek_utf16(HrtBuffer      *locked_buffer,
                       const guint16 **utf16_data_p,
                       gsize          *len_p)
 {
-    g_return_if_fail(locked_buffer->encoding == &utf16_encoding);
+    g_return_if_fail(locked_buffer->encoding->encoding == HRT_BUFFER_ENCODING_UTF16);
     g_return_if_fail(locked_buffer->locked);
 
-    *utf16_data_p = locked_buffer->d.buf_16.data;
+    if (locked_buffer->encoding == &latin1_encoding)
+        *utf16_data_p = latin1_get_widened(locked_buffer);
+    else
+        *utf16_data_p = locked_buffer->d.buf_16.data;
     *len_p = locked_buffer->length;
 }
 
@@ -415,12 +1052,12 @@ hrt_buffer_steal_utf8(HrtBuffer     *locked_buffer,
 {
     g_return_if_fail(locked_buffer->encoding == &utf8_encoding);
     g_return_if_fail(locked_buffer->locked);
+    g_return_if_fail(locked_buffer->allocator != &slice_allocator);
+    /* see hrt_buffer_steal_utf16() */
+    g_return_if_fail(g_atomic_int_get(&locked_buffer->refcount) == 1);
 
-    *utf8_data_p = locked_buffer->d.buf_8.data;
     *len_p = locked_buffer->length;
-
-    locked_buffer->d.buf_8.data = NULL;
-    locked_buffer->length = 0;
+    *utf8_data_p = storage_steal(locked_buffer, 1);
 }
 
 void
@@ -435,6 +1072,18 @@ hrt_buffer_peek_utf8(HrtBuffer      *locked_buffer,
     *len_p = locked_buffer->length;
 }
 
+void
+hrt_buffer_peek_binary(HrtBuffer      *locked_buffer,
+                       const guint8  **data_p,
+                       gsize          *len_p)
+{
+    g_return_if_fail(locked_buffer->encoding == &binary_encoding);
+    g_return_if_fail(locked_buffer->locked);
+
+    *data_p = (const guint8*) locked_buffer->d.buf_8.data;
+    *len_p = locked_buffer->length;
+}
+
 gsize
 hrt_buffer_get_write_size(HrtBuffer *locked_buffer)
 {
@@ -443,6 +1092,73 @@ hrt_buffer_get_write_size(HrtBuffer *locked_buffer)
     return (* locked_buffer->encoding->get_write_size)(locked_buffer);
 }
 
+/* The bytes hrt_buffer_write() would send, which for a UTF-16
+ * buffer are its 16-bit units. Returns FALSE for a file buffer,
+ * whose bytes aren't in memory.
+ */
+gboolean
+hrt_buffer_peek_write_data(HrtBuffer   *locked_buffer,
+                           const void **data_p,
+                           gsize       *len_p)
+{
+    g_return_val_if_fail(locked_buffer->locked, FALSE);
+
+    if (locked_buffer->encoding == &file_encoding)
+        return FALSE;
+
+    *data_p = (* locked_buffer->encoding->get_write_data)(locked_buffer);
+    *len_p = (* locked_buffer->encoding->get_write_size)(locked_buffer);
+
+    return TRUE;
+}
+
+/* Sends the last remaining bytes of a file buffer to fd, which must
+ * be nonblocking (as our sockets are). Returns FALSE on a fatal error,
+ * including the file ending early, since then we'd never finish.
+ */
+static gboolean
+file_write(HrtBuffer *buffer,
+           int        fd,
+           gsize      remaining,
+           gsize     *written_out)
+{
+    gssize bytes_written;
+
+    *written_out = 0;
+
+    if (remaining == 0)
+        return TRUE;
+
+    if (buffer->small.file.is_pipe) {
+        bytes_written = splice(buffer->small.file.fd, NULL, fd, NULL, remaining,
+                               SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    } else {
+        /* sendfile() takes its own offset, so the shared fd's
+         * position is never touched
+         */
+        off_t offset = buffer->small.file.offset + (buffer->small.file.len - remaining);
+
+        bytes_written = sendfile(fd, buffer->small.file.fd, &offset, remaining);
+    }
+
+    if (bytes_written < 0) {
+        if (errno == EINTR ||
+            errno == EAGAIN ||
+            errno == EWOULDBLOCK)
+            return TRUE; /* nothing written, try again later */
+        else
+            return FALSE; /* error case. */
+    } else if (bytes_written == 0) {
+        /* file was truncated or pipe writer went away */
+        errno = EIO;
+        return FALSE;
+    } else {
+        *written_out = bytes_written;
+
+        return TRUE;
+    }
+}
+
 /* Returns FALSE only if there was a fatal error on the fd.  Otherwise
  * does a nonblocking write and returns TRUE with remaining
  * size in bytes. Write is complete when returned remaining size is 0.
@@ -451,6 +1167,23 @@ gboolean
 hrt_buffer_write(HrtBuffer                 *locked_buffer,
                  int                        fd,
                  gsize                     *remaining_inout)
+{
+    /* batch into packets */
+    return hrt_buffer_send(locked_buffer, fd, remaining_inout, MSG_MORE);
+}
+
+/* Like hrt_buffer_write() but with the given send() flags, to which
+ * MSG_NOSIGNAL and MSG_DONTWAIT are always added. A file buffer is
+ * written as usual and the flags are ignored. If the send fails with
+ * an errno other than EINTR, EAGAIN or EWOULDBLOCK, returns FALSE
+ * with errno still set, so callers can retry other ways, for example
+ * without MSG_ZEROCOPY on ENOBUFS.
+ */
+gboolean
+hrt_buffer_send(HrtBuffer                 *locked_buffer,
+                int                        fd,
+                gsize                     *remaining_inout,
+                int                        flags)
 {
     gssize bytes_written;
     gsize total;
@@ -458,23 +1191,307 @@ hrt_buffer_write(HrtBuffer                 *locked_buffer,
 
     g_return_val_if_fail(locked_buffer->locked, FALSE);
 
+    if (locked_buffer->encoding == &file_encoding) {
+        gsize written;
+
+        g_return_val_if_fail(*remaining_inout <= locked_buffer->small.file.len, FALSE);
+
+        if (!file_write(locked_buffer, fd, *remaining_inout, &written))
+            return FALSE;
+
+        *remaining_inout -= written;
+
+        return TRUE;
+    }
+
     total = (* locked_buffer->encoding->get_write_size) (locked_buffer);
-    buf = (* locked_buffer->encoding->get_write_data) (locked_buffer);
 
     g_return_val_if_fail(*remaining_inout <= total, FALSE);
 
-    bytes_written =
-        send(fd, ((char*)buf) + (total - *remaining_inout), *remaining_inout,
-             /* no SIGPIPE, no blocking, batch into packets */
-             MSG_NOSIGNAL | MSG_DONTWAIT | MSG_MORE);
+    if (locked_buffer->encoding == &latin1_encoding) {
+        guint16 *scratch;
+        gsize len;
+
+        /* the scratch only lasts through the send, which is why
+         * hrt_zerocopy_wants() refuses these; a short write is fine
+         */
+        len = MIN(*remaining_inout, WIDEN_SCRATCH_SIZE);
+        scratch = g_new(guint16, latin1_range_units(total - *remaining_inout, len));
+        buf = latin1_widen_range(locked_buffer, total - *remaining_inout, len,
+                                 scratch);
+
+        bytes_written =
+            send(fd, buf, len,
+                 /* no SIGPIPE, no blocking */
+                 flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        g_free(scratch);
+    } else {
+        buf = (* locked_buffer->encoding->get_write_data) (locked_buffer);
+
+        bytes_written =
+            send(fd, ((char*)buf) + (total - *remaining_inout), *remaining_inout,
+                 /* no SIGPIPE, no blocking */
+                 flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    if (bytes_written < 0) {
+        if (errno == EINTR ||
+            errno == EAGAIN ||
+            errno == EWOULDBLOCK)
+            return TRUE; /* not done, leave remaining_inout unchanged */
+        else
+            return FALSE; /* error case. */
+    } else {
+        *remaining_inout -= bytes_written;
+
+        return TRUE;
+    }
+}
+
+/* Like hrt_buffer_write() but gathers several buffers into a single
+ * sendmsg(). The first buffer has first_remaining bytes left to
+ * write, the others are written whole. Returns FALSE only on a fatal
+ * error; otherwise *written_out is the number of bytes sent, which
+ * can end partway through any of the buffers. Pass more=FALSE when
+ * nothing else is known to follow, so the kernel doesn't hold the
+ * last packet back waiting for more (no MSG_MORE).
+ *
+ * File buffers can't be gathered with memory, so the write stops
+ * just before the first one; a file buffer at the start is sent on
+ * its own as hrt_buffer_write() would.
+ */
+gboolean
+hrt_buffer_writev(HrtBuffer * const         *locked_buffers,
+                  int                        n_buffers,
+                  int                        fd,
+                  gsize                      first_remaining,
+                  gboolean                   more,
+                  gsize                     *written_out)
+{
+    struct iovec iov[HRT_BUFFER_WRITEV_MAX];
+    struct msghdr msg;
+    gssize bytes_written;
+    guint16 *scratch;
+    gsize scratch_used;
+    gsize widened_bytes;
+    int flags;
+    int i;
+
+    g_return_val_if_fail(n_buffers > 0, FALSE);
+    g_return_val_if_fail(n_buffers <= HRT_BUFFER_WRITEV_MAX, FALSE);
+
+    if (locked_buffers[0]->encoding == &file_encoding) {
+        g_return_val_if_fail(locked_buffers[0]->locked, FALSE);
+        g_return_val_if_fail(first_remaining <= locked_buffers[0]->small.file.len, FALSE);
+
+        return file_write(locked_buffers[0], fd, first_remaining, written_out);
+    }
+
+    /* check up front, so we never bail out holding scratch */
+    for (i = 0; i < n_buffers; ++i)
+        g_return_val_if_fail(locked_buffers[i]->locked, FALSE);
+
+    /* compact buffers are widened into one scratch buffer, allocated
+     * if there are any; the last one widened can end the write early
+     */
+    scratch = NULL;
+    scratch_used = 0;
+    widened_bytes = 0;
+
+    for (i = 0; i < n_buffers; ++i) {
+        HrtBuffer *buffer = locked_buffers[i];
+        gsize total;
+        gsize offset;
+        gsize len;
+        const char *buf;
+
+        if (buffer->encoding == &file_encoding) {
+            /* the file's bytes come right after these */
+            n_buffers = i;
+            more = TRUE;
+            break;
+        }
+
+        total = (* buffer->encoding->get_write_size) (buffer);
+
+        offset = 0;
+        len = total;
+        if (i == 0) {
+            /* scratch isn't allocated yet */
+            g_return_val_if_fail(first_remaining <= total, FALSE);
+            offset = total - first_remaining;
+            len = first_remaining;
+        }
+
+        if (buffer->encoding == &latin1_encoding) {
+            if (widened_bytes == WIDEN_SCRATCH_SIZE) {
+                n_buffers = i;
+                more = TRUE;
+                break;
+            }
+
+            if (scratch == NULL) {
+                /* every range can take one unit more than its bytes */
+                scratch = g_new(guint16, WIDEN_SCRATCH_SIZE / 2 + n_buffers);
+            }
+
+            len = MIN(len, WIDEN_SCRATCH_SIZE - widened_bytes);
+            buf = latin1_widen_range(buffer, offset, len,
+                                     scratch + scratch_used);
+            scratch_used += latin1_range_units(offset, len);
+            widened_bytes += len;
+
+            iov[i].iov_base = (void*) buf;
+            iov[i].iov_len = len;
+
+            if (offset + len < total) {
+                /* only part of it fit, so it has to be the last */
+                n_buffers = i + 1;
+                more = TRUE;
+                break;
+            }
+        } else {
+            buf = (* buffer->encoding->get_write_data) (buffer);
+
+            iov[i].iov_base = (void*) (buf + offset);
+            iov[i].iov_len = len;
+        }
+    }
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_buffers;
+
+    /* no SIGPIPE, no blocking, batch into packets if more is coming */
+    flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    if (more)
+        flags |= MSG_MORE;
+
+    bytes_written = sendmsg(fd, &msg, flags);
+
+    g_free(scratch);
 
     if (bytes_written < 0) {
+        *written_out = 0;
         if (errno == EINTR ||
             errno == EAGAIN ||
             errno == EWOULDBLOCK)
+            return TRUE; /* nothing written, try again later */
+        else
+            return FALSE; /* error case. */
+    } else {
+        *written_out = bytes_written;
+
+        return TRUE;
+    }
+}
+
+/* Pushes out anything the kernel is holding back on fd because it was
+ * written with MSG_MORE. Harmless on an fd with nothing pending, or
+ * one that isn't a TCP socket.
+ */
+void
+hrt_buffer_uncork(int fd)
+{
+    int off = 0;
+
+    /* clearing TCP_CORK always pushes pending frames, even if the
+     * socket was never corked, and leaves it uncorked as it was.
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+}
+
+/* Appends up to len bytes read from fd at offset, without
+ * validating them, so the buffer should only be written out
+ * afterward. This blocks on the file, so only call it from a
+ * blocking thread (see hrt_task_add_file_read()). Returns the number
+ * of bytes read, 0 at end of file, or -1 with errno set.
+ */
+gssize
+hrt_buffer_pread(HrtBuffer                 *unlocked_buffer,
+                 int                        fd,
+                 goffset                    offset,
+                 gsize                      len)
+{
+    gssize bytes_read;
+
+    g_return_val_if_fail(!unlocked_buffer->locked, -1);
+    g_return_val_if_fail(unlocked_buffer->encoding == &utf8_encoding ||
+                         unlocked_buffer->encoding == &binary_encoding, -1);
+    /* length is 31 bits */
+    g_return_val_if_fail(len <= (gsize) G_MAXINT - unlocked_buffer->length, -1);
+
+    /* 1 for nul, always auto-nul */
+    storage_reserve(unlocked_buffer, 1, unlocked_buffer->length + len + 1, TRUE);
+
+    do {
+        bytes_read = pread(fd,
+                           unlocked_buffer->d.buf_8.data + unlocked_buffer->length,
+                           len, offset);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0)
+        return -1;
+
+    unlocked_buffer->length = unlocked_buffer->length + bytes_read;
+    unlocked_buffer->d.buf_8.data[unlocked_buffer->length] = '\0';
+
+    return bytes_read;
+}
+
+/* Like hrt_buffer_write() but for a file; the remaining bytes are
+ * written at the matching position after offset. This blocks, so
+ * only call it from a blocking thread. Returns FALSE with errno set
+ * on error, including EIO if the file accepts no bytes at all.
+ */
+gboolean
+hrt_buffer_pwrite(HrtBuffer                 *locked_buffer,
+                  int                        fd,
+                  goffset                    offset,
+                  gsize                     *remaining_inout)
+{
+    gssize bytes_written;
+    gsize total;
+    const void *buf;
+
+    g_return_val_if_fail(locked_buffer->locked, FALSE);
+    g_return_val_if_fail(locked_buffer->encoding != &file_encoding, FALSE);
+
+    total = (* locked_buffer->encoding->get_write_size) (locked_buffer);
+
+    g_return_val_if_fail(*remaining_inout <= total, FALSE);
+
+    if (locked_buffer->encoding == &latin1_encoding) {
+        guint16 *scratch;
+        gsize len;
+
+        len = MIN(*remaining_inout, WIDEN_SCRATCH_SIZE);
+        scratch = g_new(guint16, latin1_range_units(total - *remaining_inout, len));
+        buf = latin1_widen_range(locked_buffer, total - *remaining_inout, len,
+                                 scratch);
+
+        bytes_written =
+            pwrite(fd, buf, len, offset + (total - *remaining_inout));
+
+        g_free(scratch);
+    } else {
+        buf = (* locked_buffer->encoding->get_write_data) (locked_buffer);
+
+        bytes_written =
+            pwrite(fd, ((char*)buf) + (total - *remaining_inout), *remaining_inout,
+                   offset + (total - *remaining_inout));
+    }
+
+    if (bytes_written < 0) {
+        if (errno == EINTR)
             return TRUE; /* not done, leave remaining_inout unchanged */
         else
             return FALSE; /* error case. */
+    } else if (bytes_written == 0 && *remaining_inout > 0) {
+        /* no progress and no errno; retrying would spin forever */
+        errno = EIO;
+        return FALSE;
     } else {
         *remaining_inout -= bytes_written;
 
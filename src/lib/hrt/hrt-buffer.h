@@ -25,9 +25,17 @@
 #define __HRT_BUFFER_H__
 
 #include <glib.h>
+#include <limits.h>
 
 G_BEGIN_DECLS
 
+/* Most buffers hrt_buffer_writev() can gather into one write */
+#ifdef IOV_MAX
+#define HRT_BUFFER_WRITEV_MAX IOV_MAX
+#else
+#define HRT_BUFFER_WRITEV_MAX 16 /* the POSIX minimum */
+#endif
+
 typedef struct {
     void*  (* malloc)  (gsize  bytes,
                         void  *allocator_data);
@@ -42,7 +50,8 @@ typedef enum {
     HRT_BUFFER_ENCODING_INVALID,
     HRT_BUFFER_ENCODING_UTF8,
     HRT_BUFFER_ENCODING_UTF16,
-    HRT_BUFFER_ENCODING_BINARY
+    HRT_BUFFER_ENCODING_BINARY,
+    HRT_BUFFER_ENCODING_FILE
 } HrtBufferEncoding;
 
 typedef struct HrtBuffer HrtBuffer;
@@ -53,6 +62,18 @@ HrtBuffer* hrt_buffer_new                       (HrtBufferEncoding          enco
                                                  GDestroyNotify             dnotify);
 HrtBuffer* hrt_buffer_new_static_utf8_locked    (const char                *str);
 HrtBuffer* hrt_buffer_new_copy_utf8             (const char                *str);
+HrtBuffer* hrt_buffer_new_take                  (HrtBufferEncoding          encoding,
+                                                 void                      *data,
+                                                 gsize                      len,
+                                                 const HrtBufferAllocator  *allocator,
+                                                 void                      *allocator_data,
+                                                 GDestroyNotify             dnotify);
+HrtBuffer* hrt_buffer_new_file                  (int                        fd,
+                                                 goffset                    offset,
+                                                 gsize                      len);
+HrtBuffer* hrt_buffer_new_slice                 (HrtBuffer                 *locked_parent,
+                                                 gsize                      offset,
+                                                 gsize                      len);
 void       hrt_buffer_ref                       (HrtBuffer                 *buffer);
 void       hrt_buffer_unref                     (HrtBuffer                 *buffer);
 void       hrt_buffer_lock                      (HrtBuffer                 *buffer);
@@ -60,7 +81,17 @@ gboolean   hrt_buffer_is_locked                 (HrtBuffer                 *buff
 void       hrt_buffer_append_ascii              (HrtBuffer                 *unlocked_buffer,
                                                  const char                *bytes,
                                                  gsize                      len);
+void       hrt_buffer_append_bytes              (HrtBuffer                 *unlocked_buffer,
+                                                 const void                *bytes,
+                                                 gsize                      len);
+gboolean   hrt_buffer_append_utf8               (HrtBuffer                 *unlocked_buffer,
+                                                 const char                *utf8,
+                                                 gsize                      len);
 gsize      hrt_buffer_get_length                (HrtBuffer                 *buffer);
+HrtBufferEncoding hrt_buffer_get_encoding       (HrtBuffer                 *buffer);
+gboolean   hrt_buffer_is_file                   (HrtBuffer                 *buffer);
+gboolean   hrt_buffer_is_sent_in_place          (HrtBuffer                 *buffer);
+int        hrt_buffer_get_blocked_source_fd     (HrtBuffer                 *locked_buffer);
 
 void       hrt_buffer_steal_utf16               (HrtBuffer                 *locked_buffer,
                                                  guint16                  **utf16_data_p,
@@ -74,10 +105,35 @@ void       hrt_buffer_steal_utf8                (HrtBuffer                 *lock
 void       hrt_buffer_peek_utf8                 (HrtBuffer                 *locked_buffer,
                                                  const char               **utf8_data_p,
                                                  gsize                     *len_p);
+void       hrt_buffer_peek_binary               (HrtBuffer                 *locked_buffer,
+                                                 const guint8             **data_p,
+                                                 gsize                     *len_p);
 gsize      hrt_buffer_get_write_size            (HrtBuffer                 *locked_buffer);
+gboolean   hrt_buffer_peek_write_data           (HrtBuffer                 *locked_buffer,
+                                                 const void               **data_p,
+                                                 gsize                     *len_p);
 gboolean   hrt_buffer_write                     (HrtBuffer                 *locked_buffer,
                                                  int                        fd,
                                                  gsize                     *remaining_inout);
+gboolean   hrt_buffer_send                      (HrtBuffer                 *locked_buffer,
+                                                 int                        fd,
+                                                 gsize                     *remaining_inout,
+                                                 int                        flags);
+gboolean   hrt_buffer_writev                    (HrtBuffer * const         *locked_buffers,
+                                                 int                        n_buffers,
+                                                 int                        fd,
+                                                 gsize                      first_remaining,
+                                                 gboolean                   more,
+                                                 gsize                     *written_out);
+void       hrt_buffer_uncork                    (int                        fd);
+gssize     hrt_buffer_pread                     (HrtBuffer                 *unlocked_buffer,
+                                                 int                        fd,
+                                                 goffset                    offset,
+                                                 gsize                      len);
+gboolean   hrt_buffer_pwrite                    (HrtBuffer                 *locked_buffer,
+                                                 int                        fd,
+                                                 goffset                    offset,
+                                                 gsize                     *remaining_inout);
 
 
 G_END_DECLS
@@ -24,6 +24,7 @@
 #include <hrt/hrt-event-loop.h>
 #include <hrt/hrt-event-loop-ev.h>
 #include <hrt/hrt-task-private.h>
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-log.h>
 #include <hrt/hrt-builtins.h>
 #include <hrt/hrt-marshalers.h>
@@ -44,11 +45,14 @@
 #define TYPE_MAGIC_ASYNC          2
 #define TYPE_MAGIC_IDLE           4
 #define TYPE_MAGIC_IO             8
-#define TYPE_MAGIC_WATCH_KIND_MASK (2 | 4 | 8)
+#define TYPE_MAGIC_TIMER          64
+#define TYPE_MAGIC_WATCH_KIND_MASK (2 | 4 | 8 | 64)
 /* TYPE_MAGIC_NOTIFY_RUNNING watcher used to detect we're running now */
 #define TYPE_MAGIC_NOTIFY_RUNNING 16
 /* TYPE_MAGIC_HRT_WATCHER means it's embedded in a HrtWatcher */
 #define TYPE_MAGIC_HRT_WATCHER    32
+/* TYPE_MAGIC_MAILBOX is the async watcher for _hrt_event_loop_wake_mailbox() */
+#define TYPE_MAGIC_MAILBOX        128
 
 /* set libev to have no callbacks of its own */
 struct ev_loop;
@@ -136,12 +140,20 @@ typedef struct {
     ev_io io;
 } HrtWatcherIo;
 
+typedef struct {
+    HrtWatcherEv base;
+    ev_timer timer;
+} HrtWatcherTimer;
+
 struct HrtEventLoopEv {
     HrtEventLoop parent_instance;
 
-    GMutex *loop_lock;
+    HrtLock *loop_lock;
     struct ev_loop *loop;
     ev_async loop_wakeup;
+    ev_async mailbox;
+    HrtEventLoopMailboxFunc mailbox_func;
+    void *mailbox_data;
 };
 
 struct HrtEventLoopEvClass {
@@ -164,13 +176,13 @@ enum  {
 static void
 hrt_release_ev_loop(struct ev_loop *loop)
 {
-    g_mutex_unlock(ev_userdata(loop));
+    hrt_lock_unlock(ev_userdata(loop));
 }
 
 static void
 hrt_acquire_ev_loop(struct ev_loop *loop)
 {
-    g_mutex_lock(ev_userdata(loop));
+    hrt_lock_lock(ev_userdata(loop));
 }
 
 static void
@@ -201,13 +213,13 @@ hrt_watcher_idle_stop(HrtWatcher *watcher)
 
     event_loop = HRT_EVENT_LOOP_EV(_hrt_watcher_get_event_loop(watcher));
 
-    g_mutex_lock(event_loop->loop_lock);
+    hrt_lock_lock(event_loop->loop_lock);
     if (ev_is_active(&iwatcher->idle)) {
         ev_idle_stop(event_loop->loop,
                      &iwatcher->idle);
         hrt_event_loop_ev_wakeup(event_loop);
     }
-    g_mutex_unlock(event_loop->loop_lock);
+    hrt_lock_unlock(event_loop->loop_lock);
 }
 
 /* IN EVENT OR INVOKE THREAD */
@@ -219,13 +231,13 @@ hrt_watcher_idle_start(HrtWatcher *watcher)
 
     event_loop = HRT_EVENT_LOOP_EV(_hrt_watcher_get_event_loop(watcher));
 
-    g_mutex_lock(event_loop->loop_lock);
+    hrt_lock_lock(event_loop->loop_lock);
     if (!ev_is_active(&iwatcher->idle)) {
         ev_idle_start(event_loop->loop,
                       &iwatcher->idle);
         hrt_event_loop_ev_wakeup(event_loop);
     }
-    g_mutex_unlock(event_loop->loop_lock);
+    hrt_lock_unlock(event_loop->loop_lock);
 }
 
 static void
@@ -271,13 +283,13 @@ hrt_watcher_io_stop(HrtWatcher *watcher)
 
     event_loop = HRT_EVENT_LOOP_EV(_hrt_watcher_get_event_loop(watcher));
 
-    g_mutex_lock(event_loop->loop_lock);
+    hrt_lock_lock(event_loop->loop_lock);
     if (ev_is_active(&iwatcher->io)) {
         ev_io_stop(event_loop->loop,
                    &iwatcher->io);
         hrt_event_loop_ev_wakeup(event_loop);
     }
-    g_mutex_unlock(event_loop->loop_lock);
+    hrt_lock_unlock(event_loop->loop_lock);
 }
 
 /* IN EVENT OR INVOKE THREAD */
@@ -289,13 +301,13 @@ hrt_watcher_io_start(HrtWatcher *watcher)
 
     event_loop = HRT_EVENT_LOOP_EV(_hrt_watcher_get_event_loop(watcher));
 
-    g_mutex_lock(event_loop->loop_lock);
+    hrt_lock_lock(event_loop->loop_lock);
     if (!ev_is_active(&iwatcher->io)) {
         ev_io_start(event_loop->loop,
                     &iwatcher->io);
         hrt_event_loop_ev_wakeup(event_loop);
     }
-    g_mutex_unlock(event_loop->loop_lock);
+    hrt_lock_unlock(event_loop->loop_lock);
 }
 
 static void
@@ -340,6 +352,83 @@ hrt_event_loop_ev_create_io(HrtEventLoop      *loop,
     return (HrtWatcher*) io;
 }
 
+/* IN EVENT OR INVOKE THREAD */
+static void
+hrt_watcher_timer_stop(HrtWatcher *watcher)
+{
+    HrtWatcherTimer *twatcher = (HrtWatcherTimer*) watcher;
+    HrtEventLoopEv *event_loop;
+
+    event_loop = HRT_EVENT_LOOP_EV(_hrt_watcher_get_event_loop(watcher));
+
+    hrt_lock_lock(event_loop->loop_lock);
+    if (ev_is_active(&twatcher->timer)) {
+        ev_timer_stop(event_loop->loop,
+                      &twatcher->timer);
+        hrt_event_loop_ev_wakeup(event_loop);
+    }
+    hrt_lock_unlock(event_loop->loop_lock);
+}
+
+/* IN EVENT OR INVOKE THREAD */
+static void
+hrt_watcher_timer_start(HrtWatcher *watcher)
+{
+    HrtWatcherTimer *twatcher = (HrtWatcherTimer*) watcher;
+    HrtEventLoopEv *event_loop;
+
+    event_loop = HRT_EVENT_LOOP_EV(_hrt_watcher_get_event_loop(watcher));
+
+    hrt_lock_lock(event_loop->loop_lock);
+    if (!ev_is_active(&twatcher->timer)) {
+        /* the loop's idea of "now" is from its last iteration,
+         * which may be long ago if we're in an invoke thread.
+         */
+        ev_now_update(event_loop->loop);
+        ev_timer_start(event_loop->loop,
+                       &twatcher->timer);
+        hrt_event_loop_ev_wakeup(event_loop);
+    }
+    hrt_lock_unlock(event_loop->loop_lock);
+}
+
+static void
+hrt_watcher_timer_finalize(HrtWatcher *watcher)
+{
+    HrtWatcherTimer *twatcher = (HrtWatcherTimer*) watcher;
+    g_assert(!ev_is_active(&twatcher->timer));
+    g_slice_free(HrtWatcherTimer, (HrtWatcherTimer*) watcher);
+}
+
+static const HrtWatcherVTable timer_vtable = {
+    hrt_watcher_timer_start,
+    hrt_watcher_timer_stop,
+    hrt_watcher_timer_finalize
+};
+
+static HrtWatcher*
+hrt_event_loop_ev_create_timeout(HrtEventLoop      *loop,
+                                 HrtTask           *task,
+                                 guint              interval_msec,
+                                 HrtWatcherCallback func,
+                                 void              *data,
+                                 GDestroyNotify     dnotify)
+{
+    HrtWatcherTimer *timer;
+
+    timer = g_slice_new(HrtWatcherTimer);
+    hrt_watcher_ev_base_init(&timer->base,
+                             &timer_vtable,
+                             task, func, data, dnotify);
+
+    /* no repeat; we restart the timer if the callback returns TRUE */
+    ev_timer_init(&timer->timer, NULL,
+                  interval_msec / 1000.0, 0.0);
+    timer->timer.type_magic = TYPE_MAGIC_TIMER | TYPE_MAGIC_HRT_WATCHER;
+
+    return (HrtWatcher*) timer;
+}
+
 typedef struct {
     struct ev_prepare prepare;
     HrtEventLoopEv *eloop;
@@ -399,7 +488,54 @@ hrt_event_loop_ev_quit(HrtEventLoop *loop)
     if (ev_is_active(&eloop->loop_wakeup)) {
         ev_async_stop(eloop->loop, &eloop->loop_wakeup);
     }
+    if (ev_is_active(&eloop->mailbox)) {
+        ev_async_stop(eloop->loop, &eloop->mailbox);
+    }
+    hrt_release_ev_loop(eloop->loop);
+}
+
+static void
+hrt_event_loop_ev_set_mailbox(HrtEventLoop           *loop,
+                              HrtEventLoopMailboxFunc func,
+                              void                   *data)
+{
+    HrtEventLoopEv *eloop = HRT_EVENT_LOOP_EV(loop);
+
+    g_return_if_fail(eloop->mailbox_func == NULL);
+
+    hrt_lock_lock(eloop->loop_lock);
+
+    eloop->mailbox_func = func;
+    eloop->mailbox_data = data;
+    ev_async_start(eloop->loop, &eloop->mailbox);
+
+    hrt_lock_unlock(eloop->loop_lock);
+}
+
+/* RUN FROM ANY THREAD, ev_async_send() doesn't need the loop lock */
+static void
+hrt_event_loop_ev_wake_mailbox(HrtEventLoop *loop)
+{
+    HrtEventLoopEv *eloop = HRT_EVENT_LOOP_EV(loop);
+
+    ev_async_send(eloop->loop, &eloop->mailbox);
+}
+
+/* IN EVENT THREAD, with the loop lock held */
+static void
+handle_mailbox(HrtEventLoopEv *eloop)
+{
+    /* Unlike watchers, the mailbox runs task code right here in
+     * the event thread, and that code will want to start and stop
+     * watchers. So drop the loop lock as libev does around its
+     * poll; other threads can then touch the loop, but this thread
+     * isn't looking at it until we re-acquire.
+     */
     hrt_release_ev_loop(eloop->loop);
+
+    (* eloop->mailbox_func) (eloop->mailbox_data);
+
+    hrt_acquire_ev_loop(eloop->loop);
 }
 
 /* IN EVENT THREAD */
@@ -427,6 +563,9 @@ hrt_invoke_ev_watcher(struct ev_loop    *loop,
              * pipecb().
              */
             pipecb(loop, (ev_io*) ewatcher, revents);
+        } else if (ewatcher->type_magic & TYPE_MAGIC_MAILBOX) {
+            handle_mailbox((HrtEventLoopEv*) ((char*) ewatcher -
+                                              G_STRUCT_OFFSET(HrtEventLoopEv, mailbox)));
         } else if (ewatcher->type_magic & TYPE_MAGIC_ASYNC) {
             /* this is probably the loop_wakeup async watcher */
         } else if (ewatcher->type_magic & TYPE_MAGIC_NOTIFY_RUNNING) {
@@ -465,6 +604,14 @@ hrt_invoke_ev_watcher(struct ev_loop    *loop,
             }
         }
             break;
+        case TYPE_MAGIC_TIMER: {
+            HrtWatcherTimer *twatcher = (HrtWatcherTimer*) watcher;
+            if (ev_is_active(&twatcher->timer)) {
+                ev_timer_stop(loop,
+                              &twatcher->timer);
+            }
+        }
+            break;
         }
     }
 
@@ -523,17 +670,20 @@ hrt_event_loop_ev_dispose(GObject *object)
 
     loop = HRT_EVENT_LOOP_EV(object);
 
-    g_mutex_lock(loop->loop_lock);
+    hrt_lock_lock(loop->loop_lock);
 
     if (loop->loop) {
         if (ev_is_active(&loop->loop_wakeup)) {
             ev_async_stop(loop->loop, &loop->loop_wakeup);
         }
+        if (ev_is_active(&loop->mailbox)) {
+            ev_async_stop(loop->loop, &loop->mailbox);
+        }
         ev_loop_destroy(loop->loop);
         loop->loop = NULL;
     }
 
-    g_mutex_unlock(loop->loop_lock);
+    hrt_lock_unlock(loop->loop_lock);
 
     G_OBJECT_CLASS(hrt_event_loop_ev_parent_class)->dispose(object);
 }
@@ -545,7 +695,7 @@ hrt_event_loop_ev_finalize(GObject *object)
 
     loop = HRT_EVENT_LOOP_EV(object);
 
-    g_mutex_free(loop->loop_lock);
+    hrt_lock_free(loop->loop_lock);
 
     G_OBJECT_CLASS(hrt_event_loop_ev_parent_class)->finalize(object);
 }
@@ -553,13 +703,17 @@ hrt_event_loop_ev_finalize(GObject *object)
 static void
 hrt_event_loop_ev_init(HrtEventLoopEv *loop)
 {
-    loop->loop_lock = g_mutex_new();
+    loop->loop_lock = hrt_lock_new("hrt-event-loop-ev.loop_lock");
     loop->loop = ev_loop_new(EVFLAG_AUTO);
 
     ev_async_init(&loop->loop_wakeup, NULL);
     loop->loop_wakeup.type_magic = TYPE_MAGIC_ASYNC;
     ev_async_start(loop->loop, &loop->loop_wakeup);
 
+    /* only started if someone sets a mailbox func */
+    ev_async_init(&loop->mailbox, NULL);
+    loop->mailbox.type_magic = TYPE_MAGIC_MAILBOX;
+
     ev_set_userdata(loop->loop,
                     loop->loop_lock);
     ev_set_loop_release_cb(loop->loop,
@@ -589,4 +743,7 @@ hrt_event_loop_ev_class_init(HrtEventLoopEvClass *klass)
     event_class->quit = hrt_event_loop_ev_quit;
     event_class->create_idle = hrt_event_loop_ev_create_idle;
     event_class->create_io = hrt_event_loop_ev_create_io;
+    event_class->create_timeout = hrt_event_loop_ev_create_timeout;
+    event_class->set_mailbox = hrt_event_loop_ev_set_mailbox;
+    event_class->wake_mailbox = hrt_event_loop_ev_wake_mailbox;
 }
@@ -38,6 +38,11 @@ typedef struct {
     HrtWatcherGLib base;
 } HrtWatcherIdle;
 
+typedef struct {
+    HrtWatcherGLib base;
+    guint interval_msec;
+} HrtWatcherTimeout;
+
 /* We always wake up watchers on errors, but rely on the app to try to
  * read or write to see that an error occurred.  (Also, to get EOF we
  * need G_IO_ERR or G_IO_HUP not sure which.)
@@ -50,11 +55,20 @@ typedef struct {
     GIOCondition condition;
 } HrtWatcherIo;
 
+/* see _hrt_event_loop_set_mailbox() */
+typedef struct {
+    GSource base;
+    volatile int pending;
+    HrtEventLoopMailboxFunc func;
+    void *data;
+} MailboxSource;
+
 struct HrtEventLoopGLib {
     HrtEventLoop parent_instance;
 
     GMainContext *context;
     GMainLoop *loop;
+    MailboxSource *mailbox;
 };
 
 struct HrtEventLoopGLibClass {
@@ -193,6 +207,64 @@ hrt_event_loop_glib_create_idle(HrtEventLoop      *loop,
     return (HrtWatcher*) idle;
 }
 
+/* IN EVENT OR INVOKE THREAD */
+static void
+hrt_watcher_timeout_start(HrtWatcher *watcher)
+{
+    HrtWatcherGLib *gwatcher = (HrtWatcherGLib*) watcher;
+    HrtWatcherTimeout *twatcher = (HrtWatcherTimeout*) watcher;
+
+    if (gwatcher->source == NULL) {
+        GSource *source;
+
+        /* restarting after the callback returns TRUE waits the
+         * whole interval again
+         */
+        source = g_timeout_source_new(twatcher->interval_msec);
+
+        _hrt_watcher_ref(watcher);
+        g_source_set_callback(source, run_watcher_source_func,
+                              watcher, watcher_dnotify);
+        gwatcher->source = source; /* takes the ref */
+
+        g_source_attach(source,
+                        hrt_watcher_get_g_main_context(watcher));
+    }
+}
+
+static void
+hrt_watcher_timeout_finalize(HrtWatcher *watcher)
+{
+    HrtWatcherGLib *gwatcher = (HrtWatcherGLib*) watcher;
+    g_assert(gwatcher->source == NULL);
+    g_slice_free(HrtWatcherTimeout, (HrtWatcherTimeout*) watcher);
+}
+
+static const HrtWatcherVTable timeout_vtable = {
+    hrt_watcher_timeout_start,
+    hrt_watcher_glib_stop,
+    hrt_watcher_timeout_finalize
+};
+
+static HrtWatcher*
+hrt_event_loop_glib_create_timeout(HrtEventLoop      *loop,
+                                   HrtTask           *task,
+                                   guint              interval_msec,
+                                   HrtWatcherCallback func,
+                                   void              *data,
+                                   GDestroyNotify     dnotify)
+{
+    HrtWatcherTimeout *timeout;
+
+    timeout = g_slice_new(HrtWatcherTimeout);
+    hrt_watcher_glib_base_init(&timeout->base,
+                               &timeout_vtable,
+                               task, func, data, dnotify);
+    timeout->interval_msec = interval_msec;
+
+    return (HrtWatcher*) timeout;
+}
+
 static gboolean
 run_watcher_io_func(GIOChannel   *channel,
                     GIOCondition  condition,
@@ -366,6 +438,81 @@ hrt_event_loop_glib_quit(HrtEventLoop *loop)
     g_main_context_unref(context);
 }
 
+static gboolean
+mailbox_source_prepare(GSource *source,
+                       int     *timeout)
+{
+    MailboxSource *mailbox = (MailboxSource*) source;
+
+    *timeout = -1;
+
+    return g_atomic_int_get(&mailbox->pending) != 0;
+}
+
+static gboolean
+mailbox_source_check(GSource *source)
+{
+    MailboxSource *mailbox = (MailboxSource*) source;
+
+    return g_atomic_int_get(&mailbox->pending) != 0;
+}
+
+static gboolean
+mailbox_source_dispatch(GSource    *source,
+                        GSourceFunc callback,
+                        void       *user_data)
+{
+    MailboxSource *mailbox = (MailboxSource*) source;
+
+    /* clear first, so a wake during the callback dispatches again */
+    g_atomic_int_set(&mailbox->pending, 0);
+
+    (* mailbox->func) (mailbox->data);
+
+    return TRUE;
+}
+
+static GSourceFuncs mailbox_source_funcs = {
+    mailbox_source_prepare,
+    mailbox_source_check,
+    mailbox_source_dispatch,
+    NULL
+};
+
+static void
+hrt_event_loop_glib_set_mailbox(HrtEventLoop           *loop,
+                                HrtEventLoopMailboxFunc func,
+                                void                   *data)
+{
+    HrtEventLoopGLib *gloop = HRT_EVENT_LOOP_GLIB(loop);
+    MailboxSource *mailbox;
+
+    g_return_if_fail(gloop->mailbox == NULL);
+
+    mailbox = (MailboxSource*) g_source_new(&mailbox_source_funcs,
+                                            sizeof(MailboxSource));
+    mailbox->func = func;
+    mailbox->data = data;
+
+    /* not below the watchers' priority, or a busy idle watcher
+     * would keep us from ever running the invokes it queued.
+     */
+    g_source_set_priority((GSource*) mailbox, G_PRIORITY_DEFAULT);
+    g_source_attach((GSource*) mailbox, gloop->context);
+
+    gloop->mailbox = mailbox;
+}
+
+/* RUN FROM ANY THREAD */
+static void
+hrt_event_loop_glib_wake_mailbox(HrtEventLoop *loop)
+{
+    HrtEventLoopGLib *gloop = HRT_EVENT_LOOP_GLIB(loop);
+
+    if (g_atomic_int_compare_and_exchange(&gloop->mailbox->pending, 0, 1))
+        g_main_context_wakeup(gloop->context);
+}
+
 static void
 hrt_event_loop_glib_get_property (GObject                *object,
                                   guint                   prop_id,
@@ -408,6 +555,12 @@ hrt_event_loop_glib_dispose(GObject *object)
 
     loop = HRT_EVENT_LOOP_GLIB(object);
 
+    if (loop->mailbox) {
+        g_source_destroy((GSource*) loop->mailbox);
+        g_source_unref((GSource*) loop->mailbox);
+        loop->mailbox = NULL;
+    }
+
     if (loop->loop) {
         g_main_loop_unref(loop->loop);
         loop->loop = NULL;
@@ -457,5 +610,8 @@ hrt_event_loop_glib_class_init(HrtEventLoopGLibClass *klass)
     event_class->run = hrt_event_loop_glib_run;
     event_class->quit = hrt_event_loop_glib_quit;
     event_class->create_idle = hrt_event_loop_glib_create_idle;
+    event_class->create_timeout = hrt_event_loop_glib_create_timeout;
     event_class->create_io = hrt_event_loop_glib_create_io;
+    event_class->set_mailbox = hrt_event_loop_glib_set_mailbox;
+    event_class->wake_mailbox = hrt_event_loop_glib_wake_mailbox;
 }
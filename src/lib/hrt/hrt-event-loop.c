@@ -93,7 +93,7 @@ hrt_event_loop_finalize(GObject *object)
 
     loop = HRT_EVENT_LOOP(object);
 
-    g_mutex_free(loop->running_lock);
+    hrt_lock_free(loop->running_lock);
     g_cond_free(loop->running_cond);
 
     G_OBJECT_CLASS(hrt_event_loop_parent_class)->finalize(object);
@@ -102,7 +102,7 @@ hrt_event_loop_finalize(GObject *object)
 static void
 hrt_event_loop_init(HrtEventLoop *loop)
 {
-    loop->running_lock = g_mutex_new();
+    loop->running_lock = hrt_lock_new("hrt-event-loop.running_lock");
     loop->running_cond = g_cond_new();
 }
 
@@ -172,23 +172,54 @@ _hrt_event_loop_create_io(HrtEventLoop       *loop,
                                                      func, data, dnotify);
 }
 
+HrtWatcher*
+_hrt_event_loop_create_timeout(HrtEventLoop       *loop,
+                               HrtTask            *task,
+                               guint               interval_msec,
+                               HrtWatcherCallback  func,
+                               void               *data,
+                               GDestroyNotify      dnotify)
+{
+    return HRT_EVENT_LOOP_GET_CLASS(loop)->create_timeout(loop, task, interval_msec,
+                                                          func, data, dnotify);
+}
+
+/* Must be called before the loop is run. func is then called in the
+ * loop thread each time the mailbox is woken, coalescing wakeups that
+ * arrive before it runs.
+ */
+void
+_hrt_event_loop_set_mailbox(HrtEventLoop           *loop,
+                            HrtEventLoopMailboxFunc func,
+                            void                   *data)
+{
+    HRT_EVENT_LOOP_GET_CLASS(loop)->set_mailbox(loop, func, data);
+}
+
+/* RUN FROM ANY THREAD */
+void
+_hrt_event_loop_wake_mailbox(HrtEventLoop *loop)
+{
+    HRT_EVENT_LOOP_GET_CLASS(loop)->wake_mailbox(loop);
+}
+
 void
 _hrt_event_loop_wait_running(HrtEventLoop *loop,
                              gboolean      is_running)
 {
-    g_mutex_lock(loop->running_lock);
+    hrt_lock_lock(loop->running_lock);
     while (loop->is_running != (is_running != FALSE)) {
-        g_cond_wait(loop->running_cond, loop->running_lock);
+        hrt_lock_wait(loop->running_lock, loop->running_cond);
     }
-    g_mutex_unlock(loop->running_lock);
+    hrt_lock_unlock(loop->running_lock);
 }
 
 void
 _hrt_event_loop_set_running (HrtEventLoop       *loop,
                              gboolean            is_running)
 {
-    g_mutex_lock(loop->running_lock);
+    hrt_lock_lock(loop->running_lock);
     loop->is_running = is_running;
     g_cond_signal(loop->running_cond);
-    g_mutex_unlock(loop->running_lock);
+    hrt_lock_unlock(loop->running_lock);
 }
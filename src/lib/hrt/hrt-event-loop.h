@@ -25,12 +25,18 @@
 #define __HRT_EVENT_LOOP_H__
 
 #include <glib-object.h>
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-task-runner.h>
 
 G_BEGIN_DECLS
 
 typedef struct HrtEventLoopClass HrtEventLoopClass;
 
+/* Called in the loop's thread, with no loop locks held, some time
+ * after _hrt_event_loop_wake_mailbox().
+ */
+typedef void (* HrtEventLoopMailboxFunc) (void *data);
+
 #define HRT_TYPE_EVENT_LOOP              (hrt_event_loop_get_type ())
 #define HRT_EVENT_LOOP(object)           (G_TYPE_CHECK_INSTANCE_CAST ((object), HRT_TYPE_EVENT_LOOP, HrtEventLoop))
 #define HRT_EVENT_LOOP_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST ((klass), HRT_TYPE_EVENT_LOOP, HrtEventLoopClass))
@@ -42,7 +48,7 @@ struct HrtEventLoop {
     GObject      parent_instance;
 
     /* private */
-    GMutex *running_lock;
+    HrtLock *running_lock;
     GCond *running_cond;
     gboolean is_running;
 };
@@ -65,6 +71,17 @@ struct HrtEventLoopClass {
                                  HrtWatcherCallback func,
                                  void              *data,
                                  GDestroyNotify     dnotify);
+    HrtWatcher* (* create_timeout) (HrtEventLoop      *loop,
+                                    HrtTask           *task,
+                                    guint              interval_msec,
+                                    HrtWatcherCallback func,
+                                    void              *data,
+                                    GDestroyNotify     dnotify);
+
+    void        (* set_mailbox)  (HrtEventLoop           *loop,
+                                  HrtEventLoopMailboxFunc func,
+                                  void                   *data);
+    void        (* wake_mailbox) (HrtEventLoop           *loop);
 };
 
 GType           hrt_event_loop_get_type (void) G_GNUC_CONST;
@@ -84,6 +101,16 @@ HrtWatcher*   _hrt_event_loop_create_io    (HrtEventLoop       *loop,
                                             HrtWatcherCallback  func,
                                             void               *data,
                                             GDestroyNotify      dnotify);
+HrtWatcher*   _hrt_event_loop_create_timeout (HrtEventLoop     *loop,
+                                            HrtTask            *task,
+                                            guint               interval_msec,
+                                            HrtWatcherCallback  func,
+                                            void               *data,
+                                            GDestroyNotify      dnotify);
+void          _hrt_event_loop_set_mailbox  (HrtEventLoop       *loop,
+                                            HrtEventLoopMailboxFunc func,
+                                            void               *data);
+void          _hrt_event_loop_wake_mailbox (HrtEventLoop       *loop);
 void          _hrt_event_loop_wait_running (HrtEventLoop       *loop,
                                             gboolean            is_running);
 void          _hrt_event_loop_set_running  (HrtEventLoop       *loop,
@@ -0,0 +1,336 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+
+#include <hrt/hrt-fiber.h>
+#include <hrt/hrt-log.h>
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/* Fibers are meant to be cheap enough to have one per request, with
+ * 100k of them suspended at once. Stacks are mapped lazily so only
+ * pages a fiber has touched cost memory, and there's a PROT_NONE
+ * guard page below each stack so an overflow crashes rather than
+ * scribbling on a neighbor. Mapping and protecting are syscalls, so
+ * finished stacks are kept for reuse; their pages are handed back to
+ * the kernel first, so a pool of idle stacks costs address space but
+ * not memory.
+ */
+#define FIBER_STACK_SIZE   (64 * 1024)
+#define MAX_POOLED_STACKS  1024
+
+typedef struct FiberStack FiberStack;
+
+struct FiberStack {
+    FiberStack *next;
+    /* the mapping, guard page first */
+    void *base;
+    gsize size;
+};
+
+G_LOCK_DEFINE_STATIC(stack_pool);
+static FiberStack *stack_pool = NULL;
+static guint n_pooled_stacks = 0;
+
+struct HrtFiber {
+    HrtTask *task;
+    HrtFiberFunc func;
+    void *data;
+    GDestroyNotify dnotify;
+
+    FiberStack *stack;
+    ucontext_t fiber_context;
+    /* where the invoke thread was when it switched to us */
+    ucontext_t invoke_context;
+
+    HrtWatcherFlags resume_flags;
+    unsigned int running : 1;
+    unsigned int finished : 1;
+};
+
+/* One per await; the watcher's data. */
+typedef struct {
+    HrtFiber *fiber;
+    gboolean fired;
+} FiberWait;
+
+static gsize
+page_size(void)
+{
+    static gsize size = 0;
+
+    if (size == 0)
+        size = sysconf(_SC_PAGESIZE);
+
+    return size;
+}
+
+static FiberStack*
+stack_new(void)
+{
+    FiberStack *stack;
+
+    G_LOCK(stack_pool);
+    stack = stack_pool;
+    if (stack != NULL) {
+        stack_pool = stack->next;
+        n_pooled_stacks -= 1;
+    }
+    G_UNLOCK(stack_pool);
+
+    if (stack != NULL) {
+        stack->next = NULL;
+        return stack;
+    }
+
+    stack = g_slice_new0(FiberStack);
+    stack->size = FIBER_STACK_SIZE + page_size();
+    stack->base = mmap(NULL, stack->size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+    if (stack->base == MAP_FAILED)
+        g_error("Failed to map fiber stack");
+
+    /* stacks grow down, so the guard goes at the low end */
+    if (mprotect(stack->base, page_size(), PROT_NONE) < 0)
+        g_error("Failed to protect fiber stack guard page");
+
+    return stack;
+}
+
+static void
+stack_free(FiberStack *stack)
+{
+    /* Drop the pages a deep call chain touched before pooling the
+     * stack; the next fiber gets zero pages back as it faults them
+     * in. Has to happen before the stack is visible in the pool.
+     * The guard page has nothing resident, so skip it.
+     */
+    if (madvise(((char*) stack->base) + page_size(),
+                stack->size - page_size(), MADV_DONTNEED) < 0)
+        hrt_message("Failed to release fiber stack pages");
+
+    G_LOCK(stack_pool);
+    if (n_pooled_stacks < MAX_POOLED_STACKS) {
+        stack->next = stack_pool;
+        stack_pool = stack;
+        n_pooled_stacks += 1;
+        stack = NULL;
+    }
+    G_UNLOCK(stack_pool);
+
+    if (stack != NULL) {
+        munmap(stack->base, stack->size);
+        g_slice_free(FiberStack, stack);
+    }
+}
+
+static void
+fiber_free(HrtFiber *fiber)
+{
+    if (fiber->dnotify != NULL)
+        (* fiber->dnotify) (fiber->data);
+
+    stack_free(fiber->stack);
+    g_object_unref(fiber->task);
+
+    g_slice_free(HrtFiber, fiber);
+}
+
+/* ON FIBER STACK. makecontext() only passes ints, so the pointer
+ * comes in two halves.
+ */
+static void
+fiber_entry(unsigned int high,
+            unsigned int low)
+{
+    HrtFiber *fiber;
+
+    fiber = (HrtFiber*) (((guintptr) high << 16 << 16) | (guintptr) low);
+
+    (* fiber->func) (fiber, fiber->data);
+
+    fiber->finished = TRUE;
+
+    /* never returns; on_fiber_resume() frees us once we're off
+     * this stack.
+     */
+    setcontext(&fiber->invoke_context);
+}
+
+/* IN TASK THREAD */
+static gboolean
+on_fiber_resume(HrtTask        *task,
+                HrtWatcherFlags flags,
+                void           *data)
+{
+    FiberWait *wait = data;
+    HrtFiber *fiber = wait->fiber;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    wait->fired = TRUE;
+
+    fiber->resume_flags = flags;
+    fiber->running = TRUE;
+    swapcontext(&fiber->invoke_context, &fiber->fiber_context);
+    fiber->running = FALSE;
+
+    /* The fiber has finished, or it's awaiting something new, which
+     * can't be invoked until we return since we're holding the task.
+     */
+    if (fiber->finished)
+        fiber_free(fiber);
+
+    return FALSE;
+}
+
+/* IN TASK THREAD */
+static void
+on_fiber_wait_removed(void *data)
+{
+    FiberWait *wait = data;
+
+    /* If the watcher went away without firing (the task was
+     * cancelled), nothing will ever resume the fiber, so abandon it.
+     */
+    if (!wait->fired)
+        fiber_free(wait->fiber);
+
+    g_slice_free(FiberWait, wait);
+}
+
+static FiberWait*
+fiber_wait_new(HrtFiber *fiber)
+{
+    FiberWait *wait;
+
+    wait = g_slice_new(FiberWait);
+    wait->fiber = fiber;
+    wait->fired = FALSE;
+
+    return wait;
+}
+
+/* ON FIBER STACK */
+static void
+fiber_yield(HrtFiber *fiber)
+{
+    swapcontext(&fiber->fiber_context, &fiber->invoke_context);
+}
+
+/* Runs func(fiber, data) on a new fiber in the task; it starts as an
+ * immediate watcher would. dnotify runs when func returns, or when
+ * the fiber is abandoned because the task was cancelled.
+ */
+void
+hrt_task_spawn_fiber(HrtTask         *task,
+                     HrtFiberFunc     func,
+                     void            *data,
+                     GDestroyNotify   dnotify)
+{
+    HrtFiber *fiber;
+    guintptr ptr;
+
+    fiber = g_slice_new0(HrtFiber);
+    fiber->task = g_object_ref(task);
+    fiber->func = func;
+    fiber->data = data;
+    fiber->dnotify = dnotify;
+    fiber->stack = stack_new();
+
+    if (getcontext(&fiber->fiber_context) < 0)
+        g_error("getcontext() failed");
+    fiber->fiber_context.uc_stack.ss_sp =
+        ((char*) fiber->stack->base) + page_size();
+    fiber->fiber_context.uc_stack.ss_size = FIBER_STACK_SIZE;
+    fiber->fiber_context.uc_link = NULL;
+
+    ptr = (guintptr) fiber;
+    makecontext(&fiber->fiber_context,
+                (void (*) (void)) fiber_entry, 2,
+                (unsigned int) (ptr >> 16 >> 16),
+                (unsigned int) (ptr & 0xffffffff));
+
+    hrt_task_add_immediate(task,
+                           on_fiber_resume,
+                           fiber_wait_new(fiber),
+                           on_fiber_wait_removed);
+}
+
+HrtTask*
+hrt_fiber_get_task(HrtFiber *fiber)
+{
+    return fiber->task;
+}
+
+/* ON FIBER STACK. Returns the flags the IO watcher fired with. */
+HrtWatcherFlags
+hrt_fiber_await_io(HrtFiber        *fiber,
+                   int              fd,
+                   HrtWatcherFlags  io_flags)
+{
+    g_return_val_if_fail(fiber->running, HRT_WATCHER_FLAG_NONE);
+
+    hrt_task_add_io(fiber->task, fd, io_flags,
+                    on_fiber_resume,
+                    fiber_wait_new(fiber),
+                    on_fiber_wait_removed);
+
+    fiber_yield(fiber);
+
+    return fiber->resume_flags;
+}
+
+/* ON FIBER STACK. Returns once subtask has completed. */
+void
+hrt_fiber_await_subtask(HrtFiber *fiber,
+                        HrtTask  *subtask)
+{
+    g_return_if_fail(fiber->running);
+
+    hrt_task_add_subtask(fiber->task, subtask,
+                         on_fiber_resume,
+                         fiber_wait_new(fiber),
+                         on_fiber_wait_removed);
+
+    fiber_yield(fiber);
+}
+
+/* ON FIBER STACK */
+void
+hrt_fiber_sleep(HrtFiber *fiber,
+                guint     msec)
+{
+    g_return_if_fail(fiber->running);
+
+    hrt_task_add_timeout(fiber->task, msec,
+                         on_fiber_resume,
+                         fiber_wait_new(fiber),
+                         on_fiber_wait_removed);
+
+    fiber_yield(fiber);
+}
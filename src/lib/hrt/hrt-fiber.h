@@ -0,0 +1,70 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_FIBER_H__
+#define __HRT_FIBER_H__
+
+/*
+ * A HrtFiber runs a C function on its own small stack, inside a
+ * task. When it awaits something the fiber's stack is put aside and
+ * the invoke thread goes on to other tasks; when the thing happens,
+ * the fiber continues as a watcher on its task, possibly in a
+ * different invoke thread. So the fiber code reads sequentially but
+ * doesn't hold a thread while it waits, and as with any watcher only
+ * one handler runs in the task at a time.
+ *
+ * Because the thread can change across an await, don't keep
+ * pointers to thread-local data across one.
+ *
+ * If the task is cancelled while a fiber is waiting, the fiber is
+ * never resumed; its stack is simply dropped and its dnotify is
+ * called. So a fiber should keep anything that has to be freed in
+ * its data, not only in locals.
+ */
+
+#include <glib-object.h>
+#include <hrt/hrt-task.h>
+
+G_BEGIN_DECLS
+
+typedef struct HrtFiber HrtFiber;
+
+typedef void (* HrtFiberFunc) (HrtFiber *fiber,
+                               void     *data);
+
+void            hrt_task_spawn_fiber    (HrtTask         *task,
+                                         HrtFiberFunc     func,
+                                         void            *data,
+                                         GDestroyNotify   dnotify);
+HrtTask*        hrt_fiber_get_task      (HrtFiber        *fiber);
+HrtWatcherFlags hrt_fiber_await_io      (HrtFiber        *fiber,
+                                         int              fd,
+                                         HrtWatcherFlags  io_flags);
+void            hrt_fiber_await_subtask (HrtFiber        *fiber,
+                                         HrtTask         *subtask);
+void            hrt_fiber_sleep         (HrtFiber        *fiber,
+                                         guint            msec);
+
+G_END_DECLS
+
+#endif  /* __HRT_FIBER_H__ */
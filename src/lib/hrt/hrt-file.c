@@ -0,0 +1,306 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+
+#include <hrt/hrt-task-private.h>
+#include <hrt/hrt-buffer.h>
+#include <hrt/hrt-buffer-pool.h>
+#include <hrt/hrt-log.h>
+
+#include <errno.h>
+
+/* epoll and friends always say a regular file is ready, so reading
+ * one from a task thread blocks the invoke thread on the disk (a
+ * page-cache miss can take milliseconds). Instead we pread()/pwrite()
+ * in the runner's blocking pool and invoke the task with the result.
+ */
+
+/* Reads up to this size get a buffer from a pool of recycled chunks */
+#define READ_CHUNK_SIZE    65536
+#define MAX_POOLED_CHUNKS     64
+
+G_LOCK_DEFINE_STATIC(chunk_pool);
+static GTrashStack *chunk_pool = NULL;
+static guint n_pooled_chunks = 0;
+
+static void*
+chunk_malloc(gsize bytes,
+             void *allocator_data)
+{
+    void *mem;
+
+    /* +1 for the nul the buffer always adds */
+    g_assert(bytes <= READ_CHUNK_SIZE + 1);
+
+    G_LOCK(chunk_pool);
+    mem = g_trash_stack_pop(&chunk_pool);
+    if (mem != NULL)
+        n_pooled_chunks -= 1;
+    G_UNLOCK(chunk_pool);
+
+    if (mem == NULL)
+        mem = g_try_malloc(READ_CHUNK_SIZE + 1);
+
+    return mem;
+}
+
+static void
+chunk_free(void *mem,
+           void *allocator_data)
+{
+    G_LOCK(chunk_pool);
+    if (n_pooled_chunks < MAX_POOLED_CHUNKS) {
+        g_trash_stack_push(&chunk_pool, mem);
+        n_pooled_chunks += 1;
+        mem = NULL;
+    }
+    G_UNLOCK(chunk_pool);
+
+    g_free(mem);
+}
+
+static void*
+chunk_realloc(void *mem,
+              gsize bytes,
+              void *allocator_data)
+{
+    g_error("pooled read buffer should not realloc");
+    return NULL;
+}
+
+static const HrtBufferAllocator chunk_allocator = {
+    chunk_malloc,
+    chunk_free,
+    chunk_realloc
+};
+
+typedef struct {
+    int fd;
+    goffset offset;
+    /* bytes to read, unused for writes */
+    gsize len;
+    /* buffer read into, or buffer to write */
+    HrtBuffer *buffer;
+    int error_code;
+    HrtFileCallback callback;
+    void *data;
+    GDestroyNotify dnotify;
+} FileOp;
+
+static FileOp*
+file_op_new(int             fd,
+            goffset         offset,
+            HrtFileCallback callback,
+            void           *data,
+            GDestroyNotify  dnotify)
+{
+    FileOp *op;
+
+    op = g_slice_new0(FileOp);
+    op->fd = fd;
+    op->offset = offset;
+    op->callback = callback;
+    op->data = data;
+    op->dnotify = dnotify;
+
+    return op;
+}
+
+static void
+file_op_free(void *data)
+{
+    FileOp *op = data;
+
+    if (op->dnotify != NULL)
+        (* op->dnotify) (op->data);
+
+    if (op->buffer != NULL)
+        hrt_buffer_unref(op->buffer);
+
+    g_slice_free(FileOp, op);
+}
+
+/* IN BLOCKING THREAD */
+static void
+file_op_read(void *data)
+{
+    FileOp *op = data;
+    gsize total;
+
+    /* reads can be short (signals, or other writers), so keep going
+     * until EOF or len.
+     */
+    total = 0;
+    while (total < op->len) {
+        gssize bytes_read;
+
+        bytes_read = hrt_buffer_pread(op->buffer, op->fd,
+                                      op->offset + total,
+                                      op->len - total);
+        if (bytes_read < 0) {
+            op->error_code = errno;
+            break;
+        } else if (bytes_read == 0) {
+            break;
+        }
+
+        total += bytes_read;
+    }
+
+    if (op->error_code != 0) {
+        hrt_buffer_unref(op->buffer);
+        op->buffer = NULL;
+    } else {
+        hrt_buffer_lock(op->buffer);
+    }
+}
+
+/* IN BLOCKING THREAD */
+static void
+file_op_write(void *data)
+{
+    FileOp *op = data;
+    gsize remaining;
+
+    remaining = hrt_buffer_get_write_size(op->buffer);
+    while (remaining > 0) {
+        if (!hrt_buffer_pwrite(op->buffer, op->fd,
+                               op->offset, &remaining)) {
+            op->error_code = errno;
+            break;
+        }
+    }
+}
+
+/* IN TASK THREAD */
+static gboolean
+on_file_op_done(HrtTask        *task,
+                HrtWatcherFlags flags,
+                void           *data)
+{
+    FileOp *op = data;
+
+    (* op->callback) (task, op->buffer, op->error_code, op->data);
+
+    return FALSE;
+}
+
+static HrtWatcher*
+file_op_start(HrtTask        *task,
+              FileOp         *op,
+              HrtBlockingFunc blocking_func)
+{
+    HrtWatcher *watcher;
+
+    watcher = hrt_task_run_blocking(task,
+                                    blocking_func,
+                                    on_file_op_done,
+                                    op,
+                                    file_op_free);
+
+    /* The blocking pool is backed up; rather than make every caller
+     * handle two kinds of failure, report it like an IO error.
+     */
+    if (watcher == NULL) {
+        hrt_debug("Blocking pool full, failing file op with EAGAIN");
+
+        if (op->buffer != NULL &&
+            !hrt_buffer_is_locked(op->buffer)) {
+            hrt_buffer_unref(op->buffer);
+            op->buffer = NULL;
+        }
+        op->error_code = EAGAIN;
+        watcher = hrt_task_add_immediate(task,
+                                         on_file_op_done,
+                                         op,
+                                         file_op_free);
+    }
+
+    return watcher;
+}
+
+/* Reads up to len bytes (at most G_MAXINT) at offset from fd, which
+ * should be a regular file, without blocking the task. callback gets
+ * a locked buffer with the bytes read (empty at end of file), which
+ * can be passed straight to hio_output_stream_write(), or NULL and an
+ * errno value. The caller must keep fd open until callback or
+ * dnotify runs.
+ */
+HrtWatcher*
+hrt_task_add_file_read(HrtTask              *task,
+                       int                   fd,
+                       goffset               offset,
+                       gsize                 len,
+                       HrtFileCallback       callback,
+                       void                 *data,
+                       GDestroyNotify        dnotify)
+{
+    FileOp *op;
+
+    g_return_val_if_fail(fd >= 0, NULL);
+    g_return_val_if_fail(offset >= 0, NULL);
+    g_return_val_if_fail(len <= G_MAXINT, NULL);
+
+    op = file_op_new(fd, offset, callback, data, dnotify);
+    op->len = len;
+
+    if (len <= READ_CHUNK_SIZE) {
+        op->buffer = hrt_buffer_new(HRT_BUFFER_ENCODING_BINARY,
+                                    &chunk_allocator,
+                                    NULL, NULL);
+    } else {
+        /* big reads can get huge pages from the pool, if enabled */
+        op->buffer = hrt_buffer_new(HRT_BUFFER_ENCODING_BINARY,
+                                    hrt_buffer_pool_get_allocator(),
+                                    NULL, NULL);
+    }
+
+    return file_op_start(task, op, file_op_read);
+}
+
+/* Writes all of locked_buffer to fd at offset without blocking the
+ * task, then calls callback with the buffer and 0 or an errno
+ * value. The caller must keep fd open until callback or dnotify
+ * runs.
+ */
+HrtWatcher*
+hrt_task_add_file_write(HrtTask              *task,
+                        int                   fd,
+                        goffset               offset,
+                        HrtBuffer            *locked_buffer,
+                        HrtFileCallback       callback,
+                        void                 *data,
+                        GDestroyNotify        dnotify)
+{
+    FileOp *op;
+
+    g_return_val_if_fail(fd >= 0, NULL);
+    g_return_val_if_fail(offset >= 0, NULL);
+    g_return_val_if_fail(hrt_buffer_is_locked(locked_buffer), NULL);
+
+    op = file_op_new(fd, offset, callback, data, dnotify);
+    hrt_buffer_ref(locked_buffer);
+    op->buffer = locked_buffer;
+
+    return file_op_start(task, op, file_op_write);
+}
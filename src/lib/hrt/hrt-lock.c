@@ -0,0 +1,512 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+#include <hrt/hrt-lock.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bucket i counts times in [2^i, 2^(i+1)) nanoseconds, the last one
+ * everything longer
+ */
+#define N_BUCKETS 32
+
+typedef struct {
+    char *name;
+    volatile int acquisitions;
+    volatile int contended;
+    volatile int wait_buckets[N_BUCKETS];
+    volatile int hold_buckets[N_BUCKETS];
+} LockSite;
+
+struct HrtLock {
+    GMutex *mutex;
+    const char *site_name;
+    /* the fields below are only touched with mutex held */
+    LockSite *site;
+    /* 0 if we weren't recording when the lock was taken */
+    gint64 acquired_nsec;
+};
+
+#ifdef HRT_LOCK_PROFILING
+#define PROFILING_DEFAULT TRUE
+#else
+#define PROFILING_DEFAULT FALSE
+#endif
+
+static volatile int profiling_enabled = PROFILING_DEFAULT;
+
+/* protects sites and the dump-on-signal setup */
+G_LOCK_DEFINE_STATIC(sites);
+static GHashTable *sites = NULL;
+
+static int dump_pipe[2] = { -1, -1 };
+
+static gint64
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((gint64) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bucket_for(gint64 nsec)
+{
+    int bucket;
+
+    if (nsec <= 1)
+        return 0;
+
+    bucket = g_bit_storage((gulong) nsec) - 1;
+
+    return MIN(bucket, N_BUCKETS - 1);
+}
+
+/* CALLED WITH sites LOCK HELD */
+static void
+ensure_sites_unlocked(void)
+{
+    const char *env;
+
+    if (sites != NULL)
+        return;
+
+    sites = g_hash_table_new(g_str_hash, g_str_equal);
+
+    env = g_getenv("HRT_LOCK_PROFILE");
+    if (env != NULL && strcmp(env, "0") != 0)
+        g_atomic_int_set(&profiling_enabled, TRUE);
+}
+
+static LockSite*
+lookup_site(const char *site_name,
+            gboolean    create)
+{
+    LockSite *site;
+
+    G_LOCK(sites);
+
+    ensure_sites_unlocked();
+
+    site = g_hash_table_lookup(sites, site_name);
+    if (site == NULL && create) {
+        site = g_new0(LockSite, 1);
+        site->name = g_strdup(site_name);
+        /* sites are never freed, so reports can cover locks that
+         * no longer exist
+         */
+        g_hash_table_insert(sites, site->name, site);
+    }
+
+    G_UNLOCK(sites);
+
+    return site;
+}
+
+/* site_name has to outlive the lock, normally it's a string literal
+ * like "hrt-task.invoker_lock"
+ */
+HrtLock*
+hrt_lock_new(const char *site_name)
+{
+    HrtLock *lock;
+
+    g_return_val_if_fail(site_name != NULL, NULL);
+
+    lock = g_slice_new0(HrtLock);
+    lock->mutex = g_mutex_new();
+    lock->site_name = site_name;
+
+    /* this is mostly so the environment gets checked before the
+     * first lock is taken
+     */
+    if (G_UNLIKELY(sites == NULL)) {
+        G_LOCK(sites);
+        ensure_sites_unlocked();
+        G_UNLOCK(sites);
+    }
+
+    return lock;
+}
+
+void
+hrt_lock_free(HrtLock *lock)
+{
+    g_mutex_free(lock->mutex);
+    g_slice_free(HrtLock, lock);
+}
+
+void
+hrt_lock_lock(HrtLock *lock)
+{
+    LockSite *site;
+    gint64 wait_start;
+
+    if (G_LIKELY(!g_atomic_int_get(&profiling_enabled))) {
+        g_mutex_lock(lock->mutex);
+        lock->acquired_nsec = 0;
+        return;
+    }
+
+    if (g_mutex_trylock(lock->mutex)) {
+        wait_start = 0;
+    } else {
+        wait_start = now_nsec();
+        g_mutex_lock(lock->mutex);
+    }
+
+    lock->acquired_nsec = now_nsec();
+
+    /* looked up lazily so creating a lock doesn't need the global
+     * sites lock
+     */
+    if (lock->site == NULL)
+        lock->site = lookup_site(lock->site_name, TRUE);
+    site = lock->site;
+
+    g_atomic_int_inc(&site->acquisitions);
+    if (wait_start != 0) {
+        g_atomic_int_inc(&site->contended);
+        g_atomic_int_inc(&site->wait_buckets[bucket_for(lock->acquired_nsec - wait_start)]);
+    }
+}
+
+/* CALLED WITH MUTEX HELD, right before giving it up */
+static void
+record_hold(HrtLock *lock)
+{
+    if (lock->acquired_nsec != 0) {
+        gint64 held;
+
+        held = now_nsec() - lock->acquired_nsec;
+        lock->acquired_nsec = 0;
+
+        g_atomic_int_inc(&lock->site->hold_buckets[bucket_for(held)]);
+    }
+}
+
+/* CALLED WITH MUTEX HELD, right after getting it back from a cond
+ * wait. Time spent waiting on the cond isn't contention, so only the
+ * new hold time is recorded.
+ */
+static void
+start_hold_after_wait(HrtLock *lock)
+{
+    if (G_LIKELY(!g_atomic_int_get(&profiling_enabled)))
+        return;
+
+    lock->acquired_nsec = now_nsec();
+    if (lock->site == NULL)
+        lock->site = lookup_site(lock->site_name, TRUE);
+}
+
+void
+hrt_lock_unlock(HrtLock *lock)
+{
+    record_hold(lock);
+
+    g_mutex_unlock(lock->mutex);
+}
+
+/* Like g_cond_wait() with the lock's mutex; lock must be held. */
+void
+hrt_lock_wait(HrtLock *lock,
+              GCond   *cond)
+{
+    record_hold(lock);
+
+    g_cond_wait(cond, lock->mutex);
+
+    start_hold_after_wait(lock);
+}
+
+/* Like g_cond_timed_wait() with the lock's mutex; lock must be held.
+ * Returns FALSE if abs_time passed.
+ */
+gboolean
+hrt_lock_timed_wait(HrtLock  *lock,
+                    GCond    *cond,
+                    GTimeVal *abs_time)
+{
+    gboolean signaled;
+
+    record_hold(lock);
+
+    signaled = g_cond_timed_wait(cond, lock->mutex, abs_time);
+
+    start_hold_after_wait(lock);
+
+    return signaled;
+}
+
+/* Can be called from any thread. Turning it on only affects locks
+ * taken afterward.
+ */
+void
+hrt_lock_profiling_set_enabled(gboolean enabled)
+{
+    G_LOCK(sites);
+    ensure_sites_unlocked();
+    g_atomic_int_set(&profiling_enabled, enabled != FALSE);
+    G_UNLOCK(sites);
+}
+
+gboolean
+hrt_lock_profiling_get_enabled(void)
+{
+    return g_atomic_int_get(&profiling_enabled);
+}
+
+static void
+reset_site(void *key,
+           void *value,
+           void *data)
+{
+    LockSite *site = value;
+    int i;
+
+    g_atomic_int_set(&site->acquisitions, 0);
+    g_atomic_int_set(&site->contended, 0);
+    for (i = 0; i < N_BUCKETS; ++i) {
+        g_atomic_int_set(&site->wait_buckets[i], 0);
+        g_atomic_int_set(&site->hold_buckets[i], 0);
+    }
+}
+
+/* Zeroes all sites. Locks taken concurrently with this may end up
+ * half-counted.
+ */
+void
+hrt_lock_profiling_reset(void)
+{
+    G_LOCK(sites);
+    ensure_sites_unlocked();
+    g_hash_table_foreach(sites, reset_site, NULL);
+    G_UNLOCK(sites);
+}
+
+gboolean
+hrt_lock_profiling_get_site_stats(const char *site_name,
+                                  guint      *acquisitions_p,
+                                  guint      *contended_p)
+{
+    LockSite *site;
+
+    site = lookup_site(site_name, FALSE);
+    if (site == NULL)
+        return FALSE;
+
+    *acquisitions_p = (guint) g_atomic_int_get(&site->acquisitions);
+    *contended_p = (guint) g_atomic_int_get(&site->contended);
+
+    return TRUE;
+}
+
+/* upper bound of the bucket the given fraction of samples falls in,
+ * or 0 if no samples
+ */
+static gint64
+bucket_percentile(volatile int *buckets,
+                  double        fraction)
+{
+    guint counts[N_BUCKETS];
+    guint total;
+    guint seen;
+    int i;
+
+    total = 0;
+    for (i = 0; i < N_BUCKETS; ++i) {
+        counts[i] = (guint) g_atomic_int_get(&buckets[i]);
+        total += counts[i];
+    }
+
+    if (total == 0)
+        return 0;
+
+    seen = 0;
+    for (i = 0; i < N_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= fraction * total)
+            break;
+    }
+
+    return ((gint64) 1) << (MIN(i, N_BUCKETS - 1) + 1);
+}
+
+static void
+append_duration(GString *str,
+                gint64   nsec)
+{
+    if (nsec == 0)
+        g_string_append_printf(str, " %8s", "-");
+    else if (nsec < 1000)
+        g_string_append_printf(str, " %6dns", (int) nsec);
+    else if (nsec < 1000000)
+        g_string_append_printf(str, " %6.1fus", nsec / 1000.0);
+    else if (nsec < 1000000000)
+        g_string_append_printf(str, " %6.1fms", nsec / 1000000.0);
+    else
+        g_string_append_printf(str, " %6.2fs ", nsec / 1000000000.0);
+}
+
+static int
+compare_sites(const void *a,
+              const void *b)
+{
+    LockSite *site_a = (LockSite*) a;
+    LockSite *site_b = (LockSite*) b;
+    guint contended_a, contended_b;
+
+    contended_a = (guint) g_atomic_int_get(&site_a->contended);
+    contended_b = (guint) g_atomic_int_get(&site_b->contended);
+
+    /* most contended first */
+    if (contended_a != contended_b)
+        return contended_a < contended_b ? 1 : -1;
+
+    return strcmp(site_a->name, site_b->name);
+}
+
+/* Returns a newly-allocated table of all lock sites, most contended
+ * first. Times are upper bounds of power-of-two histogram buckets.
+ */
+char*
+hrt_lock_profiling_report(void)
+{
+    GString *str;
+    GList *list;
+    GList *l;
+
+    G_LOCK(sites);
+    ensure_sites_unlocked();
+    list = g_hash_table_get_values(sites);
+    G_UNLOCK(sites);
+
+    list = g_list_sort(list, compare_sites);
+
+    str = g_string_new(NULL);
+    g_string_append_printf(str,
+                           "%-36s %10s %10s %7s %8s %8s %8s %8s\n",
+                           "lock site", "acquired", "contended", "%",
+                           "wait p50", "wait p99", "hold p50", "hold p99");
+
+    for (l = list; l != NULL; l = l->next) {
+        LockSite *site = l->data;
+        guint acquisitions;
+        guint contended;
+
+        acquisitions = (guint) g_atomic_int_get(&site->acquisitions);
+        contended = (guint) g_atomic_int_get(&site->contended);
+
+        g_string_append_printf(str, "%-36s %10u %10u %6.2f%%",
+                               site->name, acquisitions, contended,
+                               acquisitions > 0 ?
+                               contended * 100.0 / acquisitions : 0.0);
+        append_duration(str, bucket_percentile(site->wait_buckets, 0.50));
+        append_duration(str, bucket_percentile(site->wait_buckets, 0.99));
+        append_duration(str, bucket_percentile(site->hold_buckets, 0.50));
+        append_duration(str, bucket_percentile(site->hold_buckets, 0.99));
+        g_string_append_c(str, '\n');
+    }
+
+    g_list_free(list);
+
+    if (!hrt_lock_profiling_get_enabled())
+        g_string_append(str, "(lock profiling is disabled)\n");
+
+    return g_string_free(str, FALSE);
+}
+
+static void
+dump_signal_handler(int signum)
+{
+    char c = 0;
+    int saved_errno;
+
+    /* only async-signal-safe things in here; the dump thread
+     * does the real work
+     */
+    saved_errno = errno;
+    if (write(dump_pipe[1], &c, 1) < 0) {
+        /* nothing to do about it */
+    }
+    errno = saved_errno;
+}
+
+static void*
+dump_thread(void *data)
+{
+    while (TRUE) {
+        char c;
+        ssize_t result;
+        char *report;
+
+        result = read(dump_pipe[0], &c, 1);
+        if (result < 0 && errno == EINTR)
+            continue;
+        else if (result <= 0)
+            break;
+
+        report = hrt_lock_profiling_report();
+        g_printerr("%s", report);
+        g_free(report);
+    }
+
+    return NULL;
+}
+
+/* Print hrt_lock_profiling_report() to stderr whenever the process
+ * gets signum, e.g. SIGUSR1.
+ */
+void
+hrt_lock_profiling_dump_on_signal(int signum)
+{
+    struct sigaction sa;
+
+    G_LOCK(sites);
+    if (dump_pipe[0] < 0) {
+        if (pipe(dump_pipe) < 0) {
+            g_warning("Failed to create lock report pipe: %s",
+                      strerror(errno));
+            G_UNLOCK(sites);
+            return;
+        }
+
+        g_thread_create(dump_thread, NULL, FALSE, NULL);
+    }
+    G_UNLOCK(sites);
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    sigaction(signum, &sa, NULL);
+}
@@ -0,0 +1,67 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_LOCK_H__
+#define __HRT_LOCK_H__
+
+/*
+ * HrtLock is a mutex that can record, per named lock site, how often
+ * it's acquired, how often it was already held, and histograms of
+ * time spent waiting for it and holding it. Every lock created with
+ * the same site name adds to the same numbers, so e.g. all tasks'
+ * invoker locks show up as one line in the report.
+ *
+ * Recording is on if configured with --enable-lock-profiling, if
+ * HRT_LOCK_PROFILE is set to something other than 0 in the
+ * environment, or after hrt_lock_profiling_set_enabled(TRUE).
+ * When it's off a lock costs one extra branch over a GMutex.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct HrtLock HrtLock;
+
+HrtLock*  hrt_lock_new                        (const char *site_name);
+void      hrt_lock_free                       (HrtLock    *lock);
+void      hrt_lock_lock                       (HrtLock    *lock);
+void      hrt_lock_unlock                     (HrtLock    *lock);
+void      hrt_lock_wait                       (HrtLock    *lock,
+                                               GCond      *cond);
+gboolean  hrt_lock_timed_wait                 (HrtLock    *lock,
+                                               GCond      *cond,
+                                               GTimeVal   *abs_time);
+
+void      hrt_lock_profiling_set_enabled      (gboolean    enabled);
+gboolean  hrt_lock_profiling_get_enabled      (void);
+void      hrt_lock_profiling_reset            (void);
+gboolean  hrt_lock_profiling_get_site_stats   (const char *site_name,
+                                               guint      *acquisitions_p,
+                                               guint      *contended_p);
+char*     hrt_lock_profiling_report           (void);
+void      hrt_lock_profiling_dump_on_signal   (int         signum);
+
+G_END_DECLS
+
+#endif  /* __HRT_LOCK_H__ */
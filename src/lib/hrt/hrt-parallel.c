@@ -0,0 +1,440 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+
+#include <hrt/hrt-parallel.h>
+#include <hrt/hrt-task-private.h>
+#include <hrt/hrt-lock.h>
+#include <hrt/hrt-log.h>
+
+#include <time.h>
+
+/* Aim for chunks that take about this long: long enough that taking
+ * a chunk is cheap in comparison, short enough that the threads
+ * finish at about the same time.
+ */
+#define TARGET_CHUNK_NSEC (50 * 1000)
+
+typedef struct ParallelJob ParallelJob;
+
+/* The part of the range a participant hasn't started yet. The owner
+ * takes chunks from the front, thieves take half from the back.
+ */
+typedef struct {
+    HrtLock *lock;
+    gsize start;
+    gsize end;
+} Share;
+
+typedef struct {
+    ParallelJob *job;
+    int index;
+} Participant;
+
+struct ParallelJob {
+    HrtTask *task;
+    gsize n_items;
+    HrtParallelForFunc for_func;
+    HrtParallelMapFunc map_func;
+    HrtParallelReduceFunc reduce_func;
+    GDestroyNotify result_dnotify;
+    HrtParallelDoneFunc done_func;
+    void *data;
+    GDestroyNotify dnotify;
+
+    int n_participants;
+    Share *shares;
+    Participant *participants;
+    volatile int participants_left;
+
+    /* running estimate shared by all participants, 0 until the
+     * first chunk is done
+     */
+    volatile int nsec_per_item;
+
+    HrtLock *result_lock;
+    void *result;
+    gboolean have_result;
+    gboolean result_delivered;
+};
+
+static gint64
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((gint64) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static ParallelJob*
+parallel_job_new(HrtTask        *task,
+                 gsize           n_items,
+                 void           *data,
+                 GDestroyNotify  dnotify)
+{
+    ParallelJob *job;
+
+    job = g_slice_new0(ParallelJob);
+    job->task = g_object_ref(task);
+    job->n_items = n_items;
+    job->data = data;
+    job->dnotify = dnotify;
+    job->result_lock = hrt_lock_new("hrt-parallel.result_lock");
+
+    return job;
+}
+
+/* IN TASK THREAD, as the done watcher's dnotify */
+static void
+parallel_job_free(void *data)
+{
+    ParallelJob *job = data;
+    int i;
+
+    if (job->have_result && !job->result_delivered &&
+        job->result_dnotify != NULL) {
+        (* job->result_dnotify) (job->result);
+    }
+
+    if (job->dnotify != NULL) {
+        (* job->dnotify) (job->data);
+    }
+
+    for (i = 0; i < job->n_participants; ++i) {
+        hrt_lock_free(job->shares[i].lock);
+    }
+    g_free(job->shares);
+    g_free(job->participants);
+
+    hrt_lock_free(job->result_lock);
+    g_object_unref(job->task);
+
+    g_slice_free(ParallelJob, job);
+}
+
+/* IN TASK THREAD */
+static gboolean
+on_job_done(HrtTask        *task,
+            HrtWatcherFlags flags,
+            void           *data)
+{
+    ParallelJob *job = data;
+
+    job->result_delivered = TRUE;
+
+    if (job->done_func != NULL) {
+        (* job->done_func) (task,
+                            job->have_result ? job->result : NULL,
+                            job->data);
+    }
+
+    return FALSE;
+}
+
+static gsize
+chunk_size(ParallelJob *job)
+{
+    int nsec_per_item;
+
+    nsec_per_item = g_atomic_int_get(&job->nsec_per_item);
+
+    /* with no estimate yet, do one item to get one */
+    if (nsec_per_item <= 0)
+        return 1;
+
+    return MAX(1, TARGET_CHUNK_NSEC / nsec_per_item);
+}
+
+static void
+update_cost(ParallelJob *job,
+            gsize        n_items,
+            gint64       elapsed_nsec)
+{
+    gint64 measured;
+    int old;
+
+    measured = elapsed_nsec / n_items;
+    measured = CLAMP(measured, 1, G_MAXINT / 4);
+
+    /* a racy moving average is fine, it's only for sizing */
+    old = g_atomic_int_get(&job->nsec_per_item);
+    if (old > 0)
+        measured = (old * 3 + measured) / 4;
+
+    g_atomic_int_set(&job->nsec_per_item, (int) measured);
+}
+
+static gboolean
+take_chunk(Share *share,
+           gsize  want,
+           gsize *start_p,
+           gsize *end_p)
+{
+    gboolean got_chunk;
+
+    hrt_lock_lock(share->lock);
+    got_chunk = share->start < share->end;
+    if (got_chunk) {
+        *start_p = share->start;
+        *end_p = MIN(share->end, share->start + want);
+        share->start = *end_p;
+    }
+    hrt_lock_unlock(share->lock);
+
+    return got_chunk;
+}
+
+/* Moves the back half of the largest other share into ours, which
+ * must be empty. FALSE if there's nothing left anywhere.
+ */
+static gboolean
+steal_share(ParallelJob *job,
+            int          thief)
+{
+    while (TRUE) {
+        Share *victim;
+        gsize largest;
+        gsize stolen_start;
+        gsize stolen_end;
+        int i;
+
+        /* unlocked reads, just to pick a victim */
+        victim = NULL;
+        largest = 0;
+        for (i = 0; i < job->n_participants; ++i) {
+            Share *share = &job->shares[i];
+            gsize start = share->start;
+            gsize end = share->end;
+
+            if (i != thief && end > start && end - start > largest) {
+                victim = share;
+                largest = end - start;
+            }
+        }
+
+        if (victim == NULL)
+            return FALSE;
+
+        hrt_lock_lock(victim->lock);
+        if (victim->end > victim->start) {
+            stolen_end = victim->end;
+            stolen_start = victim->start + (victim->end - victim->start) / 2;
+            victim->end = stolen_start;
+        } else {
+            stolen_start = stolen_end = 0;
+        }
+        hrt_lock_unlock(victim->lock);
+
+        if (stolen_end > stolen_start) {
+            Share *own = &job->shares[thief];
+
+            hrt_lock_lock(own->lock);
+            g_assert(own->start == own->end);
+            own->start = stolen_start;
+            own->end = stolen_end;
+            hrt_lock_unlock(own->lock);
+
+            return TRUE;
+        }
+
+        /* victim finished before we got the lock, look again */
+    }
+}
+
+/* IN A PARALLEL THREAD */
+static void
+finish_job(ParallelJob *job)
+{
+    HrtTask *task;
+
+    task = g_object_ref(job->task);
+
+    /* the watcher owns the job from here */
+    hrt_task_add_immediate(task, on_job_done, job, parallel_job_free);
+    hrt_task_unblock_completion(task);
+
+    g_object_unref(task);
+}
+
+/* IN A PARALLEL THREAD, one of these for each participant */
+void
+_hrt_parallel_run_participant(void *item)
+{
+    Participant *participant = item;
+    ParallelJob *job;
+    Share *own;
+    void *partial;
+    gboolean have_partial;
+
+    job = participant->job;
+    own = &job->shares[participant->index];
+    partial = NULL;
+    have_partial = FALSE;
+
+    while (!hrt_task_is_cancelled(job->task)) {
+        gsize start;
+        gsize end;
+        gint64 before;
+
+        if (!take_chunk(own, chunk_size(job), &start, &end)) {
+            if (steal_share(job, participant->index))
+                continue;
+            else
+                break;
+        }
+
+        before = now_nsec();
+
+        if (job->map_func != NULL) {
+            void *chunk_result;
+
+            chunk_result = (* job->map_func) (start, end, job->data);
+            if (have_partial)
+                partial = (* job->reduce_func) (partial, chunk_result, job->data);
+            else
+                partial = chunk_result;
+            have_partial = TRUE;
+        } else {
+            (* job->for_func) (start, end, job->data);
+        }
+
+        update_cost(job, end - start, now_nsec() - before);
+    }
+
+    if (have_partial) {
+        hrt_lock_lock(job->result_lock);
+        if (job->have_result)
+            job->result = (* job->reduce_func) (job->result, partial, job->data);
+        else
+            job->result = partial;
+        job->have_result = TRUE;
+        hrt_lock_unlock(job->result_lock);
+    }
+
+    if (g_atomic_int_dec_and_test(&job->participants_left)) {
+        finish_job(job);
+    }
+}
+
+/* IN TASK THREAD */
+static void
+start_job(ParallelJob *job)
+{
+    HrtTaskRunner *runner;
+    gsize per_share;
+    gsize extra;
+    int i;
+
+    if (job->n_items == 0) {
+        hrt_task_add_immediate(job->task, on_job_done, job, parallel_job_free);
+        return;
+    }
+
+    runner = _hrt_task_get_runner(job->task);
+
+    job->n_participants = _hrt_task_runner_get_n_parallel_threads(runner);
+    if ((gsize) job->n_participants > job->n_items)
+        job->n_participants = job->n_items;
+
+    job->shares = g_new0(Share, job->n_participants);
+    job->participants = g_new0(Participant, job->n_participants);
+    job->participants_left = job->n_participants;
+
+    /* even split; stealing fixes up any imbalance */
+    per_share = job->n_items / job->n_participants;
+    extra = job->n_items % job->n_participants;
+    for (i = 0; i < job->n_participants; ++i) {
+        Share *share = &job->shares[i];
+
+        share->lock = hrt_lock_new("hrt-parallel.share_lock");
+        share->start = i * per_share + MIN((gsize) i, extra);
+        share->end = share->start + per_share + ((gsize) i < extra ? 1 : 0);
+
+        job->participants[i].job = job;
+        job->participants[i].index = i;
+    }
+
+    /* the task can't complete until finish_job() */
+    hrt_task_block_completion(job->task);
+
+    for (i = 0; i < job->n_participants; ++i) {
+        _hrt_task_runner_push_parallel(runner, &job->participants[i]);
+    }
+}
+
+/* IN TASK THREAD
+ *
+ * Runs func on chunks of [0, n_items) in parallel, then
+ * done_callback in the task.
+ */
+void
+hrt_parallel_for(HrtTask               *task,
+                 gsize                  n_items,
+                 HrtParallelForFunc     func,
+                 HrtParallelDoneFunc    done_callback,
+                 void                  *data,
+                 GDestroyNotify         dnotify)
+{
+    ParallelJob *job;
+
+    g_return_if_fail(func != NULL);
+
+    job = parallel_job_new(task, n_items, data, dnotify);
+    job->for_func = func;
+    job->done_func = done_callback;
+
+    start_job(job);
+}
+
+/* IN TASK THREAD
+ *
+ * Runs map_func on chunks of [0, n_items) in parallel, combines the
+ * partial results with reduce_func, and passes the final one to
+ * done_callback in the task. If done_callback never runs, the
+ * result is freed with result_dnotify.
+ */
+void
+hrt_parallel_reduce(HrtTask               *task,
+                    gsize                  n_items,
+                    HrtParallelMapFunc     map_func,
+                    HrtParallelReduceFunc  reduce_func,
+                    GDestroyNotify         result_dnotify,
+                    HrtParallelDoneFunc    done_callback,
+                    void                  *data,
+                    GDestroyNotify         dnotify)
+{
+    ParallelJob *job;
+
+    g_return_if_fail(map_func != NULL);
+    g_return_if_fail(reduce_func != NULL);
+
+    job = parallel_job_new(task, n_items, data, dnotify);
+    job->map_func = map_func;
+    job->reduce_func = reduce_func;
+    job->result_dnotify = result_dnotify;
+    job->done_func = done_callback;
+
+    start_job(job);
+}
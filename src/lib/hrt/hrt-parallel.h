@@ -0,0 +1,88 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_PARALLEL_H__
+#define __HRT_PARALLEL_H__
+
+/*
+ * Data-parallel helpers. The range [0, n_items) is split into chunks
+ * that the runner's parallel threads (one per CPU) work through,
+ * each starting on its own share and stealing half of another
+ * thread's remaining share when it runs out. Chunk size adapts to
+ * the observed cost per item, so cheap items are batched and
+ * expensive ones are spread out.
+ *
+ * The calling task doesn't block: it can't complete while the job
+ * runs, and the done callback is then invoked in the task like any
+ * watcher. If the task is cancelled, remaining chunks are skipped
+ * and the done callback isn't run, though dnotify is.
+ */
+
+#include <glib-object.h>
+#include <hrt/hrt-task.h>
+
+G_BEGIN_DECLS
+
+/* Handle items [start, end). Runs in a parallel thread, concurrently
+ * with other chunks.
+ */
+typedef void  (* HrtParallelForFunc)    (gsize    start,
+                                         gsize    end,
+                                         void    *data);
+/* Like HrtParallelForFunc but returns a partial result */
+typedef void* (* HrtParallelMapFunc)    (gsize    start,
+                                         gsize    end,
+                                         void    *data);
+/* Combines two partial results, consuming them. Partial results are
+ * combined in no particular order, so this has to be associative
+ * and commutative.
+ */
+typedef void* (* HrtParallelReduceFunc) (void    *a,
+                                         void    *b,
+                                         void    *data);
+/* In the task thread when the job is finished. result is NULL for
+ * hrt_parallel_for() or if there were no items; otherwise the
+ * callback owns it.
+ */
+typedef void  (* HrtParallelDoneFunc)   (HrtTask *task,
+                                         void    *result,
+                                         void    *data);
+
+void hrt_parallel_for    (HrtTask               *task,
+                          gsize                  n_items,
+                          HrtParallelForFunc     func,
+                          HrtParallelDoneFunc    done_callback,
+                          void                  *data,
+                          GDestroyNotify         dnotify);
+void hrt_parallel_reduce (HrtTask               *task,
+                          gsize                  n_items,
+                          HrtParallelMapFunc     map_func,
+                          HrtParallelReduceFunc  reduce_func,
+                          GDestroyNotify         result_dnotify,
+                          HrtParallelDoneFunc    done_callback,
+                          void                  *data,
+                          GDestroyNotify         dnotify);
+
+G_END_DECLS
+
+#endif  /* __HRT_PARALLEL_H__ */
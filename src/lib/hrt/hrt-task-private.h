@@ -42,26 +42,65 @@ HrtInvoker*    _hrt_task_get_invoker                  (HrtTask            *task)
 void           _hrt_task_set_invoker                  (HrtTask            *task,
                                                        HrtInvoker         *invoker);
 void           _hrt_task_enter_invoke                 (HrtTask            *task,
-                                                       HrtTaskThreadLocal *thread_local);
+                                                       HrtTaskThreadLocal *thread_local,
+                                                       void               *callback);
 void           _hrt_task_leave_invoke                 (HrtTask            *task);
 void           _hrt_task_watchers_inc                 (HrtTask            *task);
 void           _hrt_task_watchers_dec                 (HrtTask            *task);
 gboolean       _hrt_task_has_watchers                 (HrtTask            *task);
 void           _hrt_task_mark_completed               (HrtTask            *task);
+gboolean       _hrt_task_mark_completed_unlocked      (HrtTask            *task);
+void           _hrt_task_notify_completed             (HrtTask            *task);
 gboolean       _hrt_task_is_completed                 (HrtTask            *task);
-void           _hrt_task_add_completed_notify         (HrtTask            *task,
+gboolean       _hrt_task_add_completed_notify         (HrtTask            *task,
                                                        HrtWatcher         *subtask_watcher);
 void           _hrt_task_remove_completed_notify      (HrtTask            *task,
                                                        HrtWatcher         *subtask_watcher);
 gboolean       _hrt_task_is_running_in_current_thread (HrtTask            *task);
+void           _hrt_task_add_watcher                  (HrtTask            *task,
+                                                       HrtWatcher         *watcher);
+void           _hrt_task_remove_watcher               (HrtTask            *task,
+                                                       HrtWatcher         *watcher);
+gboolean       _hrt_task_has_live_watchers_unlocked   (HrtTask            *task);
+int            _hrt_task_remove_all_watchers          (HrtTask            *task);
+gboolean       _hrt_task_get_cancelled                (HrtTask            *task);
+int            _hrt_task_get_affinity                 (HrtTask            *task);
+void           _hrt_task_set_affinity                 (HrtTask            *task,
+                                                       int                 worker);
+HrtTaskPost*   _hrt_task_pop_post                     (HrtTask            *task);
+gboolean       _hrt_task_has_posts_unlocked           (HrtTask            *task);
+int            _hrt_task_get_core                     (HrtTask            *task);
+void           _hrt_task_set_core                     (HrtTask            *task,
+                                                       int                 core);
 
 
 /* Internal HrtTaskRunner API */
 void          _hrt_task_runner_watcher_pending      (HrtTaskRunner      *runner,
                                                      HrtWatcher         *watcher);
-HrtEventLoop* _hrt_task_runner_get_event_loop       (HrtTaskRunner      *runner);
+HrtEventLoop* _hrt_task_runner_get_event_loop       (HrtTaskRunner      *runner,
+                                                     HrtTask            *task);
 void          _hrt_task_runner_queue_completed_task (HrtTaskRunner      *runner,
                                                      HrtTask            *task);
+void          _hrt_task_runner_queue_task           (HrtTaskRunner      *runner,
+                                                     HrtTask            *task);
+void          _hrt_task_runner_task_done            (HrtTaskRunner      *runner,
+                                                     HrtTask            *task);
+gboolean      _hrt_task_runner_admit_blocking       (HrtTaskRunner      *runner);
+void          _hrt_task_runner_push_blocking        (HrtTaskRunner      *runner,
+                                                     HrtWatcher         *watcher);
+void          _hrt_task_runner_push_idle            (HrtTaskRunner      *runner,
+                                                     HrtWatcher         *watcher);
+int           _hrt_task_runner_get_n_parallel_threads (HrtTaskRunner    *runner);
+void          _hrt_task_runner_push_parallel        (HrtTaskRunner      *runner,
+                                                     void               *participant);
+void          _hrt_task_runner_task_started         (HrtTaskRunner      *runner);
+void          _hrt_task_runner_task_finished        (HrtTaskRunner      *runner);
+void          _hrt_task_runner_memory_changed       (HrtTaskRunner      *runner,
+                                                     int                 bytes);
+void          _hrt_task_runner_memory_limit_hit     (HrtTaskRunner      *runner);
+GSource*      _hrt_task_runner_add_deadline         (HrtTaskRunner      *runner,
+                                                     HrtTask            *task,
+                                                     gint64              deadline);
 HrtWatcher*   _hrt_task_runner_add_immediate        (HrtTaskRunner      *runner,
                                                      HrtTask            *task,
                                                      HrtWatcherCallback  callback,
@@ -72,6 +111,12 @@ HrtWatcher*   _hrt_task_runner_add_idle             (HrtTaskRunner      *runner,
                                                      HrtWatcherCallback  callback,
                                                      void               *data,
                                                      GDestroyNotify      dnotify);
+HrtWatcher*   _hrt_task_runner_add_timeout          (HrtTaskRunner      *runner,
+                                                     HrtTask            *task,
+                                                     guint               interval_msec,
+                                                     HrtWatcherCallback  callback,
+                                                     void               *data,
+                                                     GDestroyNotify      dnotify);
 HrtWatcher*   _hrt_task_runner_add_io               (HrtTaskRunner      *runner,
                                                      HrtTask            *task,
                                                      int                 fd,
@@ -85,6 +130,16 @@ HrtWatcher*   _hrt_task_runner_add_subtask          (HrtTaskRunner      *runner,
                                                      HrtWatcherCallback  callback,
                                                      void               *data,
                                                      GDestroyNotify      dnotify);
+HrtWatcher*   _hrt_task_runner_add_blocking         (HrtTaskRunner      *runner,
+                                                     HrtTask            *task,
+                                                     HrtBlockingFunc     blocking_func,
+                                                     HrtWatcherCallback  callback,
+                                                     void               *data,
+                                                     GDestroyNotify      dnotify);
+
+
+/* Internal parallel job API */
+void           _hrt_parallel_run_participant (void *participant);
 
 
 /* Internal HrtWatcher API */
@@ -108,6 +163,9 @@ struct HrtWatcher {
     GDestroyNotify dnotify;
 
     const HrtWatcherVTable *vtable;
+
+    /* posted to the task to detach us once removed */
+    HrtTaskPost removed_post;
 };
 
 void           _hrt_watcher_base_init        (HrtWatcher             *watcher,
@@ -124,17 +182,28 @@ void           _hrt_watcher_start            (HrtWatcher             *watcher);
 void           _hrt_watcher_stop             (HrtWatcher             *watcher);
 void           _hrt_watcher_queue_invoke     (HrtWatcher             *watcher,
                                               HrtWatcherFlags         flags);
-HrtWatcher*    _hrt_watcher_new_removed      (HrtWatcher             *was_removed);
+gboolean       _hrt_watcher_try_remove       (HrtWatcher             *watcher);
 HrtWatcher*    _hrt_watcher_new_immediate    (HrtTask                *task,
                                               HrtWatcherCallback      callback,
                                               void                   *data,
                                               GDestroyNotify          dnotify);
+HrtWatcher*    _hrt_watcher_new_idle         (HrtTask                *task,
+                                              HrtWatcherCallback      callback,
+                                              void                   *data,
+                                              GDestroyNotify          dnotify);
 HrtWatcher*    _hrt_watcher_new_subtask      (HrtTask                *task,
                                               HrtTask                *wait_for_completed,
                                               HrtWatcherCallback      callback,
                                               void                   *data,
                                               GDestroyNotify          dnotify);
 void           _hrt_watcher_subtask_notify   (HrtWatcher             *watcher_subtask);
+HrtWatcher*    _hrt_watcher_new_blocking     (HrtTask                *task,
+                                              HrtBlockingFunc         blocking_func,
+                                              HrtWatcherCallback      callback,
+                                              void                   *data,
+                                              GDestroyNotify          dnotify);
+void           _hrt_watcher_blocking_run     (HrtWatcher             *watcher);
+void           _hrt_watcher_blocking_finish  (HrtWatcher             *watcher);
 HrtEventLoop*  _hrt_watcher_get_event_loop   (HrtWatcher             *watcher);
 HrtTaskRunner* _hrt_watcher_get_task_runner  (HrtWatcher             *watcher);
 
@@ -24,13 +24,37 @@
 
 #include <hrt/hrt-task-private.h>
 
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-log.h>
 #include <hrt/hrt-event-loop.h>
 #include <hrt/hrt-thread-pool.h>
+#include <hrt/hrt-watchdog.h>
 #include <hrt/hrt-watcher.h>
 #include <hrt/hrt-builtins.h>
 #include <hrt/hrt-marshalers.h>
 
+#include <unistd.h>
+
+/* In "cores" mode each core has its own event loop and runs the
+ * handlers of its tasks in the loop thread, in place of the
+ * event thread plus invoke pool. Invokers for the core's tasks are
+ * queued in its mailbox, which the loop drains in between
+ * dispatching events.
+ */
+typedef struct {
+    HrtTaskRunner *runner;
+    GThread *thread;
+    HrtEventLoop *event_loop;
+    HrtTaskThreadLocal *thread_local;
+
+    HrtLock *mailbox_lock;
+    GQueue mailbox;
+    /* only touched in the core's own thread */
+    gboolean draining;
+} HrtCore;
+
+static GStaticPrivate current_core = G_STATIC_PRIVATE_INIT;
+
 struct HrtTaskRunner {
     GObject      parent_instance;
 
@@ -48,6 +72,15 @@ struct HrtTaskRunner {
 
     /* The event loop run in the event thread. */
     HrtEventLoop *event_loop;
+    HrtEventLoopType event_loop_type;
+
+    /* If n_cores > 0, we have no event thread or invoke pool;
+     * event_loop belongs to cores[0] instead. Tasks are dealt out
+     * to cores round-robin as they're created.
+     */
+    int n_cores;
+    HrtCore *cores;
+    volatile int next_core;
 
     /* Thread pool used to invoke handlers for main
      * loop events, carefully invoking only one handler
@@ -70,14 +103,96 @@ struct HrtTaskRunner {
      */
     GQueue  completed_tasks;
     guint   completed_tasks_idle_id;
-    GMutex *completed_tasks_lock;
+    HrtLock *completed_tasks_lock;
 
     /* in the idle, we copy completed_tasks to here,
      * and then the main thread pulls from here.
      */
     GQueue  unlocked_completed_tasks;
+
+    /* Optionally, tasks are completed right away in the thread that
+     * drops their last watcher, instead of in the main thread. Then
+     * the completed queue above is only used to emit tasks-completed
+     * (if emit_tasks_completed), and subtask watchers are notified
+     * without a trip through the main loop.
+     */
+    gboolean complete_in_invoke_thread;
+    gboolean emit_tasks_completed;
+
+    /* Admission control. in_flight_tasks counts tasks that have
+     * had a watcher and are not yet completed, which includes
+     * tasks that are just waiting, such as idle keep-alive
+     * connections. active_tasks counts tasks that have work queued
+     * or running (that have an invoker), and is what's compared to
+     * concurrency_limit. The limit is adapted, CoDel-style, to the
+     * time invokers spend waiting in the invoke pool queue: if the
+     * minimum delay over an interval is above the target, we're
+     * building a standing queue and the limit is cut; if we hit the
+     * limit with no standing queue, or saw no queue at all, it's
+     * raised. Intervals are closed by load_timeout as well as
+     * by invokers, so the limit recovers when nothing is running.
+     * load_timeout only exists while there are active tasks or the
+     * limit is still recovering, so an idle runner doesn't wake up;
+     * it's created and cleared under load_lock.
+     */
+    volatile int in_flight_tasks;
+    volatile int active_tasks;
+    volatile int concurrency_limit;
+    /* see hrt_task_charge_memory() */
+    volatile int memory_used;
+    volatile int memory_limit_hits;
+    HrtLock *load_lock;
+    gint64  load_interval_end;
+    gint64  load_interval_min_delay;
+    gboolean load_interval_saturated;
+    volatile int last_queue_delay;
+    GSource *load_timeout;
+
+    /* Thread pool for hrt_task_run_blocking(), kept apart from
+     * invoke_threads so blocking work can't starve the watchers of
+     * other tasks. Created on first use. blocking_queued counts jobs
+     * pushed but not yet picked up by a thread; we refuse new jobs
+     * past blocking_queue_limit rather than queue without bound.
+     */
+    HrtLock *blocking_lock;
+    HrtThreadPool *blocking_threads;
+    int n_blocking_threads;
+
+    /* runs hrt_parallel_for() and friends, one thread per CPU.
+     * Also created on first use, under blocking_lock.
+     */
+    HrtThreadPool *parallel_threads;
+    int n_parallel_threads;
+    int blocking_queue_limit;
+    volatile int blocking_queued;
+    volatile int blocking_running;
+    volatile guint blocking_submitted;
+    volatile guint blocking_completed;
+    volatile guint blocking_rejected;
+
+    /* Optional; reports handlers that run longer than
+     * stall_threshold msec, and adds an invoke thread per stall,
+     * up to stall_extra_threads, so tasks queued behind the stuck
+     * one can still run.
+     */
+    HrtWatchdog *watchdog;
+    int stall_threshold;
+    int stall_extra_threads;
 };
 
+/* all in microseconds */
+#define QUEUE_DELAY_TARGET        5000
+#define QUEUE_DELAY_INTERVAL    100000
+#define MIN_CONCURRENCY_LIMIT       16
+#define MAX_CONCURRENCY_LIMIT    65536
+#define INITIAL_CONCURRENCY_LIMIT 1024
+
+/* same as hrt_thread_pool_new() */
+#define DEFAULT_INVOKE_THREADS         4
+
+#define DEFAULT_BLOCKING_THREADS      16
+#define DEFAULT_BLOCKING_QUEUE_LIMIT 256
+
 struct HrtTaskRunnerClass {
     GObjectClass parent_class;
 };
@@ -87,7 +202,14 @@ G_DEFINE_TYPE(HrtTaskRunner, hrt_task_runner, G_TYPE_OBJECT);
 
 enum {
     PROP_0,
-    PROP_EVENT_LOOP_TYPE
+    PROP_EVENT_LOOP_TYPE,
+    PROP_COMPLETE_IN_INVOKE_THREAD,
+    PROP_EMIT_TASKS_COMPLETED,
+    PROP_BLOCKING_THREADS,
+    PROP_BLOCKING_QUEUE_LIMIT,
+    PROP_CORES,
+    PROP_STALL_THRESHOLD,
+    PROP_STALL_EXTRA_THREADS
 };
 
 enum  {
@@ -131,15 +253,56 @@ hrt_task_runner_set_property (GObject                *object,
         g_return_if_fail(runner->event_loop == NULL);
 
         loop_type = g_value_get_enum(value);
+        runner->event_loop_type = loop_type;
         runner->event_loop = _hrt_event_loop_new(loop_type);
     }
         break;
+    case PROP_COMPLETE_IN_INVOKE_THREAD:
+        runner->complete_in_invoke_thread = g_value_get_boolean(value);
+        break;
+    case PROP_EMIT_TASKS_COMPLETED:
+        runner->emit_tasks_completed = g_value_get_boolean(value);
+        break;
+    case PROP_BLOCKING_THREADS:
+        runner->n_blocking_threads = g_value_get_int(value);
+        break;
+    case PROP_BLOCKING_QUEUE_LIMIT:
+        runner->blocking_queue_limit = g_value_get_int(value);
+        break;
+    case PROP_CORES:
+        runner->n_cores = g_value_get_int(value);
+        break;
+    case PROP_STALL_THRESHOLD:
+        runner->stall_threshold = g_value_get_int(value);
+        break;
+    case PROP_STALL_EXTRA_THREADS:
+        runner->stall_extra_threads = g_value_get_int(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
     }
 }
 
+static void shutdown_cores (HrtTaskRunner *runner);
+static void start_load_timeout (HrtTaskRunner *runner);
+
+static void
+shutdown_job_pools(HrtTaskRunner *runner)
+{
+    if (runner->parallel_threads) {
+        hrt_thread_pool_shutdown(runner->parallel_threads);
+        g_object_unref(runner->parallel_threads);
+        runner->parallel_threads = NULL;
+    }
+
+    if (runner->blocking_threads) {
+        hrt_thread_pool_shutdown(runner->blocking_threads);
+        g_object_unref(runner->blocking_threads);
+        runner->blocking_threads = NULL;
+    }
+}
+
 static void
 hrt_task_runner_dispose(GObject *object)
 {
@@ -147,6 +310,26 @@ hrt_task_runner_dispose(GObject *object)
 
     runner = HRT_TASK_RUNNER(object);
 
+    hrt_lock_lock(runner->load_lock);
+    if (runner->load_timeout) {
+        g_source_destroy(runner->load_timeout);
+        g_source_unref(runner->load_timeout);
+        runner->load_timeout = NULL;
+    }
+    hrt_lock_unlock(runner->load_lock);
+
+    /* no more stall callbacks, they use invoke_threads */
+    if (runner->watchdog)
+        _hrt_watchdog_stop(runner->watchdog);
+
+    if (runner->cores) {
+        /* blocking and parallel jobs finish by queueing watchers to
+         * the cores, so stop them while the core loops still run.
+         */
+        shutdown_job_pools(runner);
+        shutdown_cores(runner);
+    }
+
     if (runner->event_loop) {
         HrtEventLoop *loop = runner->event_loop;
 
@@ -172,12 +355,23 @@ hrt_task_runner_dispose(GObject *object)
         g_object_unref(loop);
     }
 
+    /* blocking and parallel jobs queue watchers for the invoke
+     * threads, so they have to be finished first.
+     */
+    shutdown_job_pools(runner);
+
     if (runner->invoke_threads) {
         hrt_thread_pool_shutdown(runner->invoke_threads);
         g_object_unref(runner->invoke_threads);
         runner->invoke_threads = NULL;
     }
 
+    /* after the threads that were in it are gone */
+    if (runner->watchdog) {
+        _hrt_watchdog_free(runner->watchdog);
+        runner->watchdog = NULL;
+    }
+
     /* the definition of dispose would usually involve freeing
      * everything in completed_tasks but we wait for the idle
      * to do that to be sure it's in the right thread. In the
@@ -201,11 +395,14 @@ hrt_task_runner_finalize(GObject *object)
     g_assert(g_queue_get_length(&runner->completed_tasks) == 0);
     g_assert(runner->completed_tasks_idle_id == 0);
     g_queue_clear(&runner->completed_tasks);
-    g_mutex_free(runner->completed_tasks_lock);
+    hrt_lock_free(runner->completed_tasks_lock);
     /* the idle should have cleared this too. */
     g_assert(g_queue_get_length(&runner->unlocked_completed_tasks) == 0);
     g_queue_clear(&runner->unlocked_completed_tasks);
 
+    hrt_lock_free(runner->load_lock);
+    hrt_lock_free(runner->blocking_lock);
+
     G_OBJECT_CLASS(hrt_task_runner_parent_class)->finalize(object);
 }
 
@@ -244,14 +441,18 @@ struct HrtInvoker {
 
     HrtTask *task;
 
-    GMutex *pending_watchers_lock;
+    /* when we were pushed to the invoke pool */
+    gint64 queued_time;
+
+    HrtLock *pending_watchers_lock;
     GQueue pending_watchers;
 
 };
 
 static HrtInvoker*
-hrt_invoker_new(HrtTask    *task,
-                HrtWatcher *first_watcher)
+hrt_invoker_new(HrtTaskRunner *runner,
+                HrtTask       *task,
+                HrtWatcher    *first_watcher)
 {
     HrtInvoker *invoker;
 
@@ -261,16 +462,26 @@ hrt_invoker_new(HrtTask    *task,
     invoker->task = task;
     g_object_ref(task);
 
-    invoker->pending_watchers_lock = g_mutex_new();
+    /* the task has work until run_invoker() is done with us */
+    if (g_atomic_int_exchange_and_add(&runner->active_tasks, 1) == 0)
+        start_load_timeout(runner);
+
+    invoker->queued_time = g_get_monotonic_time();
+
+    invoker->pending_watchers_lock = hrt_lock_new("hrt-invoker.pending_watchers_lock");
     g_queue_init(&invoker->pending_watchers);
 
     /* passing in first_watcher lets us avoid locking the queue for
      * just one watcher which is probably the most common case.
      * Using GStaticMutex we could even potentially
      * avoid creating a mutex, but for now skipping that.
+     * first_watcher is NULL if we only want to get into the
+     * task thread to clean up a cancelled task.
      */
-    _hrt_watcher_ref(first_watcher);
-    g_queue_push_tail(&invoker->pending_watchers, first_watcher);
+    if (first_watcher != NULL) {
+        _hrt_watcher_ref(first_watcher);
+        g_queue_push_tail(&invoker->pending_watchers, first_watcher);
+    }
 
     return invoker;
 }
@@ -290,7 +501,7 @@ hrt_invoker_unref(HrtInvoker *invoker)
     if (g_atomic_int_dec_and_test(&invoker->refcount)) {
         g_object_unref(invoker->task);
 
-        g_mutex_free(invoker->pending_watchers_lock);
+        hrt_lock_free(invoker->pending_watchers_lock);
 
         g_assert(g_queue_get_length(&invoker->pending_watchers) == 0);
 
@@ -305,9 +516,9 @@ hrt_invoker_queue_watcher(HrtInvoker *invoker,
 {
     _hrt_watcher_ref(watcher);
 
-    g_mutex_lock(invoker->pending_watchers_lock);
+    hrt_lock_lock(invoker->pending_watchers_lock);
     g_queue_push_tail(&invoker->pending_watchers, watcher);
-    g_mutex_unlock(invoker->pending_watchers_lock);
+    hrt_lock_unlock(invoker->pending_watchers_lock);
 }
 
 /* returns a ref if not NULL*/
@@ -316,9 +527,9 @@ hrt_invoker_pop_watcher(HrtInvoker *invoker)
 {
     HrtWatcher *watcher;
 
-    g_mutex_lock(invoker->pending_watchers_lock);
+    hrt_lock_lock(invoker->pending_watchers_lock);
     watcher = g_queue_pop_head(&invoker->pending_watchers);
-    g_mutex_unlock(invoker->pending_watchers_lock);
+    hrt_lock_unlock(invoker->pending_watchers_lock);
 
     return watcher;
 }
@@ -328,13 +539,35 @@ hrt_invoker_has_watchers(HrtInvoker *invoker)
 {
     gboolean has_watchers;
 
-    g_mutex_lock(invoker->pending_watchers_lock);
+    hrt_lock_lock(invoker->pending_watchers_lock);
     has_watchers = g_queue_get_length(&invoker->pending_watchers) > 0;
-    g_mutex_unlock(invoker->pending_watchers_lock);
+    hrt_lock_unlock(invoker->pending_watchers_lock);
 
     return has_watchers;
 }
 
+static void core_push_mailbox (HrtCore    *core,
+                               HrtInvoker *invoker);
+
+/* CALLED WITH TASK'S INVOKER LOCK HELD, with a newly-set invoker */
+static void
+queue_invoker(HrtTaskRunner *runner,
+              HrtTask       *task,
+              HrtInvoker    *invoker)
+{
+    if (runner->cores != NULL) {
+        core_push_mailbox(&runner->cores[_hrt_task_get_core(task)],
+                          invoker);
+    } else {
+        /* prefer the worker that last ran the task, its cache is
+         * likely still warm with the task's data
+         */
+        hrt_thread_pool_push_to(runner->invoke_threads,
+                                invoker,
+                                _hrt_task_get_affinity(task));
+    }
+}
+
 /* IN EVENT OR INVOKE THREADS */
 void
 _hrt_task_runner_watcher_pending(HrtTaskRunner      *runner,
@@ -346,7 +579,7 @@ _hrt_task_runner_watcher_pending(HrtTaskRunner      *runner,
     _hrt_task_lock_invoker(watcher->task);
     invoker = _hrt_task_get_invoker(watcher->task);
     if (invoker == NULL) {
-        invoker = hrt_invoker_new(watcher->task, watcher);
+        invoker = hrt_invoker_new(runner, watcher->task, watcher);
         _hrt_task_set_invoker(watcher->task, invoker);
         invoker_created = TRUE;
     } else {
@@ -354,21 +587,44 @@ _hrt_task_runner_watcher_pending(HrtTaskRunner      *runner,
         invoker_created = FALSE;
     }
 
-    if (invoker_created) {
-        hrt_thread_pool_push(runner->invoke_threads,
-                             invoker);
-    }
+    if (invoker_created)
+        queue_invoker(runner, watcher->task, invoker);
 
     /* If we didn't create invoker, we rely on it still being
-     * running in the thread pool.
+     * running in the thread pool (or queued to its core).
      */
     _hrt_task_unlock_invoker(watcher->task);
 }
 
+/* CALLED WITH TASK'S INVOKER LOCK HELD, FROM ANY THREAD.
+ * The task needs to get into its task thread but has no invoker,
+ * either because it has been cancelled and its watchers have to be
+ * removed, or because something was posted to it; push an empty
+ * invoker.
+ */
+void
+_hrt_task_runner_queue_task(HrtTaskRunner *runner,
+                            HrtTask       *task)
+{
+    HrtInvoker *invoker;
+
+    g_assert(_hrt_task_get_invoker(task) == NULL);
+
+    invoker = hrt_invoker_new(runner, task, NULL);
+    _hrt_task_set_invoker(task, invoker);
+
+    queue_invoker(runner, task, invoker);
+}
+
+/* The loop that task's watchers go in */
 HrtEventLoop*
-_hrt_task_runner_get_event_loop(HrtTaskRunner *runner)
+_hrt_task_runner_get_event_loop(HrtTaskRunner *runner,
+                                HrtTask       *task)
 {
-    return runner->event_loop;
+    if (runner->cores != NULL)
+        return runner->cores[_hrt_task_get_core(task)].event_loop;
+    else
+        return runner->event_loop;
 }
 
 /* Immediately queue the callback for the invoke thread,
@@ -392,7 +648,10 @@ _hrt_task_runner_add_immediate(HrtTaskRunner      *runner,
     /* start() on immediate watcher just queues for immediate
      * invoke.
      */
+    _hrt_watcher_ref(watcher);
     _hrt_watcher_start(watcher);
+    _hrt_task_add_watcher(task, watcher);
+    _hrt_watcher_unref(watcher);
 
     return watcher;
 
@@ -412,14 +671,51 @@ _hrt_task_runner_add_idle(HrtTaskRunner     *runner,
 
     g_return_val_if_fail(_hrt_task_get_runner(task) == runner, NULL);
 
+    /* a core has no pool to be idle in, so there we still use
+     * the core's event loop.
+     */
+    if (runner->cores != NULL)
+        watcher =
+            _hrt_event_loop_create_idle(_hrt_task_runner_get_event_loop(runner, task),
+                                        task, func, data, dnotify);
+    else
+        watcher = _hrt_watcher_new_idle(task, func, data, dnotify);
+
+    /* the watcher can already be invoked, or removed, in another
+     * thread as soon as we call this.
+     */
+    _hrt_watcher_ref(watcher);
+    _hrt_watcher_start(watcher);
+    _hrt_task_add_watcher(task, watcher);
+    _hrt_watcher_unref(watcher);
+
+    return watcher;
+}
+
+HrtWatcher*
+_hrt_task_runner_add_timeout(HrtTaskRunner      *runner,
+                             HrtTask            *task,
+                             guint               interval_msec,
+                             HrtWatcherCallback  func,
+                             void               *data,
+                             GDestroyNotify      dnotify)
+{
+    HrtWatcher *watcher;
+
+    g_return_val_if_fail(_hrt_task_get_runner(task) == runner, NULL);
+
     watcher =
-        _hrt_event_loop_create_idle(runner->event_loop,
-                                    task, func, data, dnotify);
+        _hrt_event_loop_create_timeout(_hrt_task_runner_get_event_loop(runner, task),
+                                       task, interval_msec,
+                                       func, data, dnotify);
 
     /* the watcher can already be invoked, or removed, in another
      * thread as soon as we call this.
      */
+    _hrt_watcher_ref(watcher);
     _hrt_watcher_start(watcher);
+    _hrt_task_add_watcher(task, watcher);
+    _hrt_watcher_unref(watcher);
 
     return watcher;
 }
@@ -438,14 +734,17 @@ _hrt_task_runner_add_io(HrtTaskRunner      *runner,
     g_return_val_if_fail(_hrt_task_get_runner(task) == runner, NULL);
 
     watcher =
-        _hrt_event_loop_create_io(runner->event_loop,
+        _hrt_event_loop_create_io(_hrt_task_runner_get_event_loop(runner, task),
                                   task, fd, io_flags,
                                   func, data, dnotify);
 
     /* the watcher can already be invoked, or removed, in another
      * thread as soon as we call this.
      */
+    _hrt_watcher_ref(watcher);
     _hrt_watcher_start(watcher);
+    _hrt_task_add_watcher(task, watcher);
+    _hrt_watcher_unref(watcher);
 
     return watcher;
 }
@@ -471,11 +770,231 @@ _hrt_task_runner_add_subtask(HrtTaskRunner      *runner,
         _hrt_watcher_new_subtask(task, wait_for_completed,
                                  callback, data, dnotify);
 
+    _hrt_watcher_ref(watcher);
     _hrt_watcher_start(watcher);
+    _hrt_task_add_watcher(task, watcher);
+    _hrt_watcher_unref(watcher);
 
     return watcher;
 }
 
+static void*
+blocking_pool_thread_data_new(void *vfunc_data)
+{
+    return NULL;
+}
+
+static void
+blocking_pool_thread_data_free(void *thread_data,
+                               void *vfunc_data)
+{
+}
+
+/* IN BLOCKING THREAD */
+static void
+blocking_pool_handle_item(void *thread_data,
+                          void *item,
+                          void *vfunc_data)
+{
+    HrtTaskRunner *runner = HRT_TASK_RUNNER(vfunc_data);
+    HrtWatcher *watcher = item;
+
+    g_atomic_int_add(&runner->blocking_queued, -1);
+    g_atomic_int_inc(&runner->blocking_running);
+
+    _hrt_watcher_blocking_run(watcher);
+
+    /* before the watcher is queued, so the stats are up to date
+     * by the time the task can complete
+     */
+    g_atomic_int_add(&runner->blocking_running, -1);
+    g_atomic_int_inc((volatile int*) &runner->blocking_completed);
+
+    _hrt_watcher_blocking_finish(watcher);
+}
+
+static const HrtThreadPoolVTable blocking_pool_vtable = {
+    blocking_pool_thread_data_new,
+    blocking_pool_handle_item,
+    blocking_pool_thread_data_free
+};
+
+/* RUN FROM ANY THREAD, from the blocking watcher's start() */
+void
+_hrt_task_runner_push_blocking(HrtTaskRunner *runner,
+                               HrtWatcher    *watcher)
+{
+    HrtThreadPool *pool;
+
+    hrt_lock_lock(runner->blocking_lock);
+    if (runner->blocking_threads == NULL) {
+        runner->blocking_threads =
+            hrt_thread_pool_new_sized(&blocking_pool_vtable,
+                                      runner,
+                                      NULL,
+                                      runner->n_blocking_threads);
+    }
+    pool = runner->blocking_threads;
+    hrt_lock_unlock(runner->blocking_lock);
+
+    g_atomic_int_inc(&runner->blocking_queued);
+    g_atomic_int_inc((volatile int*) &runner->blocking_submitted);
+
+    hrt_thread_pool_push(pool, watcher);
+}
+
+/* IN PARALLEL THREAD */
+static void
+parallel_pool_handle_item(void *thread_data,
+                          void *item,
+                          void *vfunc_data)
+{
+    _hrt_parallel_run_participant(item);
+}
+
+static const HrtThreadPoolVTable parallel_pool_vtable = {
+    blocking_pool_thread_data_new,
+    parallel_pool_handle_item,
+    blocking_pool_thread_data_free
+};
+
+/* RUN FROM ANY THREAD */
+int
+_hrt_task_runner_get_n_parallel_threads(HrtTaskRunner *runner)
+{
+    return runner->n_parallel_threads;
+}
+
+/* RUN FROM ANY THREAD */
+void
+_hrt_task_runner_push_parallel(HrtTaskRunner *runner,
+                               void          *participant)
+{
+    HrtThreadPool *pool;
+
+    hrt_lock_lock(runner->blocking_lock);
+    if (runner->parallel_threads == NULL) {
+        runner->parallel_threads =
+            hrt_thread_pool_new_sized(&parallel_pool_vtable,
+                                      runner,
+                                      NULL,
+                                      runner->n_parallel_threads);
+    }
+    pool = runner->parallel_threads;
+    hrt_lock_unlock(runner->blocking_lock);
+
+    hrt_thread_pool_push(pool, participant);
+}
+
+/* RUN FROM ANY THREAD. Every run of a blocking function, including
+ * a restart from the watcher callback, has to get past this before
+ * it's pushed.
+ *
+ * This is a soft limit, a few concurrent callers can all get past
+ * it; it only needs to stop unbounded queueing.
+ */
+gboolean
+_hrt_task_runner_admit_blocking(HrtTaskRunner *runner)
+{
+    if (g_atomic_int_get(&runner->blocking_queued) >=
+        runner->blocking_queue_limit) {
+        g_atomic_int_inc((volatile int*) &runner->blocking_rejected);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Returns NULL without taking ownership of data if too many blocking
+ * jobs are already waiting for a thread.
+ */
+HrtWatcher*
+_hrt_task_runner_add_blocking(HrtTaskRunner      *runner,
+                              HrtTask            *task,
+                              HrtBlockingFunc     blocking_func,
+                              HrtWatcherCallback  callback,
+                              void               *data,
+                              GDestroyNotify      dnotify)
+{
+    HrtWatcher *watcher;
+
+    g_return_val_if_fail(_hrt_task_get_runner(task) == runner, NULL);
+
+    if (!_hrt_task_runner_admit_blocking(runner))
+        return NULL;
+
+    watcher =
+        _hrt_watcher_new_blocking(task, blocking_func,
+                                  callback, data, dnotify);
+
+    _hrt_watcher_ref(watcher);
+    _hrt_watcher_start(watcher);
+    _hrt_task_add_watcher(task, watcher);
+    _hrt_watcher_unref(watcher);
+
+    return watcher;
+}
+
+/* Can be called from any thread. The counters are read separately so
+ * they may be slightly inconsistent with each other.
+ */
+void
+hrt_task_runner_get_blocking_stats(HrtTaskRunner              *runner,
+                                   HrtTaskRunnerBlockingStats *stats)
+{
+    stats->n_threads = runner->n_blocking_threads;
+    stats->queue_limit = runner->blocking_queue_limit;
+    stats->queued = g_atomic_int_get(&runner->blocking_queued);
+    stats->running = g_atomic_int_get(&runner->blocking_running);
+    stats->submitted = (guint) g_atomic_int_get((volatile int*) &runner->blocking_submitted);
+    stats->completed = (guint) g_atomic_int_get((volatile int*) &runner->blocking_completed);
+    stats->rejected = (guint) g_atomic_int_get((volatile int*) &runner->blocking_rejected);
+}
+
+/* Can be called from any thread. Number of handlers that ran past
+ * the stall-threshold, always 0 if it isn't set.
+ */
+guint
+hrt_task_runner_get_stall_count(HrtTaskRunner *runner)
+{
+    if (runner->watchdog == NULL)
+        return 0;
+
+    return _hrt_watchdog_get_stalls(runner->watchdog);
+}
+
+/* Can be called from any thread. Number of invoke threads, including
+ * any added because of stalls; 0 when running with cores.
+ */
+int
+hrt_task_runner_get_n_invoke_threads(HrtTaskRunner *runner)
+{
+    if (runner->invoke_threads == NULL)
+        return 0;
+
+    return hrt_thread_pool_get_n_threads(runner->invoke_threads);
+}
+
+/* Can be called from any thread. Hits count task invocations that ran
+ * in the invoke thread that last ran the same task, misses count
+ * those taken by another thread because that one was busy.
+ */
+void
+hrt_task_runner_get_affinity_stats(HrtTaskRunner *runner,
+                                   guint         *hits_p,
+                                   guint         *misses_p)
+{
+    if (runner->invoke_threads == NULL) {
+        /* cores mode, tasks never move */
+        *hits_p = 0;
+        *misses_p = 0;
+        return;
+    }
+
+    hrt_thread_pool_get_affinity_stats(runner->invoke_threads,
+                                       hits_p, misses_p);
+}
+
 /* Creates a new task, owned by the caller, associated with
  * the task runner.
  */
@@ -488,6 +1007,16 @@ hrt_task_runner_create_task(HrtTaskRunner *runner)
 
     _hrt_task_set_runner(task, runner);
 
+    /* a new root task is usually a new connection, which is
+     * what we want to spread across cores
+     */
+    if (runner->cores != NULL) {
+        guint core;
+
+        core = (guint) g_atomic_int_exchange_and_add(&runner->next_core, 1);
+        _hrt_task_set_core(task, core % runner->n_cores);
+    }
+
     return task;
 }
 
@@ -536,6 +1065,12 @@ hrt_task_runner_pop_completed(HrtTaskRunner *runner)
      * tasks that are already marked completed.
      */
 
+    /* tasks were already completed in the invoke thread, and queued
+     * exactly once.
+     */
+    if (runner->complete_in_invoke_thread)
+        return g_queue_pop_head(&runner->unlocked_completed_tasks);
+
     while ((task = g_queue_pop_head(&runner->unlocked_completed_tasks)) != NULL) {
         /* We skip the task if watchers were added (so it's no longer
          * complete) or if it was already completed (so we don't want
@@ -576,7 +1111,7 @@ complete_tasks_in_runner_thread(void *data)
     HrtTaskRunner *runner = HRT_TASK_RUNNER(data);
     HrtTask *task;
 
-    g_mutex_lock(runner->completed_tasks_lock);
+    hrt_lock_lock(runner->completed_tasks_lock);
 
     /* unlocked_completed_tasks must be empty because we only run one
      * of these idles at a time, and at the end of the idle we
@@ -590,7 +1125,7 @@ complete_tasks_in_runner_thread(void *data)
 
     runner->completed_tasks_idle_id = 0;
 
-    g_mutex_unlock(runner->completed_tasks_lock);
+    hrt_lock_unlock(runner->completed_tasks_lock);
 
     /* During this emission, unlocked_completed_tasks MUST be drained or
      * else we'll just drop its contents on the floor.
@@ -613,9 +1148,10 @@ _hrt_task_runner_queue_completed_task(HrtTaskRunner *runner,
      * thread. The completion idle does nothing if a watcher is added
      * before the completion idle runs.
      */
-    g_assert(!_hrt_task_is_completed(task));
+    g_assert(runner->complete_in_invoke_thread ||
+             !_hrt_task_is_completed(task));
 
-    g_mutex_lock(runner->completed_tasks_lock);
+    hrt_lock_lock(runner->completed_tasks_lock);
 
     if (runner->completed_tasks_idle_id == 0) {
         GSource *source;
@@ -631,31 +1167,352 @@ _hrt_task_runner_queue_completed_task(HrtTaskRunner *runner,
     g_object_ref(task);
     g_queue_push_tail(&runner->completed_tasks, task);
 
-    g_mutex_unlock(runner->completed_tasks_lock);
+    hrt_lock_unlock(runner->completed_tasks_lock);
+}
+
+
+/* RUN FROM ANY THREAD */
+void
+_hrt_task_runner_task_started(HrtTaskRunner *runner)
+{
+    g_atomic_int_inc(&runner->in_flight_tasks);
+}
+
+/* RUN FROM ANY THREAD: the main thread, or with
+ * complete-in-invoke-thread whichever invoke thread completed the
+ * task. in_flight_tasks is only ever changed atomically and isn't
+ * tied to any other state, so no lock is needed.
+ */
+void
+_hrt_task_runner_task_finished(HrtTaskRunner *runner)
+{
+    g_atomic_int_add(&runner->in_flight_tasks, -1);
+}
+
+/* RUN FROM ANY THREAD */
+void
+_hrt_task_runner_memory_changed(HrtTaskRunner *runner,
+                                int            bytes)
+{
+    g_atomic_int_add(&runner->memory_used, bytes);
+}
+
+/* RUN FROM ANY THREAD */
+void
+_hrt_task_runner_memory_limit_hit(HrtTaskRunner *runner)
+{
+    g_atomic_int_inc(&runner->memory_limit_hits);
+}
+
+/* CALLED WITH load_lock HELD, once the interval has ended */
+static void
+close_load_interval(HrtTaskRunner *runner,
+                    gint64         now)
+{
+    gint64 min_delay;
+    int limit;
+
+    limit = g_atomic_int_get(&runner->concurrency_limit);
+
+    /* nothing was queued at all in the interval, so there was
+     * certainly no standing queue
+     */
+    min_delay = runner->load_interval_min_delay;
+    if (min_delay == G_MAXINT64)
+        min_delay = 0;
+
+    if (min_delay > QUEUE_DELAY_TARGET) {
+        /* standing queue; back off multiplicatively */
+        limit = MAX(MIN_CONCURRENCY_LIMIT, limit * 3 / 4);
+    } else if (runner->load_interval_saturated ||
+               limit < INITIAL_CONCURRENCY_LIMIT) {
+        /* we were at the limit but kept up, or we cut the limit
+         * earlier and the queue has since drained; probe upward
+         */
+        limit = MIN(MAX_CONCURRENCY_LIMIT, limit + MAX(1, limit / 16));
+    }
+
+    g_atomic_int_set(&runner->concurrency_limit, limit);
+    g_atomic_int_set(&runner->last_queue_delay, (int) MIN(min_delay, G_MAXINT));
+
+    runner->load_interval_end = now + QUEUE_DELAY_INTERVAL;
+    runner->load_interval_min_delay = G_MAXINT64;
+    runner->load_interval_saturated = FALSE;
+}
+
+/* IN MAIN THREAD */
+static gboolean
+on_deadline(void *data)
+{
+    HrtTask *task = HRT_TASK(data);
+
+    hrt_debug("Task %p reached its deadline, cancelling", task);
+    hrt_task_cancel(task);
+
+    return FALSE;
+}
+
+/* RUN FROM ANY THREAD, with the task's invoker lock held. Returns a
+ * timeout in the runner's context that cancels the task at the
+ * deadline (on the g_get_monotonic_time() clock). The timeout holds
+ * a ref on the task; the caller owns a ref on the timeout and
+ * destroys it if the task completes first.
+ */
+GSource*
+_hrt_task_runner_add_deadline(HrtTaskRunner *runner,
+                              HrtTask       *task,
+                              gint64         deadline)
+{
+    GSource *source;
+    gint64 delay_msec;
+
+    /* round up so we don't fire just short of the deadline */
+    delay_msec = (deadline - g_get_monotonic_time() + 999) / 1000;
+    delay_msec = CLAMP(delay_msec, 0, G_MAXUINT);
+
+    source = g_timeout_source_new((guint) delay_msec);
+    g_object_ref(task);
+    g_source_set_callback(source, on_deadline,
+                          task, (GDestroyNotify) g_object_unref);
+    g_source_attach(source, runner->runner_context);
+
+    return source;
 }
 
+/* IN INVOKE THREAD, each time we pick up an invoker */
+static void
+update_concurrency_limit(HrtTaskRunner *runner,
+                         gint64         queue_delay)
+{
+    gint64 now;
+
+    now = g_get_monotonic_time();
+
+    hrt_lock_lock(runner->load_lock);
+
+    if (queue_delay < runner->load_interval_min_delay)
+        runner->load_interval_min_delay = queue_delay;
+
+    if (g_atomic_int_get(&runner->active_tasks) >=
+        g_atomic_int_get(&runner->concurrency_limit))
+        runner->load_interval_saturated = TRUE;
+
+    if (now >= runner->load_interval_end)
+        close_load_interval(runner, now);
+
+    hrt_lock_unlock(runner->load_lock);
+}
+
+/* IN MAIN THREAD. Invokers only close an interval when they run, so
+ * this closes it when nothing has been running; otherwise a limit
+ * cut during a burst would stay down until the next burst. Once
+ * nothing is active and the limit is back up, there's nothing left
+ * to do, so we remove ourselves until the next task gets work.
+ */
+static gboolean
+on_load_timeout(void *data)
+{
+    HrtTaskRunner *runner = HRT_TASK_RUNNER(data);
+    gint64 now;
+    gboolean keep;
 
+    now = g_get_monotonic_time();
+
+    hrt_lock_lock(runner->load_lock);
+
+    if (now >= runner->load_interval_end)
+        close_load_interval(runner, now);
+
+    /* a task that becomes active after this check finds
+     * load_timeout cleared and starts a new one
+     */
+    keep = g_atomic_int_get(&runner->active_tasks) > 0 ||
+        g_atomic_int_get(&runner->concurrency_limit) < INITIAL_CONCURRENCY_LIMIT;
+    if (!keep) {
+        g_source_unref(runner->load_timeout);
+        runner->load_timeout = NULL;
+    }
+
+    hrt_lock_unlock(runner->load_lock);
+
+    return keep;
+}
+
+/* RUN FROM ANY THREAD, when active_tasks goes up from zero. The
+ * timeout holds no ref on the runner; it's removed in dispose.
+ */
+static void
+start_load_timeout(HrtTaskRunner *runner)
+{
+    hrt_lock_lock(runner->load_lock);
+
+    if (runner->load_timeout == NULL) {
+        runner->load_timeout = g_timeout_source_new(QUEUE_DELAY_INTERVAL / 1000);
+        g_source_set_callback(runner->load_timeout, on_load_timeout,
+                              runner, NULL);
+        g_source_attach(runner->load_timeout, runner->runner_context);
+    }
+
+    hrt_lock_unlock(runner->load_lock);
+}
+
+/* Can be called from any thread. The queue delay is the minimum
+ * delay over the last completed measurement interval.
+ */
+void
+hrt_task_runner_get_load(HrtTaskRunner     *runner,
+                         HrtTaskRunnerLoad *load)
+{
+    load->in_flight_tasks = g_atomic_int_get(&runner->in_flight_tasks);
+    load->active_tasks = g_atomic_int_get(&runner->active_tasks);
+    load->concurrency_limit = g_atomic_int_get(&runner->concurrency_limit);
+    load->queue_delay_usec = g_atomic_int_get(&runner->last_queue_delay);
+    load->memory_used = g_atomic_int_get(&runner->memory_used);
+    load->memory_limit_hits = (guint) g_atomic_int_get(&runner->memory_limit_hits);
+}
+
+/* Can be called from any thread. Returns TRUE if the caller should
+ * avoid starting new work (for example, reject new connections).
+ * Only tasks with work queued or running count against the limit,
+ * so tasks waiting on IO (idle connections) don't cause shedding.
+ * This is advisory, the runner never refuses to run a task.
+ */
+gboolean
+hrt_task_runner_is_overloaded(HrtTaskRunner *runner)
+{
+    return g_atomic_int_get(&runner->active_tasks) >=
+        g_atomic_int_get(&runner->concurrency_limit);
+}
+
+/* IN THE THREAD THAT JUST COMPLETED THE TASK, without the invoker
+ * lock held
+ */
+static void
+finish_completed_task(HrtTaskRunner *runner,
+                      HrtTask       *task)
+{
+    _hrt_task_notify_completed(task);
+
+    if (runner->emit_tasks_completed)
+        _hrt_task_runner_queue_completed_task(runner, task);
+}
+
+/* RUN FROM ANY THREAD when a task's watcher count drops to zero
+ * outside of an invoke (i.e. hrt_task_unblock_completion())
+ */
+void
+_hrt_task_runner_task_done(HrtTaskRunner *runner,
+                           HrtTask       *task)
+{
+    gboolean completed;
+
+    if (!runner->complete_in_invoke_thread) {
+        _hrt_task_runner_queue_completed_task(runner, task);
+        return;
+    }
+
+    /* if there's an invoker, it will complete the task when it
+     * finishes up.
+     */
+    _hrt_task_lock_invoker(task);
+    completed = _hrt_task_get_invoker(task) == NULL &&
+        !_hrt_task_has_watchers(task) &&
+        _hrt_task_mark_completed_unlocked(task);
+    _hrt_task_unlock_invoker(task);
+
+    if (completed)
+        finish_completed_task(runner, task);
+}
+
+static HrtTaskThreadLocal*
+thread_local_new_watched(HrtTaskRunner *runner)
+{
+    HrtTaskThreadLocal *thread_local;
+
+    thread_local = _hrt_task_thread_local_new();
+
+    if (runner->watchdog != NULL)
+        _hrt_task_thread_local_set_watchdog_slot(thread_local,
+                                                 _hrt_watchdog_add_thread(runner->watchdog));
+
+    return thread_local;
+}
+
+static void
+thread_local_unwatch(HrtTaskRunner      *runner,
+                     HrtTaskThreadLocal *thread_local)
+{
+    HrtWatchdogSlot *slot;
+
+    slot = _hrt_task_thread_local_get_watchdog_slot(thread_local);
+    if (slot != NULL) {
+        _hrt_watchdog_remove_thread(runner->watchdog, slot);
+        _hrt_task_thread_local_set_watchdog_slot(thread_local, NULL);
+    }
+}
+
+/* IN INVOKE THREAD */
 static void*
 invoke_pool_thread_data_new(void *vfunc_data)
 {
-    return _hrt_task_thread_local_new();
+    return thread_local_new_watched(HRT_TASK_RUNNER(vfunc_data));
 }
 
+/* IN INVOKE THREAD. Returns TRUE if any posts were run. */
+static gboolean
+run_posts(HrtTask            *task,
+          HrtTaskThreadLocal *thread_local)
+{
+    HrtTaskPost *post;
+    gboolean any_run;
+
+    any_run = FALSE;
+
+    while ((post = _hrt_task_pop_post(task)) != NULL) {
+        HrtTaskPostFunc func;
+
+        g_assert(!_hrt_task_is_completed(task));
+
+        func = post->func;
+
+        /* after this the post may be queued again, even by
+         * another thread, so don't touch it
+         */
+        g_atomic_int_set(&post->queued, 0);
+
+        _hrt_task_enter_invoke(task, thread_local, (void*) func);
+        (* func) (task, post);
+        /* the count taken by hrt_task_post() */
+        _hrt_task_watchers_dec(task);
+        _hrt_task_leave_invoke(task);
+
+        any_run = TRUE;
+    }
+
+    return any_run;
+}
+
+/* IN INVOKE THREAD (or the task's core thread) */
 static void
-invoke_pool_handle_item (void *thread_data,
-                         void *pushed_item,
-                         void *pool_data)
+run_invoker(HrtTaskRunner      *runner,
+            HrtTaskThreadLocal *thread_local,
+            HrtInvoker         *invoker)
 {
-    HrtTaskThreadLocal *thread_local = thread_data;
-    HrtInvoker *invoker = pushed_item;
-    HrtTaskRunner *runner = HRT_TASK_RUNNER(pool_data);
     HrtWatcher *watcher;
     HrtTask *task;
+    gboolean cancelled;
+    gboolean completed;
 
     task = invoker->task;
 
     g_object_ref(task);
 
+    update_concurrency_limit(runner,
+                             g_get_monotonic_time() - invoker->queued_time);
+
+    /* this also notices if we're past the deadline */
+    cancelled = hrt_task_is_cancelled(task);
+
  redrain_watchers:
     g_assert(!_hrt_task_is_completed(task));
 
@@ -673,13 +1530,23 @@ invoke_pool_handle_item (void *thread_data,
          * from it... which can happen due to the queue.
          */
         if (g_atomic_int_get(&watcher->removed) > 0) {
+            _hrt_watcher_unref(watcher);
+            continue;
+        }
+
+        /* A cancelled task doesn't get any more callbacks; the
+         * removals are posts, which still run, to dnotify.
+         */
+        if (cancelled) {
+            _hrt_watcher_try_remove(watcher);
+            _hrt_watcher_unref(watcher);
             continue;
         }
 
         func = watcher->func;
         watcher_data = watcher->data;
 
-        _hrt_task_enter_invoke(task, thread_local);
+        _hrt_task_enter_invoke(task, thread_local, (void*) func);
         restart = (* func) (task,
                             watcher->flags,
                             watcher_data);
@@ -712,15 +1579,39 @@ invoke_pool_handle_item (void *thread_data,
 
     g_assert(!_hrt_task_is_completed(task));
 
+    /* posts can add watchers so we may have to drain those again */
+    if (run_posts(task, thread_local))
+        goto redrain_watchers;
+
+    /* Tear down any watchers that haven't fired, such as IO
+     * watchers, if we're cancelled. This posts the removals
+     * to the task so we have to drain again.
+     */
+    if (cancelled &&
+        _hrt_task_remove_all_watchers(task) > 0) {
+        goto redrain_watchers;
+    }
+
     _hrt_task_lock_invoker(task);
 
     /* The idea here is that while the invoker is still
      * available, we guarantee we'll process any watcher
-     * events added to it.
+     * events added to it. Also, hrt_task_cancel() relies on us
+     * checking for cancellation with the lock held, if it sees
+     * an invoker it leaves the cleanup to us.
      */
     _hrt_task_set_invoker(task, NULL);
 
-    if (hrt_invoker_has_watchers(invoker)) {
+    if (_hrt_task_get_cancelled(task) &&
+        (!cancelled || _hrt_task_has_live_watchers_unlocked(task))) {
+        cancelled = TRUE;
+        _hrt_task_set_invoker(task, invoker);
+        _hrt_task_unlock_invoker(task);
+        goto redrain_watchers;
+    }
+
+    if (hrt_invoker_has_watchers(invoker) ||
+        _hrt_task_has_posts_unlocked(task)) {
         /* put invoker back and handle the watchers that were added... */
         _hrt_task_set_invoker(task, invoker);
         _hrt_task_unlock_invoker(task);
@@ -730,8 +1621,10 @@ invoke_pool_handle_item (void *thread_data,
     g_assert(!_hrt_task_is_completed(task));
 
     /* invoker is now cleared off the task and has no events. We can
-     * queue completion.
+     * queue completion. The task has nothing more to do, so it's
+     * no longer active, even if it isn't complete.
      */
+    g_atomic_int_add(&runner->active_tasks, -1);
 
     /* We are worried about the following:
      *
@@ -756,38 +1649,316 @@ invoke_pool_handle_item (void *thread_data,
      * it won't queue a completion itself. So it can complete exactly
      * once.
      */
+    completed = FALSE;
     if (!_hrt_task_has_watchers(task)) {
-        /* task is completed when it has had a watcher once, and now
-         * has none, and main thread has entered the main loop.
-         * Completion is only done in the main thread.  Main thread
-         * can add watchers again once we're already queued for
-         * completion, in that case the main thread won't remove this
-         * task in hrt_task_runner_pop_completed() and the task will
-         * be resurrected.
-         */
-        _hrt_task_runner_queue_completed_task(runner, task);
+        if (runner->complete_in_invoke_thread) {
+            /* In this mode we complete the task right here, so
+             * nobody may add watchers to a task with no watchers,
+             * other than from inside the task itself. To add several
+             * watchers from outside, use hrt_task_block_completion().
+             */
+            completed = _hrt_task_mark_completed_unlocked(task);
+        } else {
+            /* task is completed when it has had a watcher once, and
+             * now has none, and main thread has entered the main
+             * loop.  Completion is only done in the main thread.
+             * Main thread can add watchers again once we're already
+             * queued for completion, in that case the main thread
+             * won't remove this task in
+             * hrt_task_runner_pop_completed() and the task will be
+             * resurrected.
+             */
+            _hrt_task_runner_queue_completed_task(runner, task);
+        }
     }
 
     _hrt_task_unlock_invoker(task);
 
+    if (completed)
+        finish_completed_task(runner, task);
+
     hrt_invoker_unref(invoker);
 
     g_object_unref(task);
 }
 
+static void
+invoke_pool_handle_item (void *thread_data,
+                         void *pushed_item,
+                         void *pool_data)
+{
+    HrtInvoker *invoker = pushed_item;
+    HrtTaskRunner *runner = HRT_TASK_RUNNER(pool_data);
+
+    _hrt_task_set_affinity(invoker->task,
+                           hrt_thread_pool_get_current_worker(runner->invoke_threads));
+
+    run_invoker(runner, thread_data, invoker);
+}
+
+/* IN INVOKE THREAD, with a watcher from _hrt_task_runner_push_idle() */
+static void
+invoke_pool_handle_idle_item(void *thread_data,
+                             void *pushed_item,
+                             void *pool_data)
+{
+    HrtWatcher *watcher = pushed_item;
+    HrtTaskRunner *runner = HRT_TASK_RUNNER(pool_data);
+    HrtInvoker *invoker;
+    HrtTask *task;
+
+    task = watcher->task;
+
+    /* removed while queued; the removal post cleans up */
+    if (g_atomic_int_get(&watcher->removed) > 0) {
+        _hrt_watcher_unref(watcher);
+        return;
+    }
+
+    /* The pool had nothing else for us, so rather than pushing a
+     * new invoker that this thread would just pop again, run it
+     * here. If the task already has an invoker, it will run the
+     * idle along with its other watchers.
+     */
+    _hrt_task_lock_invoker(task);
+    invoker = _hrt_task_get_invoker(task);
+    if (invoker == NULL) {
+        invoker = hrt_invoker_new(runner, task, watcher);
+        _hrt_task_set_invoker(task, invoker);
+    } else {
+        hrt_invoker_queue_watcher(invoker, watcher);
+        invoker = NULL;
+    }
+    _hrt_task_unlock_invoker(task);
+
+    _hrt_watcher_unref(watcher);
+
+    if (invoker != NULL) {
+        _hrt_task_set_affinity(task,
+                               hrt_thread_pool_get_current_worker(runner->invoke_threads));
+
+        run_invoker(runner, thread_data, invoker);
+    }
+}
+
 static void
 invoke_pool_thread_data_free(void *thread_data,
                              void *vfunc_data)
 {
+    thread_local_unwatch(HRT_TASK_RUNNER(vfunc_data), thread_data);
     _hrt_task_thread_local_free(thread_data);
 }
 
+/* IN THE THREAD SHUTTING DOWN THE POOL, or the task thread of an
+ * idle that restarted during shutdown. The idle will never run.
+ */
+static void
+invoke_pool_drop_idle_item(void *item,
+                           void *pool_data)
+{
+    HrtWatcher *watcher = item;
+
+    /* the ref _hrt_watcher_idle_start() gave the queue */
+    _hrt_watcher_unref(watcher);
+}
+
 static const HrtThreadPoolVTable invoke_pool_vtable = {
     invoke_pool_thread_data_new,
     invoke_pool_handle_item,
-    invoke_pool_thread_data_free
+    invoke_pool_thread_data_free,
+    invoke_pool_handle_idle_item,
+    invoke_pool_drop_idle_item
 };
 
+/* RUN FROM ANY THREAD, from the idle watcher's start(). The pool
+ * hands the watcher to invoke_pool_handle_idle_item() once it has
+ * no other work.
+ */
+void
+_hrt_task_runner_push_idle(HrtTaskRunner *runner,
+                           HrtWatcher    *watcher)
+{
+    hrt_thread_pool_push_idle(runner->invoke_threads, watcher);
+}
+
+/* RUN FROM ANY THREAD */
+static void
+core_push_mailbox(HrtCore    *core,
+                  HrtInvoker *invoker)
+{
+    hrt_lock_lock(core->mailbox_lock);
+    g_queue_push_tail(&core->mailbox, invoker);
+    hrt_lock_unlock(core->mailbox_lock);
+
+    /* If the core is draining already, it will get to this invoker
+     * before it goes back to its loop. That's the common case:
+     * a handler adding an immediate or finishing a subtask on the
+     * same core.
+     */
+    if (g_static_private_get(&current_core) == core &&
+        core->draining)
+        return;
+
+    _hrt_event_loop_wake_mailbox(core->event_loop);
+}
+
+static HrtInvoker*
+core_pop_mailbox(HrtCore *core)
+{
+    HrtInvoker *invoker;
+
+    hrt_lock_lock(core->mailbox_lock);
+    invoker = g_queue_pop_head(&core->mailbox);
+    hrt_lock_unlock(core->mailbox_lock);
+
+    return invoker;
+}
+
+/* IN CORE THREAD, with no loop locks held */
+static void
+core_drain_mailbox(void *data)
+{
+    HrtCore *core = data;
+    HrtInvoker *invoker;
+
+    core->draining = TRUE;
+
+    while ((invoker = core_pop_mailbox(core)) != NULL) {
+        run_invoker(core->runner, core->thread_local, invoker);
+    }
+
+    core->draining = FALSE;
+}
+
+static void*
+core_thread(void *data)
+{
+    HrtCore *core = data;
+
+    g_static_private_set(&current_core, core, NULL);
+
+    if (core->runner->watchdog != NULL)
+        _hrt_task_thread_local_set_watchdog_slot(core->thread_local,
+                                                 _hrt_watchdog_add_thread(core->runner->watchdog));
+
+    _hrt_event_loop_run(core->event_loop);
+
+    /* anything queued while we were quitting */
+    core_drain_mailbox(core);
+
+    /* the final sweep happens in the disposing thread */
+    thread_local_unwatch(core->runner, core->thread_local);
+
+    g_static_private_set(&current_core, NULL, NULL);
+
+    return NULL;
+}
+
+static void
+start_cores(HrtTaskRunner *runner)
+{
+    int i;
+
+    runner->cores = g_new0(HrtCore, runner->n_cores);
+
+    for (i = 0; i < runner->n_cores; ++i) {
+        HrtCore *core = &runner->cores[i];
+        GError *error;
+
+        core->runner = runner;
+        core->thread_local = _hrt_task_thread_local_new();
+        core->mailbox_lock = hrt_lock_new("hrt-task-runner.mailbox_lock");
+        g_queue_init(&core->mailbox);
+
+        if (i == 0)
+            core->event_loop = g_object_ref(runner->event_loop);
+        else
+            core->event_loop = _hrt_event_loop_new(runner->event_loop_type);
+
+        _hrt_event_loop_set_mailbox(core->event_loop,
+                                    core_drain_mailbox, core);
+
+        error = NULL;
+        core->thread =
+            g_thread_create(core_thread, core,
+                            TRUE, &error);
+        if (error != NULL) {
+            g_error("create thread: %s", error->message);
+        }
+    }
+
+    for (i = 0; i < runner->n_cores; ++i) {
+        _hrt_event_loop_wait_running(runner->cores[i].event_loop, TRUE);
+    }
+}
+
+static void
+shutdown_cores(HrtTaskRunner *runner)
+{
+    gboolean drained;
+    int i;
+
+    for (i = 0; i < runner->n_cores; ++i) {
+        HrtCore *core = &runner->cores[i];
+
+        _hrt_event_loop_wait_running(core->event_loop, TRUE);
+        _hrt_event_loop_quit(core->event_loop);
+        _hrt_event_loop_wait_running(core->event_loop, FALSE);
+    }
+
+    for (i = 0; i < runner->n_cores; ++i) {
+        g_thread_join(runner->cores[i].thread);
+        runner->cores[i].thread = NULL;
+    }
+
+    /* A core can queue to another after that one's thread has
+     * exited, so sweep up here until everything is empty; this
+     * is the same as the invoke pool running its leftover items
+     * on shutdown.
+     */
+    do {
+        drained = FALSE;
+        for (i = 0; i < runner->n_cores; ++i) {
+            HrtCore *core = &runner->cores[i];
+            HrtInvoker *invoker;
+
+            while ((invoker = core_pop_mailbox(core)) != NULL) {
+                run_invoker(runner, core->thread_local, invoker);
+                drained = TRUE;
+            }
+        }
+    } while (drained);
+
+    for (i = 0; i < runner->n_cores; ++i) {
+        HrtCore *core = &runner->cores[i];
+
+        g_object_unref(core->event_loop);
+        _hrt_task_thread_local_free(core->thread_local);
+        hrt_lock_free(core->mailbox_lock);
+    }
+
+    g_free(runner->cores);
+    runner->cores = NULL;
+
+    /* was cores[0]'s */
+    g_object_unref(runner->event_loop);
+    runner->event_loop = NULL;
+}
+
+/* IN WATCHDOG THREAD, once per stalled handler */
+static void
+on_stall(void *data)
+{
+    HrtTaskRunner *runner = HRT_TASK_RUNNER(data);
+
+    /* there's no pool to grow in cores mode */
+    if (runner->invoke_threads != NULL &&
+        runner->stall_extra_threads > 0 &&
+        hrt_thread_pool_add_thread(runner->invoke_threads)) {
+        hrt_message("Added an invoke thread because of the stall");
+    }
+}
+
 static void*
 task_runner_event_thread(void *data)
 {
@@ -807,7 +1978,14 @@ hrt_task_runner_init(HrtTaskRunner *runner)
 
     g_queue_init(&runner->completed_tasks);
     g_queue_init(&runner->unlocked_completed_tasks);
-    runner->completed_tasks_lock = g_mutex_new();
+    runner->completed_tasks_lock = hrt_lock_new("hrt-task-runner.completed_tasks_lock");
+
+    runner->load_lock = hrt_lock_new("hrt-task-runner.load_lock");
+    runner->concurrency_limit = INITIAL_CONCURRENCY_LIMIT;
+    runner->load_interval_min_delay = G_MAXINT64;
+
+    runner->blocking_lock = hrt_lock_new("hrt-task-runner.blocking_lock");
+    runner->n_parallel_threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
 }
 
 static GObject*
@@ -833,11 +2011,25 @@ hrt_task_runner_constructor(GType                  type,
     runner->runner_context =
         g_main_context_get_thread_default();
 
+    /* load_timeout is added by start_load_timeout() once there's work */
+
+    if (runner->stall_threshold > 0) {
+        runner->watchdog = _hrt_watchdog_new(runner->stall_threshold,
+                                             on_stall, runner);
+    }
+
+    if (runner->n_cores > 0) {
+        start_cores(runner);
+        return object;
+    }
+
     error = NULL;
     runner->invoke_threads =
-        hrt_thread_pool_new(&invoke_pool_vtable,
-                            runner,
-                            NULL);
+        hrt_thread_pool_new_elastic(&invoke_pool_vtable,
+                                    runner,
+                                    NULL,
+                                    DEFAULT_INVOKE_THREADS,
+                                    DEFAULT_INVOKE_THREADS + runner->stall_extra_threads);
 
     error = NULL;
     runner->event_thread =
@@ -880,6 +2072,74 @@ hrt_task_runner_class_init(HrtTaskRunnerClass *klass)
                                                       G_PARAM_WRITABLE |
                                                       G_PARAM_CONSTRUCT_ONLY));
 
+    g_object_class_install_property(object_class,
+                                    PROP_COMPLETE_IN_INVOKE_THREAD,
+                                    g_param_spec_boolean("complete-in-invoke-thread",
+                                                         "Complete in invoke thread",
+                                                         "Complete tasks in the thread that removes their last watcher, rather than the main thread",
+                                                         FALSE,
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property(object_class,
+                                    PROP_EMIT_TASKS_COMPLETED,
+                                    g_param_spec_boolean("emit-tasks-completed",
+                                                         "Emit tasks-completed",
+                                                         "Whether to emit tasks-completed in the main thread when completing in invoke threads",
+                                                         TRUE,
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property(object_class,
+                                    PROP_BLOCKING_THREADS,
+                                    g_param_spec_int("blocking-threads",
+                                                     "Blocking threads",
+                                                     "Number of threads used for hrt_task_run_blocking()",
+                                                     1, G_MAXINT,
+                                                     DEFAULT_BLOCKING_THREADS,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property(object_class,
+                                    PROP_BLOCKING_QUEUE_LIMIT,
+                                    g_param_spec_int("blocking-queue-limit",
+                                                     "Blocking queue limit",
+                                                     "Max number of blocking jobs waiting for a thread before hrt_task_run_blocking() fails",
+                                                     1, G_MAXINT,
+                                                     DEFAULT_BLOCKING_QUEUE_LIMIT,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property(object_class,
+                                    PROP_CORES,
+                                    g_param_spec_int("cores",
+                                                     "Cores",
+                                                     "If nonzero, run this many event loops that each invoke their own tasks' handlers, instead of an event thread plus invoke thread pool",
+                                                     0, G_MAXINT,
+                                                     0,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property(object_class,
+                                    PROP_STALL_THRESHOLD,
+                                    g_param_spec_int("stall-threshold",
+                                                     "Stall threshold",
+                                                     "If nonzero, log the task and handler when a handler runs longer than this many milliseconds",
+                                                     0, G_MAXINT,
+                                                     0,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property(object_class,
+                                    PROP_STALL_EXTRA_THREADS,
+                                    g_param_spec_int("stall-extra-threads",
+                                                     "Stall extra threads",
+                                                     "Max number of invoke threads to add, one per stall, when stall-threshold is set",
+                                                     0, G_MAXINT,
+                                                     0,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+
     signals[TASKS_COMPLETED] =
         g_signal_new("tasks-completed",
                      G_OBJECT_CLASS_TYPE(klass),
@@ -48,9 +48,38 @@ typedef gboolean (* HrtWatcherCallback) (HrtTask        *task,
                                          HrtWatcherFlags flags,
                                          void           *data);
 
+/* Run in a blocking-work thread, see hrt_task_run_blocking() */
+typedef void     (* HrtBlockingFunc)    (void           *data);
+
 typedef struct HrtTaskRunner      HrtTaskRunner;
 typedef struct HrtTaskRunnerClass HrtTaskRunnerClass;
 
+typedef struct {
+    /* tasks not yet completed, and of those, the ones with work
+     * queued or running; only active_tasks counts against
+     * concurrency_limit
+     */
+    int    in_flight_tasks;
+    int    active_tasks;
+    int    concurrency_limit;
+    gint64 queue_delay_usec;
+    /* bytes charged with hrt_task_charge_memory() across all tasks,
+     * and how many charges were refused for a task's memory limit
+     */
+    gsize  memory_used;
+    guint  memory_limit_hits;
+} HrtTaskRunnerLoad;
+
+typedef struct {
+    int     n_threads;
+    int     queue_limit;
+    int     queued;
+    int     running;
+    guint   submitted;
+    guint   completed;
+    guint   rejected;
+} HrtTaskRunnerBlockingStats;
+
 #define HRT_TYPE_TASK_RUNNER              (hrt_task_runner_get_type ())
 #define HRT_TASK_RUNNER(object)           (G_TYPE_CHECK_INSTANCE_CAST ((object), HRT_TYPE_TASK_RUNNER, HrtTaskRunner))
 #define HRT_TASK_RUNNER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST ((klass), HRT_TYPE_TASK_RUNNER, HrtTaskRunnerClass))
@@ -62,6 +91,16 @@ GType           hrt_task_runner_get_type                  (void) G_GNUC_CONST;
 
 HrtTask*      hrt_task_runner_create_task     (HrtTaskRunner      *runner);
 HrtTask*      hrt_task_runner_pop_completed   (HrtTaskRunner      *runner);
+void          hrt_task_runner_get_load        (HrtTaskRunner      *runner,
+                                               HrtTaskRunnerLoad  *load);
+gboolean      hrt_task_runner_is_overloaded   (HrtTaskRunner      *runner);
+void          hrt_task_runner_get_blocking_stats (HrtTaskRunner              *runner,
+                                                  HrtTaskRunnerBlockingStats *stats);
+void          hrt_task_runner_get_affinity_stats (HrtTaskRunner              *runner,
+                                                  guint                      *hits_p,
+                                                  guint                      *misses_p);
+guint         hrt_task_runner_get_stall_count    (HrtTaskRunner              *runner);
+int           hrt_task_runner_get_n_invoke_threads (HrtTaskRunner            *runner);
 
 G_END_DECLS
 
@@ -41,6 +41,8 @@ thread_local_value_free(void *data)
 
 struct HrtTaskThreadLocal {
     GHashTable *hash;
+    /* NULL unless the runner has a watchdog */
+    HrtWatchdogSlot *watchdog_slot;
 };
 
 HrtTaskThreadLocal*
@@ -55,6 +57,7 @@ _hrt_task_thread_local_new(void)
                               g_direct_equal,
                               NULL,
                               thread_local_value_free);
+    thread_local->watchdog_slot = NULL;
 
     return thread_local;
 }
@@ -97,3 +100,16 @@ _hrt_task_thread_local_set(HrtTaskThreadLocal *thread_local,
                              key, tvalue);
     }
 }
+
+HrtWatchdogSlot*
+_hrt_task_thread_local_get_watchdog_slot(HrtTaskThreadLocal *thread_local)
+{
+    return thread_local->watchdog_slot;
+}
+
+void
+_hrt_task_thread_local_set_watchdog_slot(HrtTaskThreadLocal *thread_local,
+                                         HrtWatchdogSlot    *slot)
+{
+    thread_local->watchdog_slot = slot;
+}
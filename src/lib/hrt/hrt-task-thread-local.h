@@ -31,6 +31,7 @@
  */
 
 #include <glib-object.h>
+#include <hrt/hrt-watchdog.h>
 
 G_BEGIN_DECLS
 
@@ -44,6 +45,9 @@ void                _hrt_task_thread_local_set  (HrtTaskThreadLocal *thread_loca
                                                  void               *key,
                                                  void               *value,
                                                  GDestroyNotify      dnotify);
+HrtWatchdogSlot*    _hrt_task_thread_local_get_watchdog_slot (HrtTaskThreadLocal *thread_local);
+void                _hrt_task_thread_local_set_watchdog_slot (HrtTaskThreadLocal *thread_local,
+                                                              HrtWatchdogSlot    *slot);
 
 G_END_DECLS
 
@@ -24,6 +24,7 @@
 
 #include <hrt/hrt-task-private.h>
 
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-log.h>
 #include <hrt/hrt-watcher.h>
 #include <hrt/hrt-marshalers.h>
@@ -39,12 +40,39 @@ struct HrtTask {
     GObject      parent_instance;
     HrtTaskRunner *runner;
     volatile int watchers_count;
-    GMutex *invoker_lock;
+    HrtLock *invoker_lock;
     HrtInvoker *invoker;
     gboolean completed;
     GSList *args;
     GValue result;
     GSList *completed_notifiees;
+    /* parent, children, watchers, and posts are protected by invoker_lock */
+    HrtTask *parent;
+    GSList *children;
+    GSList *watchers;
+    HrtTaskPost *posts_head;
+    HrtTaskPost *posts_tail;
+    volatile int cancelled;
+    /* counted in the runner's in-flight tasks */
+    volatile int in_flight;
+    /* in g_get_monotonic_time() microseconds, or 0 for none. The
+     * timeout cancels us at the deadline, even if we're blocked on
+     * IO and never look; it holds a ref on us until it fires or we
+     * complete.
+     */
+    gint64 deadline;
+    GSource *deadline_source;
+    /* invoke pool worker that last ran us, or -1 */
+    volatile int affinity;
+    /* runner core we belong to, if the runner has cores; fixed at
+     * creation, children share their parent's
+     */
+    int core;
+    /* bytes charged to us or any descendant, and our limit on
+     * that (0 for none); see hrt_task_charge_memory()
+     */
+    volatile int memory_used;
+    volatile int memory_limit;
 #ifndef G_DISABLE_CHECKS
     GThread *invoke_thread;
 #endif
@@ -71,6 +99,10 @@ enum  {
 
 /* static guint signals[LAST_SIGNAL]; */
 
+static gboolean charge_memory (HrtTask  *task,
+                               int       bytes,
+                               gboolean  enforce);
+
 static void
 hrt_task_get_property (GObject                *object,
                        guint                   prop_id,
@@ -124,6 +156,9 @@ _hrt_task_get_runner(HrtTask *task)
     return task->runner;
 }
 
+/* The new task is a child of the parent; it inherits the parent's
+ * deadline, and is cancelled when the parent is cancelled.
+ */
 HrtTask*
 hrt_task_create_task(HrtTask *parent)
 {
@@ -133,6 +168,26 @@ hrt_task_create_task(HrtTask *parent)
 
     _hrt_task_set_runner(task, parent->runner);
 
+    /* the child keeps the parent alive, the parent only has
+     * a weak list of children which remove themselves on finalize.
+     */
+    task->parent = parent;
+    g_object_ref(parent);
+
+    task->core = parent->core;
+
+    hrt_lock_lock(parent->invoker_lock);
+    parent->children = g_slist_prepend(parent->children, task);
+    task->deadline = parent->deadline;
+    task->cancelled = g_atomic_int_get(&parent->cancelled);
+    hrt_lock_unlock(parent->invoker_lock);
+
+    /* our own timeout, since the parent may complete before us */
+    if (task->deadline != 0 && !task->cancelled) {
+        task->deadline_source =
+            _hrt_task_runner_add_deadline(task->runner, task, task->deadline);
+    }
+
     return task;
 }
 
@@ -153,6 +208,19 @@ hrt_task_arg_new(const char   *name,
     return arg;
 }
 
+static gsize
+hrt_task_arg_size(HrtTaskArg *arg)
+{
+    gsize size;
+
+    size = sizeof(HrtTaskArg) + strlen(arg->name) + 1;
+    if (G_VALUE_HOLDS_STRING(&arg->value) &&
+        g_value_get_string(&arg->value) != NULL)
+        size += strlen(g_value_get_string(&arg->value)) + 1;
+
+    return size;
+}
+
 static void
 hrt_task_arg_free(HrtTaskArg *arg)
 {
@@ -198,6 +266,11 @@ hrt_task_add_arg(HrtTask       *task,
 
     arg = hrt_task_arg_new(name, value);
     task->args = g_slist_prepend(task->args, arg);
+
+    /* args are set up front by the creator of the task so aren't
+     * subject to the limit, but they count toward it.
+     */
+    charge_memory(task, hrt_task_arg_size(arg), FALSE);
 }
 
 gboolean
@@ -351,11 +424,338 @@ hrt_task_unblock_completion(HrtTask *task)
     g_atomic_int_add(&task->watchers_count, -1);
 
     /* if that was our last watcher we now have to nominate
-     * ourselves to be completed in main thread.
+     * ourselves to be completed.
      */
     if (!_hrt_task_has_watchers(task)) {
-        _hrt_task_runner_queue_completed_task(task->runner, task);
+        _hrt_task_runner_task_done(task->runner, task);
+    }
+}
+
+
+/* called with task's invoker lock held; cascades down the tree of
+ * children, always locking parent before child.
+ */
+static void
+cancel_unlocked(HrtTask *task)
+{
+    GSList *tmp;
+
+    if (g_atomic_int_get(&task->cancelled))
+        return;
+
+    g_atomic_int_set(&task->cancelled, 1);
+
+    /* If there's an invoker, it will notice the cancellation before
+     * it goes away and remove the task's watchers. Otherwise we
+     * have to get into the task thread to remove them.
+     */
+    if (task->invoker == NULL &&
+        _hrt_task_has_watchers(task)) {
+        _hrt_task_runner_queue_task(task->runner, task);
+    }
+
+    for (tmp = task->children; tmp != NULL; tmp = tmp->next) {
+        HrtTask *child = tmp->data;
+
+        hrt_lock_lock(child->invoker_lock);
+        cancel_unlocked(child);
+        hrt_lock_unlock(child->invoker_lock);
+    }
+}
+
+/* RUN FROM ANY THREAD
+ *
+ * Cancelling a task cancels all its children (tasks created with
+ * hrt_task_create_task() on it), recursively. The task's watchers
+ * are removed (dnotify still runs) and no further watcher callbacks
+ * are invoked, so the task completes as soon as possible. Code that
+ * is already running in the task should poll hrt_task_is_cancelled()
+ * if it does a lot of work.
+ */
+void
+hrt_task_cancel(HrtTask *task)
+{
+    hrt_lock_lock(task->invoker_lock);
+    cancel_unlocked(task);
+    hrt_lock_unlock(task->invoker_lock);
+}
+
+/* RUN FROM ANY THREAD
+ *
+ * Cancels the children of the task (and thus their children), but
+ * not the task itself.
+ */
+void
+hrt_task_cancel_children(HrtTask *task)
+{
+    GSList *tmp;
+
+    hrt_lock_lock(task->invoker_lock);
+    for (tmp = task->children; tmp != NULL; tmp = tmp->next) {
+        HrtTask *child = tmp->data;
+
+        hrt_lock_lock(child->invoker_lock);
+        cancel_unlocked(child);
+        hrt_lock_unlock(child->invoker_lock);
+    }
+    hrt_lock_unlock(task->invoker_lock);
+}
+
+/* This is meant to be cheap enough to call often from a long-running
+ * watcher callback. A task past its deadline is cancelled by a
+ * timeout, but a callback that's still running may notice first.
+ */
+gboolean
+hrt_task_is_cancelled(HrtTask *task)
+{
+    if (g_atomic_int_get(&task->cancelled))
+        return TRUE;
+
+    if (task->deadline != 0 &&
+        g_get_monotonic_time() >= task->deadline) {
+        hrt_debug("Task %p is past its deadline, cancelling", task);
+        hrt_task_cancel(task);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* The deadline is in microseconds on the g_get_monotonic_time()
+ * clock, so stepping the wall clock doesn't move it. At the deadline
+ * the task is cancelled, whether or not it's running.
+ *
+ * Like args, the deadline should be set before adding watchers or
+ * creating subtasks; subtasks get the deadline the parent had when
+ * they were created. A deadline can be made earlier but not later, so a
+ * subtask can't outlive its parent's deadline.
+ */
+void
+hrt_task_set_deadline(HrtTask *task,
+                      gint64   deadline)
+{
+    GSource *old_source;
+
+    g_return_if_fail(deadline > 0);
+
+    old_source = NULL;
+
+    hrt_lock_lock(task->invoker_lock);
+    if (!task->completed &&
+        (task->deadline == 0 || deadline < task->deadline)) {
+        task->deadline = deadline;
+
+        old_source = task->deadline_source;
+        task->deadline_source =
+            _hrt_task_runner_add_deadline(task->runner, task, deadline);
+    }
+    hrt_lock_unlock(task->invoker_lock);
+
+    if (old_source != NULL) {
+        g_source_destroy(old_source);
+        g_source_unref(old_source);
+    }
+}
+
+gboolean
+hrt_task_get_deadline(HrtTask *task,
+                      gint64  *deadline_p)
+{
+    gint64 deadline;
+
+    hrt_lock_lock(task->invoker_lock);
+    deadline = task->deadline;
+    hrt_lock_unlock(task->invoker_lock);
+
+    if (deadline == 0)
+        return FALSE;
+
+    *deadline_p = deadline;
+
+    return TRUE;
+}
+
+/* Adds bytes to the task and each of its ancestors. If enforce, and
+ * that would put any of them over its limit, nothing is charged and
+ * the task with the limit is cancelled (which cancels its
+ * descendants).
+ */
+static gboolean
+charge_memory(HrtTask  *task,
+              int       bytes,
+              gboolean  enforce)
+{
+    HrtTask *t;
+    HrtTask *over_limit;
+
+    over_limit = NULL;
+    for (t = task; t != NULL; t = t->parent) {
+        int used;
+        int limit;
+
+        used = g_atomic_int_exchange_and_add(&t->memory_used, bytes) + bytes;
+        limit = g_atomic_int_get(&t->memory_limit);
+
+        if (enforce && limit > 0 && used > limit) {
+            over_limit = t;
+            break;
+        }
+    }
+
+    if (over_limit != NULL) {
+        for (t = task; t != over_limit->parent; t = t->parent) {
+            g_atomic_int_add(&t->memory_used, -bytes);
+        }
+
+        hrt_debug("Task %p over its memory limit of %d bytes, cancelling",
+                  over_limit, g_atomic_int_get(&over_limit->memory_limit));
+
+        _hrt_task_runner_memory_limit_hit(task->runner);
+        hrt_task_cancel(over_limit);
+
+        return FALSE;
+    }
+
+    _hrt_task_runner_memory_changed(task->runner, bytes);
+
+    return TRUE;
+}
+
+/* RUN FROM ANY THREAD
+ *
+ * Accounts for memory held on behalf of the task, such as queued
+ * output or parse state. The bytes count toward this task and all
+ * its ancestors. If that puts any of them over its memory limit,
+ * returns FALSE without charging anything and cancels the task whose
+ * limit was hit; the caller should then not allocate or keep the
+ * memory. Every successful charge must eventually be matched by
+ * hrt_task_uncharge_memory() on the same task.
+ */
+gboolean
+hrt_task_charge_memory(HrtTask *task,
+                       gsize    bytes)
+{
+    g_return_val_if_fail(bytes <= G_MAXINT, FALSE);
+
+    if (bytes == 0)
+        return TRUE;
+
+    return charge_memory(task, bytes, TRUE);
+}
+
+/* RUN FROM ANY THREAD */
+void
+hrt_task_uncharge_memory(HrtTask *task,
+                         gsize    bytes)
+{
+    g_return_if_fail(bytes <= G_MAXINT);
+
+    if (bytes == 0)
+        return;
+
+    charge_memory(task, - (int) bytes, FALSE);
+}
+
+/* Limits memory charged to the task and its descendants together; 0
+ * means no limit. Lowering the limit below what's already charged
+ * doesn't cancel anything until the next charge.
+ */
+void
+hrt_task_set_memory_limit(HrtTask *task,
+                          gsize    limit_bytes)
+{
+    g_return_if_fail(limit_bytes <= G_MAXINT);
+
+    g_atomic_int_set(&task->memory_limit, limit_bytes);
+}
+
+gsize
+hrt_task_get_memory_limit(HrtTask *task)
+{
+    return g_atomic_int_get(&task->memory_limit);
+}
+
+/* Bytes currently charged to the task and its descendants */
+gsize
+hrt_task_get_memory_used(HrtTask *task)
+{
+    return g_atomic_int_get(&task->memory_used);
+}
+
+/* RUN FROM ANY THREAD
+ *
+ * A lighter-weight hrt_task_add_immediate(): func runs once in the
+ * task thread, serialized with the task's watchers, but nothing is
+ * allocated. The post node belongs to the caller and is usually
+ * embedded in the object func will work on (see
+ * HRT_TASK_POST_CONTAINER()). A post can't be removed, has no
+ * dnotify, and runs even if the task is cancelled.
+ *
+ * If the node is already queued this does nothing and returns FALSE,
+ * so several posts of the same node before it runs collapse into one
+ * call. The node is unqueued just before func is called, so func may
+ * post it again, or free it.
+ *
+ * Like adding a watcher, a pending post keeps the task from
+ * completing, and it's an error to post to a completed task.
+ */
+gboolean
+hrt_task_post(HrtTask         *task,
+              HrtTaskPost     *post,
+              HrtTaskPostFunc  func)
+{
+    if (!g_atomic_int_compare_and_exchange(&post->queued, 0, 1))
+        return FALSE;
+
+    post->func = func;
+    post->next = NULL;
+
+    /* dropped by the invoker after running the post */
+    _hrt_task_watchers_inc(task);
+
+    hrt_lock_lock(task->invoker_lock);
+
+    if (task->posts_tail != NULL)
+        task->posts_tail->next = post;
+    else
+        task->posts_head = post;
+    task->posts_tail = post;
+
+    /* an existing invoker checks for posts before it goes away */
+    if (task->invoker == NULL)
+        _hrt_task_runner_queue_task(task->runner, task);
+
+    hrt_lock_unlock(task->invoker_lock);
+
+    return TRUE;
+}
+
+/* IN TASK THREAD */
+HrtTaskPost*
+_hrt_task_pop_post(HrtTask *task)
+{
+    HrtTaskPost *post;
+
+    hrt_lock_lock(task->invoker_lock);
+
+    post = task->posts_head;
+    if (post != NULL) {
+        task->posts_head = post->next;
+        if (task->posts_head == NULL)
+            task->posts_tail = NULL;
+        post->next = NULL;
     }
+
+    hrt_lock_unlock(task->invoker_lock);
+
+    return post;
+}
+
+/* Called with invoker lock held */
+gboolean
+_hrt_task_has_posts_unlocked(HrtTask *task)
+{
+    return task->posts_head != NULL;
 }
 
 HrtWatcher*
@@ -384,6 +784,24 @@ hrt_task_add_idle(HrtTask              *task,
                                      dnotify);
 }
 
+/* callback runs after interval_msec, and again after another
+ * interval_msec each time it returns TRUE.
+ */
+HrtWatcher*
+hrt_task_add_timeout(HrtTask              *task,
+                     guint                 interval_msec,
+                     HrtWatcherCallback    callback,
+                     void                 *data,
+                     GDestroyNotify        dnotify)
+{
+    return _hrt_task_runner_add_timeout(task->runner,
+                                        task,
+                                        interval_msec,
+                                        callback,
+                                        data,
+                                        dnotify);
+}
+
 HrtWatcher*
 hrt_task_add_io(HrtTask              *task,
                 int                   fd,
@@ -416,6 +834,34 @@ hrt_task_add_subtask(HrtTask              *task,
                                         dnotify);
 }
 
+/* Runs blocking_func(data) in the runner's blocking-work thread pool,
+ * which is separate from the threads that invoke watchers, then
+ * invokes done_callback(task, flags, data) in the task like any other
+ * watcher. If done_callback returns TRUE, blocking_func runs
+ * again. dnotify runs once the watcher is removed and blocking_func
+ * has returned.
+ *
+ * Returns NULL if the blocking pool's queue is full; in that case
+ * nothing is called and the caller still owns data. A rerun asked
+ * for by returning TRUE is held to the same limit; if the queue is
+ * full then, the watcher is removed as though done_callback had
+ * returned FALSE.
+ */
+HrtWatcher*
+hrt_task_run_blocking(HrtTask              *task,
+                      HrtBlockingFunc       blocking_func,
+                      HrtWatcherCallback    done_callback,
+                      void                 *data,
+                      GDestroyNotify        dnotify)
+{
+    return _hrt_task_runner_add_blocking(task->runner,
+                                         task,
+                                         blocking_func,
+                                         done_callback,
+                                         data,
+                                         dnotify);
+}
+
 gboolean
 hrt_task_check_in_task_thread(HrtTask *task)
 {
@@ -442,6 +888,7 @@ hrt_task_dispose(GObject *object)
         hrt_task_arg_free(arg);
     }
     g_slist_free(hrt_task->args);
+    hrt_task->args = NULL;
 
     if (G_VALUE_TYPE(&hrt_task->result) != 0) {
         g_value_unset(&hrt_task->result);
@@ -459,8 +906,37 @@ hrt_task_finalize(GObject *object)
 
     g_assert(hrt_task->invoker == NULL);
     g_assert(hrt_task->completed_notifiees == NULL);
+    g_assert(hrt_task->watchers == NULL);
+
+    /* the timeout refs us until it's destroyed, so it already is */
+    if (hrt_task->deadline_source != NULL) {
+        g_source_unref(hrt_task->deadline_source);
+        hrt_task->deadline_source = NULL;
+    }
+
+    /* children ref us, so are gone and have taken their charges
+     * with them; anything left (at least the args) was charged to
+     * us and has to come off our ancestors too.
+     */
+    if (hrt_task->memory_used != 0) {
+        charge_memory(hrt_task, - hrt_task->memory_used, FALSE);
+    }
+
+    if (hrt_task->parent != NULL) {
+        HrtTask *parent = hrt_task->parent;
+
+        hrt_lock_lock(parent->invoker_lock);
+        parent->children = g_slist_remove(parent->children, hrt_task);
+        hrt_lock_unlock(parent->invoker_lock);
+
+        hrt_task->parent = NULL;
+        g_object_unref(parent);
+    }
+
+    /* children ref us, so they must be gone */
+    g_assert(hrt_task->children == NULL);
 
-    g_mutex_free(hrt_task->invoker_lock);
+    hrt_lock_free(hrt_task->invoker_lock);
 
     G_OBJECT_CLASS(hrt_task_parent_class)->finalize(object);
 }
@@ -468,13 +944,13 @@ hrt_task_finalize(GObject *object)
 void
 _hrt_task_lock_invoker(HrtTask *task)
 {
-    g_mutex_lock(task->invoker_lock);
+    hrt_lock_lock(task->invoker_lock);
 }
 
 void
 _hrt_task_unlock_invoker(HrtTask *task)
 {
-    g_mutex_unlock(task->invoker_lock);
+    hrt_lock_unlock(task->invoker_lock);
 }
 
 HrtInvoker*
@@ -492,17 +968,30 @@ _hrt_task_set_invoker(HrtTask       *task,
 
 void
 _hrt_task_enter_invoke(HrtTask            *task,
-                       HrtTaskThreadLocal *thread_local)
+                       HrtTaskThreadLocal *thread_local,
+                       void               *callback)
 {
+    HrtWatchdogSlot *slot;
+
 #ifndef G_DISABLE_CHECKS
     task->invoke_thread = g_thread_self();
 #endif
     task->thread_local = thread_local;
+
+    slot = _hrt_task_thread_local_get_watchdog_slot(thread_local);
+    if (slot != NULL)
+        _HRT_WATCHDOG_SLOT_ENTER(slot, task, callback);
 }
 
 void
 _hrt_task_leave_invoke(HrtTask *task)
 {
+    HrtWatchdogSlot *slot;
+
+    slot = _hrt_task_thread_local_get_watchdog_slot(task->thread_local);
+    if (slot != NULL)
+        _HRT_WATCHDOG_SLOT_LEAVE(slot);
+
 #ifndef G_DISABLE_CHECKS
     task->invoke_thread = NULL;
 #endif
@@ -514,7 +1003,11 @@ _hrt_task_watchers_inc(HrtTask *task)
 {
     g_assert(!_hrt_task_is_completed(task));
 
-    g_atomic_int_inc(&task->watchers_count);
+    /* the first watcher puts us in flight, until completion */
+    if (g_atomic_int_exchange_and_add(&task->watchers_count, 1) == 0 &&
+        g_atomic_int_compare_and_exchange(&task->in_flight, 0, 1)) {
+        _hrt_task_runner_task_started(task->runner);
+    }
 }
 
 void
@@ -538,34 +1031,77 @@ _hrt_task_has_watchers(HrtTask *task)
  * completed notifies while holding the invoker lock.
  */
 #define LOCK_COMPLETED_NOTIFIEES(task)          \
-    g_mutex_lock((task)->invoker_lock)
+    hrt_lock_lock((task)->invoker_lock)
 #define UNLOCK_COMPLETED_NOTIFIEES(task)        \
-    g_mutex_unlock((task)->invoker_lock)
+    hrt_lock_unlock((task)->invoker_lock)
 
-/* RUN IN MAIN THREAD */
-void
-_hrt_task_mark_completed(HrtTask *task)
+/* Called with the invoker lock (which is also the completed
+ * notifiees lock) held. Returns FALSE if already completed.
+ * Once completed is set, no more notifiees can be added, so
+ * the caller must then call _hrt_task_notify_completed() after
+ * dropping the lock.
+ */
+gboolean
+_hrt_task_mark_completed_unlocked(HrtTask *task)
 {
     g_assert(g_atomic_int_get(&task->watchers_count) == 0);
     g_assert(task->invoker == NULL);
 
-    if (!task->completed) {
-        task->completed = TRUE;
+    if (task->completed)
+        return FALSE;
 
-        LOCK_COMPLETED_NOTIFIEES(task);
-        while (task->completed_notifiees != NULL) {
-            HrtWatcher *notifiee = task->completed_notifiees->data;
+    task->completed = TRUE;
 
-            task->completed_notifiees =
-                g_slist_remove(task->completed_notifiees,
-                               task->completed_notifiees->data);
+    /* Drops the timeout's ref on us; the caller holds one too, so
+     * this can't finalize us with the lock held.
+     */
+    if (task->deadline_source != NULL) {
+        g_source_destroy(task->deadline_source);
+        g_source_unref(task->deadline_source);
+        task->deadline_source = NULL;
+    }
+
+    if (g_atomic_int_get(&task->in_flight)) {
+        g_atomic_int_set(&task->in_flight, 0);
+        _hrt_task_runner_task_finished(task->runner);
+    }
+
+    return TRUE;
+}
+
+/* Called without the lock held, after marking completed */
+void
+_hrt_task_notify_completed(HrtTask *task)
+{
+    g_assert(task->completed);
+
+    LOCK_COMPLETED_NOTIFIEES(task);
+    while (task->completed_notifiees != NULL) {
+        HrtWatcher *notifiee = task->completed_notifiees->data;
+
+        task->completed_notifiees =
+            g_slist_remove(task->completed_notifiees,
+                           task->completed_notifiees->data);
 
-            UNLOCK_COMPLETED_NOTIFIEES(task);
-            _hrt_watcher_subtask_notify(notifiee);
-            LOCK_COMPLETED_NOTIFIEES(task);
-        }
         UNLOCK_COMPLETED_NOTIFIEES(task);
+        _hrt_watcher_subtask_notify(notifiee);
+        LOCK_COMPLETED_NOTIFIEES(task);
     }
+    UNLOCK_COMPLETED_NOTIFIEES(task);
+}
+
+/* RUN IN MAIN THREAD (unless the runner completes in invoke threads) */
+void
+_hrt_task_mark_completed(HrtTask *task)
+{
+    gboolean newly_completed;
+
+    LOCK_COMPLETED_NOTIFIEES(task);
+    newly_completed = _hrt_task_mark_completed_unlocked(task);
+    UNLOCK_COMPLETED_NOTIFIEES(task);
+
+    if (newly_completed)
+        _hrt_task_notify_completed(task);
 }
 
 gboolean
@@ -574,19 +1110,32 @@ _hrt_task_is_completed(HrtTask *task)
     return task->completed;
 }
 
-/* RUN FROM ANY THREAD */
-void
+/* RUN FROM ANY THREAD
+ *
+ * Returns FALSE if the task is already completed, in which case
+ * there will be no notification.
+ */
+gboolean
 _hrt_task_add_completed_notify(HrtTask    *task,
                                HrtWatcher *subtask_watcher)
 {
+    gboolean added;
+
     LOCK_COMPLETED_NOTIFIEES(task);
-    /* subtask_watcher will have a pointer to task and
-     * remove itself on finalize, so this is a weak ref
-     */
-    task->completed_notifiees =
-        g_slist_prepend(task->completed_notifiees,
-                        subtask_watcher);
+    if (task->completed) {
+        added = FALSE;
+    } else {
+        /* subtask_watcher will have a pointer to task and
+         * remove itself on finalize, so this is a weak ref
+         */
+        task->completed_notifiees =
+            g_slist_prepend(task->completed_notifiees,
+                            subtask_watcher);
+        added = TRUE;
+    }
     UNLOCK_COMPLETED_NOTIFIEES(task);
+
+    return added;
 }
 
 /* RUN FROM ANY THREAD */
@@ -601,10 +1150,133 @@ _hrt_task_remove_completed_notify(HrtTask    *task,
     UNLOCK_COMPLETED_NOTIFIEES(task);
 }
 
+/* RUN FROM ANY THREAD, after starting the watcher.
+ *
+ * We keep a list of the task's live watchers so that cancellation
+ * can remove them.  The watcher may already have been invoked and
+ * removed by the time we get here, in which case we skip it.
+ */
+void
+_hrt_task_add_watcher(HrtTask    *task,
+                      HrtWatcher *watcher)
+{
+    hrt_lock_lock(task->invoker_lock);
+    if (g_atomic_int_get(&watcher->removed) == 0) {
+        task->watchers = g_slist_prepend(task->watchers, watcher);
+
+        /* watcher added to an already-cancelled task that has no
+         * invoker to clean it up
+         */
+        if (g_atomic_int_get(&task->cancelled) &&
+            task->invoker == NULL) {
+            _hrt_task_runner_queue_task(task->runner, task);
+        }
+    }
+    hrt_lock_unlock(task->invoker_lock);
+}
+
+/* IN TASK THREAD, when the watcher is detached */
+void
+_hrt_task_remove_watcher(HrtTask    *task,
+                         HrtWatcher *watcher)
+{
+    hrt_lock_lock(task->invoker_lock);
+    task->watchers = g_slist_remove(task->watchers, watcher);
+    hrt_lock_unlock(task->invoker_lock);
+}
+
+/* Called with invoker lock held */
+gboolean
+_hrt_task_has_live_watchers_unlocked(HrtTask *task)
+{
+    GSList *tmp;
+
+    for (tmp = task->watchers; tmp != NULL; tmp = tmp->next) {
+        HrtWatcher *watcher = tmp->data;
+        if (g_atomic_int_get(&watcher->removed) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* IN TASK THREAD. Returns number of watchers removed. */
+int
+_hrt_task_remove_all_watchers(HrtTask *task)
+{
+    GSList *watchers;
+    GSList *tmp;
+    int count;
+
+    /* watchers can only be detached (removed from the list) in the
+     * task thread, which we're in, but they can be added from other
+     * threads, so copy the list.
+     */
+    hrt_lock_lock(task->invoker_lock);
+    watchers = g_slist_copy(task->watchers);
+    for (tmp = watchers; tmp != NULL; tmp = tmp->next) {
+        _hrt_watcher_ref(tmp->data);
+    }
+    hrt_lock_unlock(task->invoker_lock);
+
+    count = 0;
+    for (tmp = watchers; tmp != NULL; tmp = tmp->next) {
+        HrtWatcher *watcher = tmp->data;
+
+        if (_hrt_watcher_try_remove(watcher))
+            count += 1;
+
+        _hrt_watcher_unref(watcher);
+    }
+    g_slist_free(watchers);
+
+    return count;
+}
+
+/* Unlike hrt_task_is_cancelled() this doesn't check the deadline,
+ * so it's safe to call with the invoker lock held.
+ */
+gboolean
+_hrt_task_get_cancelled(HrtTask *task)
+{
+    return g_atomic_int_get(&task->cancelled) != 0;
+}
+
+/* FROM ANY THREAD, only a hint so no locking */
+int
+_hrt_task_get_affinity(HrtTask *task)
+{
+    return g_atomic_int_get(&task->affinity);
+}
+
+/* IN TASK THREAD */
+void
+_hrt_task_set_affinity(HrtTask *task,
+                       int      worker)
+{
+    g_atomic_int_set(&task->affinity, worker);
+}
+
+/* FROM ANY THREAD, never changes after the task is created */
+int
+_hrt_task_get_core(HrtTask *task)
+{
+    return task->core;
+}
+
+/* only when creating the task */
+void
+_hrt_task_set_core(HrtTask *task,
+                   int      core)
+{
+    task->core = core;
+}
+
 static void
 hrt_task_init(HrtTask *hrt_task)
 {
-    hrt_task->invoker_lock = g_mutex_new();
+    hrt_task->invoker_lock = hrt_lock_new("hrt-task.invoker_lock");
+    hrt_task->affinity = -1;
 }
 
 static void
@@ -33,6 +33,7 @@
  */
 
 #include <glib-object.h>
+#include <hrt/hrt-buffer.h>
 #include <hrt/hrt-task-runner.h>
 #include <hrt/hrt-watcher.h>
 
@@ -51,6 +52,32 @@ G_BEGIN_DECLS
 /* struct HrtTask forward-declared in task runner */
 typedef struct HrtTaskClass HrtTaskClass;
 
+/* Result of hrt_task_add_file_read() or hrt_task_add_file_write(),
+ * error_code is 0 or an errno value. Ref the buffer to keep it.
+ */
+typedef void (* HrtFileCallback) (HrtTask   *task,
+                                  HrtBuffer *buffer,
+                                  int        error_code,
+                                  void      *data);
+
+/* A closure node for hrt_task_post(), embedded in some struct of the
+ * caller's and zero-filled before first use. The fields are private.
+ */
+typedef struct HrtTaskPost HrtTaskPost;
+
+typedef void (* HrtTaskPostFunc) (HrtTask     *task,
+                                  HrtTaskPost *post);
+
+struct HrtTaskPost {
+    HrtTaskPost *next;
+    HrtTaskPostFunc func;
+    volatile int queued;
+};
+
+/* Get the struct a post is embedded in, from inside the post func */
+#define HRT_TASK_POST_CONTAINER(post, type, member)                     \
+    ((type*) (((char*) (post)) - G_STRUCT_OFFSET(type, member)))
+
 #define HRT_TYPE_TASK              (hrt_task_get_type ())
 #define HRT_TASK(object)           (G_TYPE_CHECK_INSTANCE_CAST ((object), HRT_TYPE_TASK, HrtTask))
 #define HRT_TASK_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST ((klass), HRT_TYPE_TASK, HrtTaskClass))
@@ -82,8 +109,26 @@ void           hrt_task_set_thread_local   (HrtTask              *task,
                                             void                 *key,
                                             void                 *value,
                                             GDestroyNotify        dnotify);
+void           hrt_task_cancel             (HrtTask              *task);
+void           hrt_task_cancel_children    (HrtTask              *task);
+gboolean       hrt_task_is_cancelled       (HrtTask              *task);
+void           hrt_task_set_deadline       (HrtTask              *task,
+                                            gint64                deadline);
+gboolean       hrt_task_get_deadline       (HrtTask              *task,
+                                            gint64               *deadline_p);
+void           hrt_task_set_memory_limit   (HrtTask              *task,
+                                            gsize                 limit_bytes);
+gsize          hrt_task_get_memory_limit   (HrtTask              *task);
+gsize          hrt_task_get_memory_used    (HrtTask              *task);
+gboolean       hrt_task_charge_memory      (HrtTask              *task,
+                                            gsize                 bytes);
+void           hrt_task_uncharge_memory    (HrtTask              *task,
+                                            gsize                 bytes);
 void           hrt_task_block_completion   (HrtTask              *task);
 void           hrt_task_unblock_completion (HrtTask              *task);
+gboolean       hrt_task_post               (HrtTask              *task,
+                                            HrtTaskPost          *post,
+                                            HrtTaskPostFunc       func);
 HrtWatcher*    hrt_task_add_immediate      (HrtTask              *task,
                                             HrtWatcherCallback    callback,
                                             void                 *data,
@@ -92,6 +137,11 @@ HrtWatcher*    hrt_task_add_idle           (HrtTask              *task,
                                             HrtWatcherCallback    callback,
                                             void                 *data,
                                             GDestroyNotify        dnotify);
+HrtWatcher*    hrt_task_add_timeout        (HrtTask              *task,
+                                            guint                 interval_msec,
+                                            HrtWatcherCallback    callback,
+                                            void                 *data,
+                                            GDestroyNotify        dnotify);
 HrtWatcher*    hrt_task_add_io             (HrtTask              *task,
                                             int                   fd,
                                             HrtWatcherFlags       io_flags,
@@ -103,6 +153,25 @@ HrtWatcher*    hrt_task_add_subtask        (HrtTask              *task,
                                             HrtWatcherCallback    callback,
                                             void                 *data,
                                             GDestroyNotify        dnotify);
+HrtWatcher*    hrt_task_run_blocking       (HrtTask              *task,
+                                            HrtBlockingFunc       blocking_func,
+                                            HrtWatcherCallback    done_callback,
+                                            void                 *data,
+                                            GDestroyNotify        dnotify);
+HrtWatcher*    hrt_task_add_file_read      (HrtTask              *task,
+                                            int                   fd,
+                                            goffset               offset,
+                                            gsize                 len,
+                                            HrtFileCallback       callback,
+                                            void                 *data,
+                                            GDestroyNotify        dnotify);
+HrtWatcher*    hrt_task_add_file_write     (HrtTask              *task,
+                                            int                   fd,
+                                            goffset               offset,
+                                            HrtBuffer            *locked_buffer,
+                                            HrtFileCallback       callback,
+                                            void                 *data,
+                                            GDestroyNotify        dnotify);
 
 
 /* Internal (but has to be exported from lib), used by assertions only */
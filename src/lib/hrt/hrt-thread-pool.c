@@ -23,9 +23,35 @@
 #include <config.h>
 #include <hrt/hrt-thread-pool.h>
 #include <hrt/hrt-log.h>
+#include <hrt/hrt-lock.h>
 #include <hrt/hrt-builtins.h>
 #include <hrt/hrt-marshalers.h>
 
+#include <sched.h>
+#include <unistd.h>
+
+typedef enum {
+    WORKER_BUSY,
+    WORKER_SPINNING,
+    WORKER_PARKED,
+    /* woken but not yet running; like spinning, it will look at its
+     * own queue first, so don't steal from it
+     */
+    WORKER_WOKEN
+} WorkerState;
+
+/* A thread with nothing to do parks on its own condition variable. */
+typedef struct Worker Worker;
+struct Worker {
+    HrtThreadPool *pool;
+    int index;
+    WorkerState state;
+    GCond *cond;
+    Worker *next_idle;
+    /* items pushed with this worker as the affinity hint */
+    GQueue local_items;
+};
+
 struct HrtThreadPool {
     GObject      parent_instance;
 
@@ -33,14 +59,70 @@ struct HrtThreadPool {
     void                      *vfunc_data;
     GDestroyNotify             vfunc_data_dnotify;
 
-    GAsyncQueue *queue;
+    /* lock protects everything below except n_items may be read
+     * without it. n_items counts the shared queue, the workers'
+     * local queues, and the idle queue.
+     */
+    HrtLock *lock;
+    GQueue items;
+    volatile int n_items;
+
+    /* Low-priority items, only run by a thread that found nothing
+     * in any of the other queues.
+     */
+    GQueue idle_items;
+
+    /* Waking a parked thread costs a futex syscall plus a context
+     * switch, which is most of the latency when a task ping-pongs
+     * between threads. So before parking, a thread spins for a
+     * while, and pushes don't wake anyone if a spinner will pick the
+     * item up. The spin length adapts: doubled when spinning found
+     * work, halved when it didn't.
+     */
+    int n_spinning;
+    int max_spinning;
+    int spin_limit;
+
+    /* Parked threads, most recently parked first. We wake the top
+     * one since its cache (and JS context) is most likely still warm,
+     * and threads at the bottom can stay asleep.
+     */
+    Worker *idle_workers;
 
+    /* Soft affinity: an item pushed with a worker hint goes on that
+     * worker's local queue, and other workers take it only if that
+     * worker is busy running something else. Hits are hinted items
+     * run by their worker, misses are hinted items stolen.
+     */
+    Worker *workers;
+    int n_workers_started;
+    volatile int affinity_hits;
+    volatile int affinity_misses;
+
+    /* threads and workers have room for max_threads, in case
+     * hrt_thread_pool_add_thread() is used. n_threads only changes
+     * with lock held.
+     */
     GThread **threads;
     gsize n_threads;
+    gsize max_threads;
 
     gboolean shutting_down;
 };
 
+/* in iterations of cpu_relax() */
+#define MIN_SPIN_LIMIT     64
+#define MAX_SPIN_LIMIT  16384
+#define INITIAL_SPIN_LIMIT 1024
+
+static GStaticPrivate current_worker = G_STATIC_PRIVATE_INIT;
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
 struct HrtThreadPoolClass {
     GObjectClass parent_class;
 };
@@ -89,15 +171,44 @@ hrt_thread_pool_finalize(GObject *object)
     g_assert(pool->n_threads == 0);
     g_assert(pool->vtable == NULL);
 
-    g_async_queue_unref(pool->queue);
+    g_assert(g_queue_get_length(&pool->items) == 0);
+    g_assert(g_queue_get_length(&pool->idle_items) == 0);
+    g_assert(pool->idle_workers == NULL);
+    hrt_lock_free(pool->lock);
 
     G_OBJECT_CLASS(hrt_thread_pool_parent_class)->finalize(object);
 }
 
+/* CPUs we may actually run on. A container or taskset can pin us to
+ * fewer CPUs than the machine has online, and spinning then only
+ * delays the thread we're waiting for.
+ */
+static long
+count_usable_cpus(void)
+{
+#ifdef CPU_COUNT
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        return CPU_COUNT(&set);
+#endif
+
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
 static void
 hrt_thread_pool_init(HrtThreadPool *pool)
 {
-    pool->queue = g_async_queue_new();
+    long n_cpus;
+
+    pool->lock = hrt_lock_new("hrt-thread-pool.lock");
+    g_queue_init(&pool->items);
+    g_queue_init(&pool->idle_items);
+    pool->spin_limit = INITIAL_SPIN_LIMIT;
+
+    /* spinning on one CPU just delays the thread we're waiting for */
+    n_cpus = count_usable_cpus();
+    pool->max_spinning = n_cpus > 1 ? 1 : 0;
 }
 
 static void
@@ -114,25 +225,144 @@ hrt_thread_pool_class_init(HrtThreadPoolClass *klass)
 /* just an arbitrary unique valid pointer */
 static void* shutting_down_item = (void*) &hrt_thread_pool_class_init;
 
+/* CALLED WITH LOCK HELD. Our own queue first, then the shared one,
+ * then any busy worker's queue, and only then the idle queue.
+ */
+static void*
+pop_item_unlocked(HrtThreadPool *pool,
+                  Worker        *worker,
+                  gboolean      *is_idle_p)
+{
+    void *item;
+    gsize i;
+
+    *is_idle_p = FALSE;
+
+    item = g_queue_pop_head(&worker->local_items);
+    if (item != NULL) {
+        g_atomic_int_inc(&pool->affinity_hits);
+        goto out;
+    }
+
+    item = g_queue_pop_head(&pool->items);
+    if (item != NULL)
+        goto out;
+
+    for (i = 0; i < pool->n_threads; ++i) {
+        Worker *victim = &pool->workers[i];
+
+        if (victim == worker ||
+            victim->state != WORKER_BUSY)
+            continue;
+
+        item = g_queue_pop_head(&victim->local_items);
+        if (item != NULL) {
+            g_atomic_int_inc(&pool->affinity_misses);
+            goto out;
+        }
+    }
+
+    item = g_queue_pop_head(&pool->idle_items);
+    if (item != NULL)
+        *is_idle_p = TRUE;
+
+ out:
+    if (item != NULL)
+        g_atomic_int_add(&pool->n_items, -1);
+
+    return item;
+}
+
+/* Spin briefly, then park until an item arrives */
+static void*
+pool_pop(HrtThreadPool *pool,
+         Worker        *worker,
+         gboolean      *is_idle_p)
+{
+    void *item;
+
+    hrt_lock_lock(pool->lock);
+
+    while ((item = pop_item_unlocked(pool, worker, is_idle_p)) == NULL) {
+        if (pool->n_spinning < pool->max_spinning) {
+            int spin_limit;
+            int i;
+
+            pool->n_spinning += 1;
+            worker->state = WORKER_SPINNING;
+            spin_limit = pool->spin_limit;
+            hrt_lock_unlock(pool->lock);
+
+            for (i = 0; i < spin_limit; ++i) {
+                if (g_atomic_int_get(&pool->n_items) > 0)
+                    break;
+                cpu_relax();
+            }
+
+            hrt_lock_lock(pool->lock);
+            pool->n_spinning -= 1;
+
+            /* pushers don't wake anyone while we're spinning, so we
+             * have to check again with the lock held before parking.
+             */
+            item = pop_item_unlocked(pool, worker, is_idle_p);
+            if (item != NULL) {
+                pool->spin_limit = MIN(pool->spin_limit * 2, MAX_SPIN_LIMIT);
+                break;
+            } else {
+                pool->spin_limit = MAX(pool->spin_limit / 2, MIN_SPIN_LIMIT);
+            }
+        }
+
+        worker->state = WORKER_PARKED;
+        worker->next_idle = pool->idle_workers;
+        pool->idle_workers = worker;
+
+        /* the pusher takes us off idle_workers before waking us */
+        while (worker->state == WORKER_PARKED)
+            hrt_lock_wait(pool->lock, worker->cond);
+    }
+
+    worker->state = WORKER_BUSY;
+
+    hrt_lock_unlock(pool->lock);
+
+    return item;
+}
+
 static void*
 hrt_thread_pool_thread(void *data)
 {
     HrtThreadPool *pool;
     void *thread_data;
+    Worker *worker;
 
     pool = HRT_THREAD_POOL(data);
 
+    hrt_lock_lock(pool->lock);
+    worker = &pool->workers[pool->n_workers_started];
+    pool->n_workers_started += 1;
+    hrt_lock_unlock(pool->lock);
+
+    g_static_private_set(&current_worker, worker, NULL);
+
     thread_data = (* pool->vtable->thread_data_new) (pool->vfunc_data);
 
     while (TRUE) {
         void *item;
+        gboolean is_idle;
 
-        item = g_async_queue_pop(pool->queue);
+        item = pool_pop(pool, worker, &is_idle);
         g_assert(item != NULL);
 
         if (item == shutting_down_item) {
             /* time to quit */
             break;
+        } else if (is_idle &&
+                   pool->vtable->handle_idle_item != NULL) {
+            (* pool->vtable->handle_idle_item) (thread_data,
+                                                item,
+                                                pool->vfunc_data);
         } else {
             (* pool->vtable->handle_item) (thread_data,
                                            item,
@@ -142,53 +372,113 @@ hrt_thread_pool_thread(void *data)
 
     (* pool->vtable->thread_data_free) (thread_data, pool->vfunc_data);
 
+    g_static_private_set(&current_worker, NULL, NULL);
+
     g_object_unref(pool);
     return NULL;
 }
 
 static void
-create_threads(HrtThreadPool *pool)
+init_worker(HrtThreadPool *pool,
+            gsize          i)
+{
+    Worker *worker = &pool->workers[i];
+
+    worker->pool = pool;
+    worker->index = i;
+    worker->state = WORKER_BUSY;
+    worker->cond = g_cond_new();
+    g_queue_init(&worker->local_items);
+}
+
+static GThread*
+start_thread(HrtThreadPool *pool)
+{
+    GThread *thread;
+    GError *error = NULL;
+
+    thread = g_thread_create(hrt_thread_pool_thread,
+                             g_object_ref(pool),
+                             TRUE, /* joinable */
+                             &error);
+    if (error != NULL) {
+        g_error("Failed to create thread: %s", error->message);
+    }
+
+    return thread;
+}
+
+static void
+create_threads(HrtThreadPool *pool,
+               gsize          n_threads,
+               gsize          max_threads)
 {
     gsize i;
 
-    /* on my 2-core system 3 or 4 threads seems to be optimal, with
-     * two or five clearly worse. We might end up wanting to look at
-     * number of cores and decide.
-     */
-    pool->n_threads = 4;
-    pool->threads = g_new0(GThread*, pool->n_threads);
+    pool->n_threads = n_threads;
+    pool->max_threads = max_threads;
+    pool->threads = g_new0(GThread*, pool->max_threads);
 
+    pool->workers = g_new0(Worker, pool->max_threads);
     for (i = 0; i < pool->n_threads; ++i) {
-        GError *error = NULL;
-        pool->threads[i] =
-            g_thread_create(hrt_thread_pool_thread,
-                            g_object_ref(pool),
-                            TRUE, /* joinable */
-                            &error);
-        if (error != NULL) {
-            g_error("Failed to create thread: %s", error->message);
-        }
+        init_worker(pool, i);
+    }
+
+    for (i = 0; i < pool->n_threads; ++i) {
+        pool->threads[i] = start_thread(pool);
     }
 }
 
+/* Like hrt_thread_pool_new_sized() but hrt_thread_pool_add_thread()
+ * can add threads up to max_threads.
+ */
 HrtThreadPool*
-hrt_thread_pool_new(const HrtThreadPoolVTable *vtable,
-                    void                      *vfunc_data,
-                    GDestroyNotify             vfunc_data_dnotify)
+hrt_thread_pool_new_elastic(const HrtThreadPoolVTable *vtable,
+                            void                      *vfunc_data,
+                            GDestroyNotify             vfunc_data_dnotify,
+                            int                        n_threads,
+                            int                        max_threads)
 {
     HrtThreadPool *pool;
 
+    g_return_val_if_fail(n_threads > 0, NULL);
+    g_return_val_if_fail(max_threads >= n_threads, NULL);
+
     pool = g_object_new(HRT_TYPE_THREAD_POOL,
                         NULL);
     pool->vtable = vtable;
     pool->vfunc_data = vfunc_data;
     pool->vfunc_data_dnotify = vfunc_data_dnotify;
 
-    create_threads(pool);
+    create_threads(pool, n_threads, max_threads);
 
     return pool;
 }
 
+HrtThreadPool*
+hrt_thread_pool_new_sized(const HrtThreadPoolVTable *vtable,
+                          void                      *vfunc_data,
+                          GDestroyNotify             vfunc_data_dnotify,
+                          int                        n_threads)
+{
+    return hrt_thread_pool_new_elastic(vtable, vfunc_data,
+                                       vfunc_data_dnotify,
+                                       n_threads, n_threads);
+}
+
+HrtThreadPool*
+hrt_thread_pool_new(const HrtThreadPoolVTable *vtable,
+                    void                      *vfunc_data,
+                    GDestroyNotify             vfunc_data_dnotify)
+{
+    /* on my 2-core system 3 or 4 threads seems to be optimal, with
+     * two or five clearly worse. We might end up wanting to look at
+     * number of cores and decide.
+     */
+    return hrt_thread_pool_new_sized(vtable, vfunc_data,
+                                     vfunc_data_dnotify, 4);
+}
+
 typedef struct {
     GFunc          handler;
     void          *handler_data;
@@ -251,7 +541,8 @@ handler_thread_data_free(void *thread_data,
 static const HrtThreadPoolVTable handler_vtable = {
     handler_thread_data_new,
     handler_handle_item,
-    handler_thread_data_free
+    handler_thread_data_free,
+    NULL /* idle items go to handle_item too */
 };
 
 HrtThreadPool*
@@ -269,9 +560,93 @@ hrt_thread_pool_new_func (GFunc                      handler_func,
                                handler_free);
 }
 
+/* CALLED WITH LOCK HELD */
+static void
+wake_worker_unlocked(HrtThreadPool *pool,
+                     Worker        *worker)
+{
+    Worker **link;
+
+    /* usually worker is on top of the stack */
+    for (link = &pool->idle_workers;
+         *link != worker;
+         link = &(*link)->next_idle) {
+        g_assert(*link != NULL);
+    }
+    *link = worker->next_idle;
+
+    worker->next_idle = NULL;
+    worker->state = WORKER_WOKEN;
+    g_cond_signal(worker->cond);
+}
+
+/* CALLED WITHOUT LOCK, for an idle item that will never run */
+static void
+drop_idle_item(HrtThreadPool *pool,
+               void          *item)
+{
+    if (pool->vtable->drop_idle_item != NULL)
+        (* pool->vtable->drop_idle_item) (item, pool->vfunc_data);
+}
+
+static void
+push_item(HrtThreadPool *pool,
+          void          *item,
+          int            worker_hint,
+          gboolean       idle)
+{
+    Worker *hinted;
+
+    hrt_lock_lock(pool->lock);
+
+    hinted = NULL;
+    if (worker_hint >= 0 &&
+        worker_hint < pool->n_workers_started)
+        hinted = &pool->workers[worker_hint];
+
+    if (idle && pool->shutting_down) {
+        /* an idle restarting itself while we shut down; it would
+         * never run anyway.
+         */
+        hrt_lock_unlock(pool->lock);
+        drop_idle_item(pool, item);
+        return;
+    }
+
+    if (idle)
+        g_queue_push_tail(&pool->idle_items, item);
+    else if (hinted != NULL)
+        g_queue_push_tail(&hinted->local_items, item);
+    else
+        g_queue_push_tail(&pool->items, item);
+    g_atomic_int_inc(&pool->n_items);
+
+    if (hinted != NULL &&
+        hinted->state == WORKER_PARKED) {
+        wake_worker_unlocked(pool, hinted);
+    } else if (hinted != NULL &&
+               hinted->state != WORKER_BUSY) {
+        /* hinted worker is spinning or already awake and will get
+         * to it right away.
+         */
+    } else if (g_atomic_int_get(&pool->n_items) > pool->n_spinning &&
+               pool->idle_workers != NULL) {
+        /* a spinning thread will take the item without a wakeup,
+         * unless there are more items than spinners. If the hinted
+         * worker is busy, even if it's us, a woken worker steals the
+         * item; we may be in the middle of a long handler, and the
+         * item shouldn't wait behind it while others are idle.
+         */
+        wake_worker_unlocked(pool, pool->idle_workers);
+    }
+
+    hrt_lock_unlock(pool->lock);
+}
+
 void
 hrt_thread_pool_shutdown(HrtThreadPool *pool)
 {
+    void *item;
     gsize i;
 
     g_return_if_fail(HRT_IS_THREAD_POOL(pool));
@@ -280,7 +655,9 @@ hrt_thread_pool_shutdown(HrtThreadPool *pool)
         return;
 
     /* Mark that threads should exit when nothing left in queue */
+    hrt_lock_lock(pool->lock);
     pool->shutting_down = TRUE;
+    hrt_lock_unlock(pool->lock);
 
     /* push a special item to tell threads to exit.  Threads will not
      * pop anything else once they get this special item, so each
@@ -289,7 +666,7 @@ hrt_thread_pool_shutdown(HrtThreadPool *pool)
      * to get processed before threads will quit.
      */
     for (i = 0; i < pool->n_threads; ++i) {
-        g_async_queue_push(pool->queue, shutting_down_item);
+        push_item(pool, shutting_down_item, -1, FALSE);
     }
 
     /* now close down */
@@ -297,6 +674,21 @@ hrt_thread_pool_shutdown(HrtThreadPool *pool)
         g_thread_join(pool->threads[i]);
     }
 
+    /* The exit items outrank idle items, so any idle items still
+     * queued are dropped, like idles in a main loop that quit.
+     */
+    while ((item = g_queue_pop_head(&pool->idle_items)) != NULL) {
+        g_atomic_int_add(&pool->n_items, -1);
+        drop_idle_item(pool, item);
+    }
+
+    for (i = 0; i < pool->n_threads; ++i) {
+        g_cond_free(pool->workers[i].cond);
+    }
+    g_free(pool->workers);
+    pool->workers = NULL;
+    pool->idle_workers = NULL;
+
     g_free(pool->threads);
     pool->threads = NULL;
     pool->n_threads = 0;
@@ -315,5 +707,126 @@ hrt_thread_pool_push(HrtThreadPool *pool,
     g_return_if_fail(!pool->shutting_down);
     g_return_if_fail(pool->n_threads > 0);
 
-    g_async_queue_push(pool->queue, item);
+    push_item(pool, item, -1, FALSE);
+}
+
+/* Like hrt_thread_pool_push() but prefers to run the item in the
+ * worker with the given index (see
+ * hrt_thread_pool_get_current_worker()). Another worker only takes
+ * it if that one is busy. -1 means no preference.
+ */
+void
+hrt_thread_pool_push_to(HrtThreadPool *pool,
+                        void          *item,
+                        int            worker_hint)
+{
+    g_return_if_fail(HRT_IS_THREAD_POOL(pool));
+    g_return_if_fail(item != NULL);
+    g_return_if_fail(!pool->shutting_down);
+    g_return_if_fail(pool->n_threads > 0);
+
+    push_item(pool, item, worker_hint, FALSE);
+}
+
+/* Like hrt_thread_pool_push() but the item only runs when a thread
+ * has nothing else to do; items pushed any other way, including
+ * ones pushed later, go first. The item goes to the vtable's
+ * handle_idle_item, or handle_item if that's NULL. Idle items still
+ * queued at shutdown, or pushed during it, are dropped without being
+ * handled; they go to the vtable's drop_idle_item, if any, so their
+ * resources can be released.
+ */
+void
+hrt_thread_pool_push_idle(HrtThreadPool *pool,
+                          void          *item)
+{
+    g_return_if_fail(HRT_IS_THREAD_POOL(pool));
+    g_return_if_fail(item != NULL);
+
+    push_item(pool, item, -1, TRUE);
+}
+
+/* Add a thread, e.g. because one of the existing ones is stuck in a
+ * long-running item. Returns FALSE if the pool already has the
+ * max_threads it was created with, or is shutting down. Threads are
+ * never taken away again.
+ */
+gboolean
+hrt_thread_pool_add_thread(HrtThreadPool *pool)
+{
+    gsize i;
+
+    g_return_val_if_fail(HRT_IS_THREAD_POOL(pool), FALSE);
+
+    hrt_lock_lock(pool->lock);
+
+    if (pool->shutting_down ||
+        pool->n_threads >= pool->max_threads) {
+        hrt_lock_unlock(pool->lock);
+        return FALSE;
+    }
+
+    /* the new worker is BUSY with an empty queue until its thread
+     * gets going, so nobody looks at it before then.
+     */
+    i = pool->n_threads;
+    init_worker(pool, i);
+    pool->threads[i] = start_thread(pool);
+    pool->n_threads += 1;
+
+    hrt_lock_unlock(pool->lock);
+
+    return TRUE;
+}
+
+/* Index of the calling thread's worker, or -1 if the caller isn't
+ * one of this pool's threads.
+ */
+int
+hrt_thread_pool_get_current_worker(HrtThreadPool *pool)
+{
+    Worker *worker;
+
+    worker = g_static_private_get(&current_worker);
+    if (worker == NULL || worker->pool != pool)
+        return -1;
+
+    return worker->index;
+}
+
+void
+hrt_thread_pool_get_affinity_stats(HrtThreadPool *pool,
+                                   guint         *hits_p,
+                                   guint         *misses_p)
+{
+    g_return_if_fail(HRT_IS_THREAD_POOL(pool));
+
+    *hits_p = (guint) g_atomic_int_get(&pool->affinity_hits);
+    *misses_p = (guint) g_atomic_int_get(&pool->affinity_misses);
+}
+
+/* Number of threads, counting any added with
+ * hrt_thread_pool_add_thread()
+ */
+int
+hrt_thread_pool_get_n_threads(HrtThreadPool *pool)
+{
+    int n_threads;
+
+    g_return_val_if_fail(HRT_IS_THREAD_POOL(pool), 0);
+
+    hrt_lock_lock(pool->lock);
+    n_threads = pool->n_threads;
+    hrt_lock_unlock(pool->lock);
+
+    return n_threads;
+}
+
+/* Number of items pushed but not yet picked up by a thread */
+int
+hrt_thread_pool_get_queue_length(HrtThreadPool *pool)
+{
+    g_return_val_if_fail(HRT_IS_THREAD_POOL(pool), 0);
+
+    return g_atomic_int_get(&pool->n_items);
 }
@@ -36,6 +36,13 @@ typedef struct {
                                 void *vfunc_data);
     void  (* thread_data_free) (void *thread_data,
                                 void *vfunc_data);
+    /* optional, for items from hrt_thread_pool_push_idle() */
+    void  (* handle_idle_item) (void *thread_data,
+                                void *item,
+                                void *vfunc_data);
+    /* optional, to release idle items dropped at shutdown */
+    void  (* drop_idle_item)   (void *item,
+                                void *vfunc_data);
 } HrtThreadPoolVTable;
 
 typedef struct HrtThreadPool      HrtThreadPool;
@@ -50,15 +57,36 @@ typedef struct HrtThreadPoolClass HrtThreadPoolClass;
 
 GType           hrt_thread_pool_get_type (void) G_GNUC_CONST;
 
-HrtThreadPool* hrt_thread_pool_new      (const HrtThreadPoolVTable *vtable,
-                                         void                      *vfunc_data,
-                                         GDestroyNotify             vfunc_data_dnotify);
-HrtThreadPool* hrt_thread_pool_new_func (GFunc                      handler_func,
-                                         void                      *handler_data,
-                                         GDestroyNotify             handler_data_dnotify);
-void           hrt_thread_pool_shutdown (HrtThreadPool             *pool);
-void           hrt_thread_pool_push     (HrtThreadPool             *pool,
-                                         void                      *item);
+HrtThreadPool* hrt_thread_pool_new              (const HrtThreadPoolVTable *vtable,
+                                                 void                      *vfunc_data,
+                                                 GDestroyNotify             vfunc_data_dnotify);
+HrtThreadPool* hrt_thread_pool_new_sized        (const HrtThreadPoolVTable *vtable,
+                                                 void                      *vfunc_data,
+                                                 GDestroyNotify             vfunc_data_dnotify,
+                                                 int                        n_threads);
+HrtThreadPool* hrt_thread_pool_new_elastic      (const HrtThreadPoolVTable *vtable,
+                                                 void                      *vfunc_data,
+                                                 GDestroyNotify             vfunc_data_dnotify,
+                                                 int                        n_threads,
+                                                 int                        max_threads);
+HrtThreadPool* hrt_thread_pool_new_func         (GFunc                      handler_func,
+                                                 void                      *handler_data,
+                                                 GDestroyNotify             handler_data_dnotify);
+void           hrt_thread_pool_shutdown         (HrtThreadPool             *pool);
+void           hrt_thread_pool_push             (HrtThreadPool             *pool,
+                                                 void                      *item);
+void           hrt_thread_pool_push_to          (HrtThreadPool             *pool,
+                                                 void                      *item,
+                                                 int                        worker_hint);
+void           hrt_thread_pool_push_idle        (HrtThreadPool             *pool,
+                                                 void                      *item);
+gboolean       hrt_thread_pool_add_thread       (HrtThreadPool             *pool);
+int            hrt_thread_pool_get_n_threads    (HrtThreadPool             *pool);
+int            hrt_thread_pool_get_queue_length (HrtThreadPool             *pool);
+int            hrt_thread_pool_get_current_worker (HrtThreadPool           *pool);
+void           hrt_thread_pool_get_affinity_stats (HrtThreadPool           *pool,
+                                                   guint                   *hits_p,
+                                                   guint                   *misses_p);
 
 G_END_DECLS
 
@@ -0,0 +1,786 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <hrt/hrt-utf.h>
+#include <string.h>
+
+#if defined(__GNUC__) &&                                                \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) &&         \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/* Same rule as GLib's UNICODE_VALID() */
+#define UNICHAR_VALID(c)                                \
+    ((c) < 0x110000 &&                                  \
+     ((c) & 0xFFFFF800) != 0xD800 &&                    \
+     ((c) < 0xFDD0 || (c) > 0xFDEF) &&                  \
+     ((c) & 0xFFFE) != 0xFFFE)
+
+/* Each kernel handles a run of "plain ASCII", 0x01 through 0x7F; nul
+ * is left for the scalar code to reject.
+ */
+typedef struct {
+    HrtUtfKernels which;
+    /* how many leading bytes or units are plain ASCII */
+    gsize (* ascii_prefix)       (const guint8  *s,
+                                  gsize          len);
+    gsize (* utf16_ascii_prefix) (const guint16 *s,
+                                  gsize          len);
+    /* copy ASCII (or Latin-1) bytes to UTF-16 and back */
+    void  (* widen)              (guint16       *dest,
+                                  const guint8  *src,
+                                  gsize          len);
+    void  (* narrow)             (guint8        *dest,
+                                  const guint16 *src,
+                                  gsize          len);
+    /* how many leading bytes need no HTML or JSON escaping */
+    gsize (* html_safe_prefix)   (const guint8  *s,
+                                  gsize          len);
+    gsize (* json_safe_prefix)   (const guint8  *s,
+                                  gsize          len);
+} Kernels;
+
+static gsize
+scalar_ascii_prefix(const guint8 *s,
+                    gsize         len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i) {
+        if ((guint8) (s[i] - 1) >= 0x7F)
+            break;
+    }
+
+    return i;
+}
+
+static gsize
+scalar_utf16_ascii_prefix(const guint16 *s,
+                          gsize          len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i) {
+        if ((guint16) (s[i] - 1) >= 0x7F)
+            break;
+    }
+
+    return i;
+}
+
+static void
+scalar_widen(guint16      *dest,
+             const guint8 *src,
+             gsize         len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i)
+        dest[i] = src[i];
+}
+
+static void
+scalar_narrow(guint8        *dest,
+              const guint16 *src,
+              gsize          len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i)
+        dest[i] = (guint8) src[i];
+}
+
+static gsize
+scalar_html_safe_prefix(const guint8 *s,
+                        gsize         len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '&' || s[i] == '<' || s[i] == '>' ||
+            s[i] == '"' || s[i] == '\'')
+            break;
+    }
+
+    return i;
+}
+
+static gsize
+scalar_json_safe_prefix(const guint8 *s,
+                        gsize         len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i) {
+        if (s[i] < 0x20 || s[i] == '"' || s[i] == '\\')
+            break;
+    }
+
+    return i;
+}
+
+static const Kernels scalar_kernels = {
+    HRT_UTF_KERNELS_SCALAR,
+    scalar_ascii_prefix,
+    scalar_utf16_ascii_prefix,
+    scalar_widen,
+    scalar_narrow,
+    scalar_html_safe_prefix,
+    scalar_json_safe_prefix
+};
+
+#ifdef HAVE_X86_KERNELS
+
+TARGET_SSE2 static gsize
+sse2_ascii_prefix(const guint8 *s,
+                  gsize         len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    gsize i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v;
+        int mask;
+
+        v = _mm_loadu_si128((const __m128i*) (s + i));
+        /* high bit set for non-ASCII bytes and (via the compare) nuls */
+        mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + scalar_ascii_prefix(s + i, len - i);
+}
+
+TARGET_SSE2 static gsize
+sse2_utf16_ascii_prefix(const guint16 *s,
+                        gsize          len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high = _mm_set1_epi16((short) 0xFF80);
+    gsize i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        __m128i v;
+        __m128i ascii;
+        int mask;
+
+        v = _mm_loadu_si128((const __m128i*) (s + i));
+        ascii = _mm_andnot_si128(_mm_cmpeq_epi16(v, zero),
+                                 _mm_cmpeq_epi16(_mm_and_si128(v, high), zero));
+        /* two mask bits per unit */
+        mask = _mm_movemask_epi8(ascii) ^ 0xFFFF;
+        if (mask != 0)
+            return i + __builtin_ctz(mask) / 2;
+    }
+
+    return i + scalar_utf16_ascii_prefix(s + i, len - i);
+}
+
+TARGET_SSE2 static void
+sse2_widen(guint16      *dest,
+           const guint8 *src,
+           gsize         len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    gsize i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v;
+
+        v = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dest + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i*) (dest + i + 8), _mm_unpackhi_epi8(v, zero));
+    }
+
+    scalar_widen(dest + i, src + i, len - i);
+}
+
+TARGET_SSE2 static void
+sse2_narrow(guint8        *dest,
+            const guint16 *src,
+            gsize          len)
+{
+    gsize i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i a;
+        __m128i b;
+
+        a = _mm_loadu_si128((const __m128i*) (src + i));
+        b = _mm_loadu_si128((const __m128i*) (src + i + 8));
+        _mm_storeu_si128((__m128i*) (dest + i), _mm_packus_epi16(a, b));
+    }
+
+    scalar_narrow(dest + i, src + i, len - i);
+}
+
+TARGET_SSE2 static gsize
+sse2_html_safe_prefix(const guint8 *s,
+                      gsize         len)
+{
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    gsize i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v;
+        __m128i special;
+        int mask;
+
+        v = _mm_loadu_si128((const __m128i*) (s + i));
+        special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                                            _mm_cmpeq_epi8(v, lt)),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, gt),
+                                            _mm_or_si128(_mm_cmpeq_epi8(v, quot),
+                                                         _mm_cmpeq_epi8(v, apos))));
+        mask = _mm_movemask_epi8(special);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + scalar_html_safe_prefix(s + i, len - i);
+}
+
+TARGET_SSE2 static gsize
+sse2_json_safe_prefix(const guint8 *s,
+                      gsize         len)
+{
+    const __m128i control = _mm_set1_epi8(0x1F);
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    gsize i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v;
+        __m128i special;
+        int mask;
+
+        v = _mm_loadu_si128((const __m128i*) (s + i));
+        /* unsigned v <= 0x1F exactly when max(v, 0x1F) is 0x1F */
+        special = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, control), control),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, quot),
+                                            _mm_cmpeq_epi8(v, backslash)));
+        mask = _mm_movemask_epi8(special);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + scalar_json_safe_prefix(s + i, len - i);
+}
+
+static const Kernels sse2_kernels = {
+    HRT_UTF_KERNELS_SSE2,
+    sse2_ascii_prefix,
+    sse2_utf16_ascii_prefix,
+    sse2_widen,
+    sse2_narrow,
+    sse2_html_safe_prefix,
+    sse2_json_safe_prefix
+};
+
+TARGET_AVX2 static gsize
+avx2_ascii_prefix(const guint8 *s,
+                  gsize         len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    gsize i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v;
+        unsigned int mask;
+
+        v = _mm256_loadu_si256((const __m256i*) (s + i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + sse2_ascii_prefix(s + i, len - i);
+}
+
+TARGET_AVX2 static gsize
+avx2_utf16_ascii_prefix(const guint16 *s,
+                        gsize          len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi16((short) 0xFF80);
+    gsize i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m256i v;
+        __m256i ascii;
+        unsigned int mask;
+
+        v = _mm256_loadu_si256((const __m256i*) (s + i));
+        ascii = _mm256_andnot_si256(_mm256_cmpeq_epi16(v, zero),
+                                    _mm256_cmpeq_epi16(_mm256_and_si256(v, high), zero));
+        mask = ~((unsigned int) _mm256_movemask_epi8(ascii));
+        if (mask != 0)
+            return i + __builtin_ctz(mask) / 2;
+    }
+
+    return i + sse2_utf16_ascii_prefix(s + i, len - i);
+}
+
+TARGET_AVX2 static void
+avx2_widen(guint16      *dest,
+           const guint8 *src,
+           gsize         len)
+{
+    gsize i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m128i a;
+        __m128i b;
+
+        a = _mm_loadu_si128((const __m128i*) (src + i));
+        b = _mm_loadu_si128((const __m128i*) (src + i + 16));
+        _mm256_storeu_si256((__m256i*) (dest + i), _mm256_cvtepu8_epi16(a));
+        _mm256_storeu_si256((__m256i*) (dest + i + 16), _mm256_cvtepu8_epi16(b));
+    }
+
+    sse2_widen(dest + i, src + i, len - i);
+}
+
+TARGET_AVX2 static void
+avx2_narrow(guint8        *dest,
+            const guint16 *src,
+            gsize          len)
+{
+    gsize i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i a;
+        __m256i b;
+
+        a = _mm256_loadu_si256((const __m256i*) (src + i));
+        b = _mm256_loadu_si256((const __m256i*) (src + i + 16));
+        /* packus works within 128-bit lanes, so put the lanes back
+         * in order afterward
+         */
+        _mm256_storeu_si256((__m256i*) (dest + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+                                                     0xD8));
+    }
+
+    sse2_narrow(dest + i, src + i, len - i);
+}
+
+TARGET_AVX2 static gsize
+avx2_html_safe_prefix(const guint8 *s,
+                      gsize         len)
+{
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i quot = _mm256_set1_epi8('"');
+    const __m256i apos = _mm256_set1_epi8('\'');
+    gsize i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v;
+        __m256i special;
+        unsigned int mask;
+
+        v = _mm256_loadu_si256((const __m256i*) (s + i));
+        special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp),
+                                                  _mm256_cmpeq_epi8(v, lt)),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, gt),
+                                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, quot),
+                                                                  _mm256_cmpeq_epi8(v, apos))));
+        mask = _mm256_movemask_epi8(special);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + sse2_html_safe_prefix(s + i, len - i);
+}
+
+TARGET_AVX2 static gsize
+avx2_json_safe_prefix(const guint8 *s,
+                      gsize         len)
+{
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    const __m256i quot = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    gsize i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v;
+        __m256i special;
+        unsigned int mask;
+
+        v = _mm256_loadu_si256((const __m256i*) (s + i));
+        special = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, quot),
+                                                  _mm256_cmpeq_epi8(v, backslash)));
+        mask = _mm256_movemask_epi8(special);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + sse2_json_safe_prefix(s + i, len - i);
+}
+
+static const Kernels avx2_kernels = {
+    HRT_UTF_KERNELS_AVX2,
+    avx2_ascii_prefix,
+    avx2_utf16_ascii_prefix,
+    avx2_widen,
+    avx2_narrow,
+    avx2_html_safe_prefix,
+    avx2_json_safe_prefix
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+/* the Kernels in use */
+static volatile gpointer current_kernels = NULL;
+
+static const Kernels*
+best_kernels(HrtUtfKernels max)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (max >= HRT_UTF_KERNELS_AVX2 && __builtin_cpu_supports("avx2"))
+        return &avx2_kernels;
+    if (max >= HRT_UTF_KERNELS_SSE2 && __builtin_cpu_supports("sse2"))
+        return &sse2_kernels;
+#endif
+
+    return &scalar_kernels;
+}
+
+static inline const Kernels*
+get_kernels(void)
+{
+    const Kernels *kernels;
+
+    kernels = g_atomic_pointer_get(&current_kernels);
+    if (G_UNLIKELY(kernels == NULL)) {
+        /* racing threads all pick the same ones */
+        kernels = best_kernels(HRT_UTF_KERNELS_AVX2);
+        g_atomic_pointer_set(&current_kernels, (gpointer) kernels);
+    }
+
+    return kernels;
+}
+
+/* Decodes one character that isn't plain ASCII, returning the
+ * number of bytes it used, or 0 if it's invalid.
+ */
+static int
+decode_utf8(const guint8 *s,
+            gsize         len,
+            gunichar     *c_p)
+{
+    gunichar c;
+    gunichar min;
+    int n;
+    int i;
+
+    if (s[0] < 0x80) {
+        /* nul is the only ASCII we get here */
+        if (s[0] == 0)
+            return 0;
+        *c_p = s[0];
+        return 1;
+    } else if (s[0] < 0xC2) {
+        /* stray continuation byte, or overlong 2-byte form */
+        return 0;
+    } else if (s[0] < 0xE0) {
+        n = 2;
+        c = s[0] & 0x1F;
+        min = 0x80;
+    } else if (s[0] < 0xF0) {
+        n = 3;
+        c = s[0] & 0x0F;
+        min = 0x800;
+    } else if (s[0] < 0xF5) {
+        n = 4;
+        c = s[0] & 0x07;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+
+    if ((gsize) n > len)
+        return 0;
+
+    for (i = 1; i < n; ++i) {
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+
+    if (c < min || !UNICHAR_VALID(c))
+        return 0;
+
+    *c_p = c;
+    return n;
+}
+
+gboolean
+hrt_utf_is_ascii(const char *s,
+                 gsize       len)
+{
+    return (* get_kernels()->ascii_prefix) ((const guint8*) s, len) == len;
+}
+
+/* Converts Latin-1, of which ASCII is a subset, to UTF-16 */
+void
+hrt_utf_widen_ascii(guint16    *dest,
+                    const char *src,
+                    gsize       len)
+{
+    (* get_kernels()->widen) (dest, (const guint8*) src, len);
+}
+
+/* How many leading bytes are not one of & < > " or ', which
+ * hrt_buffer_builder_append_html_escaped() replaces
+ */
+gsize
+hrt_utf_html_safe_prefix(const char *s,
+                         gsize       len)
+{
+    return (* get_kernels()->html_safe_prefix) ((const guint8*) s, len);
+}
+
+/* How many leading bytes are not a quote, backslash or control
+ * character, which a JSON string has to escape
+ */
+gsize
+hrt_utf_json_safe_prefix(const char *s,
+                         gsize       len)
+{
+    return (* get_kernels()->json_safe_prefix) ((const guint8*) s, len);
+}
+
+gboolean
+hrt_utf8_validate(const char *s,
+                  gsize       len)
+{
+    const Kernels *kernels;
+    const guint8 *u;
+    gsize i;
+
+    kernels = get_kernels();
+    u = (const guint8*) s;
+    i = 0;
+
+    while (TRUE) {
+        gunichar c;
+        int n;
+
+        i += (* kernels->ascii_prefix) (u + i, len - i);
+        if (i == len)
+            return TRUE;
+
+        n = decode_utf8(u + i, len - i, &c);
+        if (n == 0)
+            return FALSE;
+        i += n;
+    }
+}
+
+/* dest needs room for len units, which is the most it can take.
+ * Returns the number of units written, or -1 if src wasn't valid.
+ * Doesn't nul-terminate.
+ */
+gssize
+hrt_utf8_to_utf16(const char *src,
+                  gsize       len,
+                  guint16    *dest)
+{
+    const Kernels *kernels;
+    const guint8 *u;
+    gsize i;
+    gsize o;
+
+    kernels = get_kernels();
+    u = (const guint8*) src;
+    i = 0;
+    o = 0;
+
+    while (TRUE) {
+        gunichar c;
+        gsize ascii;
+        int n;
+
+        ascii = (* kernels->ascii_prefix) (u + i, len - i);
+        (* kernels->widen) (dest + o, u + i, ascii);
+        i += ascii;
+        o += ascii;
+        if (i == len)
+            return o;
+
+        n = decode_utf8(u + i, len - i, &c);
+        if (n == 0)
+            return -1;
+        i += n;
+
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            dest[o] = 0xD800 + (c >> 10);
+            dest[o + 1] = 0xDC00 + (c & 0x3FF);
+            o += 2;
+        } else {
+            dest[o] = c;
+            o += 1;
+        }
+    }
+}
+
+/* dest needs room for len bytes, which is the most it can take.
+ * Returns the number of bytes written, or -1 if src wasn't valid or
+ * has a character past U+00FF, so isn't Latin-1. Doesn't
+ * nul-terminate.
+ */
+gssize
+hrt_utf8_to_latin1(const char *src,
+                   gsize       len,
+                   char       *dest)
+{
+    const Kernels *kernels;
+    const guint8 *u;
+    gsize i;
+    gsize o;
+
+    kernels = get_kernels();
+    u = (const guint8*) src;
+    i = 0;
+    o = 0;
+
+    while (TRUE) {
+        gunichar c;
+        gsize ascii;
+        int n;
+
+        ascii = (* kernels->ascii_prefix) (u + i, len - i);
+        memcpy(dest + o, u + i, ascii);
+        i += ascii;
+        o += ascii;
+        if (i == len)
+            return o;
+
+        n = decode_utf8(u + i, len - i, &c);
+        if (n == 0 || c > 0xFF)
+            return -1;
+        i += n;
+
+        dest[o] = c;
+        o += 1;
+    }
+}
+
+/* dest needs room for 3 * len bytes, which is the most it can take.
+ * Returns the number of bytes written, or -1 if src wasn't valid
+ * (for example an unpaired surrogate). Doesn't nul-terminate.
+ */
+gssize
+hrt_utf16_to_utf8(const guint16 *src,
+                  gsize          len,
+                  char          *dest)
+{
+    const Kernels *kernels;
+    guint8 *u;
+    gsize i;
+    gsize o;
+
+    kernels = get_kernels();
+    u = (guint8*) dest;
+    i = 0;
+    o = 0;
+
+    while (TRUE) {
+        gunichar c;
+        gsize ascii;
+
+        ascii = (* kernels->utf16_ascii_prefix) (src + i, len - i);
+        (* kernels->narrow) (u + o, src + i, ascii);
+        i += ascii;
+        o += ascii;
+        if (i == len)
+            return o;
+
+        c = src[i];
+        i += 1;
+
+        if (c >= 0xD800 && c < 0xDC00) {
+            if (i == len || src[i] < 0xDC00 || src[i] >= 0xE000)
+                return -1;
+            c = 0x10000 + ((c - 0xD800) << 10) + (src[i] - 0xDC00);
+            i += 1;
+        }
+
+        if (c == 0 || !UNICHAR_VALID(c))
+            return -1;
+
+        if (c < 0x800) {
+            u[o] = 0xC0 | (c >> 6);
+            u[o + 1] = 0x80 | (c & 0x3F);
+            o += 2;
+        } else if (c < 0x10000) {
+            u[o] = 0xE0 | (c >> 12);
+            u[o + 1] = 0x80 | ((c >> 6) & 0x3F);
+            u[o + 2] = 0x80 | (c & 0x3F);
+            o += 3;
+        } else {
+            u[o] = 0xF0 | (c >> 18);
+            u[o + 1] = 0x80 | ((c >> 12) & 0x3F);
+            u[o + 2] = 0x80 | ((c >> 6) & 0x3F);
+            u[o + 3] = 0x80 | (c & 0x3F);
+            o += 4;
+        }
+    }
+}
+
+HrtUtfKernels
+hrt_utf_get_kernels(void)
+{
+    return get_kernels()->which;
+}
+
+/* Uses the best kernels the CPU supports, up to max; for tests and
+ * benchmarks. Returns the ones now in use.
+ */
+HrtUtfKernels
+hrt_utf_set_kernels(HrtUtfKernels max)
+{
+    const Kernels *kernels;
+
+    kernels = best_kernels(max);
+    g_atomic_pointer_set(&current_kernels, (gpointer) kernels);
+
+    return kernels->which;
+}
@@ -0,0 +1,75 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_UTF_H__
+#define __HRT_UTF_H__
+
+/*
+ * Validation and UTF-8/UTF-16 conversion for buffers. Text in a web
+ * server is almost all ASCII (headers entirely, bodies mostly), so
+ * each function runs vector kernels over ASCII stretches and only
+ * decodes the rest a character at a time. The kernels are picked
+ * at runtime for the CPU: AVX2, SSE2, or plain C.
+ *
+ * "Valid" follows g_utf8_validate() with a length: no nul, no
+ * surrogates or noncharacters, nothing past U+10FFFF and no overlong
+ * UTF-8 forms.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    HRT_UTF_KERNELS_SCALAR,
+    HRT_UTF_KERNELS_SSE2,
+    HRT_UTF_KERNELS_AVX2
+} HrtUtfKernels;
+
+gboolean       hrt_utf_is_ascii      (const char    *s,
+                                      gsize          len);
+void           hrt_utf_widen_ascii   (guint16       *dest,
+                                      const char    *src,
+                                      gsize          len);
+gsize          hrt_utf_html_safe_prefix (const char *s,
+                                         gsize       len);
+gsize          hrt_utf_json_safe_prefix (const char *s,
+                                         gsize       len);
+gboolean       hrt_utf8_validate     (const char    *s,
+                                      gsize          len);
+gssize         hrt_utf8_to_utf16     (const char    *src,
+                                      gsize          len,
+                                      guint16       *dest);
+gssize         hrt_utf8_to_latin1    (const char    *src,
+                                      gsize          len,
+                                      char          *dest);
+gssize         hrt_utf16_to_utf8     (const guint16 *src,
+                                      gsize          len,
+                                      char          *dest);
+
+HrtUtfKernels  hrt_utf_get_kernels   (void);
+HrtUtfKernels  hrt_utf_set_kernels   (HrtUtfKernels  max);
+
+G_END_DECLS
+
+#endif  /* __HRT_UTF_H__ */
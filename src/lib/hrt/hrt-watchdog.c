@@ -0,0 +1,257 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <hrt/hrt-watchdog.h>
+#include <hrt/hrt-lock.h>
+#include <hrt/hrt-log.h>
+
+#include <stdlib.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+/* the tick advances this many times per threshold */
+#define TICKS_PER_THRESHOLD 4
+
+typedef struct {
+    HrtWatchdogSlot slot;
+    GThread *thread;
+    /* started_tick of the last handler we reported */
+    int reported_tick;
+} Watched;
+
+struct HrtWatchdog {
+    guint threshold_msec;
+    HrtWatchdogStallFunc stall_func;
+    void *stall_data;
+
+    /* only the watchdog thread writes this */
+    volatile int ticks;
+    volatile int stalls;
+
+    /* protects everything below */
+    HrtLock *lock;
+    GCond *cond;
+    GSList *watched;
+    gboolean quit;
+    GThread *thread;
+};
+
+/* CALLED WITH LOCK HELD. We only say which task and handler are
+ * stuck; interrupting the stuck thread to get its backtrace would
+ * need a process-wide signal handler, which can make syscalls in
+ * unrelated code fail with EINTR.
+ */
+static void
+report_stall(HrtWatchdog *watchdog,
+             Watched     *watched,
+             int          elapsed_ticks)
+{
+    void *callback;
+    char *callback_name;
+
+    callback = watched->slot.callback;
+
+#ifdef HAVE_EXECINFO_H
+    {
+        char **symbols;
+
+        symbols = backtrace_symbols(&callback, 1);
+        callback_name = g_strdup(symbols != NULL ? symbols[0] : "?");
+        free(symbols);
+    }
+#else
+    callback_name = g_strdup_printf("%p", callback);
+#endif
+
+    hrt_message("Task %p has been in handler %s in thread %p for over %u ms",
+                watched->slot.task,
+                callback_name,
+                watched->thread,
+                elapsed_ticks * watchdog->threshold_msec / TICKS_PER_THRESHOLD);
+
+    g_free(callback_name);
+}
+
+static void*
+watchdog_thread(void *data)
+{
+    HrtWatchdog *watchdog = data;
+    gulong tick_usec;
+
+    tick_usec = watchdog->threshold_msec * 1000 / TICKS_PER_THRESHOLD;
+    if (tick_usec == 0)
+        tick_usec = 1;
+
+    hrt_lock_lock(watchdog->lock);
+
+    while (!watchdog->quit) {
+        GTimeVal until;
+        int n_stalls;
+        int ticks;
+        GSList *l;
+
+        g_get_current_time(&until);
+        g_time_val_add(&until, tick_usec);
+        hrt_lock_timed_wait(watchdog->lock, watchdog->cond, &until);
+
+        if (watchdog->quit)
+            break;
+
+        ticks = watchdog->ticks + 1;
+        /* 0 means "not in a handler" */
+        if (ticks <= 0)
+            ticks = 1;
+        watchdog->ticks = ticks;
+
+        n_stalls = 0;
+        for (l = watchdog->watched; l != NULL; l = l->next) {
+            Watched *watched = l->data;
+            int started;
+
+            started = watched->slot.started_tick;
+            if (started == 0 ||
+                started == watched->reported_tick ||
+                ticks - started <= TICKS_PER_THRESHOLD)
+                continue;
+
+            watched->reported_tick = started;
+            report_stall(watchdog, watched, ticks - started);
+            n_stalls += 1;
+        }
+
+        if (n_stalls > 0) {
+            g_atomic_int_add(&watchdog->stalls, n_stalls);
+
+            if (watchdog->stall_func != NULL) {
+                hrt_lock_unlock(watchdog->lock);
+                while (n_stalls-- > 0)
+                    (* watchdog->stall_func) (watchdog->stall_data);
+                hrt_lock_lock(watchdog->lock);
+            }
+        }
+    }
+
+    hrt_lock_unlock(watchdog->lock);
+
+    return NULL;
+}
+
+/* Report handlers running longer than threshold_msec (give or take a
+ * quarter of it). stall_func may be NULL.
+ */
+HrtWatchdog*
+_hrt_watchdog_new(guint                threshold_msec,
+                  HrtWatchdogStallFunc stall_func,
+                  void                *data)
+{
+    HrtWatchdog *watchdog;
+    GError *error;
+
+    watchdog = g_slice_new0(HrtWatchdog);
+    watchdog->threshold_msec = threshold_msec;
+    watchdog->stall_func = stall_func;
+    watchdog->stall_data = data;
+    watchdog->ticks = 1;
+    watchdog->lock = hrt_lock_new("hrt-watchdog.lock");
+    watchdog->cond = g_cond_new();
+
+    error = NULL;
+    watchdog->thread = g_thread_create(watchdog_thread, watchdog,
+                                       TRUE, &error);
+    if (error != NULL) {
+        g_error("Failed to create watchdog thread: %s", error->message);
+    }
+
+    return watchdog;
+}
+
+/* Stop reporting, so stall_func won't be called again. Threads can
+ * still be removed afterward.
+ */
+void
+_hrt_watchdog_stop(HrtWatchdog *watchdog)
+{
+    if (watchdog->thread == NULL)
+        return;
+
+    hrt_lock_lock(watchdog->lock);
+    watchdog->quit = TRUE;
+    g_cond_signal(watchdog->cond);
+    hrt_lock_unlock(watchdog->lock);
+
+    g_thread_join(watchdog->thread);
+    watchdog->thread = NULL;
+}
+
+void
+_hrt_watchdog_free(HrtWatchdog *watchdog)
+{
+    _hrt_watchdog_stop(watchdog);
+
+    g_assert(watchdog->watched == NULL);
+
+    g_cond_free(watchdog->cond);
+    hrt_lock_free(watchdog->lock);
+    g_slice_free(HrtWatchdog, watchdog);
+}
+
+/* CALLED IN THE THREAD TO WATCH, which must remove the slot before
+ * it exits.
+ */
+HrtWatchdogSlot*
+_hrt_watchdog_add_thread(HrtWatchdog *watchdog)
+{
+    Watched *watched;
+
+    watched = g_slice_new0(Watched);
+    watched->slot.ticks = &watchdog->ticks;
+    watched->thread = g_thread_self();
+
+    hrt_lock_lock(watchdog->lock);
+    watchdog->watched = g_slist_prepend(watchdog->watched, watched);
+    hrt_lock_unlock(watchdog->lock);
+
+    return &watched->slot;
+}
+
+void
+_hrt_watchdog_remove_thread(HrtWatchdog     *watchdog,
+                            HrtWatchdogSlot *slot)
+{
+    Watched *watched = (Watched*) slot;
+
+    hrt_lock_lock(watchdog->lock);
+    watchdog->watched = g_slist_remove(watchdog->watched, watched);
+    hrt_lock_unlock(watchdog->lock);
+
+    g_slice_free(Watched, watched);
+}
+
+/* Number of stalls reported so far */
+guint
+_hrt_watchdog_get_stalls(HrtWatchdog *watchdog)
+{
+    return (guint) g_atomic_int_get(&watchdog->stalls);
+}
@@ -0,0 +1,78 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_WATCHDOG_H__
+#define __HRT_WATCHDOG_H__
+
+/*
+ * A HrtWatchdog is an internal thread that notices task handlers
+ * that run too long. Each invoke thread adds a slot, and stamps it
+ * with the watchdog's tick count on entering a handler; the watchdog
+ * advances the tick several times per threshold and reports any
+ * handler whose stamp got too old, naming the task and handler.
+ * Entering a handler is a few plain stores.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct HrtWatchdog     HrtWatchdog;
+typedef struct HrtWatchdogSlot HrtWatchdogSlot;
+
+/* Called in the watchdog thread after each stall is reported */
+typedef void (* HrtWatchdogStallFunc) (void *data);
+
+struct HrtWatchdogSlot {
+    /* tick when the current handler started, 0 if none */
+    volatile int started_tick;
+    void * volatile task;
+    void * volatile callback;
+    volatile int *ticks;
+};
+
+#define _HRT_WATCHDOG_SLOT_ENTER(slot, the_task, the_callback)          \
+    do {                                                                \
+        (slot)->task = (the_task);                                      \
+        (slot)->callback = (the_callback);                              \
+        (slot)->started_tick = *(slot)->ticks;                          \
+    } while (0)
+
+#define _HRT_WATCHDOG_SLOT_LEAVE(slot)                                  \
+    do {                                                                \
+        (slot)->started_tick = 0;                                       \
+    } while (0)
+
+HrtWatchdog*     _hrt_watchdog_new           (guint                 threshold_msec,
+                                              HrtWatchdogStallFunc  stall_func,
+                                              void                 *data);
+void             _hrt_watchdog_stop          (HrtWatchdog          *watchdog);
+void             _hrt_watchdog_free          (HrtWatchdog          *watchdog);
+HrtWatchdogSlot* _hrt_watchdog_add_thread    (HrtWatchdog          *watchdog);
+void             _hrt_watchdog_remove_thread (HrtWatchdog          *watchdog,
+                                              HrtWatchdogSlot      *slot);
+guint            _hrt_watchdog_get_stalls    (HrtWatchdog          *watchdog);
+
+G_END_DECLS
+
+#endif  /* __HRT_WATCHDOG_H__ */
@@ -52,6 +52,10 @@ _hrt_watcher_base_init(HrtWatcher             *watcher,
     watcher->refcount = 1;
     watcher->flags = HRT_WATCHER_FLAG_NONE;
     watcher->removed = 0;
+
+    watcher->removed_post.next = NULL;
+    watcher->removed_post.func = NULL;
+    watcher->removed_post.queued = 0;
 }
 
 void
@@ -101,6 +105,7 @@ _hrt_watcher_detach(HrtWatcher *watcher)
     _hrt_watcher_dnotify_callback(watcher);
 
     g_assert(!_hrt_task_is_completed(watcher->task));
+    _hrt_task_remove_watcher(watcher->task, watcher);
     _hrt_task_watchers_dec(watcher->task);
 
     /* Remove ref owned by runner */
@@ -142,7 +147,8 @@ _hrt_watcher_queue_invoke(HrtWatcher     *watcher,
 HrtEventLoop*
 _hrt_watcher_get_event_loop(HrtWatcher *watcher)
 {
-    return _hrt_task_runner_get_event_loop(_hrt_watcher_get_task_runner(watcher));
+    return _hrt_task_runner_get_event_loop(_hrt_watcher_get_task_runner(watcher),
+                                           watcher->task);
 }
 
 HrtTaskRunner*
@@ -152,78 +158,52 @@ _hrt_watcher_get_task_runner(HrtWatcher *watcher)
 }
 
 
-/* Most watchers are event-loop-specific, but the "removed" watcher
- * isn't a real event loop source, it's just a thing we stick in the
- * invoke thread queue because we already know it's pending without
- * having to ask the event loop whether it is. So it can be generic
- * across all event loops.
+/* IN AN INVOKE THREAD, posted by _hrt_watcher_try_remove() so the
+ * dnotify is serialized with the task's other invokes.
  */
-typedef struct {
-    HrtWatcher base;
-} HrtWatcherRemoved;
-
-/* IN AN INVOKE THREAD */
-static gboolean
-on_watcher_removed(HrtTask        *task,
-                   HrtWatcherFlags flags,
-                   void           *data)
+static void
+on_watcher_removed(HrtTask     *task,
+                   HrtTaskPost *post)
 {
-    HrtWatcher *removed = data;
+    HrtWatcher *removed;
+
+    removed = HRT_TASK_POST_CONTAINER(post, HrtWatcher, removed_post);
 
     g_assert(g_atomic_int_get(&removed->removed) == 1);
 
     _hrt_watcher_detach(removed);
 
-    /* there won't be a dnotify so we do this here */
-    _hrt_task_watchers_dec(task);
-
+    /* drop the ref taken when posting */
     _hrt_watcher_unref(removed);
-
-    /* important not to actually remove_watcher() on the
-     * remove-watcher watcher, so return TRUE, but we get cleaned up
-     * anyway because neither the task runner nor main loop holds a
-     * ref to it.
-     */
-    return TRUE;
 }
 
-static void
-_hrt_watcher_removed_finalize(HrtWatcher *watcher)
-{
-    g_slice_free(HrtWatcherRemoved, (HrtWatcherRemoved*) watcher);
-}
-
-static const HrtWatcherVTable removed_vtable = {
-    NULL, /* start */
-    NULL, /* stop */
-    _hrt_watcher_removed_finalize  /* finalize */
-};
-
-/* a "removed" watcher is only an event, never added to main loop.
- * It is an event indicating we need to detach (destroy notify)
- * another watcher. The point is to get the dnotify into an
- * invoke thread and serialized with other event invokes
- * on the same task.
+/* Like hrt_watcher_remove() but returns FALSE rather than asserting
+ * if the watcher was already removed; used when cancelling a task,
+ * which may race with the task removing its own watchers.
  */
-HrtWatcher*
-_hrt_watcher_new_removed(HrtWatcher *was_removed)
+gboolean
+_hrt_watcher_try_remove(HrtWatcher *watcher)
 {
-    HrtWatcherRemoved *removed;
+    /* flag watcher as removed so we don't invoke any
+     * already-queued events.
+     */
+    if (!g_atomic_int_compare_and_exchange(&watcher->removed, 0, 1))
+        return FALSE;
 
-    _hrt_watcher_ref(was_removed); /* removed by on_watcher_removed */
+    /* immediately remove the actual event notification
+     * (remove watcher from main loop)
+     */
+    _hrt_watcher_stop(watcher);
 
-    removed = g_slice_new(HrtWatcherRemoved);
-    _hrt_watcher_base_init(&removed->base,
-                           &removed_vtable,
-                           was_removed->task,
-                           on_watcher_removed,
-                           was_removed,
-                           /* NOTE: remove-watcher is never itself
-                            * removed so dnotify would never get called
-                            */
-                           NULL);
+    /* get into the invoke thread to dnotify the watcher. The post
+     * node is embedded in the watcher so this doesn't allocate,
+     * and it can't already be queued since we only get here once.
+     */
+    _hrt_watcher_ref(watcher);
+    hrt_task_post(watcher->task, &watcher->removed_post,
+                  on_watcher_removed);
 
-    return (HrtWatcher*) removed;
+    return TRUE;
 }
 
 /* This can be called from another thread, and while invoking
@@ -232,33 +212,9 @@ _hrt_watcher_new_removed(HrtWatcher *was_removed)
 void
 hrt_watcher_remove(HrtWatcher *watcher)
 {
-    HrtWatcher *remove_watcher;
-
     g_assert(g_atomic_int_get(&watcher->removed) == 0);
 
-    /* immediately remove the actual event notification
-     * (remove watcher from main loop)
-     */
-    _hrt_watcher_stop(watcher);
-
-    /* flag watcher as removed so we don't invoke any
-     * already-queued events.
-     */
-    g_atomic_int_inc(&watcher->removed);
-
-    /* queue a task to invoke thread, to dnotify
-     * the watcher. unlike a typical watcher,
-     * the task runner does not hold a ref to it and
-     * it is not really added to the main loop,
-     * so after the first invocation it's just unref'd
-     * and vanishes.
-     */
-    remove_watcher = _hrt_watcher_new_removed(watcher);
-    _hrt_watcher_start(remove_watcher);
-    _hrt_task_runner_watcher_pending(_hrt_task_get_runner(remove_watcher->task),
-                                     remove_watcher);
-    /* runner does not hold a ref */
-    _hrt_watcher_unref(remove_watcher);
+    _hrt_watcher_try_remove(watcher);
 }
 
 /* Most watchers are event-loop-specific, but the "immediate" watcher
@@ -315,12 +271,78 @@ _hrt_watcher_new_immediate(HrtTask            *task,
     return (HrtWatcher*) immediate;
 }
 
+/* An "idle" watcher is also generic. Rather than an idle source in
+ * the event loop, which would wake the event thread and then bounce
+ * back to the invoke threads, it goes on the invoke pool's
+ * low-priority queue and runs when the pool has nothing else to do.
+ */
+typedef struct {
+    HrtWatcher base;
+} HrtWatcherIdle;
+
+static void
+_hrt_watcher_idle_finalize(HrtWatcher *watcher)
+{
+    g_slice_free(HrtWatcherIdle, (HrtWatcherIdle*) watcher);
+}
+
+static void
+_hrt_watcher_idle_start(HrtWatcher *watcher)
+{
+    _hrt_watcher_ref(watcher); /* dropped when the pool pops us */
+    _hrt_task_runner_push_idle(_hrt_watcher_get_task_runner(watcher),
+                               watcher);
+}
+
+static const HrtWatcherVTable idle_vtable = {
+    _hrt_watcher_idle_start, /* start */
+    NULL, /* stop; a removed watcher is skipped when it's popped */
+    _hrt_watcher_idle_finalize  /* finalize */
+};
+
+HrtWatcher*
+_hrt_watcher_new_idle(HrtTask            *task,
+                      HrtWatcherCallback  callback,
+                      void               *data,
+                      GDestroyNotify      dnotify)
+{
+    HrtWatcherIdle *idle;
+
+    idle = g_slice_new(HrtWatcherIdle);
+    _hrt_watcher_base_init(&idle->base,
+                           &idle_vtable,
+                           task,
+                           callback,
+                           data,
+                           dnotify);
+
+    return (HrtWatcher*) idle;
+}
+
 typedef struct {
     HrtWatcher base;
     HrtTask *wait_for_completed;
-    gboolean started;
+    volatile int started;
+    /* set once wait_for_completed is completed */
+    volatile int fired;
+    /* set once we've queued the invoke, so we only do it once */
+    volatile int queued;
 } HrtWatcherSubtask;
 
+/* Completion can happen in any thread and can race with starting
+ * the watcher, so whichever of start and notify happens second
+ * queues the invoke.
+ */
+static void
+subtask_maybe_queue_invoke(HrtWatcherSubtask *subtask)
+{
+    if (g_atomic_int_get(&subtask->started) &&
+        g_atomic_int_get(&subtask->fired) &&
+        g_atomic_int_compare_and_exchange(&subtask->queued, 0, 1)) {
+        _hrt_watcher_queue_invoke((HrtWatcher*) subtask, HRT_WATCHER_FLAG_NONE);
+    }
+}
+
 static void
 _hrt_watcher_subtask_finalize(HrtWatcher *watcher)
 {
@@ -337,7 +359,7 @@ _hrt_watcher_subtask_stop(HrtWatcher *watcher)
 {
     HrtWatcherSubtask *subtask = (HrtWatcherSubtask*) watcher;
 
-    subtask->started = FALSE;
+    g_atomic_int_set(&subtask->started, 0);
 }
 
 static void
@@ -345,7 +367,9 @@ _hrt_watcher_subtask_start(HrtWatcher *watcher)
 {
     HrtWatcherSubtask *subtask = (HrtWatcherSubtask*) watcher;
 
-    subtask->started = TRUE;
+    g_atomic_int_set(&subtask->started, 1);
+
+    subtask_maybe_queue_invoke(subtask);
 }
 
 static const HrtWatcherVTable subtask_vtable = {
@@ -379,9 +403,15 @@ _hrt_watcher_new_subtask(HrtTask            *task,
                            dnotify);
     subtask->wait_for_completed = wait_for_completed;
     g_object_ref(subtask->wait_for_completed);
-
-    _hrt_task_add_completed_notify(subtask->wait_for_completed,
-                                   (HrtWatcher*) subtask);
+    subtask->started = 0;
+    subtask->fired = 0;
+    subtask->queued = 0;
+
+    /* if the task is already completed, fire as soon as we start */
+    if (!_hrt_task_add_completed_notify(subtask->wait_for_completed,
+                                        (HrtWatcher*) subtask)) {
+        subtask->fired = 1;
+    }
 
     return (HrtWatcher*) subtask;
 }
@@ -391,8 +421,165 @@ _hrt_watcher_subtask_notify(HrtWatcher *watcher)
 {
     HrtWatcherSubtask *subtask = (HrtWatcherSubtask*) watcher;
 
-    if (!subtask->started)
+    g_atomic_int_set(&subtask->fired, 1);
+
+    subtask_maybe_queue_invoke(subtask);
+}
+
+/* A "blocking" watcher runs a function in the runner's blocking
+ * thread pool, and then is invoked in the task like any other
+ * watcher. The blocking function and the watcher callback share
+ * the user's data, so the user's dnotify can't run until both the
+ * watcher is detached and the blocking function has returned.
+ */
+typedef struct {
+    HrtWatcher base;
+    HrtBlockingFunc blocking_func;
+    HrtWatcherCallback user_callback;
+    void *user_data;
+    GDestroyNotify user_dnotify;
+    /* the blocking function and the watcher each hold a use of
+     * user_data
+     */
+    volatile int user_data_uses;
+    /* only touched by start(), which is serialized by the task */
+    gboolean started;
+} HrtWatcherBlocking;
+
+static void
+blocking_release_user_data(HrtWatcherBlocking *blocking)
+{
+    if (g_atomic_int_dec_and_test(&blocking->user_data_uses)) {
+        if (blocking->user_dnotify != NULL) {
+            (* blocking->user_dnotify) (blocking->user_data);
+        }
+        blocking->user_data = NULL;
+        blocking->user_dnotify = NULL;
+    }
+}
+
+/* IN TASK THREAD */
+static gboolean
+on_blocking_done(HrtTask        *task,
+                 HrtWatcherFlags flags,
+                 void           *data)
+{
+    HrtWatcherBlocking *blocking = data;
+
+    return (* blocking->user_callback) (task, flags,
+                                        blocking->user_data);
+}
+
+/* IN TASK THREAD, or in the blocking thread if the watcher was
+ * removed while the blocking function was running. Either way it's
+ * before the task completes.
+ */
+static void
+on_blocking_detached(void *data)
+{
+    HrtWatcherBlocking *blocking = data;
+
+    blocking_release_user_data(blocking);
+}
+
+static void
+_hrt_watcher_blocking_finalize(HrtWatcher *watcher)
+{
+    g_slice_free(HrtWatcherBlocking, (HrtWatcherBlocking*) watcher);
+}
+
+static void
+_hrt_watcher_blocking_start(HrtWatcher *watcher)
+{
+    HrtWatcherBlocking *blocking = (HrtWatcherBlocking*) watcher;
+    HrtTaskRunner *runner = _hrt_watcher_get_task_runner(watcher);
+
+    /* if the callback returns TRUE we run the blocking function
+     * again, like an immediate watcher runs again. The first run
+     * was admitted by _hrt_task_runner_add_blocking(); a restart
+     * has to get past the same queue limit, and if it can't, the
+     * watcher is removed as if the callback had returned FALSE.
+     */
+    if (blocking->started &&
+        !_hrt_task_runner_admit_blocking(runner)) {
+        hrt_watcher_remove(watcher);
         return;
+    }
+    blocking->started = TRUE;
 
-    _hrt_watcher_queue_invoke(watcher, HRT_WATCHER_FLAG_NONE);
+    g_atomic_int_inc(&blocking->user_data_uses);
+    _hrt_watcher_ref(watcher); /* dropped in _hrt_watcher_blocking_finish */
+
+    /* if the watcher is removed while the blocking function runs,
+     * the task could otherwise complete before we're done with it.
+     */
+    hrt_task_block_completion(watcher->task);
+    _hrt_task_runner_push_blocking(runner, watcher);
+}
+
+static const HrtWatcherVTable blocking_vtable = {
+    _hrt_watcher_blocking_start, /* start */
+    NULL, /* stop; a running blocking function can't be stopped */
+    _hrt_watcher_blocking_finalize  /* finalize */
+};
+
+HrtWatcher*
+_hrt_watcher_new_blocking(HrtTask            *task,
+                          HrtBlockingFunc     blocking_func,
+                          HrtWatcherCallback  callback,
+                          void               *data,
+                          GDestroyNotify      dnotify)
+{
+    HrtWatcherBlocking *blocking;
+
+    blocking = g_slice_new(HrtWatcherBlocking);
+    _hrt_watcher_base_init(&blocking->base,
+                           &blocking_vtable,
+                           task,
+                           on_blocking_done,
+                           blocking,
+                           on_blocking_detached);
+    blocking->blocking_func = blocking_func;
+    blocking->user_callback = callback;
+    blocking->user_data = data;
+    blocking->user_dnotify = dnotify;
+    /* the watcher's use, released on detach */
+    blocking->user_data_uses = 1;
+    blocking->started = FALSE;
+
+    return (HrtWatcher*) blocking;
+}
+
+/* IN BLOCKING THREAD */
+void
+_hrt_watcher_blocking_run(HrtWatcher *watcher)
+{
+    HrtWatcherBlocking *blocking = (HrtWatcherBlocking*) watcher;
+
+    /* don't bother if the watcher was removed (e.g. the task was
+     * cancelled) while we were queued.
+     */
+    if (g_atomic_int_get(&watcher->removed) == 0) {
+        (* blocking->blocking_func) (blocking->user_data);
+    }
+}
+
+/* IN BLOCKING THREAD, after _hrt_watcher_blocking_run(). Separate so
+ * the runner can count the job done before the task is able to
+ * complete.
+ */
+void
+_hrt_watcher_blocking_finish(HrtWatcher *watcher)
+{
+    HrtWatcherBlocking *blocking = (HrtWatcherBlocking*) watcher;
+
+    if (g_atomic_int_get(&watcher->removed) == 0) {
+        _hrt_watcher_queue_invoke(watcher, HRT_WATCHER_FLAG_NONE);
+    }
+
+    blocking_release_user_data(blocking);
+
+    hrt_task_unblock_completion(watcher->task);
+
+    _hrt_watcher_unref(watcher);
 }
@@ -0,0 +1,512 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <hrt/hrt-zerocopy.h>
+#include <hrt/hrt-lock.h>
+#include <hrt/hrt-log.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+/* Below this a copy is cheaper than pinning pages and reading a
+ * completion; the kernel docs suggest the crossover is around 10KB,
+ * and we want to leave headers and small bodies alone.
+ */
+#define DEFAULT_THRESHOLD (64 * 1024)
+
+/* How often to look for completions once the socket is readable for
+ * some other reason and a read watcher would never stop firing.
+ */
+#define POLL_INTERVAL_MSEC 20
+
+typedef struct {
+    /* sequence number the kernel gave the send */
+    guint32 id;
+    gboolean completed;
+    HrtBuffer *buffer;
+} PendingSend;
+
+struct HrtZerocopy {
+    volatile int refcount;
+    HrtTask *task;
+
+    /* touched from any thread writing to the fd and from the task
+     * thread reading completions
+     */
+    HrtLock *lock;
+    int fd;
+    /* the kernel numbers zero-copy sends on a socket from 0 */
+    guint32 next_id;
+    /* PendingSend oldest first, each holding a ref on its buffer */
+    GQueue pending;
+    HrtWatcher *watcher;
+    /* close fd once pending is empty */
+    guint close_when_done : 1;
+    /* watcher is a timeout rather than a read watcher */
+    guint polling : 1;
+};
+
+static volatile int enabled = -1;
+static volatile int threshold = DEFAULT_THRESHOLD;
+
+/* protected by stats_lock() */
+static HrtZerocopyStats stats;
+
+static HrtLock*
+stats_lock(void)
+{
+    static volatile gsize lock = 0;
+
+    if (g_once_init_enter(&lock)) {
+        g_once_init_leave(&lock, (gsize) hrt_lock_new("hrt-zerocopy.stats"));
+    }
+
+    return (HrtLock*) lock;
+}
+
+void
+hrt_zerocopy_set_enabled(gboolean enable)
+{
+    g_atomic_int_set(&enabled, enable != FALSE);
+}
+
+gboolean
+hrt_zerocopy_get_enabled(void)
+{
+    int value;
+
+    value = g_atomic_int_get(&enabled);
+    if (G_UNLIKELY(value < 0)) {
+        const char *env;
+
+        env = g_getenv("HRT_ZEROCOPY");
+        value = env != NULL && strcmp(env, "0") != 0;
+        g_atomic_int_set(&enabled, value);
+    }
+
+    return value;
+}
+
+/* Writes of fewer bytes than this are copied as usual */
+void
+hrt_zerocopy_set_threshold(gsize bytes)
+{
+    g_atomic_int_set(&threshold, MIN(bytes, G_MAXINT));
+}
+
+gsize
+hrt_zerocopy_get_threshold(void)
+{
+    return g_atomic_int_get(&threshold);
+}
+
+void
+hrt_zerocopy_get_stats(HrtZerocopyStats *stats_out)
+{
+    hrt_lock_lock(stats_lock());
+    *stats_out = stats;
+    hrt_lock_unlock(stats_lock());
+}
+
+/* Returns NULL if the socket can't do zero-copy sends, for example
+ * on kernels before 4.14 or a socket that isn't TCP. The fd stays
+ * the caller's until hrt_zerocopy_close_fd().
+ */
+HrtZerocopy*
+hrt_zerocopy_new(HrtTask *task,
+                 int      fd)
+{
+    HrtZerocopy *zerocopy;
+    int one;
+
+    g_return_val_if_fail(fd >= 0, NULL);
+
+#ifdef SO_ZEROCOPY
+    one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        hrt_debug("no zero-copy sends on fd %d: %s", fd, g_strerror(errno));
+        return NULL;
+    }
+#else
+    return NULL;
+#endif
+
+    zerocopy = g_slice_new0(HrtZerocopy);
+    zerocopy->refcount = 1;
+    zerocopy->task = g_object_ref(task);
+    zerocopy->lock = hrt_lock_new("hrt-zerocopy.lock");
+    zerocopy->fd = fd;
+    g_queue_init(&zerocopy->pending);
+
+    return zerocopy;
+}
+
+void
+hrt_zerocopy_ref(HrtZerocopy *zerocopy)
+{
+    g_atomic_int_inc(&zerocopy->refcount);
+}
+
+void
+hrt_zerocopy_unref(HrtZerocopy *zerocopy)
+{
+    if (g_atomic_int_dec_and_test(&zerocopy->refcount)) {
+        /* the watcher holds a ref while anything is pending */
+        g_assert(zerocopy->watcher == NULL);
+        g_assert(g_queue_get_length(&zerocopy->pending) == 0);
+
+        hrt_lock_free(zerocopy->lock);
+        g_object_unref(zerocopy->task);
+        g_slice_free(HrtZerocopy, zerocopy);
+    }
+}
+
+static void
+pending_send_free(PendingSend *send)
+{
+    hrt_buffer_unref(send->buffer);
+    g_slice_free(PendingSend, send);
+}
+
+/* id is in [lo, hi], allowing for the 32-bit ids wrapping */
+static gboolean
+id_in_range(guint32 id,
+            guint32 lo,
+            guint32 hi)
+{
+    return (gint32) (id - lo) >= 0 &&
+        (gint32) (hi - id) >= 0;
+}
+
+/* Called with the lock held. Returns the number of sends completed. */
+static int
+complete_range(HrtZerocopy *zerocopy,
+               guint32      lo,
+               guint32      hi,
+               gboolean     copied)
+{
+    PendingSend *send;
+    GList *l;
+    int n_completed;
+
+    n_completed = 0;
+    for (l = zerocopy->pending.head; l != NULL; l = l->next) {
+        send = l->data;
+
+        if (!send->completed && id_in_range(send->id, lo, hi)) {
+            send->completed = TRUE;
+            n_completed += 1;
+        }
+    }
+
+    /* TCP completes in order, but free only from the head anyway so
+     * an out-of-order range can't leave a hole
+     */
+    while ((send = g_queue_peek_head(&zerocopy->pending)) != NULL &&
+           send->completed) {
+        g_queue_pop_head(&zerocopy->pending);
+        pending_send_free(send);
+    }
+
+    if (n_completed > 0) {
+        hrt_lock_lock(stats_lock());
+        stats.completed_sends += n_completed;
+        if (copied)
+            stats.copied_sends += n_completed;
+        hrt_lock_unlock(stats_lock());
+    }
+
+    return n_completed;
+}
+
+/* Called with the lock held. Reads every completion queued on the
+ * socket's error queue.
+ */
+static void
+read_completions(HrtZerocopy *zerocopy)
+{
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        gssize result;
+
+        memset(&msg, '\0', sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        result = recvmsg(zerocopy->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            /* EAGAIN means the queue is empty */
+            break;
+        }
+
+        hrt_lock_lock(stats_lock());
+        stats.notifications += 1;
+        hrt_lock_unlock(stats_lock());
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *serr;
+
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err*) CMSG_DATA(cmsg);
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            complete_range(zerocopy, serr->ee_info, serr->ee_data,
+                           (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+#endif
+        }
+    }
+}
+
+/* Called with the lock held, once pending may have emptied */
+static void
+check_done(HrtZerocopy *zerocopy)
+{
+    if (g_queue_get_length(&zerocopy->pending) > 0)
+        return;
+
+    if (zerocopy->watcher != NULL) {
+        hrt_watcher_remove(zerocopy->watcher);
+        zerocopy->watcher = NULL;
+    }
+    /* the next send tries a read watcher again */
+    zerocopy->polling = FALSE;
+
+    if (zerocopy->close_when_done && zerocopy->fd >= 0) {
+        close(zerocopy->fd);
+        zerocopy->fd = -1;
+    }
+}
+
+/* Called with the lock held. Only POLLERR says the error queue has
+ * something; read watchers also fire for ordinary data and EOF.
+ */
+static gboolean
+error_queue_ready(HrtZerocopy *zerocopy)
+{
+    struct pollfd pfd;
+
+    pfd.fd = zerocopy->fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) > 0 &&
+        (pfd.revents & POLLERR) != 0;
+}
+
+static gboolean on_error_queue (HrtTask        *task,
+                                HrtWatcherFlags flags,
+                                void           *data);
+
+/* Called with the lock held */
+static void
+add_watcher(HrtZerocopy *zerocopy)
+{
+    hrt_zerocopy_ref(zerocopy);
+
+    if (zerocopy->polling) {
+        zerocopy->watcher =
+            hrt_task_add_timeout(zerocopy->task,
+                                 POLL_INTERVAL_MSEC,
+                                 on_error_queue,
+                                 zerocopy,
+                                 (GDestroyNotify) hrt_zerocopy_unref);
+    } else {
+        zerocopy->watcher =
+            hrt_task_add_io(zerocopy->task,
+                            zerocopy->fd,
+                            HRT_WATCHER_FLAG_READ,
+                            on_error_queue,
+                            zerocopy,
+                            (GDestroyNotify) hrt_zerocopy_unref);
+    }
+}
+
+/* IN OUR TASK THREAD */
+static gboolean
+on_error_queue(HrtTask        *task,
+               HrtWatcherFlags flags,
+               void           *data)
+{
+    HrtZerocopy *zerocopy = data;
+    gboolean spurious;
+
+    /* Error queue readiness shows up as POLLERR, which wakes read
+     * watchers; but so does ordinary data the connection hasn't
+     * read yet, or the peer's EOF once the connection has stopped
+     * reading. Those stay ready, so the read watcher would fire
+     * nonstop until the kernel is done with our sends. If we were
+     * woken without POLLERR, fall back to checking on a timer.
+     */
+    hrt_lock_lock(zerocopy->lock);
+    if (zerocopy->fd >= 0) {
+        hrt_lock_lock(stats_lock());
+        stats.wakeups += 1;
+        hrt_lock_unlock(stats_lock());
+
+        spurious = (flags & HRT_WATCHER_FLAG_READ) != 0 &&
+            !error_queue_ready(zerocopy);
+
+        read_completions(zerocopy);
+        check_done(zerocopy);
+
+        if (spurious && zerocopy->watcher != NULL) {
+            hrt_watcher_remove(zerocopy->watcher);
+            zerocopy->polling = TRUE;
+            add_watcher(zerocopy);
+        }
+    }
+    hrt_lock_unlock(zerocopy->lock);
+
+    /* stay installed until check_done() removes us */
+    return TRUE;
+}
+
+/* Whether hrt_zerocopy_write() would send remaining bytes of
+ * locked_buffer without copying them.
+ */
+gboolean
+hrt_zerocopy_wants(HrtZerocopy *zerocopy,
+                   HrtBuffer   *locked_buffer,
+                   gsize        remaining)
+{
+    return hrt_buffer_is_sent_in_place(locked_buffer) &&
+        remaining >= hrt_zerocopy_get_threshold();
+}
+
+/* Like hrt_buffer_write(), but a large enough write is sent with
+ * MSG_ZEROCOPY and locked_buffer is reffed until the kernel is done
+ * with it. more says whether to set MSG_MORE.
+ */
+/* CALLED FROM ANY THREAD */
+gboolean
+hrt_zerocopy_write(HrtZerocopy *zerocopy,
+                   HrtBuffer   *locked_buffer,
+                   gsize       *remaining_inout,
+                   gboolean     more)
+{
+    gsize before;
+    int flags;
+
+    flags = more ? MSG_MORE : 0;
+
+    if (!hrt_zerocopy_wants(zerocopy, locked_buffer, *remaining_inout))
+        return hrt_buffer_send(locked_buffer, zerocopy->fd, remaining_inout, flags);
+
+#ifdef MSG_ZEROCOPY
+    hrt_lock_lock(zerocopy->lock);
+
+    /* pick up completions as we go, so a watcher that's gone to
+     * polling doesn't hold buffers for a whole interval
+     */
+    if (g_queue_get_length(&zerocopy->pending) > 0)
+        read_completions(zerocopy);
+
+    before = *remaining_inout;
+    if (!hrt_buffer_send(locked_buffer, zerocopy->fd, remaining_inout,
+                         flags | MSG_ZEROCOPY)) {
+        hrt_lock_unlock(zerocopy->lock);
+
+        /* out of option memory to track the send; copy instead */
+        if (errno == ENOBUFS) {
+            hrt_lock_lock(stats_lock());
+            stats.fallbacks += 1;
+            hrt_lock_unlock(stats_lock());
+
+            return hrt_buffer_send(locked_buffer, zerocopy->fd, remaining_inout, flags);
+        }
+
+        return FALSE;
+    }
+
+    /* the kernel only numbers sends that sent something */
+    if (*remaining_inout < before) {
+        PendingSend *send;
+
+        send = g_slice_new(PendingSend);
+        send->id = zerocopy->next_id;
+        send->completed = FALSE;
+        send->buffer = locked_buffer;
+        hrt_buffer_ref(send->buffer);
+
+        zerocopy->next_id += 1;
+        g_queue_push_tail(&zerocopy->pending, send);
+
+        if (zerocopy->watcher == NULL)
+            add_watcher(zerocopy);
+
+        hrt_lock_lock(stats_lock());
+        stats.sends += 1;
+        stats.bytes += before - *remaining_inout;
+        hrt_lock_unlock(stats_lock());
+    }
+
+    hrt_lock_unlock(zerocopy->lock);
+
+    return TRUE;
+#else
+    return hrt_buffer_send(locked_buffer, zerocopy->fd, remaining_inout, flags);
+#endif
+}
+
+/* Number of zero-copy sends the kernel hasn't finished with */
+int
+hrt_zerocopy_get_pending(HrtZerocopy *zerocopy)
+{
+    int n;
+
+    hrt_lock_lock(zerocopy->lock);
+    n = g_queue_get_length(&zerocopy->pending);
+    hrt_lock_unlock(zerocopy->lock);
+
+    return n;
+}
+
+/* Closes the fd once the kernel has finished with every pending
+ * send, since until then it may still be reading their buffers to
+ * send them. No more writes are allowed after this.
+ */
+void
+hrt_zerocopy_close_fd(HrtZerocopy *zerocopy)
+{
+    hrt_lock_lock(zerocopy->lock);
+    zerocopy->close_when_done = TRUE;
+    if (zerocopy->fd >= 0)
+        read_completions(zerocopy);
+    check_done(zerocopy);
+    hrt_lock_unlock(zerocopy->lock);
+}
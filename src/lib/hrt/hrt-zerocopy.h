@@ -0,0 +1,91 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __HRT_ZEROCOPY_H__
+#define __HRT_ZEROCOPY_H__
+
+/*
+ * Zero-copy sends of large buffers on one socket with MSG_ZEROCOPY.
+ * The kernel sends straight from the buffer's memory instead of
+ * copying it, so the buffer is kept (reffed) until the kernel reports
+ * on the socket's error queue that it's done with it. A watcher in
+ * the given task reads those reports while any sends are pending: an
+ * io watcher, or a timer once the socket stays readable for other
+ * reasons such as the peer's EOF.
+ *
+ * Pinning pages and reading completions costs more than copying a
+ * small buffer, so only writes of at least the threshold go this way.
+ * It's opt-in, with hrt_zerocopy_set_enabled() or HRT_ZEROCOPY=1 in
+ * the environment.
+ */
+
+#include <glib.h>
+#include <hrt/hrt-buffer.h>
+#include <hrt/hrt-task.h>
+
+G_BEGIN_DECLS
+
+typedef struct HrtZerocopy HrtZerocopy;
+
+typedef struct {
+    /* zero-copy sends, and the bytes they sent, i.e. copies avoided */
+    guint64 sends;
+    guint64 bytes;
+    /* of the completed sends, ones the kernel ended up copying */
+    guint64 copied_sends;
+    /* completion overhead: messages read from error queues, and
+     * the sends they completed
+     */
+    guint64 notifications;
+    guint64 completed_sends;
+    /* times a completion watcher ran, whether or not it found any */
+    guint64 wakeups;
+    /* writes over the threshold sent the normal way because the
+     * kernel had no room to track another zero-copy send
+     */
+    guint64 fallbacks;
+} HrtZerocopyStats;
+
+void         hrt_zerocopy_set_enabled   (gboolean          enabled);
+gboolean     hrt_zerocopy_get_enabled   (void);
+void         hrt_zerocopy_set_threshold (gsize             bytes);
+gsize        hrt_zerocopy_get_threshold (void);
+void         hrt_zerocopy_get_stats     (HrtZerocopyStats *stats);
+
+HrtZerocopy* hrt_zerocopy_new           (HrtTask          *task,
+                                         int               fd);
+void         hrt_zerocopy_ref           (HrtZerocopy      *zerocopy);
+void         hrt_zerocopy_unref         (HrtZerocopy      *zerocopy);
+gboolean     hrt_zerocopy_wants         (HrtZerocopy      *zerocopy,
+                                         HrtBuffer        *locked_buffer,
+                                         gsize             remaining);
+gboolean     hrt_zerocopy_write         (HrtZerocopy      *zerocopy,
+                                         HrtBuffer        *locked_buffer,
+                                         gsize            *remaining_inout,
+                                         gboolean          more);
+int          hrt_zerocopy_get_pending   (HrtZerocopy      *zerocopy);
+void         hrt_zerocopy_close_fd      (HrtZerocopy      *zerocopy);
+
+G_END_DECLS
+
+#endif  /* __HRT_ZEROCOPY_H__ */
@@ -0,0 +1,321 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Not a test; compares the hrt-utf kernels against the code they
+ * replaced (a byte loop, and GLib's converters) on header-sized and
+ * body-sized text. Build with "make bench-utf".
+ */
+
+#include <config.h>
+#include <glib.h>
+#include <hrt/hrt-utf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* run each case for about this long */
+#define CASE_NSEC (50 * 1000 * 1000)
+
+typedef struct {
+    const char *name;
+    gsize len;
+} Size;
+
+static const Size sizes[] = {
+    { "header", 24 },
+    { "headers", 512 },
+    { "body", 16 * 1024 },
+    { "big-body", 1024 * 1024 }
+};
+
+typedef struct {
+    char *utf8;
+    gsize utf8_len;
+    guint16 *utf16;
+    gsize utf16_len;
+    /* scratch space for results */
+    guint16 *wide;
+    char *narrow;
+} Input;
+
+typedef gboolean (* BenchFunc) (Input *input);
+
+static gint64
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((gint64) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* every 64th character é if not ascii, which is about right for
+ * European-language text
+ */
+static void
+input_init(Input   *input,
+           gsize    len,
+           gboolean ascii)
+{
+    GString *str;
+    long n_units;
+
+    str = g_string_sized_new(len + 2);
+    while (str->len < len) {
+        if (!ascii && str->len % 64 == 63)
+            g_string_append(str, "\xc3\xa9");
+        else
+            g_string_append_c(str, 'a' + (str->len % 26));
+    }
+    g_string_truncate(str, len);
+    /* don't leave half a character at the end */
+    if (!ascii && len > 0 && (str->str[len - 1] & 0xE0) == 0xC0)
+        str->str[len - 1] = 'z';
+
+    input->utf8_len = str->len;
+    input->utf8 = g_string_free(str, FALSE);
+    input->utf16 = g_utf8_to_utf16(input->utf8, input->utf8_len,
+                                   NULL, &n_units, NULL);
+    input->utf16_len = n_units;
+    input->wide = g_new(guint16, input->utf8_len + 1);
+    input->narrow = g_malloc(input->utf16_len * 3 + 1);
+}
+
+static void
+input_free(Input *input)
+{
+    g_free(input->utf8);
+    g_free(input->utf16);
+    g_free(input->wide);
+    g_free(input->narrow);
+}
+
+/* utf16_append_ascii() before the kernels */
+static gboolean
+widen_loop(Input *input)
+{
+    guint16 *dest = input->wide;
+    const char *src = input->utf8;
+    gsize i;
+
+    for (i = 0; i < input->utf8_len; ++i) {
+        dest[i] = src[i];
+    }
+
+    return TRUE;
+}
+
+static gboolean
+widen_hrt(Input *input)
+{
+    hrt_utf_widen_ascii(input->wide, input->utf8, input->utf8_len);
+    return TRUE;
+}
+
+static gboolean
+is_ascii_loop(Input *input)
+{
+    gsize i;
+
+    for (i = 0; i < input->utf8_len; ++i) {
+        if (((guchar) input->utf8[i]) >= 0x80)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+is_ascii_hrt(Input *input)
+{
+    return hrt_utf_is_ascii(input->utf8, input->utf8_len);
+}
+
+static gboolean
+validate_glib(Input *input)
+{
+    return g_utf8_validate(input->utf8, input->utf8_len, NULL);
+}
+
+static gboolean
+validate_hrt(Input *input)
+{
+    return hrt_utf8_validate(input->utf8, input->utf8_len);
+}
+
+static gboolean
+to_utf16_glib(Input *input)
+{
+    gunichar2 *utf16;
+
+    utf16 = g_utf8_to_utf16(input->utf8, input->utf8_len,
+                            NULL, NULL, NULL);
+    g_free(utf16);
+
+    return utf16 != NULL;
+}
+
+static gboolean
+to_utf16_hrt(Input *input)
+{
+    guint16 *utf16;
+    gssize len;
+
+    /* allocate like the GLib version has to */
+    utf16 = g_new(guint16, input->utf8_len + 1);
+    len = hrt_utf8_to_utf16(input->utf8, input->utf8_len, utf16);
+    g_free(utf16);
+
+    return len >= 0;
+}
+
+/* what try_string_to_utf8() in hjs did before the kernels */
+static gboolean
+to_utf8_glib(Input *input)
+{
+    char *utf8;
+    long utf8_len;
+    gboolean valid;
+
+    utf8 = g_utf16_to_utf8(input->utf16, input->utf16_len,
+                           NULL, &utf8_len, NULL);
+    valid = utf8 != NULL && g_utf8_validate(utf8, utf8_len, NULL);
+    g_free(utf8);
+
+    return valid;
+}
+
+static gboolean
+to_utf8_hrt(Input *input)
+{
+    char *utf8;
+    gssize len;
+
+    utf8 = g_malloc(input->utf16_len * 3 + 1);
+    len = hrt_utf16_to_utf8(input->utf16, input->utf16_len, utf8);
+    g_free(utf8);
+
+    return len >= 0;
+}
+
+typedef struct {
+    const char *name;
+    BenchFunc baseline;
+    const char *baseline_name;
+    BenchFunc hrt;
+} Op;
+
+static const Op ops[] = {
+    { "widen", widen_loop, "loop", widen_hrt },
+    { "is-ascii", is_ascii_loop, "loop", is_ascii_hrt },
+    { "validate", validate_glib, "glib", validate_hrt },
+    { "utf8-to-16", to_utf16_glib, "glib", to_utf16_hrt },
+    { "utf16-to-8", to_utf8_glib, "glib", to_utf8_hrt }
+};
+
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+static double
+time_func(BenchFunc func,
+          Input    *input)
+{
+    gint64 start;
+    gint64 elapsed;
+    guint64 iterations;
+    guint64 batch;
+    guint64 i;
+
+    /* warm up, and size batches so we look at the clock rarely */
+    (* func) (input);
+    batch = MAX(1, (1024 * 1024) / MAX(input->utf8_len, 1));
+
+    iterations = 0;
+    start = now_nsec();
+    do {
+        for (i = 0; i < batch; ++i)
+            (* func) (input);
+        iterations += batch;
+        elapsed = now_nsec() - start;
+    } while (elapsed < CASE_NSEC);
+
+    return ((double) elapsed) / iterations;
+}
+
+static void
+report(const char *op,
+       const char *size,
+       const char *text,
+       const char *impl,
+       double      nsec,
+       gsize       bytes,
+       double      baseline_nsec)
+{
+    g_print("%-11s %-9s %-6s %-7s %12.1f ns %9.0f MB/s %6.2fx\n",
+            op, size, text, impl, nsec,
+            (bytes / (nsec / 1e9)) / (1024 * 1024),
+            baseline_nsec / nsec);
+}
+
+int
+main(int    argc,
+     char **argv)
+{
+    HrtUtfKernels best;
+    guint s;
+    guint o;
+    int ascii;
+    int k;
+
+    best = hrt_utf_set_kernels(HRT_UTF_KERNELS_AVX2);
+
+    g_print("%-11s %-9s %-6s %-7s %15s %14s %7s\n",
+            "op", "size", "text", "impl", "time/call", "throughput", "speedup");
+
+    for (o = 0; o < G_N_ELEMENTS(ops); ++o) {
+        for (s = 0; s < G_N_ELEMENTS(sizes); ++s) {
+            for (ascii = 1; ascii >= 0; --ascii) {
+                Input input;
+                double baseline;
+
+                input_init(&input, sizes[s].len, ascii);
+
+                baseline = time_func(ops[o].baseline, &input);
+                report(ops[o].name, sizes[s].name, ascii ? "ascii" : "mixed",
+                       ops[o].baseline_name, baseline, input.utf8_len, baseline);
+
+                for (k = HRT_UTF_KERNELS_SCALAR; k <= (int) best; ++k) {
+                    hrt_utf_set_kernels(k);
+                    report(ops[o].name, sizes[s].name, ascii ? "ascii" : "mixed",
+                           kernel_names[k], time_func(ops[o].hrt, &input),
+                           input.utf8_len, baseline);
+                }
+
+                input_free(&input);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,217 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+
+#define NUM_TASKS 50
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    GMainLoop *loop;
+} TestFixture;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= NUM_TASKS) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type)
+{
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static gboolean
+on_immediate(HrtTask        *task,
+             HrtWatcherFlags flags,
+             void           *data)
+{
+    HrtTaskRunner *runner = data;
+    HrtTaskRunnerLoad load;
+
+    /* we're still in flight, and active, while running */
+    hrt_task_runner_get_load(runner, &load);
+    g_assert_cmpint(load.in_flight_tasks, >=, 1);
+    g_assert_cmpint(load.active_tasks, >=, 1);
+
+    return FALSE;
+}
+
+static void
+test_in_flight_count(TestFixture *fixture,
+                     const void  *data)
+{
+    HrtTask *tasks[NUM_TASKS];
+    HrtTaskRunnerLoad load;
+    int i;
+
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpint(load.in_flight_tasks, ==, 0);
+    g_assert_cmpint(load.concurrency_limit, >, NUM_TASKS);
+    g_assert(!hrt_task_runner_is_overloaded(fixture->runner));
+
+    /* tasks with no watchers aren't in flight */
+    for (i = 0; i < NUM_TASKS; ++i) {
+        tasks[i] = hrt_task_runner_create_task(fixture->runner);
+    }
+
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpint(load.in_flight_tasks, ==, 0);
+
+    for (i = 0; i < NUM_TASKS; ++i) {
+        hrt_task_block_completion(tasks[i]);
+    }
+
+    /* in flight but with nothing to do, like an idle connection,
+     * so not counted against the limit
+     */
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpint(load.in_flight_tasks, ==, NUM_TASKS);
+    g_assert_cmpint(load.active_tasks, ==, 0);
+    g_assert(!hrt_task_runner_is_overloaded(fixture->runner));
+
+    for (i = 0; i < NUM_TASKS; ++i) {
+        hrt_task_add_immediate(tasks[i], on_immediate,
+                               fixture->runner, NULL);
+        hrt_task_unblock_completion(tasks[i]);
+        g_object_unref(tasks[i]);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_TASKS);
+
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpint(load.in_flight_tasks, ==, 0);
+    g_assert_cmpint(load.active_tasks, ==, 0);
+    g_assert_cmpint(load.queue_delay_usec, >=, 0);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Admission Control");
+    g_option_context_add_main_entries(context, entries, "test-admission");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-admission %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/admission/in_flight_count_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_in_flight_count,
+               teardown_test_fixture);
+
+    g_test_add("/admission/in_flight_count_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_in_flight_count,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -0,0 +1,540 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+
+#define NUM_TASKS 50
+#define QUEUE_LIMIT 4
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    int tasks_expected_count;
+    /* these are accessed by multiple threads so need to be atomic */
+    volatile int dnotify_count;
+    volatile int blocking_run_count;
+    volatile int done_count;
+    /* blocking funcs wait here until the gate is opened */
+    GMutex *gate_lock;
+    GCond *gate_cond;
+    gboolean gate_open;
+    GMainLoop *loop;
+    /* for test_restart_limit */
+    int restart_done_count;
+    int restart_dnotify_count;
+    int fillers_accepted;
+} TestFixture;
+
+typedef struct {
+    TestFixture *fixture;
+    gboolean ran;
+} Job;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= fixture->tasks_expected_count) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type)
+{
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     "blocking-threads", 2,
+                     "blocking-queue-limit", QUEUE_LIMIT,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+
+    fixture->gate_lock = g_mutex_new();
+    fixture->gate_cond = g_cond_new();
+    fixture->gate_open = TRUE;
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+    g_cond_free(fixture->gate_cond);
+    g_mutex_free(fixture->gate_lock);
+}
+
+static void
+set_gate_open(TestFixture *fixture,
+              gboolean     open)
+{
+    g_mutex_lock(fixture->gate_lock);
+    fixture->gate_open = open;
+    g_cond_broadcast(fixture->gate_cond);
+    g_mutex_unlock(fixture->gate_lock);
+}
+
+static void
+on_job_dnotify(void *data)
+{
+    Job *job = data;
+
+    g_atomic_int_inc(&job->fixture->dnotify_count);
+    g_slice_free(Job, job);
+}
+
+static void
+run_job_blocking(void *data)
+{
+    Job *job = data;
+    TestFixture *fixture = job->fixture;
+
+    g_mutex_lock(fixture->gate_lock);
+    while (!fixture->gate_open)
+        g_cond_wait(fixture->gate_cond, fixture->gate_lock);
+    g_mutex_unlock(fixture->gate_lock);
+
+    /* pretend to do some disk IO */
+    g_usleep(G_USEC_PER_SEC / 1000);
+
+    job->ran = TRUE;
+    g_atomic_int_inc(&fixture->blocking_run_count);
+}
+
+static gboolean
+on_job_done(HrtTask        *task,
+            HrtWatcherFlags flags,
+            void           *data)
+{
+    Job *job = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    /* the blocking func has to be done before we're invoked */
+    g_assert(job->ran);
+
+    g_atomic_int_inc(&job->fixture->done_count);
+
+    return FALSE;
+}
+
+static Job*
+job_new(TestFixture *fixture)
+{
+    Job *job;
+
+    job = g_slice_new0(Job);
+    job->fixture = fixture;
+
+    return job;
+}
+
+static void
+test_run_blocking(TestFixture *fixture,
+                  const void  *data)
+{
+    HrtTaskRunnerBlockingStats stats;
+    int i;
+
+    fixture->tasks_expected_count = NUM_TASKS;
+
+    /* QUEUE_LIMIT is smaller than NUM_TASKS, so don't let more
+     * than that queue up.
+     */
+    for (i = 0; i < NUM_TASKS; ++i) {
+        HrtTask *task;
+        HrtWatcher *watcher;
+
+        hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+        while (stats.queued >= QUEUE_LIMIT) {
+            g_usleep(G_USEC_PER_SEC / 1000);
+            hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+        }
+
+        task = hrt_task_runner_create_task(fixture->runner);
+
+        watcher = hrt_task_run_blocking(task,
+                                        run_job_blocking,
+                                        on_job_done,
+                                        job_new(fixture),
+                                        on_job_dnotify);
+        g_assert(watcher != NULL);
+
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_TASKS);
+    g_assert_cmpint(fixture->blocking_run_count, ==, NUM_TASKS);
+    g_assert_cmpint(fixture->done_count, ==, NUM_TASKS);
+    g_assert_cmpint(fixture->dnotify_count, ==, NUM_TASKS);
+
+    hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+    g_assert_cmpint(stats.n_threads, ==, 2);
+    g_assert_cmpint(stats.queue_limit, ==, QUEUE_LIMIT);
+    g_assert_cmpint(stats.submitted, ==, NUM_TASKS);
+    g_assert_cmpint(stats.completed, ==, NUM_TASKS);
+    g_assert_cmpint(stats.rejected, ==, 0);
+    g_assert_cmpint(stats.queued, ==, 0);
+    g_assert_cmpint(stats.running, ==, 0);
+}
+
+static void
+test_queue_limit(TestFixture *fixture,
+                 const void  *data)
+{
+    HrtTaskRunnerBlockingStats stats;
+    HrtTask *task;
+    Job *rejected_job;
+    int accepted;
+
+    /* keep blocking funcs from finishing so the queue fills up */
+    set_gate_open(fixture, FALSE);
+
+    task = hrt_task_runner_create_task(fixture->runner);
+
+    /* at most 2 jobs can be running and QUEUE_LIMIT queued, after
+     * that we must be refused.
+     */
+    rejected_job = NULL;
+    for (accepted = 0; accepted <= QUEUE_LIMIT + 2; ++accepted) {
+        Job *job;
+
+        job = job_new(fixture);
+        if (hrt_task_run_blocking(task,
+                                  run_job_blocking,
+                                  on_job_done,
+                                  job,
+                                  on_job_dnotify) == NULL) {
+            rejected_job = job;
+            break;
+        }
+    }
+
+    g_assert(rejected_job != NULL);
+    g_assert_cmpint(accepted, >=, QUEUE_LIMIT);
+
+    /* caller still owns the data of a refused job */
+    g_assert(!rejected_job->ran);
+    g_slice_free(Job, rejected_job);
+
+    hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+    g_assert_cmpint(stats.rejected, ==, 1);
+    g_assert_cmpint(stats.submitted, ==, accepted);
+
+    g_object_unref(task);
+
+    fixture->tasks_expected_count = 1;
+    set_gate_open(fixture, TRUE);
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->blocking_run_count, ==, accepted);
+    g_assert_cmpint(fixture->done_count, ==, accepted);
+    g_assert_cmpint(fixture->dnotify_count, ==, accepted);
+}
+
+static void
+test_cancel_blocking(TestFixture *fixture,
+                     const void  *data)
+{
+    HrtTask *task;
+    int i;
+
+    set_gate_open(fixture, FALSE);
+
+    task = hrt_task_runner_create_task(fixture->runner);
+
+    for (i = 0; i < QUEUE_LIMIT; ++i) {
+        g_assert(hrt_task_run_blocking(task,
+                                       run_job_blocking,
+                                       on_job_done,
+                                       job_new(fixture),
+                                       on_job_dnotify) != NULL);
+    }
+
+    /* jobs that were already running finish, but nobody's
+     * done callback runs, and every job's data is freed.
+     */
+    hrt_task_cancel(task);
+    set_gate_open(fixture, TRUE);
+
+    g_object_unref(task);
+
+    fixture->tasks_expected_count = 1;
+
+    g_main_loop_run(fixture->loop);
+
+    /* the task can't complete until running jobs have returned */
+    g_assert_cmpint(fixture->done_count, ==, 0);
+    g_assert_cmpint(fixture->blocking_run_count, <=, 2);
+    g_assert_cmpint(fixture->dnotify_count, ==, QUEUE_LIMIT);
+}
+
+static void
+run_restart_blocking(void *data)
+{
+    Job *job = data;
+
+    g_atomic_int_inc(&job->fixture->blocking_run_count);
+}
+
+static void
+wait_for_running(TestFixture *fixture,
+                 int          n_running)
+{
+    HrtTaskRunnerBlockingStats stats;
+
+    hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+    while (stats.running != n_running) {
+        g_usleep(G_USEC_PER_SEC / 1000);
+        hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+    }
+}
+
+static gboolean
+on_restart_done(HrtTask        *task,
+                HrtWatcherFlags flags,
+                void           *data)
+{
+    Job *job = data;
+    TestFixture *fixture = job->fixture;
+    Job *filler;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    fixture->restart_done_count += 1;
+
+    /* Fill the blocking pool: tie up both threads, then queue
+     * until refused. Nothing can leave the queue until the gate
+     * opens, so the restart we ask for below must be refused too.
+     * Our own blocking func can still count as running until just
+     * after we're invoked, so wait that out first.
+     */
+    set_gate_open(fixture, FALSE);
+    wait_for_running(fixture, 0);
+
+    while (TRUE) {
+        if (fixture->fillers_accepted == 2)
+            wait_for_running(fixture, 2);
+
+        filler = job_new(fixture);
+        if (hrt_task_run_blocking(task,
+                                  run_job_blocking,
+                                  on_job_done,
+                                  filler,
+                                  on_job_dnotify) == NULL) {
+            g_slice_free(Job, filler);
+            break;
+        }
+        fixture->fillers_accepted += 1;
+    }
+
+    return TRUE;
+}
+
+/* IN TASK THREAD, once the refused restart removes the watcher */
+static void
+on_restart_dnotify(void *data)
+{
+    Job *job = data;
+    TestFixture *fixture = job->fixture;
+
+    fixture->restart_dnotify_count += 1;
+    g_slice_free(Job, job);
+
+    set_gate_open(fixture, TRUE);
+}
+
+static void
+test_restart_limit(TestFixture *fixture,
+                   const void  *data)
+{
+    HrtTaskRunnerBlockingStats stats;
+    HrtTask *task;
+
+    task = hrt_task_runner_create_task(fixture->runner);
+
+    g_assert(hrt_task_run_blocking(task,
+                                   run_restart_blocking,
+                                   on_restart_done,
+                                   job_new(fixture),
+                                   on_restart_dnotify) != NULL);
+
+    g_object_unref(task);
+
+    fixture->tasks_expected_count = 1;
+
+    g_main_loop_run(fixture->loop);
+
+    /* the restart was refused, so the blocking func ran once for
+     * the restarting job and once for each filler.
+     */
+    g_assert_cmpint(fixture->restart_done_count, ==, 1);
+    g_assert_cmpint(fixture->restart_dnotify_count, ==, 1);
+    g_assert_cmpint(fixture->fillers_accepted, ==, QUEUE_LIMIT + 2);
+    g_assert_cmpint(fixture->blocking_run_count, ==,
+                    fixture->fillers_accepted + 1);
+    g_assert_cmpint(fixture->done_count, ==, fixture->fillers_accepted);
+    g_assert_cmpint(fixture->dnotify_count, ==, fixture->fillers_accepted);
+
+    hrt_task_runner_get_blocking_stats(fixture->runner, &stats);
+    g_assert_cmpint(stats.submitted, ==, fixture->fillers_accepted + 1);
+    g_assert_cmpint(stats.rejected, ==, 2);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Blocking Work");
+    g_option_context_add_main_entries(context, entries, "test-blocking");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-blocking %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/blocking/run_blocking_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_run_blocking,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/run_blocking_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_run_blocking,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/queue_limit_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_queue_limit,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/queue_limit_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_queue_limit,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/cancel_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_cancel_blocking,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/cancel_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_cancel_blocking,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/restart_limit_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_restart_limit,
+               teardown_test_fixture);
+
+    g_test_add("/blocking/restart_limit_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_restart_limit,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
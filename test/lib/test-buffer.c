@@ -25,12 +25,18 @@
 #include <glib-object.h>
 #include <hrt/hrt-log.h>
 #include <hrt/hrt-buffer.h>
+#include <hrt/hrt-buffer-builder.h>
+#include <hrt/hrt-buffer-pool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 typedef struct {
     HrtBuffer *buffer;
     int allocator_dnotify_count;
+    int malloc_count;
     gboolean used_our_allocator;
 } BufferTestFixture;
 
@@ -39,7 +45,12 @@ buffer_g_malloc(gsize bytes,
                 void *allocator_data)
 {
     /* break if allocator isn't used */
+    BufferTestFixture *fixture = allocator_data;
     void *mem;
+
+    if (fixture != NULL)
+        fixture->malloc_count += 1;
+
     mem = g_try_malloc(bytes + 4);
     return mem ? ((char*)mem) + 4 : NULL;
 }
@@ -118,6 +129,26 @@ setup_utf16(BufferTestFixture *fixture,
     fixture->used_our_allocator = TRUE;
 }
 
+static void
+setup_binary(BufferTestFixture *fixture,
+             const void        *data)
+{
+    fixture->buffer =
+        hrt_buffer_new(HRT_BUFFER_ENCODING_BINARY,
+                       &allocator, fixture, allocator_dnotify);
+    fixture->used_our_allocator = TRUE;
+}
+
+static void
+setup_pool(BufferTestFixture *fixture,
+           const void        *data)
+{
+    fixture->buffer =
+        hrt_buffer_new(HRT_BUFFER_ENCODING_UTF8,
+                       hrt_buffer_pool_get_allocator(),
+                       NULL, NULL);
+}
+
 static void
 setup_utf8_static(BufferTestFixture *fixture,
                   const void        *data)
@@ -242,6 +273,122 @@ test_utf8_steal(BufferTestFixture *fixture,
     allocator.free(utf8, fixture);
 }
 
+static void
+test_utf16_compact(BufferTestFixture *fixture,
+                   const void        *data)
+{
+    const guint16 *utf16;
+    const guint16 *again;
+    gsize len;
+    int fds[2];
+    guint16 wire[64];
+    gssize bytes_read;
+    gsize remaining;
+
+    /* all Latin-1, so one byte each, which fits inline */
+    hrt_buffer_append_ascii(fixture->buffer, "Accept-Language: ", 17);
+    g_assert(hrt_buffer_append_utf8(fixture->buffer, "caf\xc3\xa9", 5));
+    hrt_buffer_lock(fixture->buffer);
+    g_assert_cmpint(hrt_buffer_get_length(fixture->buffer), ==, 21);
+    g_assert_cmpint(fixture->malloc_count, ==, 0);
+
+    /* the wire gets the UTF-16, same as for a wide buffer, widened
+     * just for the write
+     */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        g_error("socketpair: %s", g_strerror(errno));
+
+    remaining = hrt_buffer_get_write_size(fixture->buffer);
+    g_assert_cmpint(remaining, ==, 21 * 2);
+    g_assert(hrt_buffer_write(fixture->buffer, fds[0], &remaining));
+    g_assert_cmpint(remaining, ==, 0);
+    g_assert_cmpint(fixture->malloc_count, ==, 0);
+
+    bytes_read = read(fds[1], wire, sizeof(wire));
+    g_assert_cmpint(bytes_read, ==, 21 * 2);
+
+    /* a write can start halfway through a unit */
+    remaining = 21 * 2 - 3;
+    g_assert(hrt_buffer_write(fixture->buffer, fds[0], &remaining));
+    g_assert_cmpint(remaining, ==, 0);
+    bytes_read = read(fds[1], ((char*) wire) + 21 * 2, sizeof(wire) - 21 * 2);
+    g_assert_cmpint(bytes_read, ==, 21 * 2 - 3);
+    g_assert(memcmp(((char*) wire) + 21 * 2, ((char*) wire) + 3, 21 * 2 - 3) == 0);
+
+    /* peeking widens on first use, then caches */
+    hrt_buffer_peek_utf16(fixture->buffer, &utf16, &len);
+    g_assert_cmpint(fixture->malloc_count, ==, 1);
+    g_assert_cmpint(len, ==, 21);
+    g_assert(utf16[0] == 'A' && utf16[20] == 0xE9 && utf16[21] == 0);
+    g_assert(memcmp(wire, utf16, 21 * 2) == 0);
+
+    hrt_buffer_peek_utf16(fixture->buffer, &again, &len);
+    g_assert(again == utf16);
+    g_assert_cmpint(fixture->malloc_count, ==, 1);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    hrt_buffer_unref(fixture->buffer);
+
+    /* a character past U+00FF widens the buffer for good */
+    fixture->buffer =
+        hrt_buffer_new(HRT_BUFFER_ENCODING_UTF16,
+                       &allocator, fixture, allocator_dnotify);
+    hrt_buffer_append_ascii(fixture->buffer, ascii_alphabet, strlen(ascii_alphabet));
+    g_assert(hrt_buffer_append_utf8(fixture->buffer, " \xe2\x98\x83", 4));
+    g_assert(!hrt_buffer_append_utf8(fixture->buffer, "\xc0\x80", 2));
+    hrt_buffer_lock(fixture->buffer);
+
+    fixture->malloc_count = 0;
+    hrt_buffer_peek_utf16(fixture->buffer, &utf16, &len);
+    g_assert_cmpint(fixture->malloc_count, ==, 0);
+    g_assert_cmpint(len, ==, strlen(ascii_alphabet) + 2);
+    g_assert(utf16[0] == 'a' && utf16[len - 1] == 0x2603 && utf16[len] == 0);
+}
+
+static void
+test_utf8_inline(BufferTestFixture *fixture,
+                 const void        *data)
+{
+    char *utf8;
+    const char *peeked;
+    gsize len;
+
+    /* small contents don't need an allocation */
+    hrt_buffer_append_ascii(fixture->buffer, "Content-Type", 12);
+    hrt_buffer_append_ascii(fixture->buffer, ": ", 2);
+    g_assert_cmpint(fixture->malloc_count, ==, 0);
+
+    /* and move to the allocator's memory on growth */
+    hrt_buffer_append_ascii(fixture->buffer, ascii_alphabet, strlen(ascii_alphabet));
+    g_assert_cmpint(fixture->malloc_count, ==, 1);
+
+    hrt_buffer_lock(fixture->buffer);
+    hrt_buffer_peek_utf8(fixture->buffer, &peeked, &len);
+    g_assert_cmpint(len, ==, 14 + strlen(ascii_alphabet));
+    g_assert(strncmp(peeked, "Content-Type: ", 14) == 0);
+    g_assert_cmpstr(peeked + 14, ==, ascii_alphabet);
+
+    hrt_buffer_unref(fixture->buffer);
+
+    /* stealing inline contents copies them into the allocator's memory */
+    fixture->buffer =
+        hrt_buffer_new(HRT_BUFFER_ENCODING_UTF8,
+                       &allocator, fixture, allocator_dnotify);
+    fixture->malloc_count = 0;
+    hrt_buffer_append_ascii(fixture->buffer, "text/html", 9);
+    hrt_buffer_lock(fixture->buffer);
+    g_assert_cmpint(fixture->malloc_count, ==, 0);
+
+    hrt_buffer_steal_utf8(fixture->buffer, &utf8, &len);
+    g_assert_cmpint(fixture->malloc_count, ==, 1);
+    g_assert_cmpint(len, ==, 9);
+    g_assert_cmpstr(utf8, ==, "text/html");
+
+    allocator.free(utf8, fixture);
+}
+
 static void
 test_utf8_static(BufferTestFixture *fixture,
                  const void        *data)
@@ -261,6 +408,418 @@ test_utf8_static(BufferTestFixture *fixture,
     g_assert_cmpstr(ascii_alphabet, ==, utf8);
 }
 
+static void
+test_binary_append_bytes(BufferTestFixture *fixture,
+                         const void        *data)
+{
+    static const guint8 bytes[] = { 0, 1, 2, 0xff, 0, 0x80 };
+    const guint8 *peeked;
+    gsize len;
+
+    hrt_buffer_append_bytes(fixture->buffer, bytes, 3);
+    hrt_buffer_append_bytes(fixture->buffer, bytes + 3, sizeof(bytes) - 3);
+    hrt_buffer_lock(fixture->buffer);
+
+    g_assert_cmpint(hrt_buffer_get_length(fixture->buffer), ==, sizeof(bytes));
+    g_assert_cmpint(hrt_buffer_get_write_size(fixture->buffer), ==, sizeof(bytes));
+
+    hrt_buffer_peek_binary(fixture->buffer, &peeked, &len);
+    g_assert_cmpint(len, ==, sizeof(bytes));
+    g_assert(memcmp(peeked, bytes, len) == 0);
+}
+
+static void
+test_binary_slice(BufferTestFixture *fixture,
+                  const void        *data)
+{
+    HrtBuffer *slice;
+    HrtBuffer *slice_of_slice;
+    const guint8 *parent_bytes;
+    const guint8 *bytes;
+    gsize len;
+    int old_count;
+
+    hrt_buffer_append_bytes(fixture->buffer, ascii_alphabet, strlen(ascii_alphabet));
+    hrt_buffer_lock(fixture->buffer);
+    hrt_buffer_peek_binary(fixture->buffer, &parent_bytes, &len);
+
+    slice = hrt_buffer_new_slice(fixture->buffer, 3, 10);
+    g_assert(hrt_buffer_is_locked(slice));
+    g_assert_cmpint(hrt_buffer_get_length(slice), ==, 10);
+
+    /* shares the parent's storage, no copy */
+    hrt_buffer_peek_binary(slice, &bytes, &len);
+    g_assert(bytes == parent_bytes + 3);
+    g_assert_cmpint(len, ==, 10);
+
+    slice_of_slice = hrt_buffer_new_slice(slice, 2, 5);
+    hrt_buffer_peek_binary(slice_of_slice, &bytes, &len);
+    g_assert(bytes == parent_bytes + 5);
+    g_assert(memcmp(bytes, ascii_alphabet + 5, 5) == 0);
+
+    hrt_buffer_unref(slice);
+
+    /* an empty slice at the end is fine */
+    slice = hrt_buffer_new_slice(fixture->buffer, strlen(ascii_alphabet), 0);
+    g_assert_cmpint(hrt_buffer_get_length(slice), ==, 0);
+    hrt_buffer_unref(slice);
+
+    /* the slice keeps the storage alive after the parent's unref,
+     * and teardown checks that dropping the slice frees it.
+     */
+    old_count = fixture->allocator_dnotify_count;
+    hrt_buffer_unref(fixture->buffer);
+    fixture->buffer = slice_of_slice;
+    g_assert_cmpint(old_count, ==, fixture->allocator_dnotify_count);
+
+    hrt_buffer_peek_binary(slice_of_slice, &bytes, &len);
+    g_assert(memcmp(bytes, ascii_alphabet + 5, 5) == 0);
+}
+
+static void
+test_utf8_slice(BufferTestFixture *fixture,
+                const void        *data)
+{
+    HrtBuffer *slice;
+    const char *utf8;
+    gsize len;
+
+    slice = hrt_buffer_new_slice(fixture->buffer, 26, 26);
+    hrt_buffer_peek_utf8(slice, &utf8, &len);
+    g_assert_cmpint(len, ==, 26);
+    g_assert(strncmp(utf8, "ABCDEFGHIJKLMNOPQRSTUVWXYZ", len) == 0);
+    hrt_buffer_unref(slice);
+}
+
+static void
+test_binary_take(BufferTestFixture *fixture,
+                 const void        *data)
+{
+    HrtBuffer *buffer;
+    const guint8 *bytes;
+    char *mem;
+    gsize len;
+
+    mem = allocator.malloc(4, fixture);
+    memcpy(mem, "\1\2\3\4", 4);
+
+    buffer = hrt_buffer_new_take(HRT_BUFFER_ENCODING_BINARY, mem, 4,
+                                 &allocator, fixture, allocator_dnotify);
+    g_assert(hrt_buffer_is_locked(buffer));
+
+    hrt_buffer_peek_binary(buffer, &bytes, &len);
+    g_assert(bytes == (guint8*) mem);
+    g_assert_cmpint(len, ==, 4);
+
+    hrt_buffer_unref(buffer);
+    g_assert_cmpint(fixture->allocator_dnotify_count, ==, 1);
+
+    /* and with g_malloc() memory */
+    buffer = hrt_buffer_new_take(HRT_BUFFER_ENCODING_BINARY,
+                                 g_strdup("hello"), 5,
+                                 NULL, NULL, NULL);
+    hrt_buffer_peek_binary(buffer, &bytes, &len);
+    g_assert_cmpint(len, ==, 5);
+    g_assert(memcmp(bytes, "hello", 5) == 0);
+    hrt_buffer_unref(buffer);
+}
+
+static void
+test_writev(BufferTestFixture *fixture,
+            const void        *data)
+{
+    HrtBuffer *buffers[3];
+    int fds[2];
+    char buf[64];
+    gsize written;
+    gssize bytes_read;
+    int i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        g_error("socketpair: %s", g_strerror(errno));
+
+    buffers[0] = hrt_buffer_new_static_utf8_locked("skip this: first ");
+    buffers[1] = hrt_buffer_new_static_utf8_locked("second ");
+    buffers[2] = hrt_buffer_new_static_utf8_locked("third");
+
+    /* the first buffer starts partway through, as if partly written */
+    g_assert(hrt_buffer_writev(buffers, 3, fds[0],
+                               strlen("first "), FALSE, &written));
+    g_assert_cmpint(written, ==, strlen("first second third"));
+
+    bytes_read = read(fds[1], buf, sizeof(buf) - 1);
+    g_assert_cmpint(bytes_read, ==, written);
+    buf[bytes_read] = '\0';
+    g_assert_cmpstr(buf, ==, "first second third");
+
+    /* harmless on something that isn't a TCP socket */
+    hrt_buffer_uncork(fds[0]);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    for (i = 0; i < 3; ++i)
+        hrt_buffer_unref(buffers[i]);
+}
+
+static void
+test_file(BufferTestFixture *fixture,
+          const void        *data)
+{
+    HrtBuffer *file;
+    HrtBuffer *buffers[3];
+    int fds[2];
+    int pipe_fds[2];
+    int file_fd;
+    char *filename;
+    char buf[64];
+    gsize written;
+    gsize remaining;
+    gssize bytes_read;
+    int i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        g_error("socketpair: %s", g_strerror(errno));
+
+    file_fd = g_file_open_tmp("test-buffer-XXXXXX", &filename, NULL);
+    g_assert(file_fd >= 0);
+    g_assert_cmpint(write(file_fd, "0123456789", 10), ==, 10);
+    unlink(filename);
+    g_free(filename);
+
+    file = hrt_buffer_new_file(file_fd, 2, 6);
+    g_assert(hrt_buffer_is_locked(file));
+    g_assert(hrt_buffer_is_file(file));
+    g_assert_cmpint(hrt_buffer_get_length(file), ==, 6);
+    g_assert_cmpint(hrt_buffer_get_write_size(file), ==, 6);
+    /* regular files are always ready */
+    g_assert_cmpint(hrt_buffer_get_blocked_source_fd(file), ==, -1);
+
+    /* "3456", sharing the file's fd */
+    buffers[1] = hrt_buffer_new_slice(file, 1, 4);
+    hrt_buffer_unref(file);
+    buffers[0] = hrt_buffer_new_static_utf8_locked("head ");
+    buffers[2] = hrt_buffer_new_static_utf8_locked(" tail");
+
+    /* gathering stops before the file buffer */
+    g_assert(hrt_buffer_writev(buffers, 3, fds[0],
+                               strlen("head "), FALSE, &written));
+    g_assert_cmpint(written, ==, strlen("head "));
+
+    /* which then goes on its own, resuming partway through */
+    remaining = 4;
+    g_assert(hrt_buffer_write(buffers[1], fds[0], &remaining));
+    g_assert_cmpint(remaining, ==, 0);
+    remaining = 2;
+    g_assert(hrt_buffer_write(buffers[1], fds[0], &remaining));
+    g_assert_cmpint(remaining, ==, 0);
+
+    g_assert(hrt_buffer_writev(&buffers[1], 2, fds[0],
+                               1, FALSE, &written));
+    g_assert_cmpint(written, ==, 1);
+    g_assert(hrt_buffer_writev(&buffers[2], 1, fds[0],
+                               strlen(" tail"), FALSE, &written));
+    g_assert_cmpint(written, ==, strlen(" tail"));
+
+    bytes_read = read(fds[1], buf, sizeof(buf) - 1);
+    buf[MAX(bytes_read, 0)] = '\0';
+    g_assert_cmpstr(buf, ==, "head 3456566 tail");
+
+    for (i = 0; i < 3; ++i)
+        hrt_buffer_unref(buffers[i]);
+
+    /* the last unref closed the file */
+    g_assert(close(file_fd) < 0 && errno == EBADF);
+
+    /* pipes are spliced; while one is empty, writing has to wait
+     * for the pipe rather than the socket
+     */
+    if (pipe(pipe_fds) < 0)
+        g_error("pipe: %s", g_strerror(errno));
+
+    file = hrt_buffer_new_file(pipe_fds[0], 0, 5);
+    g_assert_cmpint(hrt_buffer_get_blocked_source_fd(file), ==, pipe_fds[0]);
+
+    g_assert_cmpint(write(pipe_fds[1], "piped", 5), ==, 5);
+    g_assert_cmpint(hrt_buffer_get_blocked_source_fd(file), ==, -1);
+
+    remaining = 5;
+    while (remaining > 0)
+        g_assert(hrt_buffer_write(file, fds[0], &remaining));
+    hrt_buffer_unref(file);
+
+    bytes_read = read(fds[1], buf, sizeof(buf) - 1);
+    g_assert_cmpint(bytes_read, ==, 5);
+    buf[bytes_read] = '\0';
+    g_assert_cmpstr(buf, ==, "piped");
+
+    close(pipe_fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+test_pool(BufferTestFixture *fixture,
+          const void        *data)
+{
+    const HrtBufferAllocator *pool;
+    HrtBufferPoolStats before;
+    HrtBufferPoolStats after;
+    char *mem;
+    char *again;
+
+    pool = hrt_buffer_pool_get_allocator();
+
+    /* growing within a size class keeps the same chunk */
+    mem = pool->malloc(10, NULL);
+    memcpy(mem, "0123456789", 10);
+    again = pool->realloc(mem, 12, NULL);
+    g_assert(again == mem);
+
+    /* growing out of it copies */
+    again = pool->realloc(mem, 1000, NULL);
+    g_assert(memcmp(again, "0123456789", 10) == 0);
+
+    /* freed chunks come back from this thread's cache */
+    pool->free(again, NULL);
+    hrt_buffer_pool_get_stats(&before);
+    mem = pool->malloc(1000, NULL);
+    hrt_buffer_pool_get_stats(&after);
+    g_assert(mem == again);
+    g_assert_cmpint(after.thread_hits, ==, before.thread_hits + 1);
+    g_assert_cmpint(after.misses, ==, before.misses);
+    g_assert_cmpint(after.cached_bytes, <, before.cached_bytes);
+    pool->free(mem, NULL);
+
+    /* large chunks go back to the system; huge pages are only
+     * advice so this works without THP too
+     */
+    hrt_buffer_pool_set_huge_pages(TRUE);
+    hrt_buffer_pool_get_stats(&before);
+    mem = pool->malloc(3 * 1024 * 1024, NULL);
+    memset(mem, 'x', 3 * 1024 * 1024);
+    hrt_buffer_pool_get_stats(&after);
+    g_assert_cmpint(after.misses, ==, before.misses + 1);
+    g_assert_cmpint(after.huge_page_bytes, >=, before.huge_page_bytes + 3 * 1024 * 1024);
+    g_assert_cmpint(after.resident_bytes, >=, before.resident_bytes + 3 * 1024 * 1024);
+    pool->free(mem, NULL);
+    hrt_buffer_pool_get_stats(&after);
+    g_assert_cmpint(after.huge_page_bytes, ==, before.huge_page_bytes);
+    g_assert_cmpint(after.resident_bytes, ==, before.resident_bytes);
+    hrt_buffer_pool_set_huge_pages(FALSE);
+}
+
+static void
+test_builder(BufferTestFixture *fixture,
+             const void        *data)
+{
+    HrtBufferBuilder *builder;
+    HrtBuffer *buffer;
+    HrtBuffer *large;
+    HrtBuffer **chain;
+    const char *s;
+    char *big;
+    gsize len;
+    int n_chain;
+    int i;
+
+    builder = hrt_buffer_builder_new(HRT_BUFFER_ENCODING_UTF8);
+
+    hrt_buffer_builder_append_int(builder, 0);
+    hrt_buffer_builder_append_ascii(builder, " ", 1);
+    hrt_buffer_builder_append_int(builder, -42);
+    hrt_buffer_builder_append_ascii(builder, " ", 1);
+    hrt_buffer_builder_append_int(builder, G_MININT64);
+    hrt_buffer_builder_append_ascii(builder, " ", 1);
+    hrt_buffer_builder_append_uint(builder, G_MAXUINT64);
+    hrt_buffer_builder_append_ascii(builder, " ", 1);
+    hrt_buffer_builder_append_hex(builder, 0);
+    hrt_buffer_builder_append_ascii(builder, " ", 1);
+    hrt_buffer_builder_append_hex(builder, 0x1f3a);
+    hrt_buffer_builder_append_printf(builder, " %s=%d", "x", 7);
+    g_assert(hrt_buffer_builder_append_html_escaped(builder, " <a href=\"&\">'</a>", 18));
+    g_assert(hrt_buffer_builder_append_json_escaped(builder, " \"\\\n\x01\xc3\xa9", 7));
+    g_assert(!hrt_buffer_builder_append_json_escaped(builder, "\xff", 1));
+
+    buffer = hrt_buffer_builder_finish(builder);
+    g_assert(hrt_buffer_is_locked(buffer));
+    hrt_buffer_peek_utf8(buffer, &s, &len);
+    g_assert_cmpstr(s, ==,
+                    "0 -42 -9223372036854775808 18446744073709551615 0 1f3a x=7"
+                    " &lt;a href=&quot;&amp;&quot;&gt;&#39;&lt;/a&gt;"
+                    " \\\"\\\\\\n\\u0001\xc3\xa9");
+    g_assert_cmpint(len, ==, strlen(s));
+    hrt_buffer_unref(buffer);
+
+    /* printf output bigger than the chunk it started in */
+    big = g_strnfill(4000, 'p');
+    hrt_buffer_builder_append_ascii(builder, "a", 1);
+    hrt_buffer_builder_append_printf(builder, "%s", big);
+    g_assert_cmpint(hrt_buffer_builder_get_length(builder), ==, 4001);
+    buffer = hrt_buffer_builder_finish(builder);
+    hrt_buffer_peek_utf8(buffer, &s, &len);
+    g_assert_cmpint(len, ==, 4001);
+    g_assert(s[0] == 'a' && strcmp(s + 1, big) == 0);
+    hrt_buffer_unref(buffer);
+
+    /* the escape scans run over several vectors before finding one */
+    big[1000] = '&';
+    g_assert(hrt_buffer_builder_append_html_escaped(builder, big, 4000));
+    g_assert_cmpint(hrt_buffer_builder_get_length(builder), ==, 4004);
+    buffer = hrt_buffer_builder_finish(builder);
+    hrt_buffer_peek_utf8(buffer, &s, &len);
+    g_assert(strncmp(s + 999, "p&amp;p", 7) == 0);
+    hrt_buffer_unref(buffer);
+    big[1000] = 'p';
+
+    /* a large buffer is shared, so the chain has three pieces */
+    large = hrt_buffer_new_static_utf8_locked(big);
+    hrt_buffer_builder_append_ascii(builder, "<", 1);
+    hrt_buffer_builder_append_buffer(builder, large);
+    hrt_buffer_builder_append_ascii(builder, ">", 1);
+    n_chain = hrt_buffer_builder_finish_chain(builder, &chain);
+    g_assert_cmpint(n_chain, ==, 3);
+    g_assert(chain[1] == large);
+    hrt_buffer_peek_utf8(chain[2], &s, &len);
+    g_assert_cmpstr(s, ==, ">");
+    for (i = 0; i < n_chain; ++i)
+        hrt_buffer_unref(chain[i]);
+    g_free(chain);
+    g_assert_cmpint(hrt_buffer_builder_get_length(builder), ==, 0);
+
+    /* and finish copies the pieces together */
+    hrt_buffer_builder_append_ascii(builder, "<", 1);
+    hrt_buffer_builder_append_buffer(builder, large);
+    hrt_buffer_builder_append_ascii(builder, ">", 1);
+    buffer = hrt_buffer_builder_finish(builder);
+    hrt_buffer_peek_utf8(buffer, &s, &len);
+    g_assert_cmpint(len, ==, 4002);
+    g_assert(s[0] == '<' && s[4001] == '>' && s[4002] == '\0');
+    hrt_buffer_unref(buffer);
+
+    /* lots of output spans more than one chunk */
+    for (i = 0; i < 100000; ++i)
+        hrt_buffer_builder_append_uint(builder, i % 10);
+    n_chain = hrt_buffer_builder_finish_chain(builder, &chain);
+    g_assert_cmpint(n_chain, >, 1);
+    len = 0;
+    for (i = 0; i < n_chain; ++i) {
+        len += hrt_buffer_get_write_size(chain[i]);
+        hrt_buffer_unref(chain[i]);
+    }
+    g_free(chain);
+    g_assert_cmpint(len, ==, 100000);
+
+    /* nothing appended */
+    buffer = hrt_buffer_builder_finish(builder);
+    g_assert_cmpint(hrt_buffer_get_write_size(buffer), ==, 0);
+    hrt_buffer_unref(buffer);
+
+    hrt_buffer_unref(large);
+    g_free(big);
+    hrt_buffer_builder_free(builder);
+}
+
 static gboolean option_debug = FALSE;
 static gboolean option_version = FALSE;
 
@@ -321,6 +880,13 @@ main(int    argc,
                test_utf8_append_ascii,
                teardown);
 
+    g_test_add("/buffer/utf16_compact",
+               BufferTestFixture,
+               NULL,
+               setup_utf16,
+               test_utf16_compact,
+               teardown);
+
     g_test_add("/buffer/utf16_steal",
                BufferTestFixture,
                NULL,
@@ -335,6 +901,13 @@ main(int    argc,
                test_utf8_steal,
                teardown);
 
+    g_test_add("/buffer/utf8_inline",
+               BufferTestFixture,
+               NULL,
+               setup_utf8,
+               test_utf8_inline,
+               teardown);
+
     g_test_add("/buffer/utf8_static",
                BufferTestFixture,
                NULL,
@@ -342,5 +915,68 @@ main(int    argc,
                test_utf8_static,
                teardown);
 
+    g_test_add("/buffer/binary_append_bytes",
+               BufferTestFixture,
+               NULL,
+               setup_binary,
+               test_binary_append_bytes,
+               teardown);
+
+    g_test_add("/buffer/binary_slice",
+               BufferTestFixture,
+               NULL,
+               setup_binary,
+               test_binary_slice,
+               teardown);
+
+    g_test_add("/buffer/utf8_slice",
+               BufferTestFixture,
+               NULL,
+               setup_utf8_static,
+               test_utf8_slice,
+               teardown);
+
+    g_test_add("/buffer/binary_take",
+               BufferTestFixture,
+               NULL,
+               setup_binary,
+               test_binary_take,
+               teardown);
+
+    g_test_add("/buffer/pool_append_ascii",
+               BufferTestFixture,
+               NULL,
+               setup_pool,
+               test_utf8_append_ascii,
+               teardown);
+
+    g_test_add("/buffer/pool",
+               BufferTestFixture,
+               NULL,
+               setup_pool,
+               test_pool,
+               teardown);
+
+    g_test_add("/buffer/writev",
+               BufferTestFixture,
+               NULL,
+               setup_utf8_static,
+               test_writev,
+               teardown);
+
+    g_test_add("/buffer/file",
+               BufferTestFixture,
+               NULL,
+               setup_utf8_static,
+               test_file,
+               teardown);
+
+    g_test_add("/buffer/builder",
+               BufferTestFixture,
+               NULL,
+               setup_pool,
+               test_builder,
+               teardown);
+
     return g_test_run();
 }
@@ -0,0 +1,408 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NUM_CHILDREN 10
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    int tasks_expected_count;
+    /* these are accessed by multiple task threads so need to be atomic */
+    volatile int dnotify_count;
+    volatile int callbacks_run_count;
+    int pipe_fds[2];
+    GMainLoop *loop;
+} TestFixture;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_assert(hrt_task_is_cancelled(task));
+
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= fixture->tasks_expected_count) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type)
+{
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+
+    /* nothing is ever written to the pipe, so watchers on the
+     * read end never fire
+     */
+    if (pipe(fixture->pipe_fds) < 0)
+        g_error("pipe() failed");
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    close(fixture->pipe_fds[0]);
+    close(fixture->pipe_fds[1]);
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static void
+on_dnotify_bump_count(void *data)
+{
+    TestFixture *fixture = data;
+    g_atomic_int_inc(&fixture->dnotify_count);
+}
+
+static gboolean
+on_should_not_run(HrtTask        *task,
+                  HrtWatcherFlags flags,
+                  void           *data)
+{
+    TestFixture *fixture = data;
+
+    g_atomic_int_inc(&fixture->callbacks_run_count);
+
+    return FALSE;
+}
+
+static void
+test_cancel_tree(TestFixture *fixture,
+                 const void  *data)
+{
+    HrtTask *root;
+    HrtTask *children[NUM_CHILDREN];
+    HrtTask *grandchildren[NUM_CHILDREN];
+    int i;
+
+    root = hrt_task_runner_create_task(fixture->runner);
+    hrt_task_add_io(root, fixture->pipe_fds[0],
+                    HRT_WATCHER_FLAG_READ,
+                    on_should_not_run,
+                    fixture,
+                    on_dnotify_bump_count);
+
+    for (i = 0; i < NUM_CHILDREN; ++i) {
+        children[i] = hrt_task_create_task(root);
+        hrt_task_add_io(children[i], fixture->pipe_fds[0],
+                        HRT_WATCHER_FLAG_READ,
+                        on_should_not_run,
+                        fixture,
+                        on_dnotify_bump_count);
+
+        grandchildren[i] = hrt_task_create_task(children[i]);
+        hrt_task_add_io(grandchildren[i], fixture->pipe_fds[0],
+                        HRT_WATCHER_FLAG_READ,
+                        on_should_not_run,
+                        fixture,
+                        on_dnotify_bump_count);
+    }
+
+    fixture->tasks_expected_count = 1 + NUM_CHILDREN * 2;
+
+    g_assert(!hrt_task_is_cancelled(root));
+
+    hrt_task_cancel(root);
+
+    g_assert(hrt_task_is_cancelled(root));
+    for (i = 0; i < NUM_CHILDREN; ++i) {
+        g_assert(hrt_task_is_cancelled(children[i]));
+        g_assert(hrt_task_is_cancelled(grandchildren[i]));
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, fixture->tasks_expected_count);
+    g_assert_cmpint(fixture->dnotify_count, ==, fixture->tasks_expected_count);
+    g_assert_cmpint(fixture->callbacks_run_count, ==, 0);
+
+    for (i = 0; i < NUM_CHILDREN; ++i) {
+        g_object_unref(grandchildren[i]);
+        g_object_unref(children[i]);
+    }
+    g_object_unref(root);
+}
+
+static void
+test_cancel_children_only(TestFixture *fixture,
+                          const void  *data)
+{
+    HrtTask *root;
+    HrtTask *child;
+
+    root = hrt_task_runner_create_task(fixture->runner);
+    child = hrt_task_create_task(root);
+
+    hrt_task_cancel_children(root);
+
+    g_assert(!hrt_task_is_cancelled(root));
+    g_assert(hrt_task_is_cancelled(child));
+
+    /* a child created after cancellation is cancelled too */
+    hrt_task_cancel(root);
+    g_object_unref(child);
+    child = hrt_task_create_task(root);
+    g_assert(hrt_task_is_cancelled(child));
+
+    /* immediate watchers on a cancelled task are dnotified
+     * but never invoked
+     */
+    hrt_task_add_immediate(child,
+                           on_should_not_run,
+                           fixture,
+                           on_dnotify_bump_count);
+
+    fixture->tasks_expected_count = 1;
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, 1);
+    g_assert_cmpint(fixture->dnotify_count, ==, 1);
+    g_assert_cmpint(fixture->callbacks_run_count, ==, 0);
+
+    g_object_unref(child);
+    g_object_unref(root);
+}
+
+static void
+test_deadline(TestFixture *fixture,
+              const void  *data)
+{
+    HrtTask *root;
+    HrtTask *child;
+    gint64 deadline;
+    gint64 inherited;
+
+    root = hrt_task_runner_create_task(fixture->runner);
+
+    g_assert(!hrt_task_get_deadline(root, &inherited));
+
+    /* a deadline in the past */
+    deadline = g_get_monotonic_time() - 10 * G_USEC_PER_SEC;
+    hrt_task_set_deadline(root, deadline);
+
+    child = hrt_task_create_task(root);
+
+    g_assert(hrt_task_get_deadline(child, &inherited));
+    g_assert_cmpint(inherited, ==, deadline);
+
+    /* deadline can't be pushed out past the parent's */
+    hrt_task_set_deadline(child, deadline + 100 * G_USEC_PER_SEC);
+    g_assert(hrt_task_get_deadline(child, &inherited));
+    g_assert_cmpint(inherited, ==, deadline);
+
+    hrt_task_add_immediate(root,
+                           on_should_not_run,
+                           fixture,
+                           on_dnotify_bump_count);
+    hrt_task_add_io(child, fixture->pipe_fds[0],
+                    HRT_WATCHER_FLAG_READ,
+                    on_should_not_run,
+                    fixture,
+                    on_dnotify_bump_count);
+
+    fixture->tasks_expected_count = 2;
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, 2);
+    g_assert_cmpint(fixture->dnotify_count, ==, 2);
+    g_assert_cmpint(fixture->callbacks_run_count, ==, 0);
+
+    g_object_unref(child);
+    g_object_unref(root);
+}
+
+static void
+test_deadline_while_blocked(TestFixture *fixture,
+                            const void  *data)
+{
+    HrtTask *task;
+    gint64 start;
+
+    task = hrt_task_runner_create_task(fixture->runner);
+
+    start = g_get_monotonic_time();
+    hrt_task_set_deadline(task, start + G_USEC_PER_SEC / 20);
+
+    /* the task never runs again on its own, so only the deadline's
+     * timer can cancel it
+     */
+    hrt_task_add_io(task, fixture->pipe_fds[0],
+                    HRT_WATCHER_FLAG_READ,
+                    on_should_not_run,
+                    fixture,
+                    on_dnotify_bump_count);
+
+    fixture->tasks_expected_count = 1;
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, 1);
+    g_assert_cmpint(fixture->dnotify_count, ==, 1);
+    g_assert_cmpint(fixture->callbacks_run_count, ==, 0);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, G_USEC_PER_SEC / 20);
+
+    g_object_unref(task);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Cancellation");
+    g_option_context_add_main_entries(context, entries, "test-cancel");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-cancel %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/cancel/cancel_tree_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_cancel_tree,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/cancel_tree_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_cancel_tree,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/cancel_children_only_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_cancel_children_only,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/cancel_children_only_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_cancel_children_only,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/deadline_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_deadline,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/deadline_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_deadline,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/deadline_while_blocked_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_deadline_while_blocked,
+               teardown_test_fixture);
+
+    g_test_add("/cancel/deadline_while_blocked_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_deadline_while_blocked,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -0,0 +1,416 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_TASKS 100
+#define CHAIN_LENGTH 20
+#define NUM_CORES 4
+
+typedef struct {
+    HrtEventLoopType loop_type;
+    /* 0 for the event thread plus invoke pool */
+    int cores;
+} RunnerConfig;
+
+static const RunnerConfig classic_glib = { HRT_EVENT_LOOP_GLIB, 0 };
+static const RunnerConfig classic_libev = { HRT_EVENT_LOOP_EV, 0 };
+static const RunnerConfig cores_glib = { HRT_EVENT_LOOP_GLIB, NUM_CORES };
+static const RunnerConfig cores_libev = { HRT_EVENT_LOOP_EV, NUM_CORES };
+
+typedef struct TestFixture TestFixture;
+
+typedef struct {
+    TestFixture *fixture;
+    /* the thread the task first ran in, which in cores mode is
+     * the only thread it and its children may run in
+     */
+    GThread *thread;
+    int remaining;
+} TaskState;
+
+struct TestFixture {
+    HrtTaskRunner *runner;
+    const RunnerConfig *config;
+    int tasks_completed_count;
+    int tasks_expected_count;
+    /* these are accessed by multiple threads so need to be atomic */
+    volatile int steps_count;
+    volatile int dnotify_count;
+    TaskState states[NUM_TASKS];
+    GMainLoop *loop;
+};
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= fixture->tasks_expected_count) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture(TestFixture *fixture,
+                   const void  *data)
+{
+    fixture->config = data;
+
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", fixture->config->loop_type,
+                     "cores", fixture->config->cores,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static void
+on_dnotify_bump_count(void *data)
+{
+    TaskState *state = data;
+
+    g_atomic_int_inc(&state->fixture->dnotify_count);
+}
+
+static void
+check_thread(TaskState *state)
+{
+    /* In classic mode a task may move between invoke threads */
+    if (state->fixture->config->cores == 0)
+        return;
+
+    if (state->thread == NULL)
+        state->thread = g_thread_self();
+    else
+        g_assert(state->thread == g_thread_self());
+}
+
+static gboolean
+on_child_timeout(HrtTask        *task,
+                 HrtWatcherFlags flags,
+                 void           *data)
+{
+    TaskState *state = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    check_thread(state);
+    g_atomic_int_inc(&state->fixture->steps_count);
+
+    return FALSE;
+}
+
+static gboolean
+on_child_idle(HrtTask        *task,
+              HrtWatcherFlags flags,
+              void           *data)
+{
+    TaskState *state = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    check_thread(state);
+    g_atomic_int_inc(&state->fixture->steps_count);
+
+    hrt_task_add_timeout(task, 1, on_child_timeout,
+                         state, on_dnotify_bump_count);
+
+    return FALSE;
+}
+
+static gboolean
+on_child_completed(HrtTask        *task,
+                   HrtWatcherFlags flags,
+                   void           *data)
+{
+    TaskState *state = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    check_thread(state);
+    g_atomic_int_inc(&state->fixture->steps_count);
+
+    return FALSE;
+}
+
+static gboolean
+on_step(HrtTask        *task,
+        HrtWatcherFlags flags,
+        void           *data)
+{
+    TaskState *state = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    check_thread(state);
+    g_atomic_int_inc(&state->fixture->steps_count);
+
+    if (state->remaining == CHAIN_LENGTH) {
+        HrtTask *child;
+
+        /* the child shares our core, so its watchers have to run
+         * in our thread too
+         */
+        child = hrt_task_create_task(task);
+        hrt_task_add_idle(child, on_child_idle,
+                          state, on_dnotify_bump_count);
+        hrt_task_add_subtask(task, child, on_child_completed,
+                             state, on_dnotify_bump_count);
+        g_object_unref(child);
+    }
+
+    state->remaining -= 1;
+    if (state->remaining > 0) {
+        hrt_task_add_immediate(task, on_step,
+                               state, on_dnotify_bump_count);
+    }
+
+    return FALSE;
+}
+
+static void
+run_chains(TestFixture *fixture)
+{
+    int i;
+
+    fixture->tasks_expected_count = NUM_TASKS * 2;
+
+    for (i = 0; i < NUM_TASKS; ++i) {
+        HrtTask *task;
+        TaskState *state = &fixture->states[i];
+
+        state->fixture = fixture;
+        state->remaining = CHAIN_LENGTH;
+
+        task = hrt_task_runner_create_task(fixture->runner);
+
+        hrt_task_add_immediate(task, on_step,
+                               state, on_dnotify_bump_count);
+
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_TASKS * 2);
+    /* chain, plus idle, timeout, and subtask for the child */
+    g_assert_cmpint(fixture->steps_count, ==, NUM_TASKS * (CHAIN_LENGTH + 3));
+    g_assert_cmpint(fixture->dnotify_count, ==, NUM_TASKS * (CHAIN_LENGTH + 3));
+}
+
+static void
+test_cores_chains(TestFixture *fixture,
+                  const void  *data)
+{
+    run_chains(fixture);
+}
+
+static gboolean
+on_perf_step(HrtTask        *task,
+             HrtWatcherFlags flags,
+             void           *data)
+{
+    int *remaining = data;
+
+    /* each task has only one watcher at a time so there's no
+     * concurrent access to remaining
+     */
+    *remaining -= 1;
+    if (*remaining > 0)
+        hrt_task_add_immediate(task, on_perf_step, data, NULL);
+    else
+        g_free(data);
+
+    return FALSE;
+}
+
+static void
+test_cores_performance(TestFixture *fixture,
+                       const void  *data)
+{
+#define N_TASKS 20000
+#define N_STEPS 50
+    int i;
+
+    if (!g_test_perf())
+        return;
+
+    fixture->tasks_expected_count = N_TASKS;
+
+    /* start here, to include task creation. Also, immediates can start
+     * running right away, before we block in main loop.
+     */
+    g_test_timer_start();
+
+    for (i = 0; i < N_TASKS; ++i) {
+        HrtTask *task;
+        int *remaining;
+
+        remaining = g_new(int, 1);
+        *remaining = N_STEPS;
+
+        task = hrt_task_runner_create_task(fixture->runner);
+        hrt_task_add_immediate(task, on_perf_step, remaining, NULL);
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_test_minimized_result(g_test_timer_elapsed(),
+                            "Run %d tasks of %d chained immediates with %s loop, %d cores",
+                            N_TASKS, N_STEPS,
+                            fixture->config->loop_type == HRT_EVENT_LOOP_EV ?
+                            "libev" : "glib",
+                            fixture->config->cores);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, N_TASKS);
+#undef N_TASKS
+#undef N_STEPS
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Cores");
+    g_option_context_add_main_entries(context, entries, "test-cores");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-cores %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/cores/chains_classic_glib",
+               TestFixture,
+               &classic_glib,
+               setup_test_fixture,
+               test_cores_chains,
+               teardown_test_fixture);
+
+    g_test_add("/cores/chains_classic_libev",
+               TestFixture,
+               &classic_libev,
+               setup_test_fixture,
+               test_cores_chains,
+               teardown_test_fixture);
+
+    g_test_add("/cores/chains_cores_glib",
+               TestFixture,
+               &cores_glib,
+               setup_test_fixture,
+               test_cores_chains,
+               teardown_test_fixture);
+
+    g_test_add("/cores/chains_cores_libev",
+               TestFixture,
+               &cores_libev,
+               setup_test_fixture,
+               test_cores_chains,
+               teardown_test_fixture);
+
+    g_test_add("/cores/performance_classic_glib",
+               TestFixture,
+               &classic_glib,
+               setup_test_fixture,
+               test_cores_performance,
+               teardown_test_fixture);
+
+    g_test_add("/cores/performance_classic_libev",
+               TestFixture,
+               &classic_libev,
+               setup_test_fixture,
+               test_cores_performance,
+               teardown_test_fixture);
+
+    g_test_add("/cores/performance_cores_glib",
+               TestFixture,
+               &cores_glib,
+               setup_test_fixture,
+               test_cores_performance,
+               teardown_test_fixture);
+
+    g_test_add("/cores/performance_cores_libev",
+               TestFixture,
+               &cores_libev,
+               setup_test_fixture,
+               test_cores_performance,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -0,0 +1,357 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <hrt/hrt-fiber.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NUM_FIBERS 100
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    int tasks_expected_count;
+    /* these are accessed by multiple task threads so need to be atomic */
+    volatile int dnotify_count;
+    volatile int fibers_finished_count;
+    volatile int subtasks_run_count;
+    GMainLoop *loop;
+} TestFixture;
+
+typedef struct {
+    TestFixture *fixture;
+    int pipe_fds[2];
+} FiberData;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= fixture->tasks_expected_count) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type)
+{
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static FiberData*
+fiber_data_new(TestFixture *fixture)
+{
+    FiberData *fd;
+
+    fd = g_slice_new0(FiberData);
+    fd->fixture = fixture;
+    if (pipe(fd->pipe_fds) < 0)
+        g_error("pipe() failed");
+
+    return fd;
+}
+
+static void
+on_fiber_data_dnotify(void *data)
+{
+    FiberData *fd = data;
+
+    g_atomic_int_inc(&fd->fixture->dnotify_count);
+
+    close(fd->pipe_fds[0]);
+    close(fd->pipe_fds[1]);
+    g_slice_free(FiberData, fd);
+}
+
+static gboolean
+on_subtask_immediate(HrtTask        *task,
+                     HrtWatcherFlags flags,
+                     void           *data)
+{
+    TestFixture *fixture = data;
+
+    g_atomic_int_inc(&fixture->subtasks_run_count);
+
+    return FALSE;
+}
+
+static void
+run_sequential_fiber(HrtFiber *fiber,
+                     void     *data)
+{
+    FiberData *fd = data;
+    HrtTask *task;
+    HrtTask *subtask;
+    HrtWatcherFlags flags;
+    char c;
+    int i;
+
+    task = hrt_fiber_get_task(fiber);
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    hrt_fiber_sleep(fiber, 5);
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    subtask = hrt_task_create_task(task);
+    hrt_task_add_immediate(subtask,
+                           on_subtask_immediate,
+                           fd->fixture,
+                           NULL);
+    hrt_fiber_await_subtask(fiber, subtask);
+    g_object_unref(subtask);
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    /* a few round trips through a pipe; locals have to survive */
+    for (i = 0; i < 3; ++i) {
+        flags = hrt_fiber_await_io(fiber, fd->pipe_fds[1],
+                                   HRT_WATCHER_FLAG_WRITE);
+        g_assert(flags & HRT_WATCHER_FLAG_WRITE);
+
+        c = 'a' + i;
+        if (write(fd->pipe_fds[1], &c, 1) != 1)
+            g_error("write() failed");
+
+        flags = hrt_fiber_await_io(fiber, fd->pipe_fds[0],
+                                   HRT_WATCHER_FLAG_READ);
+        g_assert(flags & HRT_WATCHER_FLAG_READ);
+
+        c = '\0';
+        if (read(fd->pipe_fds[0], &c, 1) != 1)
+            g_error("read() failed");
+        g_assert(c == 'a' + i);
+
+        HRT_ASSERT_IN_TASK_THREAD(task);
+    }
+
+    g_atomic_int_inc(&fd->fixture->fibers_finished_count);
+}
+
+static void
+test_fiber_sequential(TestFixture *fixture,
+                      const void  *data)
+{
+    int i;
+
+    fixture->tasks_expected_count = NUM_FIBERS * 2;
+
+    for (i = 0; i < NUM_FIBERS; ++i) {
+        HrtTask *task;
+
+        task = hrt_task_runner_create_task(fixture->runner);
+
+        hrt_task_spawn_fiber(task,
+                             run_sequential_fiber,
+                             fiber_data_new(fixture),
+                             on_fiber_data_dnotify);
+
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_FIBERS * 2);
+    g_assert_cmpint(fixture->fibers_finished_count, ==, NUM_FIBERS);
+    g_assert_cmpint(fixture->subtasks_run_count, ==, NUM_FIBERS);
+    g_assert_cmpint(fixture->dnotify_count, ==, NUM_FIBERS);
+}
+
+static void
+run_never_finished_fiber(HrtFiber *fiber,
+                         void     *data)
+{
+    FiberData *fd = data;
+
+    /* nothing is written to the pipe, so this never returns */
+    hrt_fiber_await_io(fiber, fd->pipe_fds[0],
+                       HRT_WATCHER_FLAG_READ);
+
+    g_assert_not_reached();
+}
+
+static gboolean
+on_cancel_timeout(HrtTask        *task,
+                  HrtWatcherFlags flags,
+                  void           *data)
+{
+    /* the fibers are all parked by now */
+    hrt_task_cancel_children(task);
+
+    return FALSE;
+}
+
+static void
+test_fiber_cancelled(TestFixture *fixture,
+                     const void  *data)
+{
+    HrtTask *parent;
+    int i;
+
+    parent = hrt_task_runner_create_task(fixture->runner);
+
+    fixture->tasks_expected_count = NUM_FIBERS + 1;
+
+    for (i = 0; i < NUM_FIBERS; ++i) {
+        HrtTask *task;
+
+        task = hrt_task_create_task(parent);
+
+        hrt_task_spawn_fiber(task,
+                             run_never_finished_fiber,
+                             fiber_data_new(fixture),
+                             on_fiber_data_dnotify);
+
+        g_object_unref(task);
+    }
+
+    hrt_task_add_timeout(parent, 20,
+                         on_cancel_timeout,
+                         NULL, NULL);
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_FIBERS + 1);
+    g_assert_cmpint(fixture->dnotify_count, ==, NUM_FIBERS);
+
+    g_object_unref(parent);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Fibers");
+    g_option_context_add_main_entries(context, entries, "test-fiber");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-fiber %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/fiber/sequential_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_fiber_sequential,
+               teardown_test_fixture);
+
+    g_test_add("/fiber/sequential_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_fiber_sequential,
+               teardown_test_fixture);
+
+    g_test_add("/fiber/cancelled_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_fiber_cancelled,
+               teardown_test_fixture);
+
+    g_test_add("/fiber/cancelled_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_fiber_cancelled,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -0,0 +1,347 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CONTENT "Hello, file."
+#define NUM_WRITES 20
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    int tasks_expected_count;
+    int fd;
+    char *filename;
+    /* only touched from the task thread */
+    int callbacks_run_count;
+    GMainLoop *loop;
+} TestFixture;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= fixture->tasks_expected_count) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type)
+{
+    GError *error;
+
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+
+    error = NULL;
+    fixture->fd = g_file_open_tmp("test-file-io-XXXXXX",
+                                  &fixture->filename,
+                                  &error);
+    if (fixture->fd < 0)
+        g_error("Failed to open temp file: %s", error->message);
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    close(fixture->fd);
+    unlink(fixture->filename);
+    g_free(fixture->filename);
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static void
+on_read_at_eof(HrtTask   *task,
+               HrtBuffer *buffer,
+               int        error_code,
+               void      *data)
+{
+    TestFixture *fixture = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    g_assert_cmpint(error_code, ==, 0);
+    g_assert(buffer != NULL);
+    g_assert_cmpint(hrt_buffer_get_write_size(buffer), ==, 0);
+
+    fixture->callbacks_run_count += 1;
+}
+
+static void
+on_read_all(HrtTask   *task,
+            HrtBuffer *buffer,
+            int        error_code,
+            void      *data)
+{
+    TestFixture *fixture = data;
+    const guint8 *bytes;
+    gsize len;
+    int i;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    g_assert_cmpint(error_code, ==, 0);
+    g_assert(buffer != NULL);
+    g_assert(hrt_buffer_is_locked(buffer));
+
+    hrt_buffer_peek_binary(buffer, &bytes, &len);
+    g_assert_cmpint(len, ==, strlen(CONTENT) * NUM_WRITES);
+    for (i = 0; i < NUM_WRITES; ++i) {
+        g_assert(strncmp((const char*) bytes + i * strlen(CONTENT),
+                         CONTENT, strlen(CONTENT)) == 0);
+    }
+
+    fixture->callbacks_run_count += 1;
+
+    hrt_task_add_file_read(task, fixture->fd,
+                           len, 100,
+                           on_read_at_eof,
+                           fixture, NULL);
+}
+
+static void
+on_wrote(HrtTask   *task,
+         HrtBuffer *buffer,
+         int        error_code,
+         void      *data)
+{
+    TestFixture *fixture = data;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    g_assert_cmpint(error_code, ==, 0);
+    g_assert_cmpint(hrt_buffer_get_write_size(buffer), ==, strlen(CONTENT));
+
+    fixture->callbacks_run_count += 1;
+
+    /* read everything back once the last write is done. Writes
+     * don't overlap so it doesn't matter what order they finish.
+     */
+    if (fixture->callbacks_run_count == NUM_WRITES) {
+        hrt_task_add_file_read(task, fixture->fd,
+                               0, 4096,
+                               on_read_all,
+                               fixture, NULL);
+    }
+}
+
+static gboolean
+on_start_writes(HrtTask        *task,
+                HrtWatcherFlags flags,
+                void           *data)
+{
+    TestFixture *fixture = data;
+    HrtBuffer *buffer;
+    int i;
+
+    buffer = hrt_buffer_new_copy_utf8(CONTENT);
+    hrt_buffer_lock(buffer);
+
+    for (i = 0; i < NUM_WRITES; ++i) {
+        hrt_task_add_file_write(task, fixture->fd,
+                                i * strlen(CONTENT),
+                                buffer,
+                                on_wrote,
+                                fixture, NULL);
+    }
+
+    hrt_buffer_unref(buffer);
+
+    return FALSE;
+}
+
+static void
+test_write_then_read(TestFixture *fixture,
+                     const void  *data)
+{
+    HrtTask *task;
+
+    task = hrt_task_runner_create_task(fixture->runner);
+
+    fixture->tasks_expected_count = 1;
+
+    hrt_task_add_immediate(task, on_start_writes, fixture, NULL);
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->callbacks_run_count, ==, NUM_WRITES + 2);
+
+    g_object_unref(task);
+}
+
+static void
+on_read_error(HrtTask   *task,
+              HrtBuffer *buffer,
+              int        error_code,
+              void      *data)
+{
+    TestFixture *fixture = data;
+
+    g_assert(buffer == NULL);
+    g_assert_cmpint(error_code, ==, EBADF);
+
+    fixture->callbacks_run_count += 1;
+}
+
+static void
+test_read_error(TestFixture *fixture,
+                const void  *data)
+{
+    HrtTask *task;
+    int write_only_fd;
+
+    write_only_fd = open(fixture->filename, O_WRONLY);
+    if (write_only_fd < 0)
+        g_error("open() failed");
+
+    task = hrt_task_runner_create_task(fixture->runner);
+
+    fixture->tasks_expected_count = 1;
+
+    hrt_task_add_file_read(task, write_only_fd, 0, 10,
+                           on_read_error,
+                           fixture, NULL);
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->callbacks_run_count, ==, 1);
+
+    g_object_unref(task);
+    close(write_only_fd);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite File IO");
+    g_option_context_add_main_entries(context, entries, "test-file-io");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-file-io %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/file-io/write_then_read_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_write_then_read,
+               teardown_test_fixture);
+
+    g_test_add("/file-io/write_then_read_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_write_then_read,
+               teardown_test_fixture);
+
+    g_test_add("/file-io/read_error_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_read_error,
+               teardown_test_fixture);
+
+    g_test_add("/file-io/read_error_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_read_error,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -25,10 +25,12 @@
 #include <glib-object.h>
 #include <hrt/hrt-log.h>
 #include <hio/hio-connection-http.h>
+#include <hio/hio-intern.h>
 #include <hio/hio-request-http.h>
 #include <hio/hio-response-http.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 static gboolean option_debug = FALSE;
 static gboolean option_version = FALSE;
@@ -39,6 +41,47 @@ static GOptionEntry entries[] = {
     { NULL }
 };
 
+static void
+test_intern(void)
+{
+    HrtBuffer *buffer;
+    const char *utf8;
+    const guint16 *utf16;
+    gsize len;
+
+    /* names ignore case */
+    g_assert_cmpint(hio_intern_lookup_name("Host", 4), ==, HIO_INTERN_HOST);
+    g_assert_cmpint(hio_intern_lookup_name("user-agent", 10), ==, HIO_INTERN_USER_AGENT);
+    g_assert_cmpint(hio_intern_lookup_name("ACCEPT-ENCODING", 15), ==, HIO_INTERN_ACCEPT_ENCODING);
+    g_assert_cmpint(hio_intern_get_hash(HIO_INTERN_HOST), ==,
+                    hio_intern_get_hash(hio_intern_lookup_name("hOsT", 4)));
+
+    /* values don't */
+    g_assert_cmpint(hio_intern_lookup_value("keep-alive", 10), ==, HIO_INTERN_VALUE_KEEP_ALIVE);
+    g_assert_cmpint(hio_intern_lookup_value("Keep-Alive", 10), ==, HIO_INTERN_NONE);
+    g_assert_cmpint(hio_intern_lookup_value("gzip, deflate", 13), ==, HIO_INTERN_VALUE_GZIP_DEFLATE);
+
+    /* names and values are separate, and prefixes don't match */
+    g_assert_cmpint(hio_intern_lookup_name("close", 5), ==, HIO_INTERN_NONE);
+    g_assert_cmpint(hio_intern_lookup_name("Hos", 3), ==, HIO_INTERN_NONE);
+    g_assert_cmpint(hio_intern_lookup_name("X-Unknown", 9), ==, HIO_INTERN_NONE);
+    g_assert_cmpint(hio_intern_lookup_name("", 0), ==, HIO_INTERN_NONE);
+
+    /* buffers are shared, so they can be compared by pointer */
+    buffer = hio_intern_get_buffer(HIO_INTERN_CONTENT_TYPE, HRT_BUFFER_ENCODING_UTF8);
+    g_assert(buffer == hio_intern_get_buffer(hio_intern_lookup_name("content-type", 12),
+                                             HRT_BUFFER_ENCODING_UTF8));
+    g_assert(hrt_buffer_is_locked(buffer));
+    hrt_buffer_peek_utf8(buffer, &utf8, &len);
+    g_assert_cmpstr(utf8, ==, "Content-Type");
+    g_assert_cmpstr(hio_intern_get_string(HIO_INTERN_CONTENT_TYPE), ==, "Content-Type");
+
+    buffer = hio_intern_get_buffer(HIO_INTERN_VALUE_CLOSE, HRT_BUFFER_ENCODING_UTF16);
+    hrt_buffer_peek_utf16(buffer, &utf16, &len);
+    g_assert_cmpint(len, ==, 5);
+    g_assert(utf16[0] == 'c' && utf16[4] == 'e' && utf16[5] == 0);
+}
+
 int
 main(int    argc,
      char **argv)
@@ -69,5 +112,7 @@ main(int    argc,
     hrt_log_init(option_debug ?
                  HRT_LOG_FLAG_DEBUG : 0);
 
+    g_test_add_func("/http/intern", test_intern);
+
     return g_test_run();
 }
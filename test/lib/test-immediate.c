@@ -30,8 +30,17 @@
 #include <unistd.h>
 
 #define NUM_TASKS 100
+#define NUM_POSTS 5
+
+typedef struct TestFixture TestFixture;
 
 typedef struct {
+    TestFixture *fixture;
+    HrtTaskPost post;
+    int run_count;
+} PostItem;
+
+struct TestFixture {
     HrtTaskRunner *runner;
     int tasks_started_count;
     int tasks_completed_count;
@@ -52,7 +61,10 @@ typedef struct {
     gboolean completion_should_be_blocked;
     gboolean completion_check_timeout_ran;
     guint completion_check_timeout_id;
-} TestFixture;
+
+    /* used by post case */
+    PostItem posts[NUM_TASKS];
+};
 
 static void
 on_tasks_completed(HrtTaskRunner *runner,
@@ -706,6 +718,58 @@ test_immediate_block_completion(TestFixture *fixture,
     }
 }
 
+/* runs in task thread */
+static void
+on_post(HrtTask     *task,
+        HrtTaskPost *post)
+{
+    PostItem *item;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    item = HRT_TASK_POST_CONTAINER(post, PostItem, post);
+
+    item->run_count += 1;
+
+    if (item->run_count < NUM_POSTS) {
+        /* we're unqueued before being called so this requeues,
+         * then the second post is collapsed into the first since
+         * nothing else can run the task while we're in it.
+         */
+        g_assert(hrt_task_post(task, post, on_post));
+        g_assert(!hrt_task_post(task, post, on_post));
+    }
+}
+
+static void
+test_immediate_post(TestFixture *fixture,
+                    const void  *data)
+{
+    int i;
+
+    fixture->tasks_started_count = NUM_TASKS;
+
+    for (i = 0; i < NUM_TASKS; ++i) {
+        HrtTask *task;
+        PostItem *item = &fixture->posts[i];
+
+        task =
+            hrt_task_runner_create_task(fixture->runner);
+
+        item->fixture = fixture;
+        g_assert(hrt_task_post(task, &item->post, on_post));
+
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_TASKS);
+    for (i = 0; i < NUM_TASKS; ++i) {
+        g_assert_cmpint(fixture->posts[i].run_count, ==, NUM_POSTS);
+    }
+}
+
 static gboolean option_debug = FALSE;
 static gboolean option_version = FALSE;
 
@@ -873,5 +937,19 @@ main(int    argc,
                test_immediate_block_completion,
                teardown_test_fixture);
 
+    g_test_add("/immediate/post_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_immediate_post,
+               teardown_test_fixture);
+
+    g_test_add("/immediate/post_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_immediate_post,
+               teardown_test_fixture);
+
     return g_test_run();
 }
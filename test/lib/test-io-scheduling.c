@@ -54,6 +54,12 @@ typedef struct {
      */
     int always_ready_fd;
     int always_ready_fd_other_end;
+    /* two ends of a socketpair that test_ping_pong bounces one byte
+     * across, tasks[0] reading one end and tasks[1] the other.
+     */
+    int ping_pong_fds[2];
+    /* decremented by both tasks' threads so needs to be atomic */
+    volatile int ping_pong_rounds_left;
     struct {
         HrtTask *task;
         HrtWatcher *watcher;
@@ -444,6 +450,100 @@ test_many_tasks_many_ios(TestFixture *fixture,
 #undef NUM_IOS
 }
 
+#define PING_PONG_ROUNDS 20000
+
+static gboolean
+on_io_ping_pong(HrtTask        *task,
+                HrtWatcherFlags flags,
+                void           *data)
+{
+    TestFixture *fixture = data;
+    char buf[1];
+    int i;
+
+    g_assert(flags == HRT_WATCHER_FLAG_READ);
+
+    i = fixture->tasks[0].task == task ? 0 : 1;
+    g_assert(fixture->tasks[i].task == task);
+
+    if (read(fixture->ping_pong_fds[i], buf, 1) != 1) {
+        if (errno == EAGAIN)
+            return TRUE;
+        g_error("read() failed: %s", strerror(errno));
+    }
+
+    fixture->tasks[i].ios_run_count += 1;
+
+    /* send the byte back even after the last round, so the other
+     * task wakes up and sees the game is over.
+     */
+    if (write(fixture->ping_pong_fds[i], buf, 1) != 1)
+        g_error("write() failed: %s", strerror(errno));
+
+    return g_atomic_int_exchange_and_add(&fixture->ping_pong_rounds_left, -1) > 1;
+}
+
+/* Each hop is one task's IO watcher firing and waking the other
+ * task's, so this measures how long it takes an idle runner to get
+ * a newly ready watcher onto an invoke thread.
+ */
+static void
+test_ping_pong(TestFixture *fixture,
+               const void  *data)
+{
+    int i;
+    double elapsed;
+    char buf[1];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                   0, &fixture->ping_pong_fds[0]) < 0)
+        g_error("socketpair() failed: %s", strerror(errno));
+
+    fixture->ping_pong_rounds_left = PING_PONG_ROUNDS;
+    fixture->tasks_started_count = 2;
+
+    for (i = 0; i < 2; ++i) {
+        fixture->tasks[i].task =
+            hrt_task_runner_create_task(fixture->runner);
+    }
+
+    for (i = 0; i < 2; ++i) {
+        hrt_task_add_io(fixture->tasks[i].task,
+                        fixture->ping_pong_fds[i],
+                        HRT_WATCHER_FLAG_READ,
+                        on_io_ping_pong,
+                        fixture,
+                        on_dnotify_bump_count);
+    }
+
+    g_test_timer_start();
+
+    /* serve to tasks[0] */
+    buf[0] = 'p';
+    if (write(fixture->ping_pong_fds[1], buf, 1) != 1)
+        g_error("write() failed: %s", strerror(errno));
+
+    g_main_loop_run(fixture->loop);
+
+    elapsed = g_test_timer_elapsed();
+    g_test_minimized_result(elapsed * G_USEC_PER_SEC / PING_PONG_ROUNDS,
+                            "%g usec per hop",
+                            elapsed * G_USEC_PER_SEC / PING_PONG_ROUNDS);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, 2);
+    g_assert_cmpint(fixture->dnotify_count, ==, 2);
+    /* the loser of the last round reads one extra time to find out */
+    g_assert_cmpint(fixture->tasks[0].ios_run_count +
+                    fixture->tasks[1].ios_run_count, ==,
+                    PING_PONG_ROUNDS + 1);
+
+    for (i = 0; i < 2; ++i)
+        g_object_unref(fixture->tasks[i].task);
+
+    close(fixture->ping_pong_fds[0]);
+    close(fixture->ping_pong_fds[1]);
+}
+
 static gboolean option_debug = FALSE;
 static gboolean option_version = FALSE;
 
@@ -539,5 +639,19 @@ main(int    argc,
                test_many_tasks_many_ios,
                teardown_test_fixture);
 
+    g_test_add("/io_scheduling/ping_pong_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_ping_pong,
+               teardown_test_fixture);
+
+    g_test_add("/io_scheduling/ping_pong_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_ping_pong,
+               teardown_test_fixture);
+
     return g_test_run();
 }
@@ -0,0 +1,265 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-lock.h>
+#include <hrt/hrt-log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_THREADS 4
+#define N_ITERATIONS 20000
+
+typedef struct {
+    HrtLock *lock;
+    volatile int counter;
+} TestFixture;
+
+static void
+setup_test_fixture(TestFixture *fixture,
+                   const void  *data)
+{
+    hrt_lock_profiling_set_enabled(TRUE);
+    hrt_lock_profiling_reset();
+
+    fixture->lock = hrt_lock_new(data);
+    fixture->counter = 0;
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    hrt_lock_free(fixture->lock);
+}
+
+static void
+test_lock_counts(TestFixture *fixture,
+                 const void  *data)
+{
+    guint acquisitions;
+    guint contended;
+    int i;
+
+    /* a site has no stats until the first recorded acquisition */
+    g_assert(!hrt_lock_profiling_get_site_stats(data,
+                                                &acquisitions,
+                                                &contended));
+
+    for (i = 0; i < N_ITERATIONS; ++i) {
+        hrt_lock_lock(fixture->lock);
+        hrt_lock_unlock(fixture->lock);
+    }
+
+    g_assert(hrt_lock_profiling_get_site_stats(data,
+                                               &acquisitions,
+                                               &contended));
+    g_assert_cmpuint(acquisitions, ==, N_ITERATIONS);
+    g_assert_cmpuint(contended, ==, 0);
+
+    /* nothing is recorded while disabled */
+    hrt_lock_profiling_set_enabled(FALSE);
+    hrt_lock_lock(fixture->lock);
+    hrt_lock_unlock(fixture->lock);
+    hrt_lock_profiling_set_enabled(TRUE);
+
+    g_assert(hrt_lock_profiling_get_site_stats(data,
+                                               &acquisitions,
+                                               &contended));
+    g_assert_cmpuint(acquisitions, ==, N_ITERATIONS);
+
+    hrt_lock_profiling_reset();
+    g_assert(hrt_lock_profiling_get_site_stats(data,
+                                               &acquisitions,
+                                               &contended));
+    g_assert_cmpuint(acquisitions, ==, 0);
+}
+
+static void*
+contend_thread(void *data)
+{
+    TestFixture *fixture = data;
+    int i;
+
+    for (i = 0; i < N_ITERATIONS; ++i) {
+        hrt_lock_lock(fixture->lock);
+        /* not atomic on purpose, the lock protects it */
+        fixture->counter = fixture->counter + 1;
+        hrt_lock_unlock(fixture->lock);
+    }
+
+    return NULL;
+}
+
+static void
+test_lock_contended(TestFixture *fixture,
+                    const void  *data)
+{
+    GThread *threads[N_THREADS];
+    guint acquisitions;
+    guint contended;
+    char *report;
+    int i;
+
+    for (i = 0; i < N_THREADS; ++i) {
+        threads[i] = g_thread_create(contend_thread, fixture,
+                                     TRUE, NULL);
+    }
+
+    for (i = 0; i < N_THREADS; ++i) {
+        g_thread_join(threads[i]);
+    }
+
+    g_assert_cmpint(fixture->counter, ==, N_THREADS * N_ITERATIONS);
+
+    g_assert(hrt_lock_profiling_get_site_stats(data,
+                                               &acquisitions,
+                                               &contended));
+    g_assert_cmpuint(acquisitions, ==, N_THREADS * N_ITERATIONS);
+    /* how many were contended depends on scheduling */
+    g_assert_cmpuint(contended, <=, acquisitions);
+
+    report = hrt_lock_profiling_report();
+    g_assert(strstr(report, data) != NULL);
+    if (g_test_verbose())
+        g_print("%s", report);
+    g_free(report);
+}
+
+typedef struct {
+    TestFixture *fixture;
+    GCond *cond;
+} WaitData;
+
+static void*
+signal_thread(void *data)
+{
+    WaitData *wait_data = data;
+
+    hrt_lock_lock(wait_data->fixture->lock);
+    wait_data->fixture->counter = 1;
+    g_cond_signal(wait_data->cond);
+    hrt_lock_unlock(wait_data->fixture->lock);
+
+    return NULL;
+}
+
+static void
+test_lock_wait(TestFixture *fixture,
+               const void  *data)
+{
+    WaitData wait_data;
+    GThread *thread;
+    GTimeVal until;
+    guint acquisitions;
+    guint contended;
+
+    wait_data.fixture = fixture;
+    wait_data.cond = g_cond_new();
+
+    /* nobody signals, so this times out with the lock held again */
+    hrt_lock_lock(fixture->lock);
+    g_get_current_time(&until);
+    g_time_val_add(&until, 1000);
+    g_assert(!hrt_lock_timed_wait(fixture->lock, wait_data.cond, &until));
+    hrt_lock_unlock(fixture->lock);
+
+    hrt_lock_lock(fixture->lock);
+    thread = g_thread_create(signal_thread, &wait_data,
+                             TRUE, NULL);
+    while (fixture->counter == 0)
+        hrt_lock_wait(fixture->lock, wait_data.cond);
+    hrt_lock_unlock(fixture->lock);
+
+    g_thread_join(thread);
+    g_cond_free(wait_data.cond);
+
+    /* getting the lock back after a wait isn't a new acquisition */
+    g_assert(hrt_lock_profiling_get_site_stats(data,
+                                               &acquisitions,
+                                               &contended));
+    g_assert_cmpuint(acquisitions, ==, 3);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Lock");
+    g_option_context_add_main_entries(context, entries, "test-lock");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-lock %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/lock/counts",
+               TestFixture,
+               "test-lock.counts",
+               setup_test_fixture,
+               test_lock_counts,
+               teardown_test_fixture);
+
+    g_test_add("/lock/contended",
+               TestFixture,
+               "test-lock.contended",
+               setup_test_fixture,
+               test_lock_contended,
+               teardown_test_fixture);
+
+    g_test_add("/lock/wait",
+               TestFixture,
+               "test-lock.wait",
+               setup_test_fixture,
+               test_lock_wait,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
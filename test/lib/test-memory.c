@@ -0,0 +1,221 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    HrtTaskRunner *runner;
+} TestFixture;
+
+static void
+setup_test_fixture(TestFixture *fixture,
+                   const void  *data)
+{
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", HRT_EVENT_LOOP_GLIB,
+                     NULL);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+}
+
+static void
+test_memory_rollup(TestFixture *fixture,
+                   const void  *data)
+{
+    HrtTask *root;
+    HrtTask *child;
+    HrtTask *grandchild;
+    HrtTaskRunnerLoad load;
+
+    root = hrt_task_runner_create_task(fixture->runner);
+    child = hrt_task_create_task(root);
+    grandchild = hrt_task_create_task(child);
+
+    g_assert(hrt_task_charge_memory(grandchild, 100));
+    g_assert(hrt_task_charge_memory(child, 50));
+
+    g_assert_cmpuint(hrt_task_get_memory_used(grandchild), ==, 100);
+    g_assert_cmpuint(hrt_task_get_memory_used(child), ==, 150);
+    g_assert_cmpuint(hrt_task_get_memory_used(root), ==, 150);
+
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpuint(load.memory_used, ==, 150);
+
+    hrt_task_uncharge_memory(grandchild, 100);
+    hrt_task_uncharge_memory(child, 50);
+
+    g_assert_cmpuint(hrt_task_get_memory_used(grandchild), ==, 0);
+    g_assert_cmpuint(hrt_task_get_memory_used(child), ==, 0);
+    g_assert_cmpuint(hrt_task_get_memory_used(root), ==, 0);
+
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpuint(load.memory_used, ==, 0);
+
+    g_object_unref(grandchild);
+    g_object_unref(child);
+    g_object_unref(root);
+}
+
+static void
+test_memory_limit(TestFixture *fixture,
+                  const void  *data)
+{
+    HrtTask *root;
+    HrtTask *child;
+    HrtTask *sibling;
+    HrtTaskRunnerLoad load;
+
+    root = hrt_task_runner_create_task(fixture->runner);
+    child = hrt_task_create_task(root);
+    sibling = hrt_task_create_task(root);
+
+    hrt_task_set_memory_limit(root, 1000);
+    g_assert_cmpuint(hrt_task_get_memory_limit(root), ==, 1000);
+
+    /* the limit covers the whole tree */
+    g_assert(hrt_task_charge_memory(child, 600));
+    g_assert(!hrt_task_is_cancelled(root));
+    g_assert(!hrt_task_charge_memory(sibling, 600));
+
+    /* the failed charge left nothing behind */
+    g_assert_cmpuint(hrt_task_get_memory_used(sibling), ==, 0);
+    g_assert_cmpuint(hrt_task_get_memory_used(root), ==, 600);
+
+    /* the task with the limit was cancelled, taking its children */
+    g_assert(hrt_task_is_cancelled(root));
+    g_assert(hrt_task_is_cancelled(child));
+    g_assert(hrt_task_is_cancelled(sibling));
+
+    hrt_task_runner_get_load(fixture->runner, &load);
+    g_assert_cmpuint(load.memory_limit_hits, ==, 1);
+    g_assert_cmpuint(load.memory_used, ==, 600);
+
+    hrt_task_uncharge_memory(child, 600);
+    g_assert_cmpuint(hrt_task_get_memory_used(root), ==, 0);
+
+    g_object_unref(sibling);
+    g_object_unref(child);
+    g_object_unref(root);
+}
+
+static void
+test_memory_args(TestFixture *fixture,
+                 const void  *data)
+{
+    HrtTask *root;
+    HrtTask *child;
+    GValue value = { 0, };
+    const char *str = "an argument value";
+
+    root = hrt_task_runner_create_task(fixture->runner);
+    child = hrt_task_create_task(root);
+
+    g_value_init(&value, G_TYPE_STRING);
+    g_value_set_static_string(&value, str);
+    hrt_task_add_arg(child, "arg", &value);
+    g_value_unset(&value);
+
+    g_assert_cmpuint(hrt_task_get_memory_used(child), >, strlen(str));
+    g_assert_cmpuint(hrt_task_get_memory_used(root), ==,
+                     hrt_task_get_memory_used(child));
+
+    /* args are released from the tree with the task */
+    g_object_unref(child);
+    g_assert_cmpuint(hrt_task_get_memory_used(root), ==, 0);
+
+    g_object_unref(root);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Memory Accounting");
+    g_option_context_add_main_entries(context, entries, "test-memory");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-memory %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/memory/rollup",
+               TestFixture,
+               NULL,
+               setup_test_fixture,
+               test_memory_rollup,
+               teardown_test_fixture);
+
+    g_test_add("/memory/limit",
+               TestFixture,
+               NULL,
+               setup_test_fixture,
+               test_memory_limit,
+               teardown_test_fixture);
+
+    g_test_add("/memory/args",
+               TestFixture,
+               NULL,
+               setup_test_fixture,
+               test_memory_args,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
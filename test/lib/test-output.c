@@ -26,6 +26,7 @@
 #include <hrt/hrt-log.h>
 #include <hio/hio-output-chain.h>
 #include <hrt/hrt-task.h>
+#include <hrt/hrt-zerocopy.h>
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 typedef struct {
     const char *seed;
@@ -109,6 +112,12 @@ static const StreamDesc various_stream_descs[] = {
     { "6", "This is a zero-length stream. ", 0 }
 };
 
+/* written in buffers big enough to go through the zero-copy path,
+ * with small ones in between that shouldn't
+ */
+static const StreamDesc zerocopy_stream_desc =
+    { "zerocopy", "This stream is sent without copying when possible. ", 1024 * 400 };
+
 static void*
 buffer_g_malloc(gsize bytes,
                 void *allocator_data)
@@ -239,6 +248,51 @@ create_socketpair(int *read_end_p,
     }
 }
 
+/* MSG_ZEROCOPY needs TCP, so this is a loopback connection */
+static void
+create_tcp_pair(int *read_end_p,
+                int *write_end_p)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int listen_fd;
+    int flags;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        g_error("socket failed: %s", strerror(errno));
+
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    addr_len = sizeof(addr);
+
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len) < 0)
+        g_error("failed to listen on loopback: %s", strerror(errno));
+
+    *write_end_p = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*write_end_p < 0 ||
+        connect(*write_end_p, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+        g_error("failed to connect on loopback: %s", strerror(errno));
+
+    *read_end_p = accept(listen_fd, NULL, NULL);
+    if (*read_end_p < 0)
+        g_error("accept failed: %s", strerror(errno));
+
+    close(listen_fd);
+
+    flags = fcntl(*write_end_p,
+                  F_GETFL);
+    if (fcntl(*write_end_p,
+              F_SETFL,
+              flags | O_NONBLOCK) < 0) {
+        g_error("F_SETFL failed: %s", strerror(errno));
+    }
+}
+
 typedef struct {
     HrtTaskRunner *runner;
     HioOutputChain *chain;
@@ -336,6 +390,50 @@ on_write_stream_task(HrtTask        *task,
     return FALSE;
 }
 
+static gboolean
+on_write_zerocopy_task(HrtTask        *task,
+                       HrtWatcherFlags flags,
+                       void           *data)
+{
+    WriteTaskData *wtd = data;
+    StreamGenerator generator;
+    gsize remaining;
+    gboolean large;
+
+    stream_generator_init(&generator, wtd->desc->seed);
+    remaining = wtd->desc->length;
+    large = TRUE;
+
+    while (remaining > 0) {
+        char *buf;
+        gsize count;
+        HrtBuffer *buffer;
+
+        count = MIN(large ? 1024 * 100 : 48, remaining);
+        large = !large;
+
+        buf = g_malloc(count);
+        stream_generator_generate(&generator, buf, count);
+
+        buffer = hrt_buffer_new(HRT_BUFFER_ENCODING_UTF8,
+                                &allocator,
+                                NULL, NULL);
+        hrt_buffer_append_ascii(buffer, buf, count);
+        hrt_buffer_lock(buffer);
+
+        hio_output_stream_write(wtd->stream, buffer);
+
+        hrt_buffer_unref(buffer);
+        g_free(buf);
+
+        remaining -= count;
+    }
+
+    hio_output_stream_close(wtd->stream);
+
+    return FALSE;
+}
+
 typedef enum {
     TASK_SCENARIO_ALL_ONE,
     TASK_SCENARIO_THREE,
@@ -621,6 +719,206 @@ test_stream_with_initial_error(OutputTestFixture *fixture,
     g_object_unref(stream);
 }
 
+static void
+test_stream_zerocopy(OutputTestFixture *fixture,
+                     const void        *data)
+{
+    HioOutputStream *stream;
+    HrtZerocopy *zerocopy;
+    HrtZerocopyStats before;
+    HrtZerocopyStats after;
+
+    g_assert(fixture->chain_task == NULL);
+
+    close(fixture->read_fd);
+    close(fixture->write_fd);
+    create_tcp_pair(&fixture->read_fd,
+                    &fixture->write_fd);
+
+    hrt_zerocopy_get_stats(&before);
+
+    /* NULL if the kernel can't do it, in which case this is just
+     * another test of writing large buffers
+     */
+    zerocopy = hrt_zerocopy_new(fixture->stream_tasks[0],
+                                fixture->write_fd);
+
+    stream = hio_output_stream_new(fixture->stream_tasks[0]);
+    if (zerocopy != NULL)
+        hio_output_stream_set_zerocopy(stream, zerocopy);
+    hio_output_stream_set_fd(stream, fixture->write_fd);
+
+    hrt_task_add_immediate(fixture->write_tasks[0],
+                           on_write_zerocopy_task,
+                           write_task_data_new(stream, &zerocopy_stream_desc),
+                           write_task_data_free);
+
+    read_and_verify_stream(fixture->read_fd, &zerocopy_stream_desc);
+
+    /* run main loop to collect the task, which isn't done until
+     * the kernel has given back every buffer
+     */
+    g_main_loop_run(fixture->loop);
+
+    g_assert(!hio_output_stream_got_error(stream));
+    g_assert(hio_output_stream_is_done(stream));
+
+    g_object_unref(stream);
+
+    if (zerocopy != NULL) {
+        g_assert_cmpint(hrt_zerocopy_get_pending(zerocopy), ==, 0);
+
+        hrt_zerocopy_get_stats(&after);
+
+        /* only the large buffers, and all of them complete */
+        g_assert(after.sends > before.sends);
+        g_assert(after.bytes - before.bytes <= 1024 * 400 - 48 * 3);
+        g_assert_cmpint(after.completed_sends - before.completed_sends, ==,
+                        after.sends - before.sends);
+
+        /* closes write_fd */
+        hrt_zerocopy_close_fd(zerocopy);
+        hrt_zerocopy_unref(zerocopy);
+        fixture->write_fd = -1;
+    }
+}
+
+typedef struct {
+    HrtZerocopy *zerocopy;
+    gsize bytes_sent;
+    volatile int filled;
+} FillData;
+
+/* Writes large buffers until the socket is full, so some zero-copy
+ * sends are still sitting unsent in the kernel.
+ */
+static gboolean
+on_fill_zerocopy_task(HrtTask        *task,
+                      HrtWatcherFlags flags,
+                      void           *data)
+{
+    FillData *fill = data;
+    char *buf;
+    int i;
+
+    buf = g_malloc(1024 * 256);
+    memset(buf, 'x', 1024 * 256);
+
+    for (i = 0; i < 1000; ++i) {
+        HrtBuffer *buffer;
+        gsize remaining;
+
+        buffer = hrt_buffer_new(HRT_BUFFER_ENCODING_UTF8,
+                                &allocator,
+                                NULL, NULL);
+        hrt_buffer_append_ascii(buffer, buf, 1024 * 256);
+        hrt_buffer_lock(buffer);
+
+        remaining = 1024 * 256;
+        if (!hrt_zerocopy_write(fill->zerocopy, buffer, &remaining, FALSE))
+            g_error("zerocopy write failed: %s", strerror(errno));
+
+        hrt_buffer_unref(buffer);
+
+        fill->bytes_sent += 1024 * 256 - remaining;
+        if (remaining > 0)
+            break;
+    }
+
+    g_free(buf);
+
+    g_atomic_int_set(&fill->filled, 1);
+
+    return FALSE;
+}
+
+/* A peer that half-closes, or pipelines a request we never read,
+ * leaves the socket readable for as long as sends are pending. The
+ * completion watcher mustn't spin on that.
+ */
+static void
+test_zerocopy_half_closed(OutputTestFixture *fixture,
+                          const void        *data)
+{
+    FillData fill;
+    HrtZerocopyStats before;
+    HrtZerocopyStats after;
+    const char request[] = "GET / HTTP/1.1\r\n\r\n";
+    int size;
+    int i;
+
+    close(fixture->read_fd);
+    close(fixture->write_fd);
+    create_tcp_pair(&fixture->read_fd,
+                    &fixture->write_fd);
+
+    fill.zerocopy = hrt_zerocopy_new(fixture->stream_tasks[0],
+                                     fixture->write_fd);
+    if (fill.zerocopy == NULL) {
+        g_test_message("no zero-copy sends on this kernel, skipping");
+        return;
+    }
+    fill.bytes_sent = 0;
+    fill.filled = 0;
+
+    /* keep the socket buffers small so they fill quickly */
+    size = 64 * 1024;
+    setsockopt(fixture->write_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fixture->read_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    /* a request nobody reads, then EOF */
+    if (write(fixture->read_fd, request, strlen(request)) != (gssize) strlen(request))
+        g_error("write failed: %s", strerror(errno));
+    if (shutdown(fixture->read_fd, SHUT_WR) < 0)
+        g_error("shutdown failed: %s", strerror(errno));
+
+    hrt_task_add_immediate(fixture->write_tasks[0],
+                           on_fill_zerocopy_task,
+                           &fill,
+                           NULL);
+
+    while (!g_atomic_int_get(&fill.filled))
+        g_usleep(G_USEC_PER_SEC / 1000);
+
+    hrt_zerocopy_get_stats(&before);
+    g_usleep(G_USEC_PER_SEC / 5);
+    hrt_zerocopy_get_stats(&after);
+
+    /* the reader is stalled, so the kernel still has our buffers */
+    g_assert_cmpint(hrt_zerocopy_get_pending(fill.zerocopy), >, 0);
+
+    /* a spinning watcher would run many thousands of times */
+    g_assert_cmpint(after.wakeups - before.wakeups, <, 50);
+
+    /* now let everything go out */
+    while (fill.bytes_sent > 0) {
+        char buf[4096];
+        gssize bytes_read;
+
+        bytes_read = read(fixture->read_fd, buf, MIN(sizeof(buf), fill.bytes_sent));
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            g_error("read failed: %s", strerror(errno));
+
+        fill.bytes_sent -= bytes_read;
+    }
+
+    for (i = 0; hrt_zerocopy_get_pending(fill.zerocopy) > 0; ++i) {
+        if (i == 10000)
+            g_error("zero-copy sends never completed");
+        g_usleep(G_USEC_PER_SEC / 1000);
+    }
+
+    /* closes write_fd */
+    hrt_zerocopy_close_fd(fill.zerocopy);
+    hrt_zerocopy_unref(fill.zerocopy);
+    fixture->write_fd = -1;
+
+    /* run main loop to collect the tasks */
+    g_main_loop_run(fixture->loop);
+}
+
 static void
 on_chain_empty(HioOutputChain    *chain,
                void              *data)
@@ -843,6 +1141,20 @@ main(int    argc,
     add_one_stream_test("stream_with_initial_error",
                         test_stream_with_initial_error);
 
+    g_test_add("/output/stream_zerocopy",
+               OutputTestFixture,
+               &zerocopy_stream_desc,
+               setup_two_tasks_no_chain,
+               test_stream_zerocopy,
+               teardown);
+
+    g_test_add("/output/zerocopy_half_closed",
+               OutputTestFixture,
+               &zerocopy_stream_desc,
+               setup_two_tasks_no_chain,
+               test_zerocopy_half_closed,
+               teardown);
+
     add_chain_test("chain",
                    test_chain);
 
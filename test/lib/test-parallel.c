@@ -0,0 +1,388 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-parallel.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_TASKS 5
+#define NUM_ITEMS 200000
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    int tasks_expected_count;
+    /* these are accessed by multiple threads so need to be atomic */
+    volatile int done_count;
+    volatile int dnotify_count;
+    GMainLoop *loop;
+} TestFixture;
+
+typedef struct {
+    TestFixture *fixture;
+    gsize n_items;
+    /* each item sets its own byte, so no locking needed */
+    guint8 *visited;
+} Job;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= fixture->tasks_expected_count) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type)
+{
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static Job*
+job_new(TestFixture *fixture,
+        gsize        n_items)
+{
+    Job *job;
+
+    job = g_slice_new0(Job);
+    job->fixture = fixture;
+    job->n_items = n_items;
+    job->visited = g_new0(guint8, MAX(n_items, 1));
+
+    return job;
+}
+
+static void
+on_job_dnotify(void *data)
+{
+    Job *job = data;
+
+    g_atomic_int_inc(&job->fixture->dnotify_count);
+    g_free(job->visited);
+    g_slice_free(Job, job);
+}
+
+static void
+visit_items(gsize  start,
+            gsize  end,
+            void  *data)
+{
+    Job *job = data;
+    gsize i;
+
+    g_assert(start < end);
+    g_assert(end <= job->n_items);
+
+    for (i = start; i < end; ++i) {
+        job->visited[i] += 1;
+    }
+}
+
+static void
+on_for_done(HrtTask *task,
+            void    *result,
+            void    *data)
+{
+    Job *job = data;
+    gsize i;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    g_assert(result == NULL);
+
+    for (i = 0; i < job->n_items; ++i) {
+        g_assert_cmpint(job->visited[i], ==, 1);
+    }
+
+    g_atomic_int_inc(&job->fixture->done_count);
+}
+
+static gboolean
+on_start_for(HrtTask        *task,
+             HrtWatcherFlags flags,
+             void           *data)
+{
+    Job *job = data;
+
+    hrt_parallel_for(task, job->n_items,
+                     visit_items, on_for_done,
+                     job, on_job_dnotify);
+
+    return FALSE;
+}
+
+static void*
+sum_items(gsize  start,
+          gsize  end,
+          void  *data)
+{
+    guint64 *sum;
+    gsize i;
+
+    sum = g_new0(guint64, 1);
+    for (i = start; i < end; ++i) {
+        *sum += i;
+    }
+
+    return sum;
+}
+
+static void*
+add_sums(void *a,
+         void *b,
+         void *data)
+{
+    guint64 *sum_a = a;
+    guint64 *sum_b = b;
+
+    *sum_a += *sum_b;
+    g_free(sum_b);
+
+    return sum_a;
+}
+
+static void
+on_reduce_done(HrtTask *task,
+               void    *result,
+               void    *data)
+{
+    Job *job = data;
+    guint64 *sum = result;
+
+    HRT_ASSERT_IN_TASK_THREAD(task);
+
+    if (job->n_items == 0) {
+        g_assert(sum == NULL);
+    } else {
+        g_assert(sum != NULL);
+        g_assert_cmpuint(*sum, ==,
+                         ((guint64) job->n_items) * (job->n_items - 1) / 2);
+        g_free(sum);
+    }
+
+    g_atomic_int_inc(&job->fixture->done_count);
+}
+
+static gboolean
+on_start_reduce(HrtTask        *task,
+                HrtWatcherFlags flags,
+                void           *data)
+{
+    Job *job = data;
+
+    hrt_parallel_reduce(task, job->n_items,
+                        sum_items, add_sums, g_free,
+                        on_reduce_done,
+                        job, on_job_dnotify);
+
+    return FALSE;
+}
+
+static void
+run_tasks(TestFixture        *fixture,
+          HrtWatcherCallback  start_callback,
+          gsize               n_items)
+{
+    int i;
+
+    fixture->tasks_expected_count = NUM_TASKS;
+
+    for (i = 0; i < NUM_TASKS; ++i) {
+        HrtTask *task;
+
+        task = hrt_task_runner_create_task(fixture->runner);
+
+        hrt_task_add_immediate(task, start_callback,
+                               job_new(fixture, n_items), NULL);
+
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_TASKS);
+    g_assert_cmpint(fixture->done_count, ==, NUM_TASKS);
+    g_assert_cmpint(fixture->dnotify_count, ==, NUM_TASKS);
+}
+
+static void
+test_parallel_for(TestFixture *fixture,
+                  const void  *data)
+{
+    run_tasks(fixture, on_start_for, NUM_ITEMS);
+}
+
+static void
+test_parallel_for_few_items(TestFixture *fixture,
+                            const void  *data)
+{
+    /* fewer items than threads */
+    run_tasks(fixture, on_start_for, 1);
+}
+
+static void
+test_parallel_reduce(TestFixture *fixture,
+                     const void  *data)
+{
+    run_tasks(fixture, on_start_reduce, NUM_ITEMS);
+}
+
+static void
+test_parallel_reduce_empty(TestFixture *fixture,
+                           const void  *data)
+{
+    run_tasks(fixture, on_start_reduce, 0);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Parallel");
+    g_option_context_add_main_entries(context, entries, "test-parallel");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-parallel %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/parallel/for_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_parallel_for,
+               teardown_test_fixture);
+
+    g_test_add("/parallel/for_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_parallel_for,
+               teardown_test_fixture);
+
+    g_test_add("/parallel/for_few_items",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_parallel_for_few_items,
+               teardown_test_fixture);
+
+    g_test_add("/parallel/reduce_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_parallel_reduce,
+               teardown_test_fixture);
+
+    g_test_add("/parallel/reduce_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_parallel_reduce,
+               teardown_test_fixture);
+
+    g_test_add("/parallel/reduce_empty",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_parallel_reduce_empty,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -62,7 +62,8 @@ on_tasks_completed(HrtTaskRunner *runner,
 
 static void
 setup_test_fixture_generic(TestFixture     *fixture,
-                           HrtEventLoopType loop_type)
+                           HrtEventLoopType loop_type,
+                           gboolean         complete_in_invoke_thread)
 {
     fixture->loop =
         g_main_loop_new(NULL, FALSE);
@@ -70,6 +71,7 @@ setup_test_fixture_generic(TestFixture     *fixture,
     fixture->runner =
         g_object_new(HRT_TYPE_TASK_RUNNER,
                      "event-loop-type", loop_type,
+                     "complete-in-invoke-thread", complete_in_invoke_thread,
                      NULL);
 
     g_signal_connect(G_OBJECT(fixture->runner),
@@ -82,14 +84,28 @@ static void
 setup_test_fixture_glib(TestFixture *fixture,
                         const void  *data)
 {
-    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB);
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB, FALSE);
 }
 
 static void
 setup_test_fixture_libev(TestFixture *fixture,
                          const void  *data)
 {
-    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV);
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV, FALSE);
+}
+
+static void
+setup_test_fixture_glib_invoke_completion(TestFixture *fixture,
+                                          const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB, TRUE);
+}
+
+static void
+setup_test_fixture_libev_invoke_completion(TestFixture *fixture,
+                                           const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV, TRUE);
 }
 
 static void
@@ -321,5 +337,19 @@ main(int    argc,
                test_run_subtask_tree,
                teardown_test_fixture);
 
+    g_test_add("/subtask/run_subtask_tree_glib_invoke_completion",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib_invoke_completion,
+               test_run_subtask_tree,
+               teardown_test_fixture);
+
+    g_test_add("/subtask/run_subtask_tree_libev_invoke_completion",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev_invoke_completion,
+               test_run_subtask_tree,
+               teardown_test_fixture);
+
     return g_test_run();
 }
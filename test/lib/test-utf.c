@@ -0,0 +1,335 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-buffer.h>
+#include <hrt/hrt-buffer-pool.h>
+#include <hrt/hrt-utf.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* long enough to cross a few vectors at every alignment */
+#define MAX_LEN 200
+
+/* é, €, and U+1F600 (a surrogate pair in UTF-16) */
+static const char mixed[] = "h\xc3\xa9llo \xe2\x82\xac \xf0\x9f\x98\x80 z";
+
+static const char *invalid[] = {
+    "\xc0\x80",         /* overlong nul */
+    "\xe0\x80\xaf",     /* overlong '/' */
+    "\xed\xa0\x80",     /* surrogate */
+    "\xef\xbf\xbe",     /* noncharacter U+FFFE */
+    "\xf4\x90\x80\x80", /* past U+10FFFF */
+    "\xf5\x80\x80\x80",
+    "\xe2\x82",         /* truncated */
+    "\x80",             /* stray continuation */
+    "\xe9t\xe9"         /* Latin-1 */
+};
+
+static void
+use_kernels(const void *data)
+{
+    HrtUtfKernels wanted = GPOINTER_TO_INT(data);
+
+    /* on a CPU without them we test whatever we fall back to */
+    g_assert_cmpint(hrt_utf_set_kernels(wanted), <=, wanted);
+}
+
+static void
+fill_ascii(char *buf,
+           gsize len)
+{
+    gsize i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = 'a' + (i % 26);
+}
+
+static void
+test_ascii(const void *data)
+{
+    char buf[MAX_LEN];
+    guint16 wide[MAX_LEN];
+    gsize len;
+    gsize bad;
+    gsize i;
+
+    use_kernels(data);
+
+    for (len = 0; len < MAX_LEN; ++len) {
+        fill_ascii(buf, len);
+        g_assert(hrt_utf_is_ascii(buf, len));
+        g_assert(hrt_utf8_validate(buf, len));
+
+        /* widening takes Latin-1 too */
+        if (len > 0)
+            buf[len - 1] = (char) 0xE9;
+        hrt_utf_widen_ascii(wide, buf, len);
+        for (i = 0; i < len; ++i)
+            g_assert_cmpint(wide[i], ==, (guint8) buf[i]);
+
+        /* one non-ASCII byte or nul anywhere is noticed */
+        for (bad = 0; bad < len; ++bad) {
+            fill_ascii(buf, len);
+            buf[bad] = (char) 0x80;
+            g_assert(!hrt_utf_is_ascii(buf, len));
+            buf[bad] = '\0';
+            g_assert(!hrt_utf_is_ascii(buf, len));
+            g_assert(!hrt_utf8_validate(buf, len));
+        }
+    }
+}
+
+static void
+test_validate(const void *data)
+{
+    char buf[MAX_LEN + sizeof(mixed)];
+    gsize offset;
+    gsize i;
+
+    use_kernels(data);
+
+    for (offset = 0; offset < MAX_LEN; ++offset) {
+        fill_ascii(buf, offset);
+        memcpy(buf + offset, mixed, sizeof(mixed) - 1);
+        g_assert(hrt_utf8_validate(buf, offset + sizeof(mixed) - 1));
+
+        /* chopping the last character short is invalid */
+        g_assert(!hrt_utf8_validate(buf, offset + sizeof(mixed) - 4));
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(invalid); ++i) {
+        for (offset = 0; offset < 40; ++offset) {
+            fill_ascii(buf, offset);
+            strcpy(buf + offset, invalid[i]);
+            g_assert(!hrt_utf8_validate(buf, strlen(buf)));
+        }
+    }
+}
+
+static void
+test_transcode(const void *data)
+{
+    char buf[MAX_LEN + sizeof(mixed)];
+    char back[3 * sizeof(buf)];
+    guint16 utf16[sizeof(buf)];
+    gsize offset;
+    gsize len;
+    gssize n_units;
+    gssize n_bytes;
+
+    use_kernels(data);
+
+    for (offset = 0; offset < MAX_LEN; ++offset) {
+        fill_ascii(buf, offset);
+        memcpy(buf + offset, mixed, sizeof(mixed) - 1);
+        len = offset + sizeof(mixed) - 1;
+
+        n_units = hrt_utf8_to_utf16(buf, len, utf16);
+        /* é and € are one unit, the emoji is two, all shorter than in UTF-8 */
+        g_assert_cmpint(n_units, ==, len - 1 - 2 - 2);
+        g_assert_cmpint(utf16[offset + 1], ==, 0xE9);
+        g_assert_cmpint(utf16[offset + 8], ==, 0xD83D);
+        g_assert_cmpint(utf16[offset + 9], ==, 0xDE00);
+
+        n_bytes = hrt_utf16_to_utf8(utf16, n_units, back);
+        g_assert_cmpint(n_bytes, ==, len);
+        g_assert(memcmp(back, buf, len) == 0);
+
+        /* unpaired surrogates and nul are refused */
+        utf16[offset + 9] = 'x';
+        g_assert_cmpint(hrt_utf16_to_utf8(utf16, n_units, back), ==, -1);
+        g_assert_cmpint(hrt_utf16_to_utf8(utf16 + offset + 9, 1, back), ==, 1);
+        g_assert_cmpint(hrt_utf16_to_utf8(utf16 + offset + 8, 1, back), ==, -1);
+        utf16[offset] = 0;
+        g_assert_cmpint(hrt_utf16_to_utf8(utf16, offset + 1, back), ==, -1);
+
+        g_assert_cmpint(hrt_utf8_to_utf16(invalid[offset % G_N_ELEMENTS(invalid)],
+                                          strlen(invalid[offset % G_N_ELEMENTS(invalid)]),
+                                          utf16), ==, -1);
+
+        /* up to the € it's Latin-1 */
+        g_assert_cmpint(hrt_utf8_to_latin1(buf, len, back), ==, -1);
+        g_assert_cmpint(hrt_utf8_to_latin1(buf, offset + 7, back), ==, offset + 6);
+        g_assert_cmpint((guint8) back[offset + 1], ==, 0xE9);
+        g_assert(memcmp(back + offset + 2, "llo ", 4) == 0);
+        g_assert_cmpint(hrt_utf8_to_latin1(invalid[offset % G_N_ELEMENTS(invalid)],
+                                           strlen(invalid[offset % G_N_ELEMENTS(invalid)]),
+                                           back), ==, -1);
+    }
+}
+
+static void
+test_safe_prefix(const void *data)
+{
+    static const char html_special[] = "&<>\"'";
+    static const char json_special[] = "\"\\\x01\x1f\n";
+    char buf[MAX_LEN];
+    gsize len;
+    gsize bad;
+    gsize i;
+
+    use_kernels(data);
+
+    for (len = 0; len < MAX_LEN; ++len) {
+        fill_ascii(buf, len);
+        /* non-ASCII needs no escaping; nul doesn't in HTML, but is
+         * a control character to JSON
+         */
+        if (len > 1) {
+            buf[len - 1] = (char) 0xE9;
+            buf[len - 2] = '\0';
+        }
+        g_assert_cmpuint(hrt_utf_html_safe_prefix(buf, len), ==, len);
+        g_assert_cmpuint(hrt_utf_json_safe_prefix(buf, len), ==,
+                         len > 1 ? len - 2 : len);
+
+        for (bad = 0; bad < len; bad += 7) {
+            for (i = 0; html_special[i] != '\0'; ++i) {
+                fill_ascii(buf, len);
+                buf[bad] = html_special[i];
+                g_assert_cmpuint(hrt_utf_html_safe_prefix(buf, len), ==, bad);
+            }
+
+            for (i = 0; json_special[i] != '\0'; ++i) {
+                fill_ascii(buf, len);
+                buf[bad] = json_special[i];
+                g_assert_cmpuint(hrt_utf_json_safe_prefix(buf, len), ==, bad);
+            }
+
+            /* 0x20 is the first character JSON doesn't escape */
+            fill_ascii(buf, len);
+            buf[bad] = ' ';
+            g_assert_cmpuint(hrt_utf_json_safe_prefix(buf, len), ==, len);
+        }
+    }
+}
+
+static void
+test_buffer_append_utf8(const void *data)
+{
+    HrtBuffer *buffer;
+    const guint16 *utf16;
+    const char *utf8;
+    gsize len;
+
+    use_kernels(data);
+
+    buffer = hrt_buffer_new_copy_utf8(mixed);
+    hrt_buffer_lock(buffer);
+    hrt_buffer_peek_utf8(buffer, &utf8, &len);
+    g_assert_cmpstr(utf8, ==, mixed);
+    hrt_buffer_unref(buffer);
+
+    buffer = hrt_buffer_new(HRT_BUFFER_ENCODING_UTF16,
+                            hrt_buffer_pool_get_allocator(),
+                            NULL, NULL);
+    g_assert(hrt_buffer_append_utf8(buffer, mixed, strlen(mixed)));
+    g_assert(!hrt_buffer_append_utf8(buffer, invalid[0], strlen(invalid[0])));
+    g_assert(hrt_buffer_append_utf8(buffer, "!", 1));
+    hrt_buffer_lock(buffer);
+    hrt_buffer_peek_utf16(buffer, &utf16, &len);
+    g_assert_cmpint(len, ==, strlen(mixed) - 1 - 2 - 2 + 1);
+    g_assert_cmpint(utf16[1], ==, 0xE9);
+    g_assert_cmpint(utf16[len - 1], ==, '!');
+    g_assert_cmpint(utf16[len], ==, 0);
+    hrt_buffer_unref(buffer);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    static const struct {
+        const char *name;
+        HrtUtfKernels kernels;
+    } all_kernels[] = {
+        { "scalar", HRT_UTF_KERNELS_SCALAR },
+        { "sse2", HRT_UTF_KERNELS_SSE2 },
+        { "avx2", HRT_UTF_KERNELS_AVX2 }
+    };
+    static const struct {
+        const char *name;
+        void (* func) (const void *data);
+    } tests[] = {
+        { "ascii", test_ascii },
+        { "validate", test_validate },
+        { "transcode", test_transcode },
+        { "safe_prefix", test_safe_prefix },
+        { "buffer_append_utf8", test_buffer_append_utf8 }
+    };
+    guint i;
+    guint j;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite UTF");
+    g_option_context_add_main_entries(context, entries, "test-utf");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-utf %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    /* each test runs with each set of kernels */
+    for (i = 0; i < G_N_ELEMENTS(tests); ++i) {
+        for (j = 0; j < G_N_ELEMENTS(all_kernels); ++j) {
+            char *path;
+
+            path = g_strdup_printf("/utf/%s/%s",
+                                   tests[i].name, all_kernels[j].name);
+            g_test_add_data_func(path,
+                                 GINT_TO_POINTER(all_kernels[j].kernels),
+                                 tests[i].func);
+            g_free(path);
+        }
+    }
+
+    return g_test_run();
+}
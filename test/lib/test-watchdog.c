@@ -0,0 +1,252 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+/*
+ * Copyright (c) 2010 Havoc Pennington
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <glib-object.h>
+#include <hrt/hrt-log.h>
+#include <hrt/hrt-task-runner.h>
+#include <hrt/hrt-task.h>
+#include <stdlib.h>
+
+#define NUM_TASKS 10
+
+/* msec */
+#define STALL_THRESHOLD 20
+#define STALL_SLEEP     (STALL_THRESHOLD * 10)
+
+typedef struct {
+    HrtTaskRunner *runner;
+    int tasks_completed_count;
+    GMainLoop *loop;
+} TestFixture;
+
+static void
+on_tasks_completed(HrtTaskRunner *runner,
+                   void          *data)
+{
+    TestFixture *fixture = data;
+    HrtTask *task;
+
+    while ((task = hrt_task_runner_pop_completed(fixture->runner)) != NULL) {
+        g_object_unref(task);
+
+        fixture->tasks_completed_count += 1;
+
+        if (fixture->tasks_completed_count >= NUM_TASKS) {
+            g_main_loop_quit(fixture->loop);
+        }
+    }
+}
+
+static void
+setup_test_fixture_generic(TestFixture     *fixture,
+                           HrtEventLoopType loop_type,
+                           int              stall_threshold)
+{
+    fixture->loop =
+        g_main_loop_new(NULL, FALSE);
+
+    fixture->runner =
+        g_object_new(HRT_TYPE_TASK_RUNNER,
+                     "event-loop-type", loop_type,
+                     "stall-threshold", stall_threshold,
+                     "stall-extra-threads", 1,
+                     NULL);
+
+    g_signal_connect(G_OBJECT(fixture->runner),
+                     "tasks-completed",
+                     G_CALLBACK(on_tasks_completed),
+                     fixture);
+}
+
+static void
+setup_test_fixture_glib(TestFixture *fixture,
+                        const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB,
+                               STALL_THRESHOLD);
+}
+
+static void
+setup_test_fixture_libev(TestFixture *fixture,
+                         const void  *data)
+{
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_EV,
+                               STALL_THRESHOLD);
+}
+
+static void
+setup_test_fixture_lenient(TestFixture *fixture,
+                           const void  *data)
+{
+    /* long enough that nothing in the test should hit it */
+    setup_test_fixture_generic(fixture, HRT_EVENT_LOOP_GLIB,
+                               STALL_THRESHOLD * 500);
+}
+
+static void
+teardown_test_fixture(TestFixture *fixture,
+                      const void  *data)
+{
+    g_object_unref(fixture->runner);
+    g_main_loop_unref(fixture->loop);
+}
+
+static gboolean
+on_immediate_quick(HrtTask        *task,
+                   HrtWatcherFlags flags,
+                   void           *data)
+{
+    return FALSE;
+}
+
+static gboolean
+on_immediate_stuck(HrtTask        *task,
+                   HrtWatcherFlags flags,
+                   void           *data)
+{
+    g_usleep(STALL_SLEEP * 1000);
+
+    return FALSE;
+}
+
+static void
+run_tasks(TestFixture *fixture,
+          gboolean     with_stuck_task)
+{
+    int i;
+
+    for (i = 0; i < NUM_TASKS; ++i) {
+        HrtTask *task;
+
+        task = hrt_task_runner_create_task(fixture->runner);
+        hrt_task_add_immediate(task,
+                               (with_stuck_task && i == 0) ?
+                               on_immediate_stuck : on_immediate_quick,
+                               NULL, NULL);
+        g_object_unref(task);
+    }
+
+    g_main_loop_run(fixture->loop);
+
+    g_assert_cmpint(fixture->tasks_completed_count, ==, NUM_TASKS);
+}
+
+static void
+test_watchdog_reports_stall(TestFixture *fixture,
+                            const void  *data)
+{
+    int n_threads;
+
+    g_assert_cmpuint(hrt_task_runner_get_stall_count(fixture->runner), ==, 0);
+    n_threads = hrt_task_runner_get_n_invoke_threads(fixture->runner);
+
+    run_tasks(fixture, TRUE);
+
+    /* the stuck handler was reported once, even though it stayed
+     * stuck for several thresholds
+     */
+    g_assert_cmpuint(hrt_task_runner_get_stall_count(fixture->runner), ==, 1);
+
+    /* and the stall got us the one extra thread we allow */
+    g_assert_cmpint(hrt_task_runner_get_n_invoke_threads(fixture->runner), ==,
+                    n_threads + 1);
+}
+
+static void
+test_watchdog_quiet(TestFixture *fixture,
+                    const void  *data)
+{
+    int n_threads;
+
+    n_threads = hrt_task_runner_get_n_invoke_threads(fixture->runner);
+
+    run_tasks(fixture, FALSE);
+
+    g_assert_cmpuint(hrt_task_runner_get_stall_count(fixture->runner), ==, 0);
+    g_assert_cmpint(hrt_task_runner_get_n_invoke_threads(fixture->runner), ==,
+                    n_threads);
+}
+
+static gboolean option_debug = FALSE;
+static gboolean option_version = FALSE;
+
+static GOptionEntry entries[] = {
+    { "debug", 0, 0, G_OPTION_ARG_NONE, &option_debug, "Enable debug logging", NULL },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &option_version, "Show version info and exit", NULL },
+    { NULL }
+};
+
+int
+main(int    argc,
+     char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    g_thread_init(NULL);
+    g_type_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_option_context_new("- Test Suite Stall Watchdog");
+    g_option_context_add_main_entries(context, entries, "test-watchdog");
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    if (option_version) {
+        g_print("test-watchdog %s\n",
+                VERSION);
+        exit(0);
+    }
+
+    hrt_log_init(option_debug ?
+                 HRT_LOG_FLAG_DEBUG : 0);
+
+    g_test_add("/watchdog/reports_stall_glib",
+               TestFixture,
+               NULL,
+               setup_test_fixture_glib,
+               test_watchdog_reports_stall,
+               teardown_test_fixture);
+
+    g_test_add("/watchdog/reports_stall_libev",
+               TestFixture,
+               NULL,
+               setup_test_fixture_libev,
+               test_watchdog_reports_stall,
+               teardown_test_fixture);
+
+    g_test_add("/watchdog/quiet",
+               TestFixture,
+               NULL,
+               setup_test_fixture_lenient,
+               test_watchdog_quiet,
+               teardown_test_fixture);
+
+    return g_test_run();
+}
@@ -0,0 +1,11 @@
+#! /bin/bash
+
+. "${TOP_SRCDIR}"/test/testutil.sh
+
+log "Checking we don't crash --version"
+die_if_fails ${BUILDDIR}/test-watchdog --version
+log "Checking we don't fail"
+gtest ${BUILDDIR}/test-watchdog
+
+
+exit 0